@@ -0,0 +1,740 @@
+/*
+ * ujprog end-to-end programming benchmark
+ *
+ * Copyright (c) 2010 - 2026 Marko Zec
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Synthetic bitstreams, sized for each device in jed_devices[], are
+ * programmed into SRAM and SPI flash of the virtual ULX3S (--mock), or of
+ * a real board with -p.  ujprog.c is compiled right in, so the very code
+ * ujprog ships is measured.  Each run gets a child process of its own,
+ * so that its CPU time and peak RSS are accounted for in isolation.
+ *
+ * Results go out as CSV (or JSON with -J), and may be compared against
+ * a CSV saved from an earlier run, failing on regressions beyond -t %.
+ * With -M the virtual boards sit behind an MPSSE cable instead.  The
+ * XVC server is checked against a virtual board before anything is timed.
+ */
+
+#define	main	ujprog_main
+#include "ujprog.c"
+#undef	main
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define	BENCH_RUNS_MAX	64
+#define	BENCH_TOLERANCE	10	/* Percent */
+
+enum bench_file {
+	BENCH_BIT, BENCH_IMG, BENCH_JED
+};
+
+static const struct bench_flow {
+	const char	*name;
+	int		file;
+	int		target;
+	int		xp2;
+} bench_flows[] = {
+	{ "sram-bit",	BENCH_BIT,	JED_TGT_SRAM,	0 },
+	{ "flash-bit",	BENCH_BIT,	JED_TGT_FLASH,	0 },
+	{ "flash-img",	BENCH_IMG,	JED_TGT_FLASH,	0 },
+	{ "sram-jed",	BENCH_JED,	JED_TGT_SRAM,	1 },
+	{ "flash-jed",	BENCH_JED,	JED_TGT_FLASH,	1 },
+	{ NULL,		0,		0,		0 }
+};
+
+struct bench_run {
+	const char	*dev;
+	const char	*flow;
+	long		bytes;		/* Input file size */
+	uint64_t	tcks;
+	double		wall;		/* Seconds spent in prog() */
+	double		cpu;		/* Seconds, user and system */
+	long		rss_kb;		/* Peak RSS */
+	int		res;
+	int		regressed;
+};
+
+/* What the child reports back through the pipe */
+struct bench_result {
+	int		res;
+	uint64_t	tcks;
+	double		wall;
+};
+
+/* Vector lengths around the byte, bit and command boundaries of MPSSE */
+static const unsigned bench_mpsse_bits[] = {
+	1, 2, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1000,
+	8 * MPSSE_RX_MAX - 1, 8 * MPSSE_RX_MAX + 9, 8 * MPSSE_CHUNK + 3, 0
+};
+
+static struct bench_run bench_runs[BENCH_RUNS_MAX];
+static int bench_nruns;
+static const char *bench_port;
+static uint32_t bench_seed;
+
+
+static int
+bench_rand(void)
+{
+
+	/* xorshift32, so that every run sees the same bitstreams */
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+	return (bench_seed & 0xff);
+}
+
+/*
+ * An ECP5 bitstream: preamble, VERIFY_ID for the device and random
+ * configuration data.  The .bit flavor comes with a header in front.
+ */
+static long
+bench_gen_bit(FILE *fp, const struct jed_devices *dev, int hdr)
+{
+	long i, len = dev->fuses / 8;
+
+	if (hdr) {
+		fprintf(fp, "%c%cPart: %s-6CABGA381%c", 0xff, 0x00,
+		    dev->name, 0x00);
+		fputc(0xff, fp);
+	}
+	fprintf(fp, "%c%c%c%c", 0xff, 0xff, 0xbd, 0xb3);
+	fprintf(fp, "%c%c%c%c", 0xff, 0xff, 0xff, 0xff);
+	fprintf(fp, "%c%c%c%c", 0x3b, 0x00, 0x00, 0x00);
+	fprintf(fp, "%c%c%c%c", 0xe2, 0x00, 0x00, 0x00);
+	fprintf(fp, "%c%c%c%c", (dev->id >> 24) & 0xff,
+	    (dev->id >> 16) & 0xff, (dev->id >> 8) & 0xff, dev->id & 0xff);
+	for (i = 20; i < len; i++)
+		fputc(bench_rand(), fp);
+	return (ftell(fp));
+}
+
+/*
+ * An XP2 JEDEC file, one line per fuse row, then SED CRC and USERCODE.
+ */
+static long
+bench_gen_jed(FILE *fp, const struct jed_devices *dev)
+{
+	int row, col;
+
+	fprintf(fp, "NOTE ujprog benchmark*\n");
+	fprintf(fp, "NOTE DEVICE NAME: %s-5TN144*\n", dev->name);
+	fprintf(fp, "QP144*\nQF%d*\nF0*\nL0000000\n", dev->fuses);
+	for (row = 0; row < dev->row_width; row++) {
+		for (col = 0; col < dev->col_width; col++)
+			fputc('0' + (bench_rand() & 1), fp);
+		fputc(row == dev->row_width - 1 ? '*' : '\n', fp);
+	}
+	fprintf(fp, "\nL%07d\n", dev->fuses - 32);
+	for (col = 0; col < 32; col++)
+		fputc('0' + (bench_rand() & 1), fp);
+	fprintf(fp, "*\nUH00000000*\n");
+	return (ftell(fp));
+}
+
+static int
+bench_gen(const char *path, const struct jed_devices *dev, int file,
+    long *bytes)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Can't create %s: %s\n", path,
+		    strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	bench_seed = dev->id;
+	if (file == BENCH_JED)
+		*bytes = bench_gen_jed(fp, dev);
+	else
+		*bytes = bench_gen_bit(fp, dev, file == BENCH_BIT);
+	if (fclose(fp) != 0 || *bytes < 0) {
+		fprintf(stderr, "Can't write %s\n", path);
+		return (EXIT_FAILURE);
+	}
+	return (0);
+}
+
+/*
+ * Shift the random bits of tdi through BYPASS, which hands them back one
+ * TCK late, starting from DRPAUSE with a freshly captured 0.  Whole scans
+ * take the shift() path, with TDO unpacked into the vector; otherwise the
+ * TCKs are queued in TXBUF for mpsse_compile(), and TDO is expected back
+ * in TXBUF where sync bitbang would have left it.  Returns the number of
+ * bits in error.
+ */
+static unsigned
+bench_bypass(struct jtag_ctx *ctx, const uint8_t *tdi, unsigned bits,
+    char *hex, int vector)
+{
+	unsigned i, pos, len = (bits + 3) / 4, bad = 0;
+	int c, v;
+
+	set_state(ctx, IDLE);
+	set_state(ctx, DRPAUSE);
+
+	if (vector) {
+		memset(hex, 0, len);
+		for (i = 0; i < bits; i++)
+			hex[len - 1 - i / 4] |= tdi[i] << (i & 3);
+		for (i = 0; i < len; i++)
+			hex[i] = hexdigits[(int) hex[i]];
+		hex[len] = 0;
+		if (send_dr(ctx, bits, hex, NULL, NULL))
+			return (bits);
+		for (i = 0; i < bits; i++) {
+			c = hex[len - 1 - i / 4];
+			c = c <= '9' ? c - '0' : c + 10 - 'A';
+			v = (c >> (i & 3)) & 1;
+			bad += v != (i ? tdi[i - 1] : 0);
+		}
+		return (bad);
+	}
+
+	/* DREXIT2, DRSHIFT, the bits, then DRPAUSE again */
+	set_tms_tdi(ctx, 1, 0);
+	set_tms_tdi(ctx, 0, 0);
+	pos = ctx->txpos / 2;
+	for (i = 0; i < bits; i++)
+		set_tms_tdi(ctx, i == bits - 1, tdi[i]);
+	set_tms_tdi(ctx, 0, 0);
+	ctx->cur_s = DRPAUSE;
+	if (commit(ctx, 1))
+		return (bits);
+	for (i = 0; i < bits; i++) {
+		v = (ctx->txbuf[2 * (pos + i) + 2] & JTAG_TDO) != 0;
+		bad += v != (i ? tdi[i - 1] : 0);
+	}
+	return (bad);
+}
+
+/*
+ * Check the TDO read back through the MPSSE engine of a virtual board,
+ * for byte, bit and TMS commands alike, before anything is timed.
+ */
+static int
+bench_mpsse_check(const char *dev)
+{
+	struct jtag_ctx *ctx;
+	const unsigned *bp;
+	uint8_t *tdi;
+	char *hex, ir[3];
+	unsigned i, max = 0, bad = 0, n = 0;
+	int vector;
+
+	for (bp = bench_mpsse_bits; *bp != 0; bp++)
+		if (*bp > max)
+			max = *bp;
+	tdi = malloc(max);
+	hex = malloc(max / 4 + 2);
+	ctx = jtag_ctx_new(CABLE_MOCK);
+	if (tdi == NULL || hex == NULL || ctx == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	ctx->silent = 1;
+	mock_name = dev;
+	if (cable_open(ctx, CABLE_MOCK)) {
+		jtag_ctx_free(ctx);
+		free(tdi);
+		free(hex);
+		return (EXIT_FAILURE);
+	}
+
+	set_port_mode(ctx, PORT_MODE_SYNC);
+	set_state(ctx, IDLE);
+	set_state(ctx, IRPAUSE);
+	strcpy(ir, "FF");
+	send_ir(ctx, 8, ir, NULL, NULL);
+
+	bench_seed = 0x1c3;
+	for (bp = bench_mpsse_bits; *bp != 0; bp++)
+		for (vector = 0; vector < 2; vector++, n++) {
+			for (i = 0; i < *bp; i++)
+				tdi[i] = bench_rand() & 1;
+			i = bench_bypass(ctx, tdi, *bp, hex, vector);
+			if (i)
+				fprintf(stderr, "MPSSE %s, %u bits: %u bad\n",
+				    vector ? "scan" : "TXBUF", *bp, i);
+			bad += i;
+		}
+
+	set_port_mode(ctx, PORT_MODE_ASYNC);
+	set_state(ctx, RESET);
+	commit(ctx, 1);
+	cable_close(ctx);
+	jtag_ctx_free(ctx);
+	free(tdi);
+	free(hex);
+	fprintf(stderr, "MPSSE TDO readback: %u vectors, %s\n", n,
+	    bad ? "FAILED" : "OK");
+	return (bad ? EXIT_FAILURE : 0);
+}
+
+/*
+ * Pack a shift: command, TMS and TDI given as strings of '0' and '1'.
+ */
+static unsigned
+bench_xvc_pkt(uint8_t *buf, const char *tms, const char *tdi)
+{
+	unsigned i, bits = strlen(tms), nb = (bits + 7) / 8;
+
+	memcpy(buf, "shift:", 6);
+	for (i = 0; i < 4; i++)
+		buf[6 + i] = bits >> (8 * i);
+	memset(&buf[10], 0, 2 * nb);
+	for (i = 0; i < bits; i++) {
+		buf[10 + i / 8] |= (tms[i] == '1') << (i & 7);
+		buf[10 + nb + i / 8] |= (tdi[i] == '1') << (i & 7);
+	}
+	return (10 + 2 * nb);
+}
+
+/*
+ * Expect exactly len bytes from the server, or EOF when len is 0.
+ */
+static int
+bench_xvc_expect(int fd, const void *want, size_t len)
+{
+	uint8_t buf[64];
+	struct pollfd pfd;
+	size_t got = 0;
+	ssize_t n;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do {
+		if (poll(&pfd, 1, 5000) != 1)
+			return (-1);
+		n = read(fd, &buf[got], sizeof(buf) - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || (n == 0 && len > 0))
+			return (-1);
+		got += n;
+	} while (got < len);
+	if (got != len || (len > 0 && memcmp(buf, want, len) != 0))
+		return (-1);
+	return (0);
+}
+
+/*
+ * Talk XVC to xvc_serve() on a virtual board through a socket pair:
+ * getinfo:, settck:, then pipelined shift: commands which read IDCODE,
+ * load BYPASS and loop TDI back through it.  Packets are split in their
+ * header and in their vectors, and the final vector ends with a bit whose
+ * TDO only the trailing TCK low sample sees.
+ */
+static int
+bench_xvc_check(const char *dev)
+{
+	const struct jed_devices *d;
+	struct jtag_ctx *ctx;
+	uint8_t buf[128], want[8];
+	char info[64];
+	unsigned i, len, s4;
+	int sv[2], bad = 1, status;
+	pid_t pid;
+
+	for (d = jed_devices; d->name != NULL; d++)
+		if (strcasecmp(d->name, dev) == 0)
+			break;
+	if (d->name == NULL)
+		return (EXIT_FAILURE);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		fprintf(stderr, "socketpair() failed: %s\n", strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return (EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		ctx = jtag_ctx_new(CABLE_MOCK);
+		if (ctx == NULL)
+			_exit(EXIT_FAILURE);
+		ctx->silent = 1;
+		mock_name = dev;
+		if (cable_open(ctx, CABLE_MOCK))
+			_exit(EXIT_FAILURE);
+		xvc_serve(ctx, sv[1]);
+		cable_close(ctx);
+		_exit(0);
+	}
+	close(sv[1]);
+
+	len = snprintf(info, sizeof(info), "xvcServer_v1.0:%u\n",
+	    XVC_VECTOR_MAX);
+	if (sock_write(sv[0], "getinfo:", 8) ||
+	    bench_xvc_expect(sv[0], info, len))
+		goto out;
+	memcpy(buf, "settck:", 7);
+	memcpy(&buf[7], "\x64\0\0\0", 4);
+	if (sock_write(sv[0], buf, 11) ||
+	    bench_xvc_expect(sv[0], &buf[7], 4))
+		goto out;
+
+	/* RESET to DRSHIFT, IDCODE out, to IDLE, all in one go */
+	len = bench_xvc_pkt(buf, "111110100", "000000000");
+	len += bench_xvc_pkt(&buf[len], "00000000000000000000000000000001",
+	    "00000000000000000000000000000000");
+	len += bench_xvc_pkt(&buf[len], "10", "00");
+	/* BYPASS into IR, the packet cut short within its TMS bytes */
+	s4 = len;
+	len += bench_xvc_pkt(&buf[len], "11000000000110", "00001111111100");
+	want[0] = 0;
+	want[1] = 0;
+	for (i = 0; i < 4; i++)
+		want[2 + i] = d->id >> (8 * i);
+	want[6] = 0;
+	if (sock_write(sv[0], buf, s4 + 11) ||
+	    bench_xvc_expect(sv[0], want, 7))
+		goto out;
+
+	/* Then cut within TDI, and shift 1011 through BYPASS */
+	if (sock_write(sv[0], &buf[s4 + 11], 2))
+		goto out;
+	usleep(20000);
+	len += bench_xvc_pkt(&buf[len], "1000001", "0001011");
+	want[0] = 0x10;
+	want[1] = 0;
+	want[2] = 0x50;
+	if (sock_write(sv[0], &buf[s4 + 13], len - s4 - 13) ||
+	    bench_xvc_expect(sv[0], want, 3))
+		goto out;
+
+	shutdown(sv[0], SHUT_WR);
+	bad = bench_xvc_expect(sv[0], NULL, 0) != 0;
+out:
+	close(sv[0]);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		bad = 1;
+	fprintf(stderr, "XVC loopback: %s\n", bad ? "FAILED" : "OK");
+	return (bad ? EXIT_FAILURE : 0);
+}
+
+/*
+ * Program path in a child process, which reports back the outcome, the
+ * TCK count and the time spent in prog().
+ */
+static int
+bench_one(struct bench_run *r, const char *path, int target)
+{
+	struct bench_result br;
+	struct rusage ru;
+	struct jtag_ctx *ctx;
+	struct timeval t0, t1;
+	int fds[2], status;
+	pid_t pid;
+
+	if (pipe(fds))
+		return (EXIT_FAILURE);
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		return (EXIT_FAILURE);
+	if (pid == 0) {
+		close(fds[0]);
+		memset(&br, 0, sizeof(br));
+		quiet = 1;
+		ctx = jtag_ctx_new(CABLE_UNKNOWN);
+		if (ctx == NULL)
+			_exit(EXIT_FAILURE);
+		if (bench_port != NULL) {
+			port_select(ctx, bench_port);
+			ctx->cable_hw = CABLE_HW_USB;
+		} else {
+			mock_name = r->dev;
+			ctx->cable_hw = CABLE_MOCK;
+		}
+		br.res = cable_open(ctx, ctx->cable_hw);
+		if (br.res == 0) {
+			gettimeofday(&t0, NULL);
+			br.res = prog(ctx, -1, (char *) path, target, 0);
+			gettimeofday(&t1, NULL);
+			br.wall = t1.tv_sec - t0.tv_sec +
+			    (t1.tv_usec - t0.tv_usec) / 1e6;
+			br.tcks = ctx->tcks;
+			cable_close(ctx);
+		}
+		if (write(fds[1], &br, sizeof(br)) != sizeof(br))
+			_exit(EXIT_FAILURE);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], &br, sizeof(br)) != sizeof(br))
+		br.res = EXIT_FAILURE;
+	close(fds[0]);
+	if (wait4(pid, &status, 0, &ru) < 0)
+		return (EXIT_FAILURE);
+
+	r->res = br.res;
+	r->tcks = br.tcks;
+	r->wall = br.wall;
+	r->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+	r->rss_kb = ru.ru_maxrss / 1024;	/* Bytes, not KB */
+#else
+	r->rss_kb = ru.ru_maxrss;
+#endif
+	return (r->res);
+}
+
+static double
+bench_mbps(const struct bench_run *r)
+{
+
+	return (r->wall > 0 ? r->bytes / r->wall / 1e6 : 0);
+}
+
+static double
+bench_tckps(const struct bench_run *r)
+{
+
+	return (r->wall > 0 ? r->tcks / r->wall : 0);
+}
+
+static double
+bench_nspb(const struct bench_run *r)
+{
+
+	return (r->tcks > 0 ? r->cpu * 1e9 / r->tcks : 0);
+}
+
+/*
+ * Compare the runs with a CSV from an earlier run, marking those which
+ * got slower, larger or clock more TCKs by more than tol percent.
+ */
+static int
+bench_compare(const char *path, int tol)
+{
+	struct bench_run *r;
+	char line[256], dev[32], flow[32];
+	unsigned long long tcks;
+	double mbps, nspb;
+	long bytes, rss;
+	int i, bad = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return (-1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%31[^,],%31[^,],%ld,%llu,%*f,%lf,%*f,%lf,%ld",
+		    dev, flow, &bytes, &tcks, &mbps, &nspb, &rss) != 7)
+			continue;
+		for (i = 0, r = bench_runs; i < bench_nruns; i++, r++)
+			if (strcmp(r->dev, dev) == 0 &&
+			    strcmp(r->flow, flow) == 0)
+				break;
+		if (i == bench_nruns || r->res != 0)
+			continue;
+		if (bench_mbps(r) < mbps * (100 - tol) / 100) {
+			fprintf(stderr, "%s %s: %.3f MB/s, was %.3f\n",
+			    dev, flow, bench_mbps(r), mbps);
+			r->regressed = 1;
+		}
+		if (r->tcks > tcks * (100 + tol) / 100) {
+			fprintf(stderr, "%s %s: %llu TCKs, was %llu\n",
+			    dev, flow, (unsigned long long) r->tcks, tcks);
+			r->regressed = 1;
+		}
+		if (r->rss_kb > rss * (100 + tol) / 100) {
+			fprintf(stderr, "%s %s: %ld KB peak RSS, was %ld\n",
+			    dev, flow, r->rss_kb, rss);
+			r->regressed = 1;
+		}
+		bad += r->regressed;
+	}
+	fclose(fp);
+	return (bad);
+}
+
+static void
+bench_print(FILE *fp, int json)
+{
+	struct bench_run *r;
+	int i;
+
+	if (json)
+		fprintf(fp, "[\n");
+	else
+		fprintf(fp, "device,flow,bytes,tcks,seconds,mb_s,tck_s,"
+		    "cpu_ns_per_bit,peak_rss_kb,result\n");
+	for (i = 0, r = bench_runs; i < bench_nruns; i++, r++) {
+		if (json)
+			fprintf(fp, "  {\"device\": \"%s\", \"flow\": \"%s\", "
+			    "\"bytes\": %ld, \"tcks\": %llu, "
+			    "\"seconds\": %.4f, \"mb_s\": %.3f, "
+			    "\"tck_s\": %.0f, \"cpu_ns_per_bit\": %.2f, "
+			    "\"peak_rss_kb\": %ld, \"result\": \"%s\"}%s\n",
+			    r->dev, r->flow, r->bytes,
+			    (unsigned long long) r->tcks, r->wall,
+			    bench_mbps(r), bench_tckps(r), bench_nspb(r),
+			    r->rss_kb, r->res ? "FAILED" : r->regressed ?
+			    "REGRESSED" : "OK", i + 1 < bench_nruns ? "," : "");
+		else
+			fprintf(fp, "%s,%s,%ld,%llu,%.4f,%.3f,%.0f,%.2f,%ld,"
+			    "%s\n", r->dev, r->flow, r->bytes,
+			    (unsigned long long) r->tcks, r->wall,
+			    bench_mbps(r), bench_tckps(r), bench_nspb(r),
+			    r->rss_kb, r->res ? "FAILED" : r->regressed ?
+			    "REGRESSED" : "OK");
+	}
+	if (json)
+		fprintf(fp, "]\n");
+}
+
+static void
+bench_usage(void)
+{
+
+	printf("Usage: ujprog-bench [-JM] [-d DEVICE] [-p PORT] "
+	    "[-b BASELINE.csv] [-t PERCENT] [-o FILE]\n\n");
+	printf("  -J		Report in JSON instead of CSV\n");
+	printf("  -M		Use the virtual boards through an MPSSE"
+	    " cable\n");
+	printf("  -d DEVICE	Only benchmark DEVICE, e.g. LFE5U-85F\n");
+	printf("  -p PORT	Program a real board, requires -d\n");
+	printf("  -b FILE	Fail on regressions against an earlier CSV"
+	    " report\n");
+	printf("  -t PERCENT	Regression tolerance (default %d)\n",
+	    BENCH_TOLERANCE);
+	printf("  -o FILE	Write the report to FILE instead of stdout\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct jed_devices *dev;
+	const struct bench_flow *bf;
+	struct bench_run *r;
+	const char *only = NULL, *baseline = NULL, *out = NULL;
+	char dir[] = "/tmp/ujprog-bench.XXXXXX";
+	char path[sizeof(dir) + 32];
+	int c, json = 0, tol = BENCH_TOLERANCE, res = 0, xp2;
+	FILE *fp = stdout;
+	long bytes;
+
+	while ((c = getopt(argc, argv, "JMd:p:b:t:o:")) != -1) {
+		switch (c) {
+		case 'J':
+			json = 1;
+			break;
+		case 'M':
+			mock_mpsse = 1;
+			break;
+		case 'd':
+			only = optarg;
+			break;
+		case 'p':
+			bench_port = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			tol = atoi(optarg);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			bench_usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc || (bench_port != NULL && only == NULL) ||
+	    (bench_port != NULL && mock_mpsse)) {
+		bench_usage();
+		exit(EXIT_FAILURE);
+	}
+	if (mock_mpsse &&
+	    bench_mpsse_check(only != NULL ? only : jed_devices[0].name))
+		res = EXIT_FAILURE;
+	if (bench_port == NULL &&
+	    bench_xvc_check(only != NULL ? only : jed_devices[0].name))
+		res = EXIT_FAILURE;
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "mkdtemp() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (dev = jed_devices; dev->name != NULL; dev++) {
+		if (only != NULL && strcasecmp(dev->name, only) != 0)
+			continue;
+		xp2 = strncmp(dev->name, "LFXP2", 5) == 0;
+		for (bf = bench_flows; bf->name != NULL; bf++) {
+			if (bf->xp2 != xp2 || bench_nruns == BENCH_RUNS_MAX)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s.%s", dir,
+			    dev->name, bf->file == BENCH_BIT ? "bit" :
+			    bf->file == BENCH_IMG ? "img" : "jed");
+			if (bench_gen(path, dev, bf->file, &bytes)) {
+				res = EXIT_FAILURE;
+				break;
+			}
+			r = &bench_runs[bench_nruns++];
+			r->dev = dev->name;
+			r->flow = bf->name;
+			r->bytes = bytes;
+			fprintf(stderr, "%s %s...\n", r->dev, r->flow);
+			if (bench_one(r, path, bf->target))
+				res = EXIT_FAILURE;
+			unlink(path);
+		}
+	}
+	rmdir(dir);
+
+	if (baseline != NULL && bench_compare(baseline, tol) != 0)
+		res = EXIT_FAILURE;
+
+	if (out != NULL) {
+		fp = fopen(out, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "Can't create %s: %s\n", out,
+			    strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_print(fp, json);
+	if (fp != stdout)
+		fclose(fp);
+	return (res);
+}
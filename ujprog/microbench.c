@@ -0,0 +1,413 @@
+/*
+ * ujprog hot path micro-benchmarks
+ *
+ * Copyright (c) 2010 - 2026 Marko Zec
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The per-byte kernels between the input file and the cable, timed one
+ * call at a time on the buffer sizes they see in practice: 8000 byte
+ * ECP5 rows (SDR 64000), a 510 bit boundary scan preload and 8192 byte
+ * f32c upload blocks.  As with ujprog-bench, ujprog.c is compiled right
+ * in.  The cable is a stub which drops TXBUF, so nothing but the
+ * kernel itself is measured.
+ *
+ * Cost is given per byte of payload, in TSC cycles on x86 and in
+ * nanoseconds elsewhere, after a warm-up round.
+ */
+
+#define	main	ujprog_main
+#include "ujprog.c"
+#undef	main
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define	MB_UNIT		"cycles"
+#else
+#define	MB_UNIT		"ns"
+#endif
+
+#define	MB_ROW_BYTES	8000
+#define	MB_BSR_BITS	510
+#define	MB_BLOCK_BYTES	8192
+#define	MB_WARMUP	50
+#define	MB_REPS		500
+
+struct mb_kernel {
+	const char	*name;
+	const char	*what;
+	unsigned	bytes;		/* Payload per call */
+	void		(*prep)(void);	/* Untimed, before each call */
+	void		(*run)(void);
+};
+
+static struct jtag_ctx *mb_ctx;
+static uint8_t *mb_row;		/* Random row / block data */
+static uint8_t *mb_smp;		/* Fake TDO samples, 2 bytes per TCK */
+static uint8_t *mb_dst;
+static char *mb_tdi, *mb_tdo, *mb_mask, *mb_bsr;
+static char *mb_svf, *mb_svfcopy;
+static int mb_svflen;
+static struct enc_job mb_job;
+static volatile uint32_t mb_sink;
+
+
+static int
+mb_commit(struct jtag_ctx *ctx)
+{
+
+	ctx->txpos = 0;
+	return (0);
+}
+
+static int
+mb_shift(struct jtag_ctx *ctx, unsigned bits, const char *tdi)
+{
+
+	(void) ctx;
+	(void) bits;
+	(void) tdi;
+	return (0);
+}
+
+/* Bitbanging cable which drops everything */
+static const struct cable_ops mb_ops_bb = {
+	.name =		"null bitbang",
+	.commit =	mb_commit,
+};
+
+/* Shifting cable, so that SVF parsing is timed without the expansion */
+static const struct cable_ops mb_ops_shift = {
+	.name =		"null shift",
+	.caps =		CABLE_CAP_SHIFT,
+	.commit =	mb_commit,
+	.shift =	mb_shift,
+};
+
+
+static uint64_t
+mb_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+
+	return (__rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+static void
+mb_hex(char *dst, const uint8_t *src, unsigned bits)
+{
+	unsigned i, n = (bits + 3) / 4;
+
+	for (i = 0; i < n; i++)
+		dst[i] = hexdigits[(src[i / 2] >> (4 * (i & 1))) & 0xf];
+	/* Leading digit may only hold what is left of bits */
+	if (bits & 3)
+		dst[0] = hexdigits[src[0] & ((1 << (bits & 3)) - 1)];
+	dst[n] = 0;
+}
+
+static void
+mb_send_row(void)
+{
+
+	mb_ctx->cur_s = DRPAUSE;
+	send_generic(mb_ctx, MB_ROW_BYTES * 8, mb_tdi, NULL, NULL);
+	mb_ctx->txpos = 0;
+}
+
+static void
+mb_send_bsr(void)
+{
+
+	mb_ctx->cur_s = DRPAUSE;
+	send_generic(mb_ctx, MB_BSR_BITS, mb_bsr, NULL, NULL);
+	mb_ctx->txpos = 0;
+}
+
+static void
+mb_tdo_decode(void)
+{
+
+	tdo_decode(mb_tdi, mb_tdo, mb_mask, MB_ROW_BYTES * 8, mb_smp, 2,
+	    mb_ctx->hmp->tdo);
+}
+
+static void
+mb_svf_prep(void)
+{
+
+	memcpy(mb_svfcopy, mb_svf, mb_svflen);
+}
+
+static void
+mb_svf_parse(void)
+{
+
+	mb_ctx->ops = &mb_ops_shift;
+	exec_svf_text(mb_ctx, mb_svfcopy, mb_svflen, 0, 0);
+	mb_ctx->ops = &mb_ops_bb;
+	mb_ctx->txpos = 0;
+}
+
+static void
+mb_enc_text(void)
+{
+	uint8_t *tck = mb_job.tck;
+
+	mb_job.tck = NULL;
+	enc_row(&mb_job);
+	mb_job.tck = tck;
+}
+
+static void
+mb_enc_expand(void)
+{
+
+	enc_row(&mb_job);
+}
+
+static void
+mb_txfile_crc(void)
+{
+
+	mb_sink = txfile_crc(mb_dst, mb_row, MB_BLOCK_BYTES);
+}
+
+static const struct mb_kernel mb_kernels[] = {
+	{ "hex-expand", "send_generic(), SDR 64000, async",
+	    MB_ROW_BYTES, NULL, mb_send_row },
+	{ "bsr-preload", "send_generic(), SDR 510, async",
+	    (MB_BSR_BITS + 7) / 8, NULL, mb_send_bsr },
+	{ "tdo-decode", "tdo_decode(), 64000 TCKs with TDO and MASK",
+	    MB_ROW_BYTES, NULL, mb_tdo_decode },
+	{ "svf-parse", "exec_svf_text() of one row, shifting cable",
+	    MB_ROW_BYTES, mb_svf_prep, mb_svf_parse },
+	{ "svf-format", "enc_row(), bitrev hex text",
+	    MB_ROW_BYTES, NULL, mb_enc_text },
+	{ "row-encode", "enc_row(), hex text and TCK expansion",
+	    MB_ROW_BYTES, NULL, mb_enc_expand },
+	{ "txfile-crc", "txfile_crc(), 8192 byte block",
+	    MB_BLOCK_BYTES, NULL, mb_txfile_crc },
+	{ NULL, NULL, 0, NULL, NULL }
+};
+
+
+static int
+mb_setup(void)
+{
+	struct cable_hw_map *hmp;
+	struct jtag_ctx *ctx;
+	uint32_t seed = 0x2545f491;
+	int i;
+
+	quiet = 1;
+	ctx = mb_ctx = jtag_ctx_new(CABLE_MOCK);
+	if (ctx == NULL)
+		return (EXIT_FAILURE);
+	for (hmp = cable_hw_map; hmp->cable_hw != CABLE_MOCK; hmp++)
+		continue;
+	ctx->hmp = hmp;
+	ctx->ops = &mb_ops_bb;
+	ctx->port_mode = PORT_MODE_ASYNC;
+
+	mb_row = malloc(MB_BLOCK_BYTES);
+	mb_dst = malloc(MB_BLOCK_BYTES);
+	mb_smp = malloc(MB_ROW_BYTES * 16);
+	mb_tdi = malloc(MB_ROW_BYTES * 2 + 1);
+	mb_tdo = malloc(MB_ROW_BYTES * 2 + 1);
+	mb_mask = malloc(MB_ROW_BYTES * 2 + 1);
+	mb_bsr = malloc(MB_BSR_BITS / 4 + 2);
+	if (mb_row == NULL || mb_dst == NULL || mb_smp == NULL ||
+	    mb_tdi == NULL || mb_tdo == NULL || mb_mask == NULL ||
+	    mb_bsr == NULL)
+		return (EXIT_FAILURE);
+	for (i = 0; i < MB_BLOCK_BYTES; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		mb_row[i] = seed;
+	}
+	for (i = 0; i < MB_ROW_BYTES * 16; i++)
+		mb_smp[i] = mb_row[i / 16 % MB_BLOCK_BYTES] & JTAG_TDO;
+	mb_hex(mb_tdi, mb_row, MB_ROW_BYTES * 8);
+	mb_hex(mb_tdo, mb_row + 1, MB_ROW_BYTES * 8);
+	memset(mb_mask, 'F', MB_ROW_BYTES * 2);
+	mb_mask[MB_ROW_BYTES * 2] = 0;
+	mb_hex(mb_bsr, mb_row, MB_BSR_BITS);
+
+	/* Fills enc_xlat and the bitrev table, as for a .bit file */
+	if (svfo_open(ctx, 0) || enc_start(ctx, 0, MB_ROW_BYTES))
+		return (EXIT_FAILURE);
+	enc_stop_pool();
+	mb_job.in = mb_row;
+	mb_job.n = MB_ROW_BYTES;
+	mb_job.svf = malloc(MB_ROW_BYTES * 3 + 256);
+	mb_job.tck = malloc((MB_ROW_BYTES + 4) * 16);
+	if (mb_job.svf == NULL || mb_job.tck == NULL)
+		return (EXIT_FAILURE);
+
+	/* The SVF text for a row, exactly as exec_bit_file() has it */
+	mb_enc_text();
+	mb_svf = mb_job.svf;
+	mb_svflen = mb_job.svflen;
+	mb_svfcopy = malloc(mb_svflen);
+	if (mb_svfcopy == NULL)
+		return (EXIT_FAILURE);
+	mb_job.svf = malloc(MB_ROW_BYTES * 3 + 256);
+	if (mb_job.svf == NULL)
+		return (EXIT_FAILURE);
+	strcpy(mb_svfcopy, "STATE IDLE;\n");
+	return (exec_svf_text(ctx, mb_svfcopy, strlen(mb_svfcopy), 0, 1));
+}
+
+static int
+mb_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+mb_run(const struct mb_kernel *k, int warmup, int reps, int json,
+    int first)
+{
+	double *s, sum = 0, var = 0, mean, med;
+	uint64_t t0, t1;
+	int i;
+
+	s = malloc(reps * sizeof(*s));
+	if (s == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = -warmup; i < reps; i++) {
+		if (k->prep != NULL)
+			k->prep();
+		t0 = mb_now();
+		k->run();
+		t1 = mb_now();
+		if (i >= 0)
+			s[i] = (double) (t1 - t0) / k->bytes;
+	}
+
+	for (i = 0; i < reps; i++)
+		sum += s[i];
+	mean = sum / reps;
+	for (i = 0; i < reps; i++)
+		var += (s[i] - mean) * (s[i] - mean);
+	qsort(s, reps, sizeof(*s), mb_cmp);
+	med = s[reps / 2];
+
+	if (json)
+		printf("%s  {\"kernel\": \"%s\", \"bytes\": %u, "
+		    "\"unit\": \"%s/byte\", \"min\": %.3f, \"median\": %.3f, "
+		    "\"mean\": %.3f, \"stddev\": %.3f, \"p99\": %.3f}",
+		    first ? "" : ",\n", k->name, k->bytes, MB_UNIT, s[0], med,
+		    mean, sqrt(var / reps), s[reps * 99 / 100]);
+	else
+		printf("%-12s %6u %9.3f %9.3f %9.3f %9.3f %9.3f  %s\n",
+		    k->name, k->bytes, s[0], med, mean, sqrt(var / reps),
+		    s[reps * 99 / 100], k->what);
+	free(s);
+}
+
+static void
+mb_usage(void)
+{
+
+	printf("Usage: ujprog-microbench [-J] [-k KERNEL] [-n REPS] "
+	    "[-w WARMUP]\n\n");
+	printf("  -J		Report in JSON\n");
+	printf("  -k KERNEL	Only run KERNEL, one of:");
+	for (int i = 0; mb_kernels[i].name != NULL; i++)
+		printf(" %s", mb_kernels[i].name);
+	printf("\n  -n REPS	Timed calls per kernel (default %d)\n",
+	    MB_REPS);
+	printf("  -w WARMUP	Untimed calls first (default %d)\n", MB_WARMUP);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct mb_kernel *k;
+	const char *only = NULL;
+	int c, json = 0, warmup = MB_WARMUP, reps = MB_REPS, n = 0;
+
+	while ((c = getopt(argc, argv, "Jk:n:w:")) != -1) {
+		switch (c) {
+		case 'J':
+			json = 1;
+			break;
+		case 'k':
+			only = optarg;
+			break;
+		case 'n':
+			reps = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		default:
+			mb_usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc || reps < 1 || warmup < 0) {
+		mb_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (mb_setup()) {
+		fprintf(stderr, "Benchmark setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (json)
+		printf("[\n");
+	else
+		printf("%-12s %6s %9s %9s %9s %9s %9s  (%s/byte)\n", "kernel",
+		    "bytes", "min", "median", "mean", "stddev", "p99",
+		    MB_UNIT);
+	for (k = mb_kernels; k->name != NULL; k++) {
+		if (only != NULL && strcmp(k->name, only) != 0)
+			continue;
+		mb_run(k, warmup, reps, json, n++ == 0);
+	}
+	if (json)
+		printf("\n]\n");
+	if (n == 0) {
+		fprintf(stderr, "No such kernel: %s\n", only);
+		exit(EXIT_FAILURE);
+	}
+	return (0);
+}
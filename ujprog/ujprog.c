@@ -44,14 +44,23 @@
 static const char *verstr = "ULX3S JTAG programmer v 3.5";
 
 
+#ifdef __linux__
+#define	_GNU_SOURCE		/* sched_setaffinity() */
+#endif
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #define USE_RAW
 
@@ -59,6 +68,15 @@ static const char *verstr = "ULX3S JTAG programmer v 3.5";
 #define USE_PPI
 #endif
 
+#ifndef WIN32
+#define USE_THREADS
+#define USE_SOCKETS
+#endif
+
+#if defined(USE_THREADS) && (defined(USE_ZLIB) || defined(USE_ZSTD))
+#define USE_UNZIP
+#endif
+
 #if defined(__linux__) || defined(WIN32)
 #define isnumber(x) (x >= '0' && x <= '9')
 #endif
@@ -69,6 +87,7 @@ static const char *verstr = "ULX3S JTAG programmer v 3.5";
 #include <conio.h>
 #else
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <termios.h>
 #ifdef USE_PPI
@@ -78,22 +97,59 @@ static const char *verstr = "ULX3S JTAG programmer v 3.5";
 #include <libusb.h>
 #include <ftdi.h>
 #endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef USE_THREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
+#ifdef USE_SOCKETS
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #ifdef WIN32
 #define	BITMODE_OFF		0x0
+#define	BITMODE_RESET		0x0
 #define	BITMODE_BITBANG		0x1
+#define	BITMODE_MPSSE		0x2
 #define	BITMODE_SYNCBB		0x4
 #define	BITMODE_CBUS		0x20
 #endif
 
 /* Forward declarations */
-static int commit(int);
-static void set_state(int);
-static int exec_svf_tokenized(int, char **);
-static int send_dr(int, char *, char *, char *);
-static int send_ir(int, char *, char *, char *);
-static int exec_svf_mem(char *, int, int);
+struct jtag_ctx;
+struct mpsse;
+struct mock;
+static int commit(struct jtag_ctx *, int);
+static void set_state(struct jtag_ctx *, int);
+static int exec_svf_tokenized(struct jtag_ctx *, int, char **);
+static int send_dr(struct jtag_ctx *, int, char *, char *, char *);
+static int send_ir(struct jtag_ctx *, int, char *, char *, char *);
+static int exec_svf_text(struct jtag_ctx *, char *, int, int, int);
 static int cmp_chip_ids(char *, char *);
+static int mpsse_setup(struct jtag_ctx *);
+static int setup_mock(struct jtag_ctx *);
+static int shutdown_mock(struct jtag_ctx *);
+static int commit_mock(struct jtag_ctx *);
+static int mock_mpsse_write(struct jtag_ctx *, const uint8_t *, unsigned);
+static int mock_mpsse_read(struct jtag_ctx *, uint8_t *, unsigned);
+static void mock_sleep(struct jtag_ctx *, int);
 
 
 enum svf_cmd {
@@ -160,12 +216,40 @@ enum port_mode {
 	PORT_MODE_ASYNC, PORT_MODE_SYNC, PORT_MODE_UART, PORT_MODE_UNKNOWN
 };
 typedef enum port_mode port_mode_t;
-static port_mode_t port_mode = PORT_MODE_UNKNOWN;
 
 
-static enum cable_hw {
-	CABLE_HW_USB, CABLE_HW_PPI, CABLE_HW_COM, CABLE_RAW, CABLE_UNKNOWN
-} cable_hw = CABLE_UNKNOWN;
+enum cable_hw {
+	CABLE_HW_USB, CABLE_HW_PPI, CABLE_HW_COM, CABLE_RAW, CABLE_REMOTE,
+	CABLE_MOCK, CABLE_UNKNOWN
+};
+
+/*
+ * Cable backends.  The JTAG core queues TCKs in TXBUF, two bytes per
+ * clock, and leaves it to the backend to get them onto the wire.  The
+ * optional hooks are used only when the matching capability bit is set,
+ * letting the core skip work the cable can do better on its own.
+ */
+#define	CABLE_CAP_SHIFT		0x01	/* Clocks whole scan vectors */
+#define	CABLE_CAP_TDO_CMP	0x02	/* Compares TDO itself */
+#define	CABLE_CAP_SLEEP		0x04	/* Waits without clocking TCK */
+
+struct cable_ops {
+	const char	*name;
+	int		caps;
+	int		(*open)(struct jtag_ctx *);
+	int		(*close)(struct jtag_ctx *);
+	int		(*set_mode)(struct jtag_ctx *, port_mode_t);
+	/* Send TXBUF, storing TDO samples back in place if SYNC */
+	int		(*commit)(struct jtag_ctx *);
+	/* Clock bits of hex tdi from *SHIFT, TMS high on the last one */
+	int		(*shift)(struct jtag_ctx *, unsigned, const char *);
+	/* Fetch TDO of the last shift, one byte per bit */
+	int		(*read_tdo)(struct jtag_ctx *, uint8_t *, unsigned);
+	/* Expected TDO for the vector at TXBUF index, with mask */
+	void		(*expect)(struct jtag_ctx *, unsigned, unsigned,
+			    const char *, const char *);
+	void		(*sleep)(struct jtag_ctx *, int);
+};
 
 
 static struct cable_hw_map {
@@ -175,6 +259,7 @@ static struct cable_hw_map {
 	char	*cable_path;
 	char	tck, tms, tdi, tdo;
 	char	cbus_led;
+	char	mpsse;		/* FT2232H / FT4232H, drive in MPSSE mode */
 } cable_hw_map[] = {
 #ifdef USE_RAW
 	{
@@ -183,6 +268,34 @@ static struct cable_hw_map {
 		.tms =		0x02,
 		.tdi =		0x01,
 	},
+#endif
+#ifdef USE_PPI
+	{
+		.cable_hw = 	CABLE_HW_PPI,
+		.cable_path =	"parallel port JTAG",
+		.tck =		0x02,
+		.tms =		0x04,
+		.tdi =		0x01,
+		.tdo =		0x40,
+	},
+#endif
+	{
+		.cable_hw = 	CABLE_MOCK,
+		.cable_path =	"virtual ULX3S",
+		.tck =		0x20,
+		.tms =		0x40,
+		.tdi =		0x80,
+		.tdo =		0x08,
+	},
+#ifdef USE_SOCKETS
+	{
+		.cable_hw = 	CABLE_REMOTE,
+		.cable_path =	"remote_bitbang",
+		.tck =		0x04,
+		.tms =		0x02,
+		.tdi =		0x01,
+		.tdo =		0x08,
+	},
 #endif
 	{
 		.cable_hw = 	CABLE_HW_USB,
@@ -391,7 +504,8 @@ static struct cable_hw_map {
 		.tms =		0x08,
 		.tdi =		0x02,
 		.tdo =		0x04,
-		.cbus_led =	0x10
+		.cbus_led =	0x10,
+		.mpsse =	1
 	},
 	{
 		.cable_hw = 	CABLE_HW_USB,
@@ -402,7 +516,8 @@ static struct cable_hw_map {
 		.tms =		0x08,
 		.tdi =		0x02,
 		.tdo =		0x04,
-		.cbus_led =	0x00
+		.cbus_led =	0x00,
+		.mpsse =	1
 	},
 	{
 		.cable_hw = 	CABLE_HW_USB,
@@ -424,17 +539,12 @@ static struct cable_hw_map {
 
 #define	USB_BAUDS		1000000
 
-#define	JTAG_TCK		(hmp->tck)
-#define	JTAG_TMS		(hmp->tms)
-#define	JTAG_TDI		(hmp->tdi)
-#define	JTAG_TDO		(hmp->tdo)
-
-#define	USB_CBUS_LED		(hmp->cbus_led)
+#define	JTAG_TCK		(ctx->hmp->tck)
+#define	JTAG_TMS		(ctx->hmp->tms)
+#define	JTAG_TDI		(ctx->hmp->tdi)
+#define	JTAG_TDO		(ctx->hmp->tdo)
 
-#define	PPI_TCK			0x02
-#define	PPI_TMS			0x04
-#define	PPI_TDI			0x01
-#define	PPI_TDO			0x40
+#define	USB_CBUS_LED		(ctx->hmp->cbus_led)
 
 #define	USB_BUFLEN_ASYNC	8192
 #ifdef WIN32
@@ -445,6 +555,11 @@ static struct cable_hw_map {
 
 #define	BUFLEN_MAX		USB_BUFLEN_ASYNC /* max(SYNC, ASYNC) */
 
+#define	MPSSE_TCK_KHZ		6000	/* Default TCK on MPSSE cables */
+#define	MPSSE_TX_MAX		65536	/* Commands queued before sending */
+#define	MPSSE_RX_MAX		1024	/* Bytes read back per transfer */
+#define	MPSSE_CHUNK		4096	/* Max data bytes per command */
+
 #define	LED_BLINK_RATE		250
 
 #define	BREAK_MS		250
@@ -456,49 +571,284 @@ static struct cable_hw_map {
 static char *statc = "-\\|/";
 
 /* Runtime globals */
-static int cur_s = UNDEFINED;
-static uint8_t txbuf[32 * 1024 * 1024];
-static uint8_t rxbuf[32 * 1024 * 1024];
-static char svfbuf[32 * 1024 * 1024];
-static unsigned txpos;
-static int need_led_blink;	/* Schedule CBUS led toggle */
-static int last_ledblink_ms;	/* Last time we toggled the CBUS LED */
-static int led_state;		/* CBUS LED indicator state */
-static int blinker_phase;
-static int progress_perc;
 static int bauds = 115200;	/* async terminal emulation baudrate */
 static int xbauds;		/* binary transfer baudrate */
-static int port_index = -1;
 static int terminal;		/* terminal emulation mode */
 static int reload;		/* send break to reset f32c */
 static int quiet;		/* suppress standard messages */
 char *svf_name;			/* SVF output name */
+static char *wave_name;		/* Binary waveform output name */
 static int txfu_ms;		/* txt file upload character delay (ms) */
 static int tx_binary;		/* send in raw (0) or binary (1) format */
 static const char *txfname;	/* file to send */
 static const char *com_name;	/* COM / TTY port name for -a or -t */
+static const char *daemon_name;	/* Socket to serve jobs on */
+static const char *connect_name; /* Daemon socket to send jobs to */
+static const char *xvc_name;	/* [ADDR:]PORT to serve XVC on */
+static const char *remote_name;	/* remote_bitbang target to drive */
+static const char *mock_name;	/* Device on the virtual board */
+static int mock_mpsse;		/* ... behind an MPSSE cable */
+static int watch_mode;		/* Program boards as they appear */
+static int soak_iters;		/* --soak, programming runs per board */
+static FILE *stats_fp;		/* --stats JSON goes here */
+static FILE *progress_fp;	/* --progress JSON goes here */
+static FILE *trace_fp;		/* --trace events go here */
+#ifndef WIN32
+static FILE *usbcap_fp;		/* --usb-capture log */
+static FILE *usbrep_fp;		/* --usb-replay log */
+static int usbrep_latency;	/* Replay at the recorded pace */
+#endif
 static int spi_addr;		/* Base address for -j flash programming */
 static int global_debug;
 static int cbusval = -1;
+static int tck_khz = MPSSE_TCK_KHZ; /* TCK frequency on MPSSE cables */
+static int tck_set;		/* --tck given, overrides the tune cache */
+static int tune_mode;		/* --tune the cable instead of programming */
+#ifdef __linux__
+static int low_jitter;		/* RT scheduling, locked memory */
+static int low_jitter_cpu = -1;	/* First CPU for the cable threads */
+#endif
+
+#define	BOARDS_MAX	64
+static char *board_sel[BOARDS_MAX]; /* Ports given with -p a,b,c */
+static int board_cnt;		/* -1 for -p all */
+
+#define	TXBUF_MIN		(64 * 1024)
+#define	TXBUF_MAX		(32 * 1024 * 1024)
+
+static size_t mem_budget;	/* --mem, 0 if unlimited */
+static unsigned txbuf_flush = TXBUF_MAX / 2; /* Async TXBUF bytes held */
+
+/*
+ * Where the time goes while programming, for --stats.  Time is charged
+ * only to the innermost phase entered, so that the phases add up to the
+ * total, e.g. a USB write inside an SVF command doesn't count as parse.
+ */
+enum stat_phase {
+	STAT_OTHER, STAT_READ, STAT_CONVERT, STAT_PARSE, STAT_ENCODE,
+	STAT_USB_WRITE, STAT_USB_READ, STAT_SLEEP, STAT_MODE, STAT_LED,
+	STAT_RETRY, STAT_PHASES
+};
+
+static const char *stat_names[STAT_PHASES] = {
+	"other", "file_read", "convert", "parse", "encode", "usb_write",
+	"usb_read_wait", "runtest_sleep", "mode_switch", "led_blink", "retry"
+};
+
+#define	STAT_DEPTH	8
+
+/* Trace thread IDs, each gets a track of its own */
+#define	TRACE_TID_MAIN	1
+#define	TRACE_TID_UNZIP	2
+#define	TRACE_TID_ENC	10	/* + encoder thread number */
+#define	TRACE_TID_BOARD	100	/* + board number */
+
+#define	RTT_BUCKETS	160
+
+struct jtag_stats {
+	uint64_t	ns[STAT_PHASES];
+	uint64_t	calls[STAT_PHASES];
+	uint64_t	t;		/* Last phase change */
+	uint64_t	start;
+	uint64_t	end;
+	int		stack[STAT_DEPTH];
+	uint64_t	since[STAT_DEPTH]; /* Phase entered, for --trace */
+	int		depth;
+	int		tid;		/* Trace track */
+
+	uint64_t	commits;
+	uint64_t	usb_out;	/* Bytes sent to the cable */
+	uint64_t	usb_in;		/* Bytes received */
+	uint64_t	tdo_checks;	/* SDR / SIR with TDO given */
+	uint64_t	tdo_errors;
+	uint64_t	retries;	/* Short reads and resends */
+
+	/* Sync mode USB round trips, in quarter octaves of ns */
+	uint32_t	rtt[RTT_BUCKETS];
+	uint64_t	rtt_cnt;
+	uint64_t	rtt_max;
+};
+
+/*
+ * USB cable settings, the defaults unless --tune found better ones for
+ * this very cable.  tck_khz is 0 for the --tck / default one.
+ */
+struct cable_tune {
+	int		bauds;		/* Bitbang rate */
+	int		sync_chunk;	/* Bytes per sync mode round trip */
+	int		chunk;		/* libftdi write chunk size */
+	int		latency;	/* FTDI latency timer, ms */
+	int		tck_khz;	/* TCK on MPSSE cables */
+};
+
+/*
+ * Per-device state.  Everything needed to drive a single cable and the
+ * JTAG chain behind it lives here, so that any number of boards can be
+ * driven from one process, each through its own context.
+ */
+struct jtag_ctx {
+	enum cable_hw	cable_hw;
+	const struct cable_ops *ops;	/* Cable backend */
+	struct cable_hw_map *hmp;	/* Selected cable hardware map */
+	struct mpsse	*mp;		/* MPSSE engine state */
+	struct mock	*mock;		/* Virtual board, see setup_mock() */
+	port_mode_t	port_mode;
+	int		cur_s;		/* TAP state */
+	int		last_sdr;	/* Port mode used by the last SDR */
+	int		port_index;	/* USB port, -1 for first cable found */
+	const char	*port_id;	/* USB serial number or bus path */
+	char		usb_serial[64];
+	char		usb_path[48];	/* USB bus and port numbers, 1-2.3 */
+	int		silent;		/* Don't print progress */
+	int		no_exit;	/* Fail the job, not the process */
+	int		fatal;		/* A job failed that way */
+	uint64_t	tcks;		/* TCKs clocked on this cable */
+	struct jtag_stats stats;
+	struct cable_tune tune;
+
+	uint8_t		*txbuf;		/* Pending TCKs, grown on demand */
+	unsigned	txsize;
+	unsigned	txpos;
+	uint8_t		*rxbuf;		/* Async (UART) receive buffer */
+	unsigned	rxsize;
+	uint8_t		*sdr_tck;	/* See send_generic() */
+	unsigned	sdr_tck_bits;
+
+	int		need_led_blink;	/* Schedule CBUS led toggle */
+	int		last_ledblink_ms; /* Last time we toggled the LED */
+	int		led_state;	/* CBUS LED indicator state */
+	int		blinker_phase;
+
+	/* Progress, see progress_show() */
+	double		progress;	/* Share of the input done, 0 to 1 */
+	uint64_t	prog_next;	/* No update before this time, ns */
+	uint64_t	prog_t;		/* Time of the last update */
+	uint64_t	prog_tcks;	/* TCKs at prog_t */
+	double		prog_rate;	/* TCKs per second, smoothed */
+	int		svf_input;	/* exec_svf_text() runs the input */
+
+	/* SVF executor */
+	char		*svfbuf;	/* Command being assembled */
+	unsigned	svfsize;
+	unsigned	svf_len;
+	int		svf_lno;	/* Current SVF line number */
+	int		svf_cmd_complete;
+	int		svf_parentheses_open;
+	char		*svf_carry;	/* Incomplete line from last chunk */
+	int		svf_carry_len;
+	int		svf_carry_size;
+
+	/* SVF emitter */
+	char		*svfo_buf;
+	int		svfo_len;
+	int		svfo_fd;	/* SVF output file, -1 when executing */
+	int		svfo_res;	/* First error encountered */
+	int		svfo_debug;
 
-static struct cable_hw_map *hmp; /* Selected cable hardware map */
 #ifdef WIN32
-static FT_HANDLE ftHandle;	/* USB port handle */
-static HANDLE com_port;		/* COM port file */
-static struct _DCB tty;		/* COM port TTY handle */
+	FT_HANDLE	ftHandle;	/* USB port handle */
+	HANDLE		com_port;	/* COM port file */
+	struct _DCB	tty;		/* COM port TTY handle */
 #else
-static struct ftdi_context fc;	/* USB port handle */
-static int com_port;		/* COM port file */
-static struct termios tty;	/* COM port TTY handle */
+	struct ftdi_context fc;		/* USB port handle */
+	int		com_port;	/* COM port file */
+	struct termios	tty;		/* COM port TTY handle */
 #ifdef USE_PPI
-static int ppi;			/* Parallel port handle */
+	int		ppi;		/* Parallel port handle */
 #endif
+	int		remote;		/* remote_bitbang socket */
 #endif
+};
+
+
+static void
+tune_defaults(struct cable_tune *t)
+{
+
+	t->bauds = USB_BAUDS;
+	t->sync_chunk = USB_BUFLEN_SYNC;
+	t->chunk = BUFLEN_MAX;
+	t->latency = 1;
+	t->tck_khz = 0;
+}
+
+static struct jtag_ctx *
+jtag_ctx_new(enum cable_hw cable_hw)
+{
+	struct jtag_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return (NULL);
+	ctx->txsize = TXBUF_MIN;
+	ctx->txbuf = malloc(ctx->txsize);
+	if (ctx->txbuf == NULL) {
+		free(ctx);
+		return (NULL);
+	}
+	ctx->cable_hw = cable_hw;
+	ctx->port_mode = PORT_MODE_UNKNOWN;
+	ctx->cur_s = UNDEFINED;
+	ctx->last_sdr = PORT_MODE_UNKNOWN;
+	ctx->port_index = -1;
+	ctx->svfo_fd = -1;
+	ctx->stats.tid = TRACE_TID_MAIN;
+	tune_defaults(&ctx->tune);
+	return (ctx);
+}
+
+static void
+jtag_ctx_free(struct jtag_ctx *ctx)
+{
+
+	free(ctx->txbuf);
+	free(ctx->rxbuf);
+	free(ctx->svfbuf);
+	free(ctx->svf_carry);
+	free(ctx->svfo_buf);
+	free(ctx);
+}
+
+/*
+ * Select a USB cable by index, serial number or bus path, as given to -p.
+ */
+static void
+port_select(struct jtag_ctx *ctx, const char *arg)
+{
+
+	if (arg[0] != 0 && arg[strspn(arg, "0123456789")] == 0)
+		ctx->port_index = atoi(arg);
+	else
+		ctx->port_id = arg;
+}
 
 
 /* ms_sleep() sleeps for at least the number of milliseconds given as arg */
+#if defined(__linux__) || defined(__FreeBSD__)
+static void
+ms_sleep(int delay_ms)
+{
+	struct timespec ts;
+
+	/* Against a deadline, so that a signal doesn't stretch the wait */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += delay_ms / 1000;
+	ts.tv_nsec += (delay_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	    EINTR) {
+	}
+}
+#else
 #define	ms_sleep(delay_ms)	usleep((delay_ms) * 1000)
+#endif
 
+#ifndef WIN32
+static long usbcap_ms(long);
+#endif
 
 static long
 ms_uptime(void)
@@ -509,6 +859,7 @@ ms_uptime(void)
 
 	gettimeofday(&tv, 0);
 	ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	ms = usbcap_ms(ms);
 #else
 	ms = GetTickCount();
 #endif
@@ -516,554 +867,1895 @@ ms_uptime(void)
 }
 
 
-static int
-set_port_mode(port_mode_t mode)
+/* Monotonic, in nanoseconds */
+static uint64_t
+ns_uptime(void)
 {
-	int res = 0;
+#ifndef WIN32
+	struct timespec ts;
 
-	/* No-op if already in requested mode, or not using USB */
-	if (!need_led_blink &&
-	    (port_mode == mode || cable_hw != CABLE_HW_USB)) {
-		port_mode = mode;
-		return (0);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+#else
+	LARGE_INTEGER f, c;
 
-	/* Flush any stale TX buffers */
-	commit(1);
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (c.QuadPart / f.QuadPart * 1000000000 +
+	    c.QuadPart % f.QuadPart * 1000000000 / f.QuadPart);
+#endif
+}
 
-	/* Blink status LED by deactivating CBUS pulldown pin */
-	if (need_led_blink) {
-		need_led_blink = 0;
-		led_state ^= USB_CBUS_LED;
-		if (!quiet && progress_perc < 100) {
-			fprintf(stderr, "\rProgramming: %d%% %c ",
-			    progress_perc, statc[blinker_phase]);
-			fflush(stderr);
-		}
-		blinker_phase = (blinker_phase + 1) & 0x3;
-	}
 
-#ifdef WIN32
-	if (mode == PORT_MODE_ASYNC)
-		mode = PORT_MODE_SYNC;
-#endif
+#ifndef WIN32
+/*
+ * USB capture and replay.  With --usb-capture, every libftdi call made on
+ * a cable gets a line in the log: start time and duration in ns, the
+ * call, its result and its arguments, followed by a hash of the data
+ * written or the data read back in hex.  The cable found comes first.
+ * ms_uptime() readings are logged too, as they decide when the LED
+ * blinks and with that how TXBUF is cut into transfers.
+ *
+ * --usb-replay plays such a log back in place of the cable, so that a
+ * session can be rerun without the hardware, and the same every time.
+ * What ujprog writes has to match the log, else the replay stops there.
+ * With --usb-replay-latency each call takes as long as it did when
+ * recorded, to reproduce the USB timing of another host.
+ */
+#define	USBCAP_MAGIC	"# ujprog USB capture 1"
 
-	switch (mode) {
-	case PORT_MODE_SYNC:
-#ifdef WIN32
-		/*
-		 * If switching to SYNC mode, attempt to allow for TX
-		 * buffers to drain first.
-		 */
-		if (port_mode != PORT_MODE_SYNC)
-			ms_sleep(20);
+static uint64_t usbcap_t0;
+static char *usbrep_buf;
+static size_t usbrep_size;
+static int usbrep_lno;
+static int usbrep_failed;
 
-		res = FT_SetBitMode(ftHandle,
-#else
-		res = ftdi_set_bitmode(&fc,
-#endif
-		    JTAG_TCK | JTAG_TMS | JTAG_TDI | led_state,
-		    BITMODE_SYNCBB | (BITMODE_CBUS * (USB_CBUS_LED != 0)));
+static int
+usbcap_open(const char *path, int replay)
+{
+	FILE *fp;
 
-		if (port_mode == PORT_MODE_SYNC)
-			break;
+	fp = fopen(path, replay ? "r" : "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Can't %s %s: %s\n", replay ? "open" : "create",
+		    path, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	usbcap_t0 = ns_uptime();
+	if (!replay) {
+		fprintf(fp, "%s\n", USBCAP_MAGIC);
+		usbcap_fp = fp;
+		return (0);
+	}
+	usbrep_fp = fp;
+	if (getline(&usbrep_buf, &usbrep_size, fp) < 0 ||
+	    strncmp(usbrep_buf, USBCAP_MAGIC, strlen(USBCAP_MAGIC)) != 0) {
+		fprintf(stderr, "%s: not a USB capture\n", path);
+		return (EXIT_FAILURE);
+	}
+	usbrep_lno = 1;
+	return (0);
+}
 
-		/* Flush any stale RX buffers */
-#ifdef WIN32
-		for (res = 0; res < 2; res++) {
-			do {
-				ms_sleep(10);
-			} while (FT_StopInTask(ftHandle) != FT_OK);
-			FT_Purge(ftHandle, FT_PURGE_RX);
-			do {} while (FT_RestartInTask(ftHandle) != FT_OK);
-			ms_sleep(10);
-		}
-#else
-		do {
-			res = ftdi_read_data(&fc, &txbuf[0], sizeof(txbuf));
-		} while (res == sizeof(txbuf));
-#endif
-		break;
+static uint32_t
+usbcap_hash(const uint8_t *buf, int len)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
 
-	case PORT_MODE_ASYNC:
-#ifdef WIN32
-		res = FT_SetBitMode(ftHandle,
-#else
-		res = ftdi_set_bitmode(&fc,
-#endif
-		    JTAG_TCK | JTAG_TMS | JTAG_TDI | led_state,
-		    BITMODE_BITBANG | (BITMODE_CBUS * (USB_CBUS_LED != 0)));
-		break;
+	while (len-- > 0)
+		h = (h ^ *buf++) * 16777619U;
+	return (h);
+}
 
-	case PORT_MODE_UART:
-		res = 0;
-		if (port_mode == PORT_MODE_UART)
-			break;
-		/* Pull TCK low so that we don't incidentally pulse it. */
-		memset(txbuf, 0, 10);
-#ifdef WIN32
-		FT_Write(ftHandle, txbuf, 10, (DWORD *) &res);
-		if (res < 0) {
-			fprintf(stderr, "FT_Write() failed\n");
-			return (res);
-		}
-		res = FT_SetBitMode(ftHandle, 0, BITMODE_OFF);
-#else
-		res = ftdi_write_data(&fc, &txbuf[0], 10);
-		if (res < 0) {
-			fprintf(stderr, "ftdi_write_data() failed\n");
-			return (res);
-		}
-		res = ftdi_disable_bitbang(&fc);
-#endif
-		break;
+/* Log a call which started at t0, with any data read */
+static void
+usbcap_log(uint64_t t0, int op, int res, const uint8_t *rd,
+    const char *fmt, ...)
+{
+	va_list ap;
+	uint64_t now;
+	int i;
 
-	default:
-		res = -1;
+	if (usbcap_fp == NULL)
+		return;
+	now = ns_uptime();
+	flockfile(usbcap_fp);
+	fprintf(usbcap_fp, "%llu %llu %c %d",
+	    (unsigned long long) (t0 - usbcap_t0),
+	    (unsigned long long) (now - t0), op, res);
+	va_start(ap, fmt);
+	vfprintf(usbcap_fp, fmt, ap);
+	va_end(ap);
+	if (rd != NULL && res > 0)
+		fputc(' ', usbcap_fp);
+	for (i = 0; rd != NULL && i < res; i++)
+		fprintf(usbcap_fp, "%02x", rd[i]);
+	fputc('\n', usbcap_fp);
+	funlockfile(usbcap_fp);
+}
+
+/*
+ * Take the next record off the replay log, which has to be for op.
+ * Returns its arguments, with the result of the call in *res, or NULL
+ * once this session has taken a different turn than the recorded one.
+ */
+static char *
+usbrep_next(int op, int *res)
+{
+	unsigned long long t, dur;
+	struct timespec ts;
+	char c = '?';
+	int n = 0;
+
+	if (usbrep_failed)
+		return (NULL);
+	if (getline(&usbrep_buf, &usbrep_size, usbrep_fp) < 0) {
+		fprintf(stderr, "\nUSB replay: log ends at line %d\n",
+		    usbrep_lno);
+		usbrep_failed = 1;
+		return (NULL);
 	}
+	usbrep_lno++;
+	if (sscanf(usbrep_buf, "%llu %llu %c %d %n", &t, &dur, &c, res,
+	    &n) < 4 || c != op) {
+		fprintf(stderr, "\nUSB replay diverged at line %d: "
+		    "'%c' instead of '%c'\n", usbrep_lno, op, c);
+		usbrep_failed = 1;
+		return (NULL);
+	}
+	if (usbrep_latency && dur > 0) {
+		ts.tv_sec = dur / 1000000000;
+		ts.tv_nsec = dur % 1000000000;
+		nanosleep(&ts, NULL);
+	}
+	return (usbrep_buf + n);
+}
+
+/* Result of the next recorded call, for those without data */
+static int
+usbrep_res(int op)
+{
+	int res;
 
-	port_mode = mode;
+	if (usbrep_next(op, &res) == NULL)
+		return (-1);
 	return (res);
 }
 
+static long
+usbcap_ms(long ms)
+{
+	char *args;
+	int res;
+
+	if (usbrep_fp != NULL) {
+		args = usbrep_next('T', &res);
+		if (args != NULL)
+			ms = strtol(args, NULL, 10);
+	} else
+		usbcap_log(ns_uptime(), 'T', 0, NULL, " %ld", ms);
+	return (ms);
+}
 
-#ifdef WIN32
 static int
-com2ftindex(int comnum, FT_DEVICE_LIST_INFO_NODE *devInfo)
+usbcap_write_data(struct ftdi_context *fc, unsigned char *buf, int len)
 {
-	DWORD numDevs;
-	FT_STATUS ftStatus;
-	FT_DEVICE_LIST_INFO_NODE *devInfoTbl;
-	FT_HANDLE ftHandle;
-	LONG num;
-	int i;
+	uint64_t t0 = ns_uptime();
+	uint32_t h = 0;
+	char *args;
+	int res;
 
-	ftStatus = FT_CreateDeviceInfoList(&numDevs);
-	if (ftStatus != FT_OK ||numDevs == 0)
-		return -1;
+	if (usbrep_fp != NULL || usbcap_fp != NULL)
+		h = usbcap_hash(buf, len);
+	if (usbrep_fp != NULL) {
+		args = usbrep_next('W', &res);
+		if (args == NULL)
+			return (-1);
+		if (strtoul(args, &args, 10) != (unsigned) len ||
+		    strtoul(args, NULL, 16) != h) {
+			fprintf(stderr, "\nUSB replay diverged at line %d: "
+			    "different data written\n", usbrep_lno);
+			usbrep_failed = 1;
+			return (-1);
+		}
+		return (res);
+	}
+	res = ftdi_write_data(fc, buf, len);
+	usbcap_log(t0, 'W', res, NULL, " %d %08x", len, h);
+	return (res);
+}
 
-	devInfoTbl = malloc(sizeof(*devInfoTbl) * numDevs);
-	ftStatus = FT_GetDeviceInfoList(devInfoTbl, &numDevs);
-	if (ftStatus != FT_OK) {
-		free(devInfoTbl);
-		return -1;
+static int
+usbcap_read_data(struct ftdi_context *fc, unsigned char *buf, int len)
+{
+	uint64_t t0 = ns_uptime();
+	char *args;
+	int i, res;
+
+	if (usbrep_fp != NULL) {
+		args = usbrep_next('R', &res);
+		if (args == NULL)
+			return (-1);
+		strtol(args, &args, 10);
+		for (i = 0; i < res && i < len; i++) {
+			while (*args == ' ')
+				args++;
+			if (sscanf(args, "%2hhx", &buf[i]) != 1)
+				break;
+			args += 2;
+		}
+		return (res < 0 ? res : i);
 	}
+	res = ftdi_read_data(fc, buf, len);
+	usbcap_log(t0, 'R', res, buf, " %d", len);
+	return (res);
+}
 
-	for (i = 0; i < numDevs; i++) {
-		ftStatus = FT_Open(i, &ftHandle);
-		if (ftStatus != FT_OK)
-			continue;
+static int
+usbcap_set_bitmode(struct ftdi_context *fc, unsigned char mask,
+    unsigned char mode)
+{
+	uint64_t t0 = ns_uptime();
+	int res;
 
-		FT_GetComPortNumber(ftHandle, &num);
-		FT_Close(ftHandle);
-		if (num != comnum)
-			continue;
+	if (usbrep_fp != NULL)
+		return (usbrep_res('M'));
+	res = ftdi_set_bitmode(fc, mask, mode);
+	usbcap_log(t0, 'M', res, NULL, " %02x %02x", mask, mode);
+	return (res);
+}
 
-		if (devInfo != NULL)
-			memcpy(devInfo, &devInfoTbl[i], sizeof(*devInfo));
-		free(devInfoTbl);
-		return i;
-	}
+static int
+usbcap_disable_bitbang(struct ftdi_context *fc)
+{
+	uint64_t t0 = ns_uptime();
+	int res;
 
-	free(devInfoTbl);
-	return -1;
+	if (usbrep_fp != NULL)
+		return (usbrep_res('X'));
+	res = ftdi_disable_bitbang(fc);
+	usbcap_log(t0, 'X', res, NULL, "");
+	return (res);
 }
 
-static void
-list_ports(void)
+static int
+usbcap_set_baudrate(struct ftdi_context *fc, int baud)
 {
-	FT_DEVICE_LIST_INFO_NODE devInfo;
-	int num, size, ftindex;
-	char *buf, *cp;
-	char comtbl[1024];
-
-	size = 1024 * 1024;
-	buf = malloc(size);
-	if (QueryDosDevice(NULL, buf, size) == 0) {
-		printf("QueryDosDevice() failed\n");
-		free(buf);
-		return;
-	};
+	uint64_t t0 = ns_uptime();
+	int res;
 
-	memset(comtbl, 0, sizeof(comtbl));
-	for (cp = buf; *cp != 0; cp += strlen(cp) + 1) {
-		if (strncmp("COM", cp, 3) != 0)
-			continue;
-		num = atoi(&cp[3]);
-		if (num >= sizeof(comtbl))
-			continue;
-		sprintf((char *) txbuf, "\\\\.\\%s", cp);
-		com_port = CreateFile((char *) txbuf,
-		    GENERIC_READ | GENERIC_WRITE,
-		    0, NULL, OPEN_EXISTING, 0, NULL);
-		if (com_port == INVALID_HANDLE_VALUE)
-			comtbl[num] = -1;
-		else
-			comtbl[num] = 1;
-		CloseHandle(com_port);
-	}
+	if (usbrep_fp != NULL)
+		return (usbrep_res('S'));
+	res = ftdi_set_baudrate(fc, baud);
+	usbcap_log(t0, 'S', res, NULL, " %d", baud);
+	return (res);
+}
 
-	for (num = 0; num < sizeof(comtbl); num++) {
-		if (comtbl[num] == 0)
-			continue;
-		sprintf(buf, "COM%d", num);
-		printf("%s: ", buf);
-		ftindex = com2ftindex(num, &devInfo);
-		if (ftindex >= 0) {
-			printf("%s (SN %s) ", devInfo.Description,
-			    devInfo.SerialNumber);
-			printf("FTDI #%d PID 0x%04lx\n", ftindex,
-			    devInfo.ID & 0xffff);
-		} else if (comtbl[num] > 0)
-			printf("Generic port\n");
-		else
-			printf("(port in use)\n");
-	}
+static int
+usbcap_set_latency_timer(struct ftdi_context *fc, unsigned char ms)
+{
+	uint64_t t0 = ns_uptime();
+	int res;
 
-	free(buf);
+	if (usbrep_fp != NULL)
+		return (usbrep_res('L'));
+	res = ftdi_set_latency_timer(fc, ms);
+	usbcap_log(t0, 'L', res, NULL, " %d", ms);
+	return (res);
 }
 
-
 static int
-setup_usb(void)
+usbcap_write_data_set_chunksize(struct ftdi_context *fc, unsigned len)
 {
-	FT_STATUS res;
-	FT_DEVICE ftDevice;
-	DWORD deviceID;
-	char SerialNumber[16];
-	char Description[64];
+	uint64_t t0 = ns_uptime();
+	int res;
 
-	if (port_index >= 0)
-		res = FT_Open(port_index, &ftHandle);
-	else
-		res = FT_Open(0, &ftHandle);
-	if (res != FT_OK) {
-		fprintf(stderr, "FT_Open() failed\n");
-		return (res);
-	}
+	if (usbrep_fp != NULL)
+		return (usbrep_res('C'));
+	res = ftdi_write_data_set_chunksize(fc, len);
+	usbcap_log(t0, 'C', res, NULL, " %u", len);
+	return (res);
+}
 
-	res = FT_GetDeviceInfo(ftHandle, &ftDevice, &deviceID, SerialNumber,
-	    Description, NULL);
-	if (res != FT_OK) {
-		fprintf(stderr, "FT_GetDeviceInfo() failed\n");
-		return (res);
-	}
-	for (hmp = cable_hw_map; hmp->cable_hw != CABLE_UNKNOWN; hmp++) {
-		if (deviceID == ((hmp->usb_vid << 16) | hmp->usb_pid)
-		    && strcmp(Description, hmp->cable_path) == 0)
-			break;
-	}
-	if (port_index < 0 && hmp->cable_hw == CABLE_UNKNOWN)
-		return (-1);
+static int
+usbcap_usb_purge_buffers(struct ftdi_context *fc)
+{
+	uint64_t t0 = ns_uptime();
+	int res;
 
-	if (!quiet)
-		printf("Using USB cable: %s\n", hmp->cable_path);
+	if (usbrep_fp != NULL)
+		return (usbrep_res('P'));
+	res = ftdi_usb_purge_buffers(fc);
+	usbcap_log(t0, 'P', res, NULL, "");
+	return (res);
+}
 
-	res = FT_SetBaudRate(ftHandle, USB_BAUDS);
-	if (res != FT_OK) {
-		fprintf(stderr, "FT_SetBaudRate() failed\n");
-		return (res);
-	}
+static int
+usbcap_setdtr_rts(struct ftdi_context *fc, int dtr, int rts)
+{
+	uint64_t t0 = ns_uptime();
+	int res;
 
-#ifdef NOTYET
-	FT_setUSB_Parameters();
-	res = ftdi_write_data_set_chunksize(&fc, BUFLEN_MAX);
-	if (res < 0) {
-		fprintf(stderr, "ftdi_write_data_set_chunksize() failed\n");
-		return (res);
-	}
-#endif
+	if (usbrep_fp != NULL)
+		return (usbrep_res('D'));
+	res = ftdi_setdtr_rts(fc, dtr, rts);
+	usbcap_log(t0, 'D', res, NULL, " %d %d", dtr, rts);
+	return (res);
+}
 
-	res = FT_SetLatencyTimer(ftHandle, 1);
-	if (res != FT_OK) {
-		fprintf(stderr, "FT_SetLatencyTimer() failed\n");
-		return (res);
-	}
+static int
+usbcap_set_line_property(struct ftdi_context *fc, enum ftdi_bits_type bits,
+    enum ftdi_stopbits_type stop, enum ftdi_parity_type parity)
+{
+	uint64_t t0 = ns_uptime();
+	int res;
 
-	res = FT_SetFlowControl(ftHandle, FT_FLOW_NONE, 0, 0);
-	if (res != FT_OK) {
-		fprintf(stderr, "FT_SetFlowControl() failed\n");
-		return (res);
-	}
+	if (usbrep_fp != NULL)
+		return (usbrep_res('N'));
+	res = ftdi_set_line_property(fc, bits, stop, parity);
+	usbcap_log(t0, 'N', res, NULL, " %d %d %d", bits, stop, parity);
+	return (res);
+}
 
-	res = FT_SetBitMode(ftHandle, 0, BITMODE_BITBANG);
-	if (res != FT_OK) {
-		fprintf(stderr, "FT_SetBitMode() failed\n");
-		return (res);
-	}
+static int
+usbcap_setflowctrl(struct ftdi_context *fc, int flow)
+{
+	uint64_t t0 = ns_uptime();
+	int res;
 
-	res = FT_SetTimeouts(ftHandle, 1000, 1000);
-	if (res != FT_OK) {
-		fprintf(stderr, "FT_SetTimeouts() failed\n");
-		return (res);
-	}
+	if (usbrep_fp != NULL)
+		return (usbrep_res('F'));
+	res = ftdi_setflowctrl(fc, flow);
+	usbcap_log(t0, 'F', res, NULL, " %d", flow);
+	return (res);
+}
 
-	FT_Purge(ftHandle, FT_PURGE_TX);
-	FT_Purge(ftHandle, FT_PURGE_RX);
+/* Without a device to let go of when replaying */
+static int
+usbcap_usb_close(struct ftdi_context *fc)
+{
 
-	return (0);
+	return (usbrep_fp != NULL ? 0 : ftdi_usb_close(fc));
 }
 
+static void
+usbcap_deinit(struct ftdi_context *fc)
+{
+
+	if (usbrep_fp == NULL)
+		ftdi_deinit(fc);
+}
 
 static int
-shutdown_usb(void)
+usbcap_reset_device(libusb_device_handle *h)
 {
 
-	int res;
+	return (usbrep_fp != NULL ? 0 : libusb_reset_device(h));
+}
 
-	/* Allow for the USB FIFO to drain, just in case. */
-	ms_sleep(10);
+/* From here on, all of the cable code goes through the above */
+#define	ftdi_write_data			usbcap_write_data
+#define	ftdi_read_data			usbcap_read_data
+#define	ftdi_set_bitmode		usbcap_set_bitmode
+#define	ftdi_disable_bitbang		usbcap_disable_bitbang
+#define	ftdi_set_baudrate		usbcap_set_baudrate
+#define	ftdi_set_latency_timer		usbcap_set_latency_timer
+#define	ftdi_write_data_set_chunksize	usbcap_write_data_set_chunksize
+#define	ftdi_usb_purge_buffers		usbcap_usb_purge_buffers
+#define	ftdi_setdtr_rts			usbcap_setdtr_rts
+#define	ftdi_set_line_property		usbcap_set_line_property
+#define	ftdi_setflowctrl		usbcap_setflowctrl
+#define	ftdi_usb_close			usbcap_usb_close
+#define	ftdi_deinit			usbcap_deinit
+#define	libusb_reset_device		usbcap_reset_device
+#endif /* !WIN32 */
 
-	/* Clean up */
-	res = set_port_mode(PORT_MODE_UART);
-	if (res < 0) {
-		fprintf(stderr, "set_port_mode() failed\n");
-		return (res);
-	}
 
-	res = FT_SetLatencyTimer(ftHandle, 20);
-	if (res < 0) {
-		fprintf(stderr, "FT_SetLatencyTimer() failed\n");
-		return (res);
-	}
+/*
+ * --trace writes Chrome trace events, which Perfetto and chrome://tracing
+ * load as a timeline.  Each event goes out with a single fprintf(), so
+ * threads may emit them without further locking.
+ */
+static uint64_t trace_t0;
 
-	res = FT_Close(ftHandle);
-	if (res < 0) {
-		fprintf(stderr, "FT_Close() failed\n");
-		return (res);
-	}
+static void
+trace_span(int tid, const char *name, uint64_t start, uint64_t end,
+    const char *args)
+{
 
-	return (0);
+	if (trace_fp == NULL)
+		return;
+	fprintf(trace_fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", "
+	    "\"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f%s%s}",
+	    name, tid, (start - trace_t0) / 1e3, (end - start) / 1e3,
+	    args != NULL ? ", \"args\": " : "", args != NULL ? args : "");
 }
-#endif /* WIN32 */
 
+/* Label the track of tid */
+static void
+trace_thread(int tid, const char *name)
+{
+	char buf[128];
+	int i;
+
+	if (trace_fp == NULL)
+		return;
+	snprintf(buf, sizeof(buf), "%s", name);
+	for (i = 0; buf[i] != 0; i++)
+		if (buf[i] == '"' || buf[i] == '\\' || buf[i] < 0x20)
+			buf[i] = '_';
+	fprintf(trace_fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+	    "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+	    tid, buf);
+}
 
-#ifdef USE_RAW
-static int raw_pos;
-static int raw_csum;
-static char raw_ch;
+static void
+trace_close(void)
+{
+
+	if (trace_fp == NULL)
+		return;
+	fprintf(trace_fp, "\n]\n");
+	fclose(trace_fp);
+	trace_fp = NULL;
+}
 
 static int
-setup_raw(void)
+trace_open(const char *path)
 {
 
-	for (hmp = cable_hw_map; hmp->cable_hw != CABLE_RAW; hmp++) {
+	trace_fp = fopen(path, "w");
+	if (trace_fp == NULL) {
+		fprintf(stderr, "Can't create %s: %s\n", path,
+		    strerror(errno));
+		return (EXIT_FAILURE);
 	}
-
-	/* XXX try to open output file for writing */
+	trace_t0 = ns_uptime();
+	fprintf(trace_fp, "[\n{\"name\": \"process_name\", \"ph\": \"M\", "
+	    "\"pid\": 1, \"args\": {\"name\": \"ujprog\"}}");
+	trace_thread(TRACE_TID_MAIN, "main");
+	atexit(trace_close);
 	return (0);
 }
 
+
 static void
-srec_header(const char *name)
+stats_enter(struct jtag_stats *st, int phase)
 {
-	unsigned i;
-	int csum;
+	uint64_t now;
 
-	csum = strlen(name) + 3;
-	printf("S0%02X0000", csum);
+	if ((stats_fp == NULL && trace_fp == NULL) || st == NULL)
+		return;
+	now = ns_uptime();
+	if (st->depth > 0 && st->depth <= STAT_DEPTH)
+		st->ns[st->stack[st->depth - 1]] += now - st->t;
+	st->t = now;
+	if (st->depth < STAT_DEPTH) {
+		st->stack[st->depth] = phase;
+		st->since[st->depth] = now;
+	}
+	st->depth++;
+	st->calls[phase]++;
+}
 
-	for (i = 0; i < strlen(name); i++) {
-		printf("%02X", name[i]);
-		csum += name[i];
+static void
+stats_leave(struct jtag_stats *st)
+{
+	uint64_t now;
+	int phase;
+
+	if ((stats_fp == NULL && trace_fp == NULL) || st == NULL ||
+	    st->depth == 0)
+		return;
+	now = ns_uptime();
+	st->depth--;
+	if (st->depth < STAT_DEPTH) {
+		phase = st->stack[st->depth];
+		st->ns[phase] += now - st->t;
+		trace_span(st->tid, phase == STAT_OTHER ? "program" :
+		    stat_names[phase], st->since[st->depth], now, NULL);
 	}
+	st->t = now;
+}
 
-	printf("%02X\n", 0xff - (csum & 0xff));
+/* Start over, with the clock running in STAT_OTHER */
+static void
+stats_begin(struct jtag_ctx *ctx)
+{
+	int tid = ctx->stats.tid;
+
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->stats.tid = tid;
+	ctx->tcks = 0;
+	ctx->stats.start = ns_uptime();
+	stats_enter(&ctx->stats, STAT_OTHER);
 }
 
-static int
-commit_raw(void)
+static void
+stats_end(struct jtag_ctx *ctx)
 {
-	unsigned i;
 
-	for (i = 0; i < txpos; i += 2) {
-		/* SREC line header */
-		if ((raw_pos & 0x7f) == 0) {
-			printf("S224%06X", raw_pos >> 2);
-			raw_csum = 0x24;
-			raw_csum += (raw_pos >> 18) & 0xff;
-			raw_csum += (raw_pos >> 10) & 0xff;
-			raw_csum += (raw_pos >> 2) & 0xff;
-		}
+	stats_leave(&ctx->stats);
+	ctx->stats.end = ns_uptime();
+}
 
-		raw_ch <<= 2;
-		raw_ch |= txbuf[i] & 0x3;
-		if ((raw_pos & 0x3) == 0x3) {
-			printf("%02X", raw_ch & 0xff);
-			raw_csum += raw_ch;
-		}
+/* Account a sync mode round trip which took ns */
+static void
+stats_rtt(struct jtag_stats *st, uint64_t ns)
+{
+	int b, msb;
+
+	for (msb = 0; (ns >> msb) > 1; msb++)
+		continue;
+	b = msb * 4;
+	if (msb >= 2)
+		b += (ns >> (msb - 2)) & 3;
+	if (b >= RTT_BUCKETS)
+		b = RTT_BUCKETS - 1;
+	st->rtt[b]++;
+	st->rtt_cnt++;
+	if (ns > st->rtt_max)
+		st->rtt_max = ns;
+}
 
-		if ((raw_pos & 0x7f) == 0x7f) {
-			printf("%02X\n", 0xff - (raw_csum & 0xff));
-			raw_csum = 0;
-		}
-		raw_pos++;
-	}
+/* Upper bound of the round trip time below which pct % of them were */
+static uint64_t
+stats_rtt_pct(struct jtag_stats *st, int pct)
+{
+	uint64_t n, want;
+	int b;
 
-	txpos = 0;
-	return (0);
+	want = (st->rtt_cnt * pct + 99) / 100;
+	for (b = 0, n = 0; b < RTT_BUCKETS - 1; b++) {
+		n += st->rtt[b];
+		if (n >= want && n > 0)
+			break;
+	}
+	if (b < 8)
+		return (1ULL << (b / 4));
+	return ((uint64_t) (4 + (b & 3) + 1) << (b / 4 - 2));
 }
 
+/* Print s as a quoted JSON string */
 static void
-shutdown_raw(void)
+json_str(FILE *fp, const char *s)
 {
 
-	/* Pad and flush SREC line */
-	if ((raw_pos & 0x7f) != 0x7f) {
-		txpos = (0x80 - (raw_pos & 0x7f)) * 2;
-		memset(txbuf, 0, txpos);
-		commit_raw();
+	fputc('"', fp);
+	for (; *s != 0; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
 	}
-	printf("S804000000FB\n");
+	fputc('"', fp);
 }
-#endif
 
-#ifndef WIN32
-#ifdef USE_PPI
-static int
-setup_ppi(void)
+/* Peak resident set size of the process so far, 0 if unknown */
+static long
+peak_rss_kb(void)
 {
-	char c = 0;
+#ifdef WIN32
 
-	ppi = open("/dev/ppi0", O_RDWR);
-	if (ppi < 0)
-		return (errno);
+	return (0);
+#else
+	struct rusage ru;
 
-	ioctl(ppi, PPISDATA, &c);
-	ioctl(ppi, PPISSTATUS, &c);
-	ioctl(ppi, PPIGSTATUS, &c);
-	if ((c & 0xb6) != 0x06) {
-		close (ppi);
-		return (EINVAL);
-	}
+	if (getrusage(RUSAGE_SELF, &ru))
+		return (0);
+#ifdef __APPLE__
+	return (ru.ru_maxrss / 1024);	/* Bytes, not KB */
+#else
+	return (ru.ru_maxrss);
+#endif
+#endif
+}
 
-	return (0);
+/*
+ * Append a run to the --stats file, as a single line of JSON.
+ */
+static void
+stats_report(struct jtag_ctx *ctx, const char *fname, int res)
+{
+	struct jtag_stats *st = &ctx->stats;
+	FILE *fp = stats_fp;
+	int i;
+	const struct {
+		const char	*name;
+		uint64_t	val;
+	} cnt[] = {
+		{ "tcks",		ctx->tcks },
+		{ "commits",		st->commits },
+		{ "usb_bytes_out",	st->usb_out },
+		{ "usb_bytes_in",	st->usb_in },
+		{ "tdo_checks",		st->tdo_checks },
+		{ "tdo_errors",		st->tdo_errors },
+		{ "retries",		st->retries },
+	};
+
+	if (fp == NULL)
+		return;
+#ifdef USE_THREADS
+	flockfile(fp);	/* Boards may report at the same time */
+#endif
+	fprintf(fp, "{\"file\": ");
+	json_str(fp, fname);
+	fprintf(fp, ", \"cable\": ");
+	json_str(fp, ctx->hmp ? ctx->hmp->cable_path : "");
+	fprintf(fp, ", \"serial\": ");
+	json_str(fp, ctx->usb_serial);
+	fprintf(fp, ", \"usb_path\": \"%s\", \"result\": %d, "
+	    "\"total_ns\": %llu, \"phases_ns\": {", ctx->usb_path, res,
+	    (unsigned long long) (st->end - st->start));
+	for (i = 0; i < STAT_PHASES; i++)
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", stat_names[i],
+		    (unsigned long long) st->ns[i]);
+	fprintf(fp, "}, \"phase_calls\": {");
+	for (i = 0; i < STAT_PHASES; i++)
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", stat_names[i],
+		    (unsigned long long) st->calls[i]);
+	fprintf(fp, "}, \"counters\": {");
+	for (i = 0; i < (int) (sizeof(cnt) / sizeof(cnt[0])); i++)
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", cnt[i].name,
+		    (unsigned long long) cnt[i].val);
+	fprintf(fp, "}, \"round_trip_ns\": {\"count\": %llu",
+	    (unsigned long long) st->rtt_cnt);
+	if (st->rtt_cnt)
+		fprintf(fp, ", \"p50\": %llu, \"p99\": %llu, \"max\": %llu",
+		    (unsigned long long) stats_rtt_pct(st, 50),
+		    (unsigned long long) stats_rtt_pct(st, 99),
+		    (unsigned long long) st->rtt_max);
+	fprintf(fp, "}, \"peak_rss_kb\": %ld}\n", peak_rss_kb());
+	fflush(fp);
+#ifdef USE_THREADS
+	funlockfile(fp);
+#endif
 }
 
 
+/*
+ * Progress on the terminal, and as JSON lines with --progress, at most
+ * every PROGRESS_MS.  Progress is the share of the input whose TCKs have
+ * been queued; the total TCK count and the ETA are extrapolated from it,
+ * as the input is streamed and its TCK count isn't known in advance.
+ */
+#define	PROGRESS_MS	250
+
 static void
-shutdown_ppi(void)
+progress_show(struct jtag_ctx *ctx)
 {
+	char buf[80];
+	uint64_t now, tcks;
+	double f, el, eta, rate;
+	int len;
 
-	/* Pull TCK low so that we don't incidentally pulse it on next run. */
-	txbuf[0] = 0;
-	ioctl(ppi, PPISDATA, &txbuf[0]);
+	if ((quiet || ctx->silent) && progress_fp == NULL)
+		return;
+	if (ctx->progress >= 1)
+		return;
+	now = ns_uptime();
+	if (now < ctx->prog_next)
+		return;
+	ctx->prog_next = now + PROGRESS_MS * 1000000ULL;
+
+	/* TCK rate over the last interval, smoothed a bit */
+	tcks = ctx->tcks + ctx->txpos / 2;
+	if (ctx->prog_t != 0 && now > ctx->prog_t) {
+		rate = (tcks - ctx->prog_tcks) * 1e9 / (now - ctx->prog_t);
+		ctx->prog_rate = ctx->prog_rate == 0 ? rate :
+		    ctx->prog_rate * 0.7 + rate * 0.3;
+	}
+	ctx->prog_t = now;
+	ctx->prog_tcks = tcks;
+
+	f = ctx->progress;
+	el = (now - ctx->stats.start) / 1e9;
+	eta = f >= 0.01 ? el * (1 - f) / f : -1;
+
+	if (!quiet && !ctx->silent) {
+		len = snprintf(buf, sizeof(buf), "Programming: %d%% %c ",
+		    (int) (f * 100), statc[ctx->blinker_phase]);
+		if (ctx->prog_rate > 0)
+			len += snprintf(&buf[len], sizeof(buf) - len,
+			    "%.2f MTCK/s ", ctx->prog_rate / 1e6);
+		if (eta >= 0)
+			snprintf(&buf[len], sizeof(buf) - len, "ETA %d:%02d",
+			    (int) eta / 60, (int) eta % 60);
+		fprintf(stderr, "\r%-46s", buf);
+		fflush(stderr);
+	}
 
-	close (ppi);
-}
+	/* Only runs which drive a cable, not -W or -p conversions */
+	if (progress_fp == NULL || ctx->cable_hw == CABLE_RAW)
+		return;
+#ifdef USE_THREADS
+	flockfile(progress_fp);
 #endif
+	fprintf(progress_fp, "{\"usb_path\": \"%s\", \"elapsed_s\": %.3f, "
+	    "\"progress\": %.4f, \"tcks\": %llu, \"tck_per_s\": %.0f",
+	    ctx->usb_path, el, f, (unsigned long long) tcks, ctx->prog_rate);
+	if (eta >= 0)
+		fprintf(progress_fp, ", \"tcks_total\": %llu, \"eta_s\": %.1f",
+		    (unsigned long long) (tcks / f), eta);
+	fprintf(progress_fp, "}\n");
+	fflush(progress_fp);
+#ifdef USE_THREADS
+	funlockfile(progress_fp);
+#endif
+}
 
-
-static int
-setup_usb(void)
+/* Last --progress line of a run, with its result */
+static void
+progress_end(struct jtag_ctx *ctx, int res)
 {
-	int res;
 
-#ifdef __APPLE__
-	setuid(0);
-	system("/sbin/kextunload"
-	    " -bundle-id com.FTDI.driver.FTDIUSBSerialDriver");
-	system("/sbin/kextunload"
-	    " -bundle-id com.apple.driver.AppleUSBFTDI");
+	ctx->progress = 1;
+	if (progress_fp == NULL || ctx->cable_hw == CABLE_RAW)
+		return;
+#ifdef USE_THREADS
+	flockfile(progress_fp);
+#endif
+	fprintf(progress_fp, "{\"usb_path\": \"%s\", \"elapsed_s\": %.3f, "
+	    "\"progress\": 1, \"tcks\": %llu, \"result\": %d}\n",
+	    ctx->usb_path, (ctx->stats.end - ctx->stats.start) / 1e9,
+	    (unsigned long long) ctx->tcks, res);
+	fflush(progress_fp);
+#ifdef USE_THREADS
+	funlockfile(progress_fp);
 #endif
+}
 
-	res = ftdi_init(&fc);
-	if (res < 0) {
-		fprintf(stderr, "ftdi_init() failed\n");
-		return (res);
+static int
+set_port_mode(struct jtag_ctx *ctx, port_mode_t mode)
+{
+	int res;
+
+	/* No-op if already in requested mode, or the cable has no modes */
+	if ((!ctx->need_led_blink && ctx->port_mode == mode) ||
+	    ctx->ops == NULL || ctx->ops->set_mode == NULL) {
+		ctx->port_mode = mode;
+		return (0);
 	}
+	/* Same mode again only to toggle the LED */
+	stats_enter(&ctx->stats,
+	    ctx->port_mode == mode ? STAT_LED : STAT_MODE);
+	res = ctx->ops->set_mode(ctx, mode);
+	stats_leave(&ctx->stats);
+	return (res);
+}
 
-	if (port_index < 0)
-		port_index = 0;
-	for (hmp = cable_hw_map; hmp->cable_hw != CABLE_UNKNOWN; hmp++) {
-		res = ftdi_usb_open_desc_index(&fc, hmp->usb_vid, hmp->usb_pid,
-		    hmp->cable_path, NULL, port_index);
-		if (res == 0)
-			break;
+
+static int
+set_mode_usb(struct jtag_ctx *ctx, port_mode_t mode)
+{
+	int res = 0;
+
+	/* Flush any stale TX buffers */
+	commit(ctx, 1);
+
+	/* Blink status LED by deactivating CBUS pulldown pin */
+	if (ctx->need_led_blink) {
+		ctx->need_led_blink = 0;
+		ctx->led_state ^= USB_CBUS_LED;
+		ctx->blinker_phase = (ctx->blinker_phase + 1) & 0x3;
+		progress_show(ctx);
 	}
-	if (res < 0) {
-		res = ftdi_usb_open_desc_index(&fc, 0x0403, 0x6001,
-		    NULL, NULL, port_index);
-		if (res < 0) {
-#ifdef __APPLE__
-			system("/sbin/kextload"
-			    " -bundle-id com.FTDI.driver.FTDIUSBSerialDriver");
-			system("/sbin/kextload"
-			    "  -bundle-id com.apple.driver.AppleUSBFTDI");
+
+#ifdef WIN32
+	if (mode == PORT_MODE_ASYNC)
+		mode = PORT_MODE_SYNC;
+#endif
+
+	switch (mode) {
+	case PORT_MODE_SYNC:
+#ifdef WIN32
+		/*
+		 * If switching to SYNC mode, attempt to allow for TX
+		 * buffers to drain first.
+		 */
+		if (ctx->port_mode != PORT_MODE_SYNC)
+			ms_sleep(20);
+
+		res = FT_SetBitMode(ctx->ftHandle,
+#else
+		res = ftdi_set_bitmode(&ctx->fc,
+#endif
+		    JTAG_TCK | JTAG_TMS | JTAG_TDI | ctx->led_state,
+		    BITMODE_SYNCBB | (BITMODE_CBUS * (USB_CBUS_LED != 0)));
+
+		if (ctx->port_mode == PORT_MODE_SYNC)
+			break;
+
+		/* Flush any stale RX buffers */
+#ifdef WIN32
+		for (res = 0; res < 2; res++) {
+			do {
+				ms_sleep(10);
+			} while (FT_StopInTask(ctx->ftHandle) != FT_OK);
+			FT_Purge(ctx->ftHandle, FT_PURGE_RX);
+			do {} while (FT_RestartInTask(ctx->ftHandle) != FT_OK);
+			ms_sleep(10);
+		}
+#else
+		do {
+			res = ftdi_read_data(&ctx->fc, &ctx->txbuf[0],
+			    ctx->txsize);
+		} while (res == (int) ctx->txsize);
+#endif
+		break;
+
+	case PORT_MODE_ASYNC:
+#ifdef WIN32
+		res = FT_SetBitMode(ctx->ftHandle,
+#else
+		res = ftdi_set_bitmode(&ctx->fc,
 #endif
+		    JTAG_TCK | JTAG_TMS | JTAG_TDI | ctx->led_state,
+		    BITMODE_BITBANG | (BITMODE_CBUS * (USB_CBUS_LED != 0)));
+		break;
+
+	case PORT_MODE_UART:
+		res = 0;
+		if (ctx->port_mode == PORT_MODE_UART)
+			break;
+		/* Pull TCK low so that we don't incidentally pulse it. */
+		memset(ctx->txbuf, 0, 10);
+#ifdef WIN32
+		FT_Write(ctx->ftHandle, ctx->txbuf, 10, (DWORD *) &res);
+		if (res < 0) {
+			fprintf(stderr, "FT_Write() failed\n");
+			return (res);
+		}
+		res = FT_SetBitMode(ctx->ftHandle, 0, BITMODE_OFF);
+#else
+		res = ftdi_write_data(&ctx->fc, &ctx->txbuf[0], 10);
+		if (res < 0) {
+			fprintf(stderr, "ftdi_write_data() failed\n");
 			return (res);
 		}
+		res = ftdi_disable_bitbang(&ctx->fc);
+#endif
+		break;
+
+	default:
+		res = -1;
 	}
 
-	res = ftdi_set_baudrate(&fc, USB_BAUDS);
-	if (res < 0) {
-		fprintf(stderr, "ftdi_set_baudrate() failed\n");
+	ctx->port_mode = mode;
+	return (res);
+}
+
+
+#ifdef WIN32
+static int
+com2ftindex(int comnum, FT_DEVICE_LIST_INFO_NODE *devInfo)
+{
+	DWORD numDevs;
+	FT_STATUS ftStatus;
+	FT_DEVICE_LIST_INFO_NODE *devInfoTbl;
+	FT_HANDLE ftHandle;
+	LONG num;
+	int i;
+
+	ftStatus = FT_CreateDeviceInfoList(&numDevs);
+	if (ftStatus != FT_OK ||numDevs == 0)
+		return -1;
+
+	devInfoTbl = malloc(sizeof(*devInfoTbl) * numDevs);
+	ftStatus = FT_GetDeviceInfoList(devInfoTbl, &numDevs);
+	if (ftStatus != FT_OK) {
+		free(devInfoTbl);
+		return -1;
+	}
+
+	for (i = 0; i < numDevs; i++) {
+		ftStatus = FT_Open(i, &ftHandle);
+		if (ftStatus != FT_OK)
+			continue;
+
+		FT_GetComPortNumber(ftHandle, &num);
+		FT_Close(ftHandle);
+		if (num != comnum)
+			continue;
+
+		if (devInfo != NULL)
+			memcpy(devInfo, &devInfoTbl[i], sizeof(*devInfo));
+		free(devInfoTbl);
+		return i;
+	}
+
+	free(devInfoTbl);
+	return -1;
+}
+
+static void
+list_ports(struct jtag_ctx *ctx)
+{
+	FT_DEVICE_LIST_INFO_NODE devInfo;
+	int num, size, ftindex;
+	char *buf, *cp;
+	char comtbl[1024];
+
+	size = 1024 * 1024;
+	buf = malloc(size);
+	if (QueryDosDevice(NULL, buf, size) == 0) {
+		printf("QueryDosDevice() failed\n");
+		free(buf);
+		return;
+	};
+
+	memset(comtbl, 0, sizeof(comtbl));
+	for (cp = buf; *cp != 0; cp += strlen(cp) + 1) {
+		if (strncmp("COM", cp, 3) != 0)
+			continue;
+		num = atoi(&cp[3]);
+		if (num >= sizeof(comtbl))
+			continue;
+		sprintf((char *) ctx->txbuf, "\\\\.\\%s", cp);
+		ctx->com_port = CreateFile((char *) ctx->txbuf,
+		    GENERIC_READ | GENERIC_WRITE,
+		    0, NULL, OPEN_EXISTING, 0, NULL);
+		if (ctx->com_port == INVALID_HANDLE_VALUE)
+			comtbl[num] = -1;
+		else
+			comtbl[num] = 1;
+		CloseHandle(ctx->com_port);
+	}
+
+	for (num = 0; num < sizeof(comtbl); num++) {
+		if (comtbl[num] == 0)
+			continue;
+		sprintf(buf, "COM%d", num);
+		printf("%s: ", buf);
+		ftindex = com2ftindex(num, &devInfo);
+		if (ftindex >= 0) {
+			printf("%s (SN %s) ", devInfo.Description,
+			    devInfo.SerialNumber);
+			printf("FTDI #%d PID 0x%04lx\n", ftindex,
+			    devInfo.ID & 0xffff);
+		} else if (comtbl[num] > 0)
+			printf("Generic port\n");
+		else
+			printf("(port in use)\n");
+	}
+
+	free(buf);
+}
+
+
+static int
+setup_usb(struct jtag_ctx *ctx)
+{
+	FT_STATUS res;
+	FT_DEVICE ftDevice;
+	DWORD deviceID;
+	char SerialNumber[16];
+	char Description[64];
+
+	if (ctx->port_id != NULL)
+		res = FT_OpenEx((PVOID) ctx->port_id,
+		    FT_OPEN_BY_SERIAL_NUMBER, &ctx->ftHandle);
+	else if (ctx->port_index >= 0)
+		res = FT_Open(ctx->port_index, &ctx->ftHandle);
+	else
+		res = FT_Open(0, &ctx->ftHandle);
+	if (res != FT_OK) {
+		fprintf(stderr, "FT_Open() failed\n");
+		return (res);
+	}
+
+	res = FT_GetDeviceInfo(ctx->ftHandle, &ftDevice, &deviceID,
+	    SerialNumber,
+	    Description, NULL);
+	if (res != FT_OK) {
+		fprintf(stderr, "FT_GetDeviceInfo() failed\n");
+		return (res);
+	}
+	strcpy(ctx->usb_serial, SerialNumber);
+	for (ctx->hmp = cable_hw_map; ctx->hmp->cable_hw != CABLE_UNKNOWN;
+	    ctx->hmp++) {
+		if (deviceID == ((ctx->hmp->usb_vid << 16) | ctx->hmp->usb_pid)
+		    && strcmp(Description, ctx->hmp->cable_path) == 0)
+			break;
+	}
+	if (ctx->port_index < 0 && ctx->hmp->cable_hw == CABLE_UNKNOWN)
+		return (-1);
+
+	if (!quiet)
+		printf("Using USB cable: %s\n", ctx->hmp->cable_path);
+
+	res = FT_SetBaudRate(ctx->ftHandle, ctx->tune.bauds);
+	if (res != FT_OK) {
+		fprintf(stderr, "FT_SetBaudRate() failed\n");
 		return (res);
 	}
 
-	res = ftdi_write_data_set_chunksize(&fc, BUFLEN_MAX);
+#ifdef NOTYET
+	FT_setUSB_Parameters();
+	res = ftdi_write_data_set_chunksize(&ctx->fc, BUFLEN_MAX);
 	if (res < 0) {
 		fprintf(stderr, "ftdi_write_data_set_chunksize() failed\n");
 		return (res);
 	}
+#endif
 
-	/* Reducing latency to 1 ms for BITMODE_SYNCBB is crucial! */
-	res = ftdi_set_latency_timer(&fc, 1);
-	if (res < 0) {
-		fprintf(stderr, "ftdi_set_latency_timer() failed\n");
+	res = FT_SetLatencyTimer(ctx->ftHandle, ctx->tune.latency);
+	if (res != FT_OK) {
+		fprintf(stderr, "FT_SetLatencyTimer() failed\n");
 		return (res);
 	}
 
-	res = ftdi_set_bitmode(&fc, JTAG_TCK | JTAG_TMS | JTAG_TDI,
-	    BITMODE_BITBANG);
-	if (res < 0) {
-		fprintf(stderr, "ftdi_set_bitmode() failed\n");
-		return (EXIT_FAILURE);
+	res = FT_SetFlowControl(ctx->ftHandle, FT_FLOW_NONE, 0, 0);
+	if (res != FT_OK) {
+		fprintf(stderr, "FT_SetFlowControl() failed\n");
+		return (res);
 	}
 
-	res = ftdi_setdtr_rts(&fc, 0, 0);
-	if (res < 0) {
-		fprintf(stderr, "ftdi_setdtr_rts() failed\n");
-		return (EXIT_FAILURE);
+	res = FT_SetBitMode(ctx->ftHandle, 0, BITMODE_BITBANG);
+	if (res != FT_OK) {
+		fprintf(stderr, "FT_SetBitMode() failed\n");
+		return (res);
+	}
+
+	res = FT_SetTimeouts(ctx->ftHandle, 1000, 1000);
+	if (res != FT_OK) {
+		fprintf(stderr, "FT_SetTimeouts() failed\n");
+		return (res);
 	}
 
+	FT_Purge(ctx->ftHandle, FT_PURGE_TX);
+	FT_Purge(ctx->ftHandle, FT_PURGE_RX);
+
+	if (ctx->hmp->mpsse)
+		return (mpsse_setup(ctx));
 
 	return (0);
 }
 
 
 static int
-shutdown_usb(void)
+shutdown_usb(struct jtag_ctx *ctx)
 {
+
 	int res;
 
+	/* Allow for the USB FIFO to drain, just in case. */
+	ms_sleep(10);
+
 	/* Clean up */
-	res = set_port_mode(PORT_MODE_UART);
+	res = set_port_mode(ctx, PORT_MODE_UART);
 	if (res < 0) {
-		fprintf(stderr, "ftdi_disable_bitbang() failed\n");
+		fprintf(stderr, "set_port_mode() failed\n");
 		return (res);
 	}
 
-	res = ftdi_set_latency_timer(&fc, 20);
+	res = FT_SetLatencyTimer(ctx->ftHandle, 20);
 	if (res < 0) {
-		fprintf(stderr, "ftdi_set_latency_timer() failed\n");
+		fprintf(stderr, "FT_SetLatencyTimer() failed\n");
 		return (res);
 	}
 
-#ifdef __linux__
-	libusb_reset_device(fc.usb_dev);
-#else
-	res = ftdi_usb_close(&fc);
+	res = FT_Close(ctx->ftHandle);
 	if (res < 0) {
-		fprintf(stderr, "unable to close ftdi device: %d (%s)\n",
-		    res, ftdi_get_error_string(&fc));
+		fprintf(stderr, "FT_Close() failed\n");
 		return (res);
 	}
-#endif
-
-	ftdi_deinit(&fc);
 
-#ifdef __APPLE__
+	return (0);
+}
+#endif /* WIN32 */
+
+
+static const char hexdigits[] = "0123456789ABCDEF";
+
+
+#ifdef USE_RAW
+/*
+ * Binary waveform format, written with -W and replayed by prog():
+ *
+ *	header:		WAVE_MAGIC
+ *	records:	tag byte, little-endian 32-bit TCK count, payload
+ *
+ *	WAVE_DATA	packed pin states, 4 TCKs per byte
+ *	WAVE_IDLE	run of TCKs with TMS = TDI = 0, no payload
+ *	WAVE_CHECK	32-bit index of the TCK sampling the first TDO bit,
+ *			32-bit TDO bit count, packed pin states, followed
+ *			by expected TDO and mask bitmaps, LSB first
+ *	WAVE_SLEEP	wait of the given number of milliseconds with
+ *			TMS = TDI = 0, instead of a TCK count, no payload
+ *	WAVE_END	TCK count is zero, no payload
+ *
+ * Pin states are packed MSB first, TMS in the upper and TDI in the lower
+ * bit of each pair, exactly as in the SREC output.
+ */
+#define	WAVE_MAGIC		"UJW1"
+#define	WAVE_IDLE_MIN		64	/* Shortest idle run worth a record */
+#define	WAVE_DATA_MAX		(256 * 1024) /* TCKs per WAVE_DATA record */
+
+enum wave_rec {
+	WAVE_END, WAVE_DATA, WAVE_IDLE, WAVE_CHECK, WAVE_SLEEP
+};
+
+static int raw_pos;
+static int raw_csum;
+static char raw_ch;
+static char srec_line[80];	/* SREC line being assembled */
+static int srec_len;
+
+static FILE *raw_wave;		/* Waveform output, NULL for SREC */
+static uint8_t wave_data[WAVE_DATA_MAX / 4];
+static unsigned wave_dlen;	/* TCKs pending in wave_data */
+static unsigned wave_zrun;	/* Pending run of idle TCKs */
+static unsigned wave_chk_first;	/* TXBUF index of first TDO sample */
+static unsigned wave_chk_bits;	/* TDO bits to check in next commit */
+static uint8_t *wave_chk_map;	/* Expected TDO followed by mask */
+
+/*
+ * Direct the raw cable to the waveform stream fp, or to SREC output on
+ * stdout when fp is NULL.
+ */
+static void
+wave_start(struct jtag_ctx *ctx, FILE *fp)
+{
+
+	for (ctx->hmp = cable_hw_map; ctx->hmp->cable_hw != CABLE_RAW;
+	    ctx->hmp++) {
+	}
+
+	raw_wave = fp;
+	if (raw_wave != NULL)
+		fwrite(WAVE_MAGIC, 1, 4, raw_wave);
+}
+
+static void
+srec_header(const char *name)
+{
+	unsigned i;
+	int csum;
+
+	csum = strlen(name) + 3;
+	printf("S0%02X0000", csum);
+
+	for (i = 0; i < strlen(name); i++) {
+		printf("%02X", name[i]);
+		csum += name[i];
+	}
+
+	printf("%02X\n", 0xff - (csum & 0xff));
+}
+
+static void
+srec_put(uint8_t c)
+{
+	char *cp = &srec_line[srec_len];
+
+	/* SREC line header, 32 data bytes per line */
+	if (srec_len == 0) {
+		memcpy(cp, "S224", 4);
+		cp += 4;
+		for (int sh = 20; sh >= 0; sh -= 4)
+			*cp++ = hexdigits[((raw_pos >> 2) >> sh) & 0xf];
+		raw_csum = 0x24;
+		raw_csum += (raw_pos >> 18) & 0xff;
+		raw_csum += (raw_pos >> 10) & 0xff;
+		raw_csum += (raw_pos >> 2) & 0xff;
+	}
+
+	*cp++ = hexdigits[c >> 4];
+	*cp++ = hexdigits[c & 0xf];
+	raw_csum += c;
+
+	if ((raw_pos & 0x7f) == 0x7f) {
+		c = 0xff - (raw_csum & 0xff);
+		*cp++ = hexdigits[c >> 4];
+		*cp++ = hexdigits[c & 0xf];
+		*cp++ = '\n';
+		fwrite(srec_line, 1, cp - srec_line, stdout);
+		cp = srec_line;
+		raw_csum = 0;
+	}
+	srec_len = cp - srec_line;
+}
+
+static void
+wave_put32(uint32_t val)
+{
+	uint8_t b[4];
+
+	b[0] = val;
+	b[1] = val >> 8;
+	b[2] = val >> 16;
+	b[3] = val >> 24;
+	fwrite(b, 1, 4, raw_wave);
+}
+
+static void
+wave_flush_data(void)
+{
+
+	if (wave_dlen == 0)
+		return;
+	fputc(WAVE_DATA, raw_wave);
+	wave_put32(wave_dlen);
+	fwrite(wave_data, 1, (wave_dlen + 3) / 4, raw_wave);
+	memset(wave_data, 0, (wave_dlen + 3) / 4);
+	wave_dlen = 0;
+}
+
+static void
+wave_append(int pins)
+{
+
+	wave_data[wave_dlen >> 2] |= pins << (6 - 2 * (wave_dlen & 0x3));
+	if (++wave_dlen == WAVE_DATA_MAX)
+		wave_flush_data();
+}
+
+static void
+wave_flush_idle(void)
+{
+
+	if (wave_zrun >= WAVE_IDLE_MIN) {
+		wave_flush_data();
+		fputc(WAVE_IDLE, raw_wave);
+		wave_put32(wave_zrun);
+	} else
+		for (; wave_zrun > 0; wave_zrun--)
+			wave_append(0);
+	wave_zrun = 0;
+}
+
+/*
+ * Mark the TDO bits of the vector being shifted out, so that the next
+ * commit_raw() will emit a WAVE_CHECK record covering them.
+ */
+static void
+wave_check(struct jtag_ctx *ctx, unsigned first, unsigned bits,
+    const char *tdo, const char *mask)
+{
+	unsigned i, len, bytes;
+	int t, m;
+
+	(void) ctx;
+
+	if (raw_wave == NULL || tdo == NULL)
+		return;
+
+	bytes = (bits + 7) / 8;
+	free(wave_chk_map);
+	wave_chk_map = calloc(2, bytes);
+	if (wave_chk_map == NULL) {
+		fprintf(stderr, "malloc(%u) failed\n", 2 * bytes);
+		exit(EXIT_FAILURE);
+	}
+
+	len = strlen(tdo);
+	for (i = 0; i < bits; i++) {
+		t = tdo[len - 1 - i / 4];
+		m = mask ? mask[len - 1 - i / 4] : 'F';
+		t = (t <= '9' ? t - '0' : t + 10 - 'A') >> (i & 0x3);
+		m = (m <= '9' ? m - '0' : m + 10 - 'A') >> (i & 0x3);
+		wave_chk_map[i / 8] |= (t & 1) << (i & 0x7);
+		wave_chk_map[bytes + i / 8] |= (m & 1) << (i & 0x7);
+	}
+	wave_chk_first = first / 2;
+	wave_chk_bits = bits;
+}
+
+static int
+commit_wave(struct jtag_ctx *ctx)
+{
+	unsigned i, clk = ctx->txpos / 2;
+	uint8_t c = 0;
+
+	if (wave_chk_bits == 0) {
+		for (i = 0; i < ctx->txpos; i += 2) {
+			if ((ctx->txbuf[i] & 0x3) == 0) {
+				wave_zrun++;
+				continue;
+			}
+			if (wave_zrun)
+				wave_flush_idle();
+			wave_append(ctx->txbuf[i] & 0x3);
+		}
+		ctx->txpos = 0;
+		return (0);
+	}
+
+	/* Everything preceding the checked vector goes out first */
+	wave_flush_idle();
+	wave_flush_data();
+
+	fputc(WAVE_CHECK, raw_wave);
+	wave_put32(clk);
+	wave_put32(wave_chk_first);
+	wave_put32(wave_chk_bits);
+	for (i = 0; i < clk; i++) {
+		c = (c << 2) | (ctx->txbuf[i * 2] & 0x3);
+		if ((i & 0x3) == 0x3)
+			fputc(c, raw_wave);
+	}
+	if (clk & 0x3)
+		fputc(c << (8 - 2 * (clk & 0x3)), raw_wave);
+	fwrite(wave_chk_map, 1, 2 * ((wave_chk_bits + 7) / 8), raw_wave);
+	wave_chk_bits = 0;
+
+	ctx->txpos = 0;
+	return (0);
+}
+
+static int
+commit_raw(struct jtag_ctx *ctx)
+{
+	unsigned i;
+
+	if (raw_wave != NULL)
+		return (commit_wave(ctx));
+
+	for (i = 0; i < ctx->txpos; i += 2) {
+		raw_ch <<= 2;
+		raw_ch |= ctx->txbuf[i] & 0x3;
+		if ((raw_pos & 0x3) == 0x3)
+			srec_put(raw_ch);
+		raw_pos++;
+	}
+
+	ctx->txpos = 0;
+	return (0);
+}
+
+static int
+shutdown_raw(struct jtag_ctx *ctx)
+{
+
+	if (raw_wave != NULL) {
+		wave_flush_idle();
+		wave_flush_data();
+		fputc(WAVE_END, raw_wave);
+		wave_put32(0);
+		if (raw_wave != stdout)
+			fclose(raw_wave);
+		else
+			fflush(raw_wave);
+		raw_wave = NULL;
+		return (0);
+	}
+
+	/* Pad and flush SREC line */
+	if ((raw_pos & 0x7f) != 0x7f) {
+		ctx->txpos = (0x80 - (raw_pos & 0x7f)) * 2;
+		memset(ctx->txbuf, 0, ctx->txpos);
+		commit_raw(ctx);
+	}
+	fwrite(srec_line, 1, srec_len, stdout);
+	srec_len = 0;
+	printf("S804000000FB\n");
+	return (0);
+}
+
+/*
+ * RUNTEST waits go into the waveform as such, so that its player can
+ * time them for the cable it drives, at whatever rate that one runs.
+ */
+static void
+wave_sleep(struct jtag_ctx *ctx, int ms)
+{
+
+	(void) ctx;
+	wave_flush_idle();
+	wave_flush_data();
+	fputc(WAVE_SLEEP, raw_wave);
+	wave_put32(ms);
+}
+
+/* Switched to by setup_raw() and wave_generate() for waveform output */
+static const struct cable_ops wave_ops = {
+	.name =		"waveform",
+	.caps =		CABLE_CAP_TDO_CMP | CABLE_CAP_SLEEP,
+	.close =	shutdown_raw,
+	.commit =	commit_raw,
+	.expect =	wave_check,
+	.sleep =	wave_sleep,
+};
+
+static int
+setup_raw(struct jtag_ctx *ctx)
+{
+	FILE *fp = NULL;
+
+	if (wave_name != NULL) {
+		if (strcmp(wave_name, "-") == 0)
+			fp = stdout;
+		else
+			fp = fopen(wave_name, "wb");
+		if (fp == NULL)
+			return (errno);
+		ctx->ops = &wave_ops;
+	}
+	wave_start(ctx, fp);
+	return (0);
+}
+
+/* TDO checks are recorded in the waveform, to be done by its player */
+static const struct cable_ops raw_ops = {
+	.name =		"raw",
+	.caps =		CABLE_CAP_TDO_CMP,
+	.open =		setup_raw,
+	.close =	shutdown_raw,
+	.commit =	commit_raw,
+	.expect =	wave_check,
+};
+#endif
+
+#ifndef WIN32
+#ifdef USE_PPI
+static int
+setup_ppi(struct jtag_ctx *ctx)
+{
+	char c = 0;
+
+	for (ctx->hmp = cable_hw_map; ctx->hmp->cable_hw != CABLE_HW_PPI;
+	    ctx->hmp++) {
+	}
+
+	ctx->ppi = open("/dev/ppi0", O_RDWR);
+	if (ctx->ppi < 0)
+		return (errno);
+
+	ioctl(ctx->ppi, PPISDATA, &c);
+	ioctl(ctx->ppi, PPISSTATUS, &c);
+	ioctl(ctx->ppi, PPIGSTATUS, &c);
+	if ((c & 0xb6) != 0x06) {
+		close (ctx->ppi);
+		return (EINVAL);
+	}
+
+	return (0);
+}
+
+
+static int
+shutdown_ppi(struct jtag_ctx *ctx)
+{
+
+	/* Pull TCK low so that we don't incidentally pulse it on next run. */
+	ctx->txbuf[0] = 0;
+	ioctl(ctx->ppi, PPISDATA, &ctx->txbuf[0]);
+
+	close (ctx->ppi);
+	return (0);
+}
+#endif
+
+
+/*
+ * USB cable discovery.  The bus is enumerated only once, the strings of
+ * each candidate FTDI device are read only once, and all cable_hw_map
+ * entries are then matched against this list in memory.
+ */
+#define	USB_CABLES_MAX		64
+
+struct usb_cable {
+	libusb_device	*dev;
+	int		vid;
+	int		pid;
+	char		desc[64];
+	char		serial[64];
+	char		path[48];	/* Bus and port numbers, 1-2.3 */
+};
+
+static void
+usb_path(libusb_device *dev, char *buf)
+{
+	uint8_t ports[8];
+	int i, n, len;
+
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	len = sprintf(buf, "%d", libusb_get_bus_number(dev));
+	for (i = 0; i < n; i++)
+		len += sprintf(&buf[len], "%c%d", i ? '.' : '-', ports[i]);
+}
+
+static int
+usb_cable_is(struct cable_hw_map *hmp, struct usb_cable *uc)
+{
+
+	return (hmp->cable_hw == CABLE_HW_USB && hmp->usb_vid == uc->vid &&
+	    hmp->usb_pid == uc->pid && strcmp(hmp->cable_path, uc->desc) == 0);
+}
+
+/*
+ * Collect up to max devices which may be one of our cables, in bus
+ * enumeration order.  The caller frees *list when done with uc[].
+ */
+static int
+usb_scan(libusb_context *uctx, libusb_device ***list, struct usb_cable *uc,
+    int max)
+{
+	struct libusb_device_descriptor dd;
+	struct cable_hw_map *hmp;
+	libusb_device_handle *h;
+	ssize_t i, cnt;
+	int n = 0;
+
+	*list = NULL;
+	cnt = libusb_get_device_list(uctx, list);
+	for (i = 0; i < cnt && n < max; i++) {
+		if (libusb_get_device_descriptor((*list)[i], &dd) < 0)
+			continue;
+		for (hmp = cable_hw_map; hmp->cable_hw != CABLE_UNKNOWN; hmp++)
+			if (hmp->usb_vid == dd.idVendor &&
+			    hmp->usb_pid == dd.idProduct)
+				break;
+		if (hmp->cable_hw == CABLE_UNKNOWN)
+			continue;
+
+		uc[n].dev = (*list)[i];
+		uc[n].vid = dd.idVendor;
+		uc[n].pid = dd.idProduct;
+		memset(uc[n].desc, 0, sizeof(uc[n].desc));
+		memset(uc[n].serial, 0, sizeof(uc[n].serial));
+		if (libusb_open(uc[n].dev, &h) == 0) {
+			if (dd.iProduct)
+				libusb_get_string_descriptor_ascii(h,
+				    dd.iProduct, (unsigned char *) uc[n].desc,
+				    sizeof(uc[n].desc) - 1);
+			if (dd.iSerialNumber)
+				libusb_get_string_descriptor_ascii(h,
+				    dd.iSerialNumber,
+				    (unsigned char *) uc[n].serial,
+				    sizeof(uc[n].serial) - 1);
+			libusb_close(h);
+		}
+		usb_path(uc[n].dev, uc[n].path);
+		n++;
+	}
+	return (n);
+}
+
+/*
+ * Pick the pin map for a cable.  One with an unknown description gets the
+ * first map of its VID/PID, the other boards with the same chip share it.
+ */
+static int
+usb_cable_map(struct jtag_ctx *ctx, struct usb_cable *uc)
+{
+	struct cable_hw_map *hmp;
+
+	for (hmp = cable_hw_map; hmp->cable_hw != CABLE_UNKNOWN; hmp++)
+		if (usb_cable_is(hmp, uc)) {
+			ctx->hmp = hmp;
+			return (0);
+		}
+	for (hmp = cable_hw_map; hmp->cable_hw != CABLE_UNKNOWN; hmp++)
+		if (hmp->cable_hw == CABLE_HW_USB && hmp->usb_vid == uc->vid &&
+		    hmp->usb_pid == uc->pid) {
+			ctx->hmp = hmp;
+			return (0);
+		}
+	fprintf(stderr, "No pin map for USB device %04x:%04x \"%s\"\n",
+	    uc->vid, uc->pid, uc->desc);
+	return (-1);
+}
+
+/*
+ * Pick the cable selected by ctx->port_id (serial number or bus path),
+ * or else the ctx->port_index-th instance of the first cable type found.
+ * Sets ctx->hmp, and returns the uc[] index or -1.
+ */
+static int
+usb_match(struct jtag_ctx *ctx, struct usb_cable *uc, int n)
+{
+	int i, k;
+
+	if (ctx->port_id != NULL) {
+		for (i = 0; i < n; i++)
+			if (strcmp(uc[i].serial, ctx->port_id) == 0 ||
+			    strcmp(uc[i].path, ctx->port_id) == 0)
+				break;
+		if (i == n)
+			return (-1);
+		return (usb_cable_map(ctx, &uc[i]) == 0 ? i : -1);
+	}
+
+	for (ctx->hmp = cable_hw_map; ctx->hmp->cable_hw != CABLE_UNKNOWN;
+	    ctx->hmp++)
+		for (i = 0, k = ctx->port_index; i < n; i++)
+			if (usb_cable_is(ctx->hmp, &uc[i]) && k-- == 0)
+				return (i);
+
+	/* Any FT232R */
+	for (i = 0, k = ctx->port_index; i < n; i++)
+		if (uc[i].vid == 0x0403 && uc[i].pid == 0x6001 && k-- == 0)
+			return (usb_cable_map(ctx, &uc[i]) == 0 ? i : -1);
+	return (-1);
+}
+
+/* The cable from the log, as usb_scan() would have found it */
+static int
+usbrep_scan(struct usb_cable *uc)
+{
+	char *args;
+	int res;
+
+	memset(uc, 0, sizeof(*uc));
+	args = usbrep_next('U', &res);
+	if (args == NULL || sscanf(args, "%x %x %63s %47s %63[^\n]",
+	    &uc->vid, &uc->pid, uc->serial, uc->path, uc->desc) != 5)
+		return (0);
+	if (strcmp(uc->serial, "-") == 0)
+		uc->serial[0] = 0;
+	return (1);
+}
+
+/* The cable settings in use, which replay has to follow as well */
+static void
+usbrep_tune(struct jtag_ctx *ctx)
+{
+	struct cable_tune *t = &ctx->tune;
+	char *args;
+	int res;
+
+	args = usbrep_next('K', &res);
+	if (args != NULL)
+		sscanf(args, "%d %d %d %d %d", &t->bauds, &t->sync_chunk,
+		    &t->chunk, &t->latency, &t->tck_khz);
+}
+
+static void
+usbcap_cable(struct jtag_ctx *ctx, struct usb_cable *uc)
+{
+	struct cable_tune *t = &ctx->tune;
+
+	usbcap_log(usbcap_t0, 'U', 0, NULL, " %04x %04x %s %s %s", uc->vid,
+	    uc->pid, uc->serial[0] ? uc->serial : "-", uc->path, uc->desc);
+	usbcap_log(usbcap_t0, 'K', 0, NULL, " %d %d %d %d %d", t->bauds,
+	    t->sync_chunk, t->chunk, t->latency, t->tck_khz);
+}
+
+static void
+list_ports(struct jtag_ctx *ctx)
+{
+	struct usb_cable uc[USB_CABLES_MAX];
+	libusb_device **list;
+	int i, n;
+
+	if (ftdi_init(&ctx->fc) < 0) {
+		fprintf(stderr, "ftdi_init() failed\n");
+		return;
+	}
+	n = usb_scan(ctx->fc.usb_ctx, &list, uc, USB_CABLES_MAX);
+	for (i = 0; i < n; i++)
+		printf("%-16s %04x:%04x  %-16s %s\n", uc[i].path, uc[i].vid,
+		    uc[i].pid, uc[i].serial[0] ? uc[i].serial : "-",
+		    uc[i].desc);
+	if (n == 0)
+		printf("No USB JTAG cables found\n");
+	libusb_free_device_list(list, 1);
+	ftdi_deinit(&ctx->fc);
+}
+
+/*
+ * Settings found by --tune, one line per cable serial number, in
+ * $XDG_CACHE_HOME/ujprog-tune or ~/.cache/ujprog-tune.
+ */
+static int
+tune_path(char *buf, size_t len)
+{
+	const char *dir;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir != NULL && *dir != 0) {
+		snprintf(buf, len, "%s/ujprog-tune", dir);
+		return (0);
+	}
+	dir = getenv("HOME");
+	if (dir == NULL || *dir == 0)
+		return (-1);
+	snprintf(buf, len, "%s/.cache", dir);
+	mkdir(buf, 0755);
+	snprintf(buf, len, "%s/.cache/ujprog-tune", dir);
+	return (0);
+}
+
+static void
+tune_load(struct jtag_ctx *ctx)
+{
+	struct cable_tune t;
+	char path[1024], line[256], serial[64];
+	FILE *fp;
+
+	if (ctx->usb_serial[0] == 0 || tune_path(path, sizeof(path)) ||
+	    (fp = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s %d %d %d %d %d", serial, &t.bauds,
+		    &t.sync_chunk, &t.chunk, &t.latency, &t.tck_khz) != 6 ||
+		    strcmp(serial, ctx->usb_serial) != 0)
+			continue;
+		if (t.bauds <= 0 || t.sync_chunk <= 0 ||
+		    t.sync_chunk > BUFLEN_MAX || t.chunk <= 0 ||
+		    t.chunk > BUFLEN_MAX || t.latency < 1 ||
+		    t.latency > 255 || t.tck_khz < 0 || t.tck_khz > 30000)
+			continue;
+		if (tck_set)
+			t.tck_khz = 0;
+		ctx->tune = t;
+	}
+	fclose(fp);
+}
+
+static int
+tune_save(struct jtag_ctx *ctx)
+{
+	struct cable_tune *t = &ctx->tune;
+	char path[1024], tmp[1040], line[256], serial[64];
+	FILE *fp, *out;
+
+	if (ctx->usb_serial[0] == 0) {
+		fprintf(stderr, "Cable has no serial number, not saved\n");
+		return (EXIT_FAILURE);
+	}
+	if (tune_path(path, sizeof(path))) {
+		fprintf(stderr, "No cache directory, not saved\n");
+		return (EXIT_FAILURE);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Can't create %s: %s\n", tmp, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	fp = fopen(path, "r");
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+		if (sscanf(line, "%63s", serial) == 1 &&
+		    strcmp(serial, ctx->usb_serial) != 0)
+			fputs(line, out);
+	if (fp != NULL)
+		fclose(fp);
+	fprintf(out, "%s %d %d %d %d %d\n", ctx->usb_serial, t->bauds,
+	    t->sync_chunk, t->chunk, t->latency, t->tck_khz);
+	if (fclose(out) || rename(tmp, path)) {
+		fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return (EXIT_FAILURE);
+	}
+	if (!quiet)
+		printf("Saved to %s\n", path);
+	return (0);
+}
+
+static int
+setup_usb(struct jtag_ctx *ctx)
+{
+	struct usb_cable uc[USB_CABLES_MAX];
+	libusb_device **list;
+	int i, n, res;
+
+	if (usbrep_fp != NULL) {
+		if (ctx->port_index < 0)
+			ctx->port_index = 0;
+		if (!usbrep_scan(&uc[0]) || (i = usb_match(ctx, uc, 1)) < 0)
+			return (-1);
+		strcpy(ctx->usb_serial, uc[i].serial);
+		strcpy(ctx->usb_path, uc[i].path);
+		usbrep_tune(ctx);
+		goto replay;
+	}
+
+#ifdef __APPLE__
+	setuid(0);
+	system("/sbin/kextunload"
+	    " -bundle-id com.FTDI.driver.FTDIUSBSerialDriver");
+	system("/sbin/kextunload"
+	    " -bundle-id com.apple.driver.AppleUSBFTDI");
+#endif
+
+	res = ftdi_init(&ctx->fc);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_init() failed\n");
+		return (res);
+	}
+
+	if (ctx->port_index < 0)
+		ctx->port_index = 0;
+	n = usb_scan(ctx->fc.usb_ctx, &list, uc, USB_CABLES_MAX);
+	i = usb_match(ctx, uc, n);
+	res = -1;
+	if (i >= 0) {
+		res = ftdi_usb_open_dev(&ctx->fc, uc[i].dev);
+		strcpy(ctx->usb_serial, uc[i].serial);
+		strcpy(ctx->usb_path, uc[i].path);
+		if (res >= 0) {
+			tune_load(ctx);
+			usbcap_cable(ctx, &uc[i]);
+		}
+	}
+	libusb_free_device_list(list, 1);
+	if (res < 0) {
+#ifdef __APPLE__
+		system("/sbin/kextload"
+		    " -bundle-id com.FTDI.driver.FTDIUSBSerialDriver");
+		system("/sbin/kextload"
+		    "  -bundle-id com.apple.driver.AppleUSBFTDI");
+#endif
+		return (res);
+	}
+
+replay:
+	res = ftdi_set_baudrate(&ctx->fc, ctx->tune.bauds);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_set_baudrate() failed\n");
+		return (res);
+	}
+
+	res = ftdi_write_data_set_chunksize(&ctx->fc, ctx->tune.chunk);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_write_data_set_chunksize() failed\n");
+		return (res);
+	}
+
+	/* Reducing latency to 1 ms for BITMODE_SYNCBB is crucial! */
+	res = ftdi_set_latency_timer(&ctx->fc, ctx->tune.latency);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_set_latency_timer() failed\n");
+		return (res);
+	}
+
+	res = ftdi_set_bitmode(&ctx->fc, JTAG_TCK | JTAG_TMS | JTAG_TDI,
+	    BITMODE_BITBANG);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_set_bitmode() failed\n");
+		return (EXIT_FAILURE);
+	}
+
+	res = ftdi_setdtr_rts(&ctx->fc, 0, 0);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_setdtr_rts() failed\n");
+		return (EXIT_FAILURE);
+	}
+
+	if (ctx->hmp->mpsse)
+		return (mpsse_setup(ctx));
+
+	return (0);
+}
+
+
+static int
+shutdown_usb(struct jtag_ctx *ctx)
+{
+	int res;
+
+	/* Clean up */
+	res = set_port_mode(ctx, PORT_MODE_UART);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_disable_bitbang() failed\n");
+		return (res);
+	}
+
+	res = ftdi_set_latency_timer(&ctx->fc, 20);
+	if (res < 0) {
+		fprintf(stderr, "ftdi_set_latency_timer() failed\n");
+		return (res);
+	}
+
+#ifdef __linux__
+	libusb_reset_device(ctx->fc.usb_dev);
+#else
+	res = ftdi_usb_close(&ctx->fc);
+	if (res < 0) {
+		fprintf(stderr, "unable to close ftdi device: %d (%s)\n",
+		    res, ftdi_get_error_string(&ctx->fc));
+		return (res);
+	}
+#endif
+
+	ftdi_deinit(&ctx->fc);
+
+#ifdef __APPLE__
 	system("/sbin/kextload"
 	    " -bundle-id com.FTDI.driver.FTDIUSBSerialDriver");
 	system("/sbin/kextload"
@@ -1072,901 +2764,3385 @@ shutdown_usb(void)
 
 	return (0);
 }
-#endif /* !WIN32 */
+#endif /* !WIN32 */
+
+
+/*
+ * Make room for len more bytes in TXBUF.
+ */
+static void
+txbuf_reserve(struct jtag_ctx *ctx, unsigned len)
+{
+	unsigned size;
+	uint8_t *buf;
+
+	if (ctx->txpos + len <= ctx->txsize)
+		return;
+	for (size = ctx->txsize; size < ctx->txpos + len; size *= 2)
+		continue;
+	buf = NULL;
+	if (size <= TXBUF_MAX)
+		buf = realloc(ctx->txbuf, size);
+	if (buf == NULL && ctx->no_exit) {
+		/* Fail the job, commit() discards the TCKs from here on */
+		if (!ctx->fatal)
+			fprintf(stderr, "txbuf overflow\n");
+		ctx->fatal = 1;
+		ctx->txpos = 0;
+		if (len <= ctx->txsize)
+			return;
+		buf = realloc(ctx->txbuf, len);
+		size = len;
+	}
+	if (buf == NULL) {
+		fprintf(stderr, "txbuf overflow\n");
+		if (ctx->cable_hw == CABLE_HW_USB)
+			shutdown_usb(ctx);
+		exit(EXIT_FAILURE);
+	}
+	ctx->txbuf = buf;
+	ctx->txsize = size;
+}
+
+
+#ifdef __linux__
+/*
+ * --low-jitter: keep the threads driving cables from being preempted or
+ * paged out while the host is busy with something else, such as building
+ * the next bitstream.  Whatever the system refuses (SCHED_FIFO needs
+ * CAP_SYS_NICE, locking memory CAP_IPC_LOCK or a high RLIMIT_MEMLOCK) is
+ * reported and done without.
+ */
+#define	LOW_JITTER_PRIO		40	/* Below the kernel's IRQ threads */
+#define	LOW_JITTER_TXBUF	(4 * 1024 * 1024) /* TXBUF prefaulted */
+#define	LOW_JITTER_STACK	(256 * 1024)	/* Stack prefaulted */
+
+static void
+low_jitter_setup(void)
+{
+	struct rlimit rl;
+
+	/* Locking all future mappings would make large mallocs fail */
+	if (geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &rl) == 0 &&
+	    rl.rlim_cur != RLIM_INFINITY) {
+		fprintf(stderr, "Memory not locked, RLIMIT_MEMLOCK is %lu kB\n",
+		    (unsigned long) rl.rlim_cur / 1024);
+		return;
+	}
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		fprintf(stderr, "mlockall() failed: %s\n", strerror(errno));
+}
+
+/* Set up the calling thread, the n-th one driving a cable */
+static void
+low_jitter_thread(struct jtag_ctx *ctx, int n)
+{
+	volatile char stack[LOW_JITTER_STACK];
+	struct sched_param sp;
+	cpu_set_t set;
+	int cpu, i, k;
+
+	if (!low_jitter)
+		return;
+
+	/* Take the page faults now rather than in the middle of a run */
+	for (i = 0; i < LOW_JITTER_STACK; i += 4096)
+		stack[i] = 0;
+	(void) stack[0];
+	txbuf_reserve(ctx, LOW_JITTER_TXBUF < txbuf_flush ?
+	    LOW_JITTER_TXBUF : txbuf_flush);
+	memset(ctx->txbuf, 0, ctx->txsize);
+
+	/* A CPU of its own, counting down from the last one we may use */
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		k = n % CPU_COUNT(&set);
+		for (cpu = CPU_SETSIZE - 1; cpu > 0; cpu--)
+			if (CPU_ISSET(cpu, &set) && k-- == 0)
+				break;
+		if (low_jitter_cpu >= 0)
+			cpu = low_jitter_cpu + n;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set))
+			fprintf(stderr, "Can't run on CPU %d: %s\n", cpu,
+			    strerror(errno));
+	}
+
+	/* On Linux, both of these apply to the calling thread only */
+	sp.sched_priority = LOW_JITTER_PRIO;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) && n == 0)
+		fprintf(stderr, "SCHED_FIFO not set: %s\n", strerror(errno));
+}
+#endif /* __linux__ */
+
+
+static void
+set_tms_tdi(struct jtag_ctx *ctx, int tms, int tdi)
+{
+	int val = 0;
+
+	txbuf_reserve(ctx, 2);
+	if (tms)
+		val |= JTAG_TMS;
+	if (tdi)
+		val |= JTAG_TDI;
+	ctx->txbuf[ctx->txpos++] = val;
+	ctx->txbuf[ctx->txpos++] = val | JTAG_TCK;
+}
+
+
+/*
+ * Translate TDO samples, one every stride bytes of smp, into hex stored
+ * over tdi.  If a mask is given, apply it both to the received and to
+ * the expected TDO.
+ */
+static void
+tdo_decode(char *tdi, char *tdo, char *mask, unsigned bits,
+    const uint8_t *smp, unsigned stride, int tdomask)
+{
+	int tdoval, maskval, val = 0;
+	unsigned i, len;
+
+	len = strlen(tdi);
+	if (mask != NULL)
+		mask += len;
+	if (tdo != NULL)
+		tdo += len;
+	tdi += len;
+	for (i = 0; i < bits; smp += stride) {
+		val += ((*smp & tdomask) != 0) << (i & 0x3);
+		i++;
+		if ((i & 0x3) == 0 || i == bits) {
+			if (mask != NULL) {
+				/* Apply mask to received data */
+				mask--;
+				maskval = *mask;
+				if (maskval >= '0' && maskval <= '9')
+					maskval = maskval - '0';
+				else if (maskval >= 'A' && maskval <= 'F')
+					maskval = maskval + 10 - 'A';
+				val &= maskval;
+				/* Apply mask to expected TDO as well */
+				if (tdo != NULL) {
+					tdo--;
+					tdoval = *tdo;
+					if (tdoval >= '0' && tdoval <= '9')
+						tdoval = tdoval - '0';
+					else if (tdoval >= 'A' &&
+					    tdoval <= 'F')
+						tdoval = tdoval + 10 - 'A';
+					tdoval &= maskval;
+					if (tdoval < 10)
+						*tdo = tdoval + '0';
+					else
+						*tdo = tdoval - 10 + 'A';
+				}
+			}
+			tdi--;
+			if (val < 10)
+				*tdi = val + '0';
+			else
+				*tdi = val - 10 + 'A';
+			val = 0;
+		}
+	}
+}
+
+
+/*
+ * Scan a vector through a cable which clocks it out on its own, sparing
+ * us the expansion into TXBUF.  Entered in *SHIFT, leaves in *PAUSE.
+ */
+static int
+send_vector(struct jtag_ctx *ctx, unsigned bits, char *tdi, char *tdo,
+    char *mask)
+{
+	uint8_t *smp;
+	int res, val;
+
+	/* The last TDI bit is held while moving from *EXIT1 to *PAUSE */
+	val = tdi[0] <= '9' ? tdi[0] - '0' : tdi[0] + 10 - 'A';
+	res = ctx->ops->shift(ctx, bits, tdi);
+	if (res)
+		return (res);
+	ctx->tcks += bits;
+	set_tms_tdi(ctx, 0, (val >> ((bits - 1) & 0x3)) & 1);
+	res = commit(ctx, 0);
+	if (res || ctx->port_mode != PORT_MODE_SYNC)
+		return (res);
+
+	smp = malloc(bits);
+	if (smp == NULL) {
+		fprintf(stderr, "malloc(%u) failed\n", bits);
+		return (EXIT_FAILURE);
+	}
+	res = ctx->ops->read_tdo(ctx, smp, bits);
+	if (res == 0)
+		tdo_decode(tdi, tdo, mask, bits, smp, 1, 1);
+	free(smp);
+	return (res);
+}
+
+
+/*
+ * ctx->sdr_tck may point to a pre-expanded TDI shift sequence (2 TXBUF
+ * bytes per bit, TMS already set on the last bit), used instead of
+ * expanding the TDI hex string if its length matches.  See enc_commit().
+ */
+static int
+send_generic(struct jtag_ctx *ctx, unsigned bits, char *tdi, char *tdo,
+    char *mask)
+{
+	int res, bitpos, val = 0, txval = 0;
+	unsigned i, rxpos, rxlen;
+
+	i = strlen(tdi);
+	if (i != (bits + 3) / 4) {
+		fprintf(stderr, "send_generic(): bitcount and tdi "
+		    "data length do not match\n");
+		return (EXIT_FAILURE);
+	}
+	if (tdo != NULL && strlen(tdo) != i) {
+		if (mask != NULL && strlen(mask) != i) {
+			fprintf(stderr, "send_generic(): tdi, tdo and mask "
+			    "must be of same length\n");
+			return (EXIT_FAILURE);
+		}
+		fprintf(stderr, "send_generic(): tdi and tdo "
+		    "must be of same length\n");
+		return (EXIT_FAILURE);
+	}
+
+	if (ctx->cur_s == DRPAUSE || ctx->cur_s == IRPAUSE ) {
+		/* Move from *PAUSE to *EXIT2 state */
+		set_tms_tdi(ctx, 1, 0);
+	}
+
+	/* Move from *CAPTURE or *EXIT2 to *SHIFT state */
+	set_tms_tdi(ctx, 0, 0);
+
+	if (ctx->ops->caps & CABLE_CAP_SHIFT) {
+		ctx->sdr_tck = NULL;
+		return (send_vector(ctx, bits, tdi, tdo, mask));
+	}
+
+	/* Set up receive index / length */
+	rxpos = ctx->txpos + 2;
+	rxlen = bits;
+
+	if (ctx->sdr_tck != NULL && ctx->sdr_tck_bits == bits) {
+		txbuf_reserve(ctx, 2 * bits);
+		memcpy(&ctx->txbuf[ctx->txpos], ctx->sdr_tck, 2 * bits);
+		ctx->txpos += 2 * bits;
+		txval = (ctx->txbuf[ctx->txpos - 1] & JTAG_TDI) != 0;
+		ctx->sdr_tck = NULL;
+		bits = 0;
+	}
+
+	for (bitpos = 0; bits > 0; bits--) {
+		if (bitpos == 0) {
+			/* Long scans without TDO needn't be held whole */
+			if (ctx->txpos >= txbuf_flush &&
+			    ctx->port_mode != PORT_MODE_SYNC) {
+				res = commit(ctx, 0);
+				if (res)
+					return (res);
+			}
+			i--;
+			val = tdi[i];
+			if (val >= '0' && val <= '9')
+				val = val - '0';
+			else if (val >= 'A' && val <= 'F')
+				val = val + 10 - 'A';
+			else {
+				fprintf(stderr, "send_generic():"
+				    "TDI data not in hex format\n");
+				return (EXIT_FAILURE);
+			}
+		}
+
+		txval = val & 0x1;
+		if (bits > 1)
+			set_tms_tdi(ctx, 0, txval);
+		else
+			set_tms_tdi(ctx, 1, txval);
+
+		val = val >> 1;
+		bitpos = (bitpos + 1) & 0x3;
+	}
+
+	/* Move from *EXIT1 to *PAUSE state */
+	set_tms_tdi(ctx, 0, txval);
+
+	/* Let a cable which checks TDO by itself know what to expect */
+	if ((ctx->ops->caps & CABLE_CAP_TDO_CMP) &&
+	    ctx->port_mode == PORT_MODE_SYNC)
+		ctx->ops->expect(ctx, rxpos, rxlen, tdo, mask);
+
+	/* Send / receive data on JTAG port */
+	res = commit(ctx, 0);
+
+	/* Translate received bitstream into hex, apply mask, store in tdi */
+	if (ctx->port_mode == PORT_MODE_SYNC)
+		tdo_decode(tdi, tdo, mask, rxlen, &ctx->txbuf[rxpos], 2,
+		    JTAG_TDO);
+
+	return (res);
+}
+
+
+static int
+send_dr(struct jtag_ctx *ctx, int bits, char *tdi, char *tdo, char *mask)
+{
+	int res;
+
+	if (ctx->cur_s != DRPAUSE) {
+		fprintf(stderr, "Must be in DRPAUSE on entry to send_dr()!\n");
+		return (EXIT_FAILURE);
+	}
+	res = send_generic(ctx, bits, tdi, tdo, mask);
+	ctx->cur_s = DRPAUSE;
+	return (res);
+}
+
+
+static int
+send_ir(struct jtag_ctx *ctx, int bits, char *tdi, char *tdo, char *mask)
+{
+	int res;
+
+	if (ctx->cur_s != IRPAUSE) {
+		fprintf(stderr, "Must be in IRPAUSE on entry to send_ir()!\n");
+		return (EXIT_FAILURE);
+	}
+	res = send_generic(ctx, bits, tdi, tdo, mask);
+	ctx->cur_s = IRPAUSE;
+	return (res);
+}
+
+
+static int
+commit_usb(struct jtag_ctx *ctx)
+{
+	unsigned txchunklen, i, res;
+	uint64_t t0 = 0;
+
+	for (i = 0; i < ctx->txpos; i += txchunklen) {
+		txchunklen = ctx->txpos - i;
+		if (ctx->port_mode == PORT_MODE_SYNC &&
+		    txchunklen > (unsigned) ctx->tune.sync_chunk)
+			txchunklen = ctx->tune.sync_chunk;
+		if (stats_fp != NULL)
+			t0 = ns_uptime();
+		stats_enter(&ctx->stats, STAT_USB_WRITE);
+#ifdef WIN32
+		FT_Write(ctx->ftHandle, &ctx->txbuf[i], txchunklen,
+		    (DWORD *) &res);
+#else
+		res = ftdi_write_data(&ctx->fc, &ctx->txbuf[i], txchunklen);
+#endif
+		stats_leave(&ctx->stats);
+		ctx->stats.usb_out += txchunklen;
+		if (res != txchunklen) {
+			fprintf(stderr, "ftdi_write_data() failed\n");
+			return (EXIT_FAILURE);
+		}
+
+		if (ctx->port_mode == PORT_MODE_SYNC) {
+			stats_enter(&ctx->stats, STAT_USB_READ);
+#ifdef WIN32
+			FT_Read(ctx->ftHandle, &ctx->txbuf[i], txchunklen,
+			    (DWORD *) &res);
+#else
+			int rep = 0;
+			for (res = 0; res < txchunklen && rep < 8;
+			    rep++) {
+				if (rep > 0)
+					ctx->stats.retries++;
+				res += ftdi_read_data(&ctx->fc, &ctx->txbuf[i],
+				    txchunklen - res);
+			}
+#endif
+			stats_leave(&ctx->stats);
+			ctx->stats.usb_in += res;
+			if (t0)
+				stats_rtt(&ctx->stats, ns_uptime() - t0);
+			if (res != txchunklen) {
+#ifdef WIN32
+				fprintf(stderr, "FT_Read() failed: "
+				    "expected %d, received %d bytes\n",
+				    txchunklen, res);
+#else
+				fprintf(stderr, "ftdi_read_data() failed\n");
+#endif
+				return (EXIT_FAILURE);
+			}
+		}
+	}
+	ctx->txpos = 0;
+
+	/* Schedule CBUS LED blinking */
+	i = ms_uptime();
+	if (i - ctx->last_ledblink_ms >= LED_BLINK_RATE) {
+		ctx->last_ledblink_ms += LED_BLINK_RATE;
+		ctx->need_led_blink = 1;
+	}
+
+	return (0);
+}
+
+
+#ifdef USE_PPI
+static int
+commit_ppi(struct jtag_ctx *ctx)
+{
+	unsigned i, val;
+
+	for (i = 0; i < ctx->txpos; i++) {
+		val = ctx->txbuf[i];
+		if (ctx->port_mode == PORT_MODE_SYNC && !(i & 1))  {
+			ioctl(ctx->ppi, PPIGSTATUS, &ctx->txbuf[i]);
+		}
+		ioctl(ctx->ppi, PPISDATA, &val);
+	}
+
+	ctx->txpos = 0;
+	return (0);
+}
+
+static const struct cable_ops ppi_ops = {
+	.name =		"parallel port",
+	.open =		setup_ppi,
+	.close =	shutdown_ppi,
+	.commit =	commit_ppi,
+};
+#endif
+
+
+#ifdef USE_SOCKETS
+/*
+ * OpenOCD remote_bitbang client, for driving a simulated TAP (Verilator
+ * and the like) over TCP or a Unix domain socket.  Each TXBUF byte goes
+ * out as one of '0'..'7' (TCK << 2 | TMS << 1 | TDI), and in SYNC mode an
+ * 'R' ahead of each TCK low byte reads TDO back where the FT232R would
+ * have sampled it.  A commit is sent in large chunks, reading the replies
+ * once per chunk, so the simulator is not waited on for every bit.
+ */
+#define	REMOTE_CHUNK	8192	/* TXBUF bytes per round trip */
+
+static int
+sock_write(int fd, const void *buf, size_t len)
+{
+	const char *cp = buf;
+	ssize_t n;
+
+	for (; len > 0; cp += n, len -= n) {
+		n = write(fd, cp, len);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+sock_read(int fd, void *buf, size_t len)
+{
+	char *cp = buf;
+	ssize_t n;
+
+	for (; len > 0; cp += n, len -= n) {
+		n = read(fd, cp, len);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Connect to remote_name, a Unix socket path if it has a slash in it,
+ * else [HOST]:PORT.
+ */
+static int
+setup_remote(struct jtag_ctx *ctx)
+{
+	struct sockaddr_un sun;
+	struct addrinfo hints, *res, *ai;
+	const char *port;
+	char host[256];
+	int s = -1, one = 1;
+
+	for (ctx->hmp = cable_hw_map; ctx->hmp->cable_hw != CABLE_REMOTE;
+	    ctx->hmp++) {
+	}
+
+	errno = EINVAL;
+	if (strchr(remote_name, '/') != NULL) {
+		if (strlen(remote_name) >= sizeof(sun.sun_path))
+			return (ENAMETOOLONG);
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, remote_name);
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s >= 0 &&
+		    connect(s, (struct sockaddr *) &sun, sizeof(sun))) {
+			close(s);
+			s = -1;
+		}
+	} else {
+		port = strrchr(remote_name, ':');
+		if (port == NULL || port - remote_name >= (int) sizeof(host))
+			return (EINVAL);
+		memcpy(host, remote_name, port - remote_name);
+		host[port - remote_name] = 0;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &res))
+			return (EINVAL);
+		for (ai = res; ai != NULL && s < 0; ai = ai->ai_next) {
+			s = socket(ai->ai_family, ai->ai_socktype,
+			    ai->ai_protocol);
+			if (s >= 0 && connect(s, ai->ai_addr, ai->ai_addrlen)) {
+				close(s);
+				s = -1;
+			}
+		}
+		freeaddrinfo(res);
+		if (s >= 0)
+			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one,
+			    sizeof(one));
+	}
+	if (s < 0) {
+		fprintf(stderr, "Can't connect to %s: %s\n", remote_name,
+		    strerror(errno));
+		return (errno);
+	}
+	ctx->remote = s;
+	return (0);
+}
+
+static int
+shutdown_remote(struct jtag_ctx *ctx)
+{
+
+	sock_write(ctx->remote, "Q", 1);
+	close(ctx->remote);
+	return (0);
+}
+
+static int
+commit_remote(struct jtag_ctx *ctx)
+{
+	char buf[REMOTE_CHUNK * 3 / 2];
+	unsigned i, j, end, len;
+	int sync = ctx->port_mode == PORT_MODE_SYNC;
+	uint8_t *smp;
+
+	for (i = 0; i < ctx->txpos; i = end) {
+		end = i + REMOTE_CHUNK;
+		if (end > ctx->txpos)
+			end = ctx->txpos;
+		for (j = i, len = 0; j < end; j++) {
+			if (sync && (j & 1) == 0)
+				buf[len++] = 'R';
+			buf[len++] = '0' + (ctx->txbuf[j] & 0x7);
+		}
+		if (sock_write(ctx->remote, buf, len)) {
+			fprintf(stderr, "remote_bitbang: write failed\n");
+			return (EXIT_FAILURE);
+		}
+		if (!sync)
+			continue;
+
+		len = (end - i + 1) / 2;
+		if (sock_read(ctx->remote, buf, len)) {
+			fprintf(stderr, "remote_bitbang: read failed\n");
+			return (EXIT_FAILURE);
+		}
+		for (j = 0; j < len; j++) {
+			if (buf[j] != '0' && buf[j] != '1') {
+				fprintf(stderr,
+				    "remote_bitbang: bad TDO reply\n");
+				return (EXIT_FAILURE);
+			}
+			smp = &ctx->txbuf[i + 2 * j];
+			*smp &= ~JTAG_TDO;
+			if (buf[j] == '1')
+				*smp |= JTAG_TDO;
+		}
+	}
+
+	ctx->txpos = 0;
+	return (0);
+}
+
+static const struct cable_ops remote_ops = {
+	.name =		"remote_bitbang",
+	.open =		setup_remote,
+	.close =	shutdown_remote,
+	.commit =	commit_remote,
+};
+#endif /* USE_SOCKETS */
+
+
+/*
+ * MPSSE engine for the FT2232H / FT4232H based cables.  TXBUF is
+ * compiled into MPSSE commands: runs of TCKs with TMS low become data
+ * shifts, or bare clocks while TDI idles, and the rest TMS commands of
+ * up to 7 TCKs each.  TDO read back is put into TXBUF where a cable in
+ * synchronous bitbang mode would have left it, so send_generic() and
+ * exec_wave() work unchanged.
+ */
+#define	MPSSE_WR_BYTES		0x19	/* TDI out on -ve edge, LSB first */
+#define	MPSSE_WR_BITS		0x1b
+#define	MPSSE_RW_BYTES		0x39	/* ... and TDO in on +ve edge */
+#define	MPSSE_RW_BITS		0x3b
+#define	MPSSE_WR_TMS		0x4b
+#define	MPSSE_RW_TMS		0x6b
+#define	MPSSE_SET_LOW		0x80
+#define	MPSSE_LOOPBACK_OFF	0x85
+#define	MPSSE_TCK_DIVISOR	0x86
+#define	MPSSE_SEND_IMMEDIATE	0x87
+#define	MPSSE_DIV5_OFF		0x8a
+#define	MPSSE_3PHASE_OFF	0x8d
+#define	MPSSE_CLK_BITS		0x8e
+#define	MPSSE_CLK_BYTES		0x8f
+#define	MPSSE_RTCK_OFF		0x97
+
+#define	MP_RD			0x1	/* Read TDO back */
+#define	MP_VEC			0x2	/* ... into the shift() vector */
+
+struct mpsse_rd {
+	unsigned	pos;		/* First TCK, in TXBUF or vector */
+	unsigned	bits;		/* Less than 8 if from a bit command */
+	int		flags;
+};
+
+struct mpsse {
+	uint8_t		buf[MPSSE_TX_MAX + 1];	/* Commands not yet sent */
+	unsigned	len;
+	struct mpsse_rd	rd[MPSSE_RX_MAX];	/* TDO due back */
+	unsigned	nrd;
+	uint8_t		rx[MPSSE_RX_MAX];
+	unsigned	rxlen;
+	uint8_t		*tdo;		/* TDO of the last shift(), per bit */
+	unsigned	tdosize;
+	int		tms;		/* Pin states once buf is sent */
+	int		tdi;
+	unsigned	div;		/* TCK is 30 MHz / (div + 1) */
+};
+
+static int
+mpsse_flush(struct jtag_ctx *ctx)
+{
+	struct mpsse *mp = ctx->mp;
+	struct mpsse_rd *rd;
+	unsigned b, k, pos, len;
+	uint64_t t0 = 0;
+	int res, rep, v;
+
+	if (mp->len == 0)
+		return (0);
+	if (mp->rxlen)
+		mp->buf[mp->len++] = MPSSE_SEND_IMMEDIATE;
+	len = mp->len;
+	mp->len = 0;
+	if (stats_fp != NULL && mp->rxlen)
+		t0 = ns_uptime();
+	stats_enter(&ctx->stats, STAT_USB_WRITE);
+	if (ctx->mock != NULL)
+		res = mock_mpsse_write(ctx, mp->buf, len);
+	else
+#ifdef WIN32
+		FT_Write(ctx->ftHandle, mp->buf, len, (DWORD *) &res);
+#else
+		res = ftdi_write_data(&ctx->fc, mp->buf, len);
+#endif
+	stats_leave(&ctx->stats);
+	ctx->stats.usb_out += len;
+	if (res != (int) len) {
+		fprintf(stderr, "ftdi_write_data() failed\n");
+		return (EXIT_FAILURE);
+	}
+	if (mp->rxlen == 0)
+		return (0);
+
+	stats_enter(&ctx->stats, STAT_USB_READ);
+	if (ctx->mock != NULL)
+		res = mock_mpsse_read(ctx, mp->rx, mp->rxlen);
+	else
+#ifdef WIN32
+		FT_Read(ctx->ftHandle, mp->rx, mp->rxlen, (DWORD *) &res);
+#else
+	for (res = 0, rep = 0; res < (int) mp->rxlen && rep < 8; rep++) {
+		if (rep > 0)
+			ctx->stats.retries++;
+		v = ftdi_read_data(&ctx->fc, &mp->rx[res], mp->rxlen - res);
+		if (v < 0)
+			break;
+		res += v;
+	}
+#endif
+	stats_leave(&ctx->stats);
+	ctx->stats.usb_in += res;
+	if (t0)
+		stats_rtt(&ctx->stats, ns_uptime() - t0);
+	if (res != (int) mp->rxlen) {
+		fprintf(stderr, "ftdi_read_data() failed\n");
+		return (EXIT_FAILURE);
+	}
+
+	/* Bit commands shift TDO in from the MSB end */
+	for (rd = mp->rd, k = 0; rd < &mp->rd[mp->nrd]; rd++) {
+		for (b = 0; b < rd->bits; b++) {
+			if (rd->bits < 8)
+				v = (mp->rx[k] >> (8 - rd->bits + b)) & 1;
+			else
+				v = (mp->rx[k + b / 8] >> (b & 0x7)) & 1;
+			pos = rd->pos + b;
+			if (rd->flags & MP_VEC)
+				mp->tdo[pos] = v;
+			else if (2 * pos + 2 < ctx->txpos) {
+				/* Sampled with the next TCK, as in SYNCBB */
+				ctx->txbuf[2 * pos + 2] &= ~JTAG_TDO;
+				if (v)
+					ctx->txbuf[2 * pos + 2] |= JTAG_TDO;
+			}
+		}
+		k += rd->bits < 8 ? 1 : rd->bits / 8;
+	}
+	mp->nrd = 0;
+	mp->rxlen = 0;
+	return (0);
+}
+
+/*
+ * Make room for a command of len bytes, returning rxlen bytes of TDO.
+ */
+static int
+mpsse_room(struct jtag_ctx *ctx, unsigned len, unsigned rxlen)
+{
+	struct mpsse *mp = ctx->mp;
+
+	if (mp->len + len > MPSSE_TX_MAX || mp->rxlen + rxlen > MPSSE_RX_MAX)
+		return (mpsse_flush(ctx));
+	return (0);
+}
+
+static void
+mpsse_expect(struct mpsse *mp, unsigned pos, unsigned bits, int flags)
+{
+	struct mpsse_rd *rd = &mp->rd[mp->nrd++];
+
+	rd->pos = pos;
+	rd->bits = bits;
+	rd->flags = flags;
+	mp->rxlen += bits < 8 ? 1 : bits / 8;
+}
+
+/*
+ * Clock up to 7 TCKs with TMS bits from tms, TDI held at tdi.
+ */
+static int
+mpsse_tms(struct jtag_ctx *ctx, int tms, unsigned bits, int tdi,
+    unsigned pos, int flags)
+{
+	struct mpsse *mp = ctx->mp;
+	uint8_t *cp;
+	int res;
+
+	res = mpsse_room(ctx, 3, flags & MP_RD);
+	if (res)
+		return (res);
+	cp = &mp->buf[mp->len];
+	cp[0] = flags & MP_RD ? MPSSE_RW_TMS : MPSSE_WR_TMS;
+	cp[1] = bits - 1;
+	cp[2] = tms | (tdi << 7);
+	mp->len += 3;
+	if (flags & MP_RD)
+		mpsse_expect(mp, pos, bits, flags);
+	mp->tms = (tms >> (bits - 1)) & 1;
+	mp->tdi = tdi;
+	return (0);
+}
+
+/*
+ * Shift bits of LSB first packed data out on TDI with TMS low, or just
+ * clock TCK if data is NULL and TDO isn't wanted.
+ */
+static int
+mpsse_data(struct jtag_ctx *ctx, const uint8_t *data, unsigned bits,
+    unsigned pos, int flags)
+{
+	static const uint8_t zeros[MPSSE_CHUNK];
+	struct mpsse *mp = ctx->mp;
+	unsigned n, nb;
+	uint8_t *cp;
+	int res, rd = flags & MP_RD;
+
+	for (; bits > 0; bits -= n, pos += n) {
+		nb = bits / 8;
+		if (data == NULL && !rd && mp->tdi == 0) {
+			if (nb > 65536)
+				nb = 65536;
+			res = mpsse_room(ctx, 3, 0);
+			if (res)
+				return (res);
+			cp = &mp->buf[mp->len];
+			if (nb) {
+				n = nb * 8;
+				cp[0] = MPSSE_CLK_BYTES;
+				cp[1] = (nb - 1) & 0xff;
+				cp[2] = (nb - 1) >> 8;
+				mp->len += 3;
+			} else {
+				n = bits;
+				cp[0] = MPSSE_CLK_BITS;
+				cp[1] = n - 1;
+				mp->len += 2;
+			}
+			continue;
+		}
+
+		if (nb > (rd ? MPSSE_RX_MAX : MPSSE_CHUNK))
+			nb = rd ? MPSSE_RX_MAX : MPSSE_CHUNK;
+		res = mpsse_room(ctx, 3 + nb, rd ? (nb ? nb : 1) : 0);
+		if (res)
+			return (res);
+		cp = &mp->buf[mp->len];
+		if (nb) {
+			n = nb * 8;
+			cp[0] = rd ? MPSSE_RW_BYTES : MPSSE_WR_BYTES;
+			cp[1] = (nb - 1) & 0xff;
+			cp[2] = (nb - 1) >> 8;
+			memcpy(&cp[3], data ? data : zeros, nb);
+			mp->tdi = data ? data[nb - 1] >> 7 : 0;
+			mp->len += 3 + nb;
+		} else {
+			n = bits;
+			cp[0] = rd ? MPSSE_RW_BITS : MPSSE_WR_BITS;
+			cp[1] = n - 1;
+			cp[2] = data ? data[0] : 0;
+			mp->tdi = data ? (data[0] >> (n - 1)) & 1 : 0;
+			mp->len += 3;
+		}
+		if (rd)
+			mpsse_expect(mp, pos, n, flags);
+		if (data)
+			data += nb;
+	}
+	return (0);
+}
+
+/*
+ * Translate the TCKs pending in TXBUF into MPSSE commands.
+ */
+static int
+mpsse_compile(struct jtag_ctx *ctx, int flags)
+{
+	uint8_t pack[MPSSE_CHUNK];
+	uint8_t *tb = ctx->txbuf;
+	unsigned i, j, k, b, m, n = ctx->txpos / 2;
+	int res, tms, tdi, t;
+
+	for (i = 0; i < n; i = j) {
+		if (ctx->mp->tms || (tb[2 * i] & JTAG_TMS)) {
+			/* TDI must hold, stop once TMS is low again */
+			tdi = (tb[2 * i] & JTAG_TDI) != 0;
+			tms = 0;
+			for (j = i; j < n && j - i < 7;) {
+				if (((tb[2 * j] & JTAG_TDI) != 0) != tdi)
+					break;
+				t = (tb[2 * j] & JTAG_TMS) != 0;
+				tms |= t << (j - i);
+				j++;
+				if (!t)
+					break;
+			}
+			res = mpsse_tms(ctx, tms, j - i, tdi, i, flags);
+			if (res)
+				return (res);
+			continue;
+		}
+
+		for (j = i, t = 0; j < n && !(tb[2 * j] & JTAG_TMS); j++)
+			t |= tb[2 * j];
+		if (!(t & JTAG_TDI) && !(flags & MP_RD)) {
+			res = mpsse_data(ctx, NULL, j - i, i, flags);
+			if (res)
+				return (res);
+			continue;
+		}
+		for (k = i; k < j; k += m) {
+			m = j - k;
+			if (m > 8 * MPSSE_CHUNK)
+				m = 8 * MPSSE_CHUNK;
+			memset(pack, 0, (m + 7) / 8);
+			for (b = 0; b < m; b++)
+				if (tb[2 * (k + b)] & JTAG_TDI)
+					pack[b / 8] |= 1 << (b & 0x7);
+			res = mpsse_data(ctx, pack, m, k, flags);
+			if (res)
+				return (res);
+		}
+	}
+	return (0);
+}
+
+static int
+commit_mpsse(struct jtag_ctx *ctx)
+{
+	int res;
+
+	res = mpsse_compile(ctx,
+	    ctx->port_mode == PORT_MODE_SYNC ? MP_RD : 0);
+	if (res == 0)
+		res = mpsse_flush(ctx);
+	ctx->txpos = 0;
+	return (res);
+}
+
+/*
+ * Queue a whole scan vector straight from its hex form.  TCKs pending
+ * in TXBUF go first, but their TDO is not kept.
+ */
+static int
+mpsse_shift(struct jtag_ctx *ctx, unsigned bits, const char *tdi)
+{
+	struct mpsse *mp = ctx->mp;
+	uint8_t pack[MPSSE_CHUNK], *tdo;
+	unsigned i, k, m, len;
+	int res, c, flags = 0;
+
+	res = mpsse_compile(ctx, 0);
+	ctx->txpos = 0;
+	if (res)
+		return (res);
+
+	if (ctx->port_mode == PORT_MODE_SYNC) {
+		flags = MP_RD | MP_VEC;
+		if (mp->tdosize < bits) {
+			tdo = realloc(mp->tdo, bits);
+			if (tdo == NULL) {
+				fprintf(stderr, "malloc(%u) failed\n", bits);
+				return (EXIT_FAILURE);
+			}
+			mp->tdo = tdo;
+			mp->tdosize = bits;
+		}
+	}
+
+	len = strlen(tdi);
+	for (i = 0; i < bits; i += m) {
+		m = bits - 1 - i;
+		if (m > 8 * MPSSE_CHUNK)
+			m = 8 * MPSSE_CHUNK;
+		/* Bits past m in the last byte won't be clocked */
+		memset(pack, 0, (m + 7) / 8);
+		for (k = 0; k < m; k += 4) {
+			c = tdi[len - 1 - (i + k) / 4];
+			if (c >= '0' && c <= '9')
+				c = c - '0';
+			else if (c >= 'A' && c <= 'F')
+				c = c + 10 - 'A';
+			else {
+				fprintf(stderr, "mpsse_shift(): "
+				    "TDI data not in hex format\n");
+				return (EXIT_FAILURE);
+			}
+			pack[k / 8] |= c << (k & 0x4);
+		}
+		if (m == 0)
+			break;
+		res = mpsse_data(ctx, pack, m, i, flags);
+		if (res)
+			return (res);
+	}
+
+	/* The last bit goes out with TMS high, moving to *EXIT1 */
+	c = tdi[0] <= '9' ? tdi[0] - '0' : tdi[0] + 10 - 'A';
+	return (mpsse_tms(ctx, 1, 1, (c >> ((bits - 1) & 0x3)) & 1,
+	    bits - 1, flags));
+}
+
+static int
+mpsse_read_tdo(struct jtag_ctx *ctx, uint8_t *tdo, unsigned bits)
+{
+	int res;
+
+	res = mpsse_flush(ctx);
+	if (res == 0)
+		memcpy(tdo, ctx->mp->tdo, bits);
+	return (res);
+}
+
+/*
+ * Wait by clocking TCK with TMS low, which keeps the TAP where it is
+ * and costs the host no round trip.
+ */
+static void
+mpsse_sleep(struct jtag_ctx *ctx, int ms)
+{
+	struct mpsse *mp = ctx->mp;
+
+	if (mp->tms && ctx->mock != NULL) {
+		mock_sleep(ctx, ms);
+		return;
+	}
+	if (mp->tms) {
+		ms_sleep(ms);
+		return;
+	}
+	if (mpsse_data(ctx, NULL, (ms * 30000 + mp->div) / (mp->div + 1),
+	    0, 0) == 0)
+		mpsse_flush(ctx);
+}
+
+static int
+mpsse_enter(struct jtag_ctx *ctx)
+{
+	struct mpsse *mp = ctx->mp;
+	uint8_t *cp;
+	int res = 0, pins = JTAG_TCK | JTAG_TMS | JTAG_TDI;
+
+	if (ctx->mock == NULL) {
+#ifdef WIN32
+		res = FT_SetBitMode(ctx->ftHandle, 0, BITMODE_RESET);
+		if (res == FT_OK)
+			res = FT_SetBitMode(ctx->ftHandle, pins,
+			    BITMODE_MPSSE);
+#else
+		res = ftdi_set_bitmode(&ctx->fc, 0, BITMODE_RESET);
+		if (res == 0)
+			res = ftdi_set_bitmode(&ctx->fc, pins, BITMODE_MPSSE);
+#endif
+	}
+	if (res) {
+		fprintf(stderr, "ftdi_set_bitmode() failed\n");
+		return (EXIT_FAILURE);
+	}
+
+	cp = &mp->buf[mp->len];
+	*cp++ = MPSSE_DIV5_OFF;
+	*cp++ = MPSSE_RTCK_OFF;
+	*cp++ = MPSSE_3PHASE_OFF;
+	*cp++ = MPSSE_LOOPBACK_OFF;
+	*cp++ = MPSSE_TCK_DIVISOR;
+	*cp++ = mp->div & 0xff;
+	*cp++ = mp->div >> 8;
+	/* TCK low, TMS high */
+	*cp++ = MPSSE_SET_LOW;
+	*cp++ = JTAG_TMS;
+	*cp++ = pins;
+	mp->len = cp - mp->buf;
+	mp->tms = 1;
+	mp->tdi = 0;
+	return (mpsse_flush(ctx));
+}
+
+static int
+set_mode_mpsse(struct jtag_ctx *ctx, port_mode_t mode)
+{
+	int res;
+
+	/* Flush any stale TX buffers */
+	commit(ctx, 1);
+	res = mpsse_flush(ctx);
+
+	if (res == 0 && mode == PORT_MODE_UART && ctx->mock == NULL) {
+#ifdef WIN32
+		res = FT_SetBitMode(ctx->ftHandle, 0, BITMODE_RESET);
+#else
+		res = ftdi_set_bitmode(&ctx->fc, 0, BITMODE_RESET);
+#endif
+	} else if (res == 0 && mode != PORT_MODE_UART &&
+	    ctx->port_mode == PORT_MODE_UART)
+		res = mpsse_enter(ctx);
+
+	ctx->port_mode = mode;
+	return (res);
+}
+
+static int
+mpsse_close(struct jtag_ctx *ctx)
+{
+	int res;
+
+	res = ctx->mock != NULL ? shutdown_mock(ctx) : shutdown_usb(ctx);
+	free(ctx->mp->tdo);
+	free(ctx->mp);
+	ctx->mp = NULL;
+	return (res);
+}
+
+static const struct cable_ops mpsse_ops = {
+	.name =		"FTDI MPSSE",
+	.caps =		CABLE_CAP_SHIFT | CABLE_CAP_SLEEP,
+	.open =		setup_usb,
+	.close =	mpsse_close,
+	.set_mode =	set_mode_mpsse,
+	.commit =	commit_mpsse,
+	.shift =	mpsse_shift,
+	.read_tdo =	mpsse_read_tdo,
+	.sleep =	mpsse_sleep,
+};
+
+/*
+ * Called by setup_usb() once it finds an MPSSE capable cable.
+ */
+static int
+mpsse_div(int khz)
+{
+	int div;
+
+	/* 60 MHz clock, divide by 5 off; round TCK down, never up */
+	div = (30000 + khz - 1) / khz - 1;
+	if (div > 0xffff)
+		div = 0xffff;
+	return (div);
+}
+
+static int
+mpsse_setup(struct jtag_ctx *ctx)
+{
+	struct mpsse *mp;
+
+	mp = calloc(1, sizeof(*mp));
+	if (mp == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		return (EXIT_FAILURE);
+	}
+	mp->div = mpsse_div(ctx->tune.tck_khz ? ctx->tune.tck_khz : tck_khz);
+	ctx->mp = mp;
+	ctx->ops = &mpsse_ops;
+	return (mpsse_enter(ctx));
+}
+
+
+static const struct cable_ops usb_ops = {
+	.name =		"FTDI bitbang",
+	.open =		setup_usb,
+	.close =	shutdown_usb,
+	.set_mode =	set_mode_usb,
+	.commit =	commit_usb,
+};
+
+/* A virtual board takes exactly what a bitbang cable would */
+static const struct cable_ops mock_ops = {
+	.name =		"virtual ULX3S",
+	.open =		setup_mock,
+	.close =	shutdown_mock,
+	.commit =	commit_mock,
+};
+
+static const struct cable_ops *cable_backends[] = {
+	[CABLE_HW_USB] =	&usb_ops,
+#ifdef USE_PPI
+	[CABLE_HW_PPI] =	&ppi_ops,
+#endif
+#ifdef USE_RAW
+	[CABLE_RAW] =		&raw_ops,
+#endif
+#ifdef USE_SOCKETS
+	[CABLE_REMOTE] =	&remote_ops,
+#endif
+	[CABLE_MOCK] =		&mock_ops,
+	[CABLE_UNKNOWN] =	NULL
+};
+
+/*
+ * Bind ctx to the backend for cable_hw and open the cable.
+ */
+static int
+cable_open(struct jtag_ctx *ctx, enum cable_hw cable_hw)
+{
+
+	ctx->ops = cable_backends[cable_hw];
+	if (ctx->ops == NULL)
+		return (EINVAL);
+	return (ctx->ops->open(ctx));
+}
+
+static int
+cable_close(struct jtag_ctx *ctx)
+{
+
+	if (ctx->ops == NULL)
+		return (0);
+	return (ctx->ops->close(ctx));
+}
+
+
+static int
+commit(struct jtag_ctx *ctx, int force)
+{
+
+	if (ctx->fatal) {
+		ctx->txpos = 0;
+		return (EXIT_FAILURE);
+	}
+	if (ctx->txpos == 0 || (!force && ctx->port_mode != PORT_MODE_SYNC &&
+	    ctx->txpos < BUFLEN_MAX))
+		return (0);
+
+	progress_show(ctx);
+
+	if (ctx->ops == NULL)
+		return (EINVAL);
+	if (ctx->port_mode != PORT_MODE_UART)
+		ctx->tcks += ctx->txpos / 2;
+	ctx->stats.commits++;
+	return (ctx->ops->commit(ctx));
+}
+
+
+static int
+str2tapstate(char *str)
+{
+	int i;
+
+	for (i = 0; tap_statetable[i].state_str != NULL; i++) {
+		if (strcmp(str, tap_statetable[i].state_str) == 0)
+			break;
+	}
+	return (tap_statetable[i].state_id);
+}
+
+
+static void
+set_state(struct jtag_ctx *ctx, int tgt_s) {
+	int i, res = 0;
+
+	switch (tgt_s) {
+	case RESET:
+		for (i = 0; i < 6; i++)
+			set_tms_tdi(ctx, 1, 0);
+		break;
+
+	case IDLE:
+		switch (ctx->cur_s) {
+		case RESET:
+		case DRUPDATE:
+		case IRUPDATE:
+		case IDLE:
+			set_tms_tdi(ctx, 0, 0);
+			break;
+
+		case UNDEFINED:
+			set_state(ctx, RESET);
+			set_state(ctx, IDLE);
+			break;
+
+		case DRPAUSE:
+			set_state(ctx, DREXIT2);
+			set_state(ctx, DRUPDATE);
+			set_state(ctx, IDLE);
+			break;
+
+		case IRPAUSE:
+			set_state(ctx, IREXIT2);
+			set_state(ctx, IRUPDATE);
+			set_state(ctx, IDLE);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case DRSELECT:
+		switch (ctx->cur_s) {
+		case IDLE:
+		case DRUPDATE:
+		case IRUPDATE:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case DRCAPTURE:
+		switch (ctx->cur_s) {
+		case DRSELECT:
+			set_tms_tdi(ctx, 0, 0);
+			break;
+
+		case IDLE:
+			set_state(ctx, DRSELECT);
+			set_state(ctx, DRCAPTURE);
+			break;
+
+		case IRPAUSE:
+			set_state(ctx, IDLE);
+			set_state(ctx, DRSELECT);
+			set_state(ctx, DRCAPTURE);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case DREXIT1:
+		switch (ctx->cur_s) {
+		case DRCAPTURE:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case DRPAUSE:
+		switch (ctx->cur_s) {
+		case DREXIT1:
+			set_tms_tdi(ctx, 0, 0);
+			break;
+
+		case IDLE:
+			set_state(ctx, DRSELECT);
+			set_state(ctx, DRCAPTURE);
+			set_state(ctx, DREXIT1);
+			set_state(ctx, DRPAUSE);
+			break;
+
+		case IRPAUSE:
+			set_state(ctx, IREXIT2);
+			set_state(ctx, IRUPDATE);
+			set_state(ctx, DRSELECT);
+			set_state(ctx, DRCAPTURE);
+			set_state(ctx, DREXIT1);
+			set_state(ctx, DRPAUSE);
+			break;
+
+		case DRPAUSE:
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case DREXIT2:
+		switch (ctx->cur_s) {
+		case DRPAUSE:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case DRUPDATE:
+		switch (ctx->cur_s) {
+		case DREXIT2:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case IRSELECT:
+		switch (ctx->cur_s) {
+		case DRSELECT:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case IRCAPTURE:
+		switch (ctx->cur_s) {
+		case IRSELECT:
+			set_tms_tdi(ctx, 0, 0);
+			break;
+
+		case IDLE:
+			set_state(ctx, DRSELECT);
+			set_state(ctx, IRSELECT);
+			set_state(ctx, IRCAPTURE);
+			break;
+
+		case DRPAUSE:
+			set_state(ctx, DREXIT2);
+			set_state(ctx, DRUPDATE);
+			set_state(ctx, DRSELECT);
+			set_state(ctx, IRSELECT);
+			set_state(ctx, IRCAPTURE);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case IREXIT1:
+		switch (ctx->cur_s) {
+		case IRCAPTURE:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case IRPAUSE:
+		switch (ctx->cur_s) {
+		case IREXIT1:
+			set_tms_tdi(ctx, 0, 0);
+			break;
+
+		case IDLE:
+			set_state(ctx, DRSELECT);
+			set_state(ctx, IRSELECT);
+			set_state(ctx, IRCAPTURE);
+			set_state(ctx, IREXIT1);
+			set_state(ctx, IRPAUSE);
+			break;
+
+		case DRPAUSE:
+			set_state(ctx, DREXIT2);
+			set_state(ctx, DRUPDATE);
+			set_state(ctx, DRSELECT);
+			set_state(ctx, IRSELECT);
+			set_state(ctx, IRCAPTURE);
+			set_state(ctx, IREXIT1);
+			set_state(ctx, IRPAUSE);
+			break;
+
+		case IRPAUSE:
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case IREXIT2:
+		switch (ctx->cur_s) {
+		case IRPAUSE:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	case IRUPDATE:
+		switch (ctx->cur_s) {
+		case IREXIT2:
+			set_tms_tdi(ctx, 1, 0);
+			break;
+
+		default:
+			res = -1;
+		}
+		break;
+
+	default:
+		res = -1;
+	}
+
+	if (res) {
+		fprintf(stderr, "Don't know how to proceed: %s -> %s\n",
+		    STATE2STR(ctx->cur_s), STATE2STR(tgt_s));
+		if (ctx->no_exit) {
+			ctx->fatal = 1;
+			return;
+		}
+		if (ctx->cable_hw == CABLE_HW_USB)
+			shutdown_usb(ctx);
+		exit(EXIT_FAILURE);
+	}
+
+	ctx->cur_s = tgt_s;
+}
+
+
+static int
+exec_svf_tokenized(struct jtag_ctx *ctx, int tokc, char *tokv[])
+{
+	int cmd, i, res = 0;
+	int repeat = 1, delay_ms = 0;
+
+	for (i = 0; svf_cmdtable[i].cmd_str != NULL; i++) {
+		if (strcmp(tokv[0], svf_cmdtable[i].cmd_str) == 0)
+			break;
+	}
+
+	cmd = svf_cmdtable[i].cmd_id;
+	switch (cmd) {
+	case SVF_SDR:
+	case SVF_SIR:
+		if (tokc == 4) {
+			if (cmd == SVF_SDR && ctx->last_sdr == PORT_MODE_ASYNC)
+				set_port_mode(ctx, PORT_MODE_ASYNC);
+			tokv[5] = NULL;
+			tokv[7] = NULL;
+			if (cmd == SVF_SDR)
+				ctx->last_sdr = PORT_MODE_ASYNC;
+		} else if (tokc == 6 || tokc == 8) {
+			set_port_mode(ctx, PORT_MODE_SYNC);
+			if (tokc == 5)
+				tokv[7] = NULL;
+			if (cmd == SVF_SDR)
+				ctx->last_sdr = PORT_MODE_SYNC;
+		} else {
+			res = EXIT_FAILURE;
+			break;
+		}
+		if (cmd == SVF_SDR) {
+			set_state(ctx, DRPAUSE);
+			res = send_dr(ctx, atoi(tokv[1]), tokv[3], tokv[5],
+			    tokv[7]);
+		} else {
+			set_state(ctx, IRPAUSE);
+			res = send_ir(ctx, atoi(tokv[1]), tokv[3], tokv[5],
+			    tokv[7]);
+		}
+		if (res)
+			break;
+		if (tokc == 6 || tokc == 8)
+			ctx->stats.tdo_checks++;
+		if (ctx->ops->caps & CABLE_CAP_TDO_CMP)
+			break; /* The cable checks TDO */
+		if ((tokc == 6 || tokc == 8) && strcmp(tokv[3], tokv[5]) != 0) {
+			ctx->stats.tdo_errors++;
+			if (strlen(tokv[3]) == 8 && strlen(tokv[5]) == 8 &&
+			    strcmp(tokv[7], "FFFFFFFF") == 0 &&
+			    cmp_chip_ids(tokv[3], tokv[5]) == 0)
+				return (ENODEV);
+			fprintf(stderr, "Received and expected data "
+			    "do not match!\n");
+			if (tokc == 6)
+				fprintf(stderr, "TDO: %s Expected: %s\n",
+				    tokv[3], tokv[5]);
+			if (tokc == 8)
+				fprintf(stderr, "TDO: %s Expected: %s "
+				    "mask: %s\n", tokv[3], tokv[5], tokv[7]);
+			res = EXIT_FAILURE;
+		}
+		break;
+
+	case SVF_STATE:
+		set_state(ctx, str2tapstate(tokv[1]));
+		res = commit(ctx, 0);
+		break;
+
+	case SVF_RUNTEST:
+		if (isnumber(tokv[1][0])) {
+			i = 1;
+			set_state(ctx, IDLE);
+		} else {
+			set_state(ctx, str2tapstate(tokv[1]));
+			i = 2;
+		}
+		for (; i < tokc; i += 2) {
+			if (strcmp(tokv[i + 1], "TCK") == 0) {
+				repeat = atoi(tokv[i]);
+				if (repeat < 1 || repeat > 100000) {
+					fprintf(stderr,
+					    "Unexpected token: %s\n",
+					    tokv[i]);
+					res = EXIT_FAILURE;
+					break;
+				}
+			} else if (strcmp(tokv[i + 1], "SEC") == 0) {
+				float f;
+				sscanf(tokv[i], "%f", &f);
+				delay_ms = (f + 0.0005) * 1000;
+				if (delay_ms < 1 || delay_ms > 120000) {
+					fprintf(stderr,
+					    "Unexpected token: %s\n",
+					    tokv[i]);
+					res = EXIT_FAILURE;
+					break;
+				}
+				/* Silently reduce insanely long waits */
+				if (delay_ms > 3000)
+					delay_ms = 3000;
+			} else {
+				fprintf(stderr, "Unexpected token: %s\n",
+				    tokv[i + 1]);
+				res = EXIT_FAILURE;
+				break;
+			}
+		}
+		/* Wait on the host if the cable can, else clock it away */
+		i = delay_ms * (ctx->tune.bauds / 2000);
+		if (ctx->ops->caps & CABLE_CAP_SLEEP)
+			i = 0;
+#ifdef USE_PPI
+		/* libftdi is relatively slow in sync mode on FreeBSD */
+		if (ctx->port_mode == PORT_MODE_SYNC && i > USB_BUFLEN_SYNC / 2)
+			i /= 2;
+#endif
+		if (i > repeat)
+			repeat = i;
+		for (i = 0; i < repeat; i++) {
+			txbuf_reserve(ctx, 2);
+			ctx->txbuf[ctx->txpos++] = 0;
+			ctx->txbuf[ctx->txpos++] = JTAG_TCK;
+			if (ctx->txpos >= txbuf_flush) {
+				commit(ctx, 0);
+				if (ctx->need_led_blink)
+					set_port_mode(ctx, ctx->port_mode);
+			}
+		}
+		if (delay_ms && (ctx->ops->caps & CABLE_CAP_SLEEP)) {
+			res = commit(ctx, 1);
+			stats_enter(&ctx->stats, STAT_SLEEP);
+			ctx->ops->sleep(ctx, delay_ms);
+			stats_leave(&ctx->stats);
+		}
+		break;
+
+	case SVF_HDR:
+	case SVF_HIR:
+	case SVF_TDR:
+	case SVF_TIR:
+		if (tokc != 2 || strcmp(tokv[1], "0") != 0)
+			res = EINVAL;
+		break;
+
+	case SVF_ENDDR:
+		if (tokc != 2 ||
+		    (strcmp(tokv[1], "DRPAUSE") != 0 &&
+		    strcmp(tokv[1], "IDLE") != 0))
+			res = EINVAL;
+		break;
+
+	case SVF_ENDIR:
+		if (tokc != 2 ||
+		    (strcmp(tokv[1], "IRPAUSE") != 0 &&
+		    strcmp(tokv[1], "IDLE") != 0))
+			res = EINVAL;
+		break;
+
+	case SVF_FREQUENCY:
+	case SVF_TRST:
+		/* Silently ignored. */
+		break;
+
+	default:
+		res = EOPNOTSUPP;
+	}
+
+	return (res);
+}
+
+
+enum jed_states {
+	JED_INIT, JED_PACK_KNOWN, JED_SIZE_KNOWN, JED_PROG_INITIATED,
+	JED_FUSES, JED_FUSES_DONE, JED_SED_CRC, JED_HAVE_SED_CRC, JED_USER_SIG
+};
+
+enum jed_target {
+	JED_TGT_SRAM, JED_TGT_FLASH, JED_TGT_UNKNOWN
+};
+
+static struct jed_devices {
+	char	*name;
+	int	id;
+	int	fuses;
+	int	col_width;
+	int	row_width;
+} jed_devices[] = {
+	{
+		.name =		"LFXP2-5E",
+		.id =		0x01299043,
+		.fuses =	1236476,
+		.col_width =	638,
+		.row_width =	1938,
+	},
+	{
+		.name =		"LFXP2-8E",
+		.id =		0x0129A043,
+		.fuses =	1954736,
+		.col_width =	772,
+		.row_width=	2532,
+	},
+	{
+		.name =		"LFXP2-17E",
+		.id =		0x0129B043,
+		.fuses =	3627704,
+		.col_width =	2188,
+		.row_width =	1658,
+	},
+	{
+		.name =		"LFXP2-30E",
+		.id =		0x0129D043,
+		.fuses =	5954320,
+		.col_width =	2644,
+		.row_width =	2532,
+	},
+	{
+		.name =		"LFXP2-40E",
+		.id =		0x0129E043,
+		.fuses =	8304368,
+		.col_width =	3384,
+		.row_width =	2454,
+	},
+	{
+		.name =		"LFE5U-12F",
+		.id =		0x21111043,
+		.fuses =	5681848,
+		.col_width =	592,
+		.row_width =	7562,
+	},
+	{
+		.name =		"LFE5U-25F",
+		.id =		0x41111043,
+		.fuses =	5681848,
+		.col_width =	592,
+		.row_width =	7562,
+	},
+	{
+		.name =		"LFE5U-45F",
+		.id =		0x41112043,
+		.fuses =	10208312,
+		.col_width =	848,
+		.row_width =	9470,
+	},
+	{
+		.name =		"LFE5U-85F",
+		.id =		0x41113043,
+		.fuses =	19244856,
+		.col_width =	1136,
+		.row_width =	13294,
+	},
+	{
+		.name =		"LFE5UM-25F",
+		.id =		0x01111043,
+		.fuses =	5681848,
+		.col_width =	592,
+		.row_width =	7562,
+	},
+	{
+		.name =		"LFE5UM-45F",
+		.id =		0x01112043,
+		.fuses =	10208312,
+		.col_width =	848,
+		.row_width =	9470,
+	},
+	{
+		.name =		"LFE5UM-85F",
+		.id =		0x01113043,
+		.fuses =	19244856,
+		.col_width =	1136,
+		.row_width =	13294,
+	},
+	{NULL, 0, 0, 0, 0}
+};
+
+
+/*
+ * Virtual ULX3S (--mock DEVICE), for exercising the programming flows
+ * without hardware.  It takes the very bytes an FT231X gets in bitbang
+ * mode, and in SYNC mode returns the pins the FT231X would have sampled.
+ * Behind the pins sits a TAP with the ECP5 or XP2 configuration engine,
+ * and on ECP5 a SPI flash reached through LSC_PROG_SPI.  Time is virtual,
+ * one bitbang clock per byte, so erase and program waits are clocked
+ * away exactly as on a real board, only much faster.
+ */
+#define	MOCK_NS_PER_BYTE	(1000000000 / USB_BAUDS)
+#define	MOCK_FLASH_SIZE		(16 * 1024 * 1024)
+#define	MOCK_SRAM_ERASE_NS	20000000ULL	/* ISC_ERASE */
+#define	MOCK_SECTOR_ERASE_NS	150000000ULL	/* 64 KB sector */
+#define	MOCK_BLOCK_ERASE_NS	45000000ULL	/* 4 KB block */
+#define	MOCK_CHIP_ERASE_NS	40000000000ULL
+#define	MOCK_PAGE_PROG_NS	700000ULL
+
+/* ECP5 status register */
+#define	MOCK_ST_DONE		0x00000100
+#define	MOCK_ST_ISC		0x00000200
+#define	MOCK_ST_BUSY		0x00001000
+#define	MOCK_ST_FAIL		0x00002000
+#define	MOCK_ST_ID_ERR		0x08000000
+
+/* SPI flash status register */
+#define	MOCK_SPI_WIP		0x01
+#define	MOCK_SPI_WEL		0x02
+
+static const uint8_t mock_tap_next[16][2] = {
+	[RESET] =	{ IDLE,		RESET },
+	[IDLE] =	{ IDLE,		DRSELECT },
+	[DRSELECT] =	{ DRCAPTURE,	IRSELECT },
+	[DRCAPTURE] =	{ DRSHIFT,	DREXIT1 },
+	[DRSHIFT] =	{ DRSHIFT,	DREXIT1 },
+	[DREXIT1] =	{ DRPAUSE,	DRUPDATE },
+	[DRPAUSE] =	{ DRPAUSE,	DREXIT2 },
+	[DREXIT2] =	{ DRSHIFT,	DRUPDATE },
+	[DRUPDATE] =	{ IDLE,		DRSELECT },
+	[IRSELECT] =	{ IRCAPTURE,	RESET },
+	[IRCAPTURE] =	{ IRSHIFT,	IREXIT1 },
+	[IRSHIFT] =	{ IRSHIFT,	IREXIT1 },
+	[IREXIT1] =	{ IRPAUSE,	IRUPDATE },
+	[IRPAUSE] =	{ IRPAUSE,	IREXIT2 },
+	[IREXIT2] =	{ IRSHIFT,	IRUPDATE },
+	[IRUPDATE] =	{ IDLE,		DRSELECT },
+};
+
+struct mock {
+	const struct jed_devices *dev;
+	int		xp2;
+	uint64_t	ns;		/* Virtual time */
+	uint64_t	tcks;
+	int		pins;		/* Last byte written */
+	int		tdo;		/* TDO now, and once TCK falls */
+	int		ntdo;
+
+	/* TAP */
+	int		state;
+	int		ir;
+	int		ir_sr;
+	uint64_t	dr_cap;		/* Captured, shifted out LSB first */
+	uint64_t	dr_in;		/* First 64 bits shifted in */
+	unsigned	dr_bits;
+	int		bypass;
+
+	/* Configuration engine */
+	uint32_t	status;
+	uint64_t	busy_until;
+	uint32_t	sed_crc;	/* XP2 */
+	int		xp2_done;
+	uint64_t	bs_win;		/* Last 8 bitstream bytes */
+	int		bs_byte;
+	int		bs_nbits;
+	int		bs_preamble;
+	int		bs_id_seen;
+	uint32_t	bs_id;
+	uint64_t	bs_len;
+
+	/* SPI flash */
+	uint8_t		*flash;
+	int		spi_sr;
+	uint64_t	spi_busy_until;
+	int		spi_cmd;
+	uint32_t	spi_addr;
+	unsigned	spi_len;	/* Bytes in this transaction */
+	int		spi_in;
+	int		spi_nbits;
+	int		spi_out;
+	uint8_t		spi_page[SPI_PAGE_SIZE];
+	unsigned	spi_busy_cmds;	/* Commands sent while busy */
+
+	/* MPSSE personality, see mock_mpsse_write() */
+	unsigned	mp_div;
+	int		mp_tms;		/* Pin states between commands */
+	int		mp_tdi;
+	uint8_t		mp_rx[MPSSE_RX_MAX];	/* TDO not yet read */
+	unsigned	mp_rxlen;
+};
+
+static void
+mock_bs_byte(struct mock *m, int c)
+{
+
+	m->bs_len++;
+	m->bs_win = m->bs_win << 8 | c;
+	if ((m->bs_win & 0xffffffff) == 0xffffbdb3)
+		m->bs_preamble = 1;
+	/* VERIFY_ID(0xE2), 3 bytes of zeros and the IDCODE */
+	if (m->bs_preamble && !m->bs_id_seen &&
+	    (m->bs_win >> 32) == 0xe2000000) {
+		m->bs_id_seen = 1;
+		m->bs_id = m->bs_win;
+	}
+}
+
+static void
+mock_bs_reset(struct mock *m)
+{
+
+	m->bs_win = 0;
+	m->bs_nbits = 0;
+	m->bs_preamble = 0;
+	m->bs_id_seen = 0;
+	m->bs_len = 0;
+}
+
+/*
+ * Done with a bitstream: the FPGA wakes up if it was meant for it.
+ */
+static void
+mock_bs_end(struct mock *m)
+{
+
+	m->status &= ~(MOCK_ST_DONE | MOCK_ST_FAIL | MOCK_ST_ID_ERR);
+	if (m->bs_id_seen && m->bs_id != (uint32_t) m->dev->id)
+		m->status |= MOCK_ST_FAIL | MOCK_ST_ID_ERR;
+	else if (m->bs_preamble)
+		m->status |= MOCK_ST_DONE;
+	else
+		m->status |= MOCK_ST_FAIL;
+}
+
+static void
+mock_spi_byte(struct mock *m, int c)
+{
+	unsigned i = m->spi_len++;
+
+	if (i == 0)
+		m->spi_cmd = c;
+	else if (i < 4)
+		m->spi_addr = m->spi_addr << 8 | c;
+	else if (m->spi_cmd == 0x02)
+		m->spi_page[(m->spi_addr + i - 4) % SPI_PAGE_SIZE] &= c;
+
+	switch (m->spi_cmd) {
+	case 0x05:	/* Read status */
+		m->spi_out = m->spi_sr;
+		if (m->ns < m->spi_busy_until)
+			m->spi_out |= MOCK_SPI_WIP;
+		break;
+	case 0x9f:	/* Read JEDEC ID, a 128 Mbit ISSI part */
+		m->spi_out = i < 3 ? "\x9d\x60\x18"[i] : 0xff;
+		break;
+	case 0x03:	/* Read */
+		if (i >= 3)
+			m->spi_out = m->flash[(m->spi_addr + i - 3) %
+			    MOCK_FLASH_SIZE];
+		break;
+	default:
+		m->spi_out = 0xff;
+	}
+}
+
+/*
+ * LSC_PROG_SPI drives chip select low for as long as the TAP is in
+ * SHIFT-DR, so that each DR scan is one SPI transaction.
+ */
+static void
+mock_spi_start(struct mock *m)
+{
+
+	m->spi_len = 0;
+	m->spi_nbits = 0;
+	m->spi_addr = 0;
+	m->spi_out = 0xff;
+	memset(m->spi_page, 0xff, sizeof(m->spi_page));
+}
+
+/*
+ * Chip select went high: run the command just received.
+ */
+static void
+mock_spi_end(struct mock *m)
+{
+	uint32_t addr = m->spi_addr % MOCK_FLASH_SIZE;
+	uint64_t t = 0;
+	unsigned i, len = 0;
+
+	if (m->spi_len == 0 || m->spi_cmd == 0x05 || m->spi_cmd == 0x9f ||
+	    m->spi_cmd == 0x03)
+		return;
+	if (m->ns < m->spi_busy_until) {
+		m->spi_busy_cmds++;
+		return;
+	}
+	switch (m->spi_cmd) {
+	case 0x06:	/* Write enable */
+		m->spi_sr |= MOCK_SPI_WEL;
+		return;
+	case 0x04:	/* Write disable */
+		m->spi_sr &= ~MOCK_SPI_WEL;
+		return;
+	case 0xd8:	/* 64 KB sector erase */
+		len = SPI_SECTOR_SIZE;
+		t = MOCK_SECTOR_ERASE_NS;
+		break;
+	case 0x20:	/* 4 KB block erase */
+		len = 4096;
+		t = MOCK_BLOCK_ERASE_NS;
+		break;
+	case 0x60:
+	case 0xc7:	/* Chip erase */
+		len = MOCK_FLASH_SIZE;
+		t = MOCK_CHIP_ERASE_NS;
+		break;
+	case 0x02:	/* Page program */
+		t = MOCK_PAGE_PROG_NS;
+		break;
+	default:
+		return;
+	}
+	if (!(m->spi_sr & MOCK_SPI_WEL) ||
+	    (m->spi_len < 4 && m->spi_cmd != 0x60 && m->spi_cmd != 0xc7))
+		return;
+
+	if (len)
+		memset(&m->flash[addr & ~(len - 1)], 0xff, len);
+	else
+		for (i = 0; i < SPI_PAGE_SIZE; i++)
+			m->flash[(addr & ~(SPI_PAGE_SIZE - 1)) + i] &=
+			    m->spi_page[i];
+	m->spi_sr &= ~MOCK_SPI_WEL;
+	m->spi_busy_until = m->ns + t;
+}
+
+/*
+ * LSC_REFRESH: reboot, configuring the FPGA from the SPI flash.
+ */
+static void
+mock_boot(struct mock *m)
+{
+	unsigned i;
+
+	mock_bs_reset(m);
+	for (i = 0; i < 4096 && !m->bs_id_seen; i++)
+		mock_bs_byte(m, m->flash[i]);
+	mock_bs_end(m);
+}
+
+static uint64_t
+mock_capture(struct mock *m)
+{
+	uint32_t st;
+
+	if (m->ir == (m->xp2 ? 0x16 : 0xe0))
+		return ((uint32_t) m->dev->id);
+	if (m->xp2) {
+		switch (m->ir) {
+		case 0x44:	/* SED CRC */
+			return (m->sed_crc);
+		case 0x52:	/* Ready */
+			return (1);
+		case 0xb2:	/* Status */
+			return (m->xp2_done ? 0x02 : 0);
+		}
+		return (0);
+	}
+	switch (m->ir) {
+	case 0x3c:	/* LSC_READ_STATUS */
+		st = m->status;
+		if (m->ns < m->busy_until)
+			st |= MOCK_ST_BUSY;
+		return (st);
+	}
+	return (0);
+}
+
+static void
+mock_dr_shift(struct mock *m, int tdi)
+{
 
+	if (m->dr_bits < 64)
+		m->dr_in |= (uint64_t) tdi << m->dr_bits;
+	m->dr_bits++;
+
+	if (m->xp2)
+		return;
+	if (m->ir == 0x3a) {
+		m->spi_in = (m->spi_in << 1 | tdi) & 0xff;
+		if (++m->spi_nbits == 8) {
+			mock_spi_byte(m, m->spi_in);
+			m->spi_nbits = 0;
+		}
+	} else if (m->ir == 0x7a && (m->status & MOCK_ST_ISC)) {
+		/* LSC_BITSTREAM_BURST, MSB first */
+		m->bs_byte = (m->bs_byte << 1 | tdi) & 0xff;
+		if (++m->bs_nbits == 8) {
+			mock_bs_byte(m, m->bs_byte);
+			m->bs_nbits = 0;
+		}
+	}
+}
 
 static void
-set_tms_tdi(int tms, int tdi)
+mock_dr_update(struct mock *m)
 {
-	int val = 0;
 
-	if (cable_hw != CABLE_HW_PPI) {
-		if (tms)
-			val |= JTAG_TMS;
-		if (tdi)
-			val |= JTAG_TDI;
-		txbuf[txpos++] = val;
-		txbuf[txpos++] = val | JTAG_TCK;
-	} else { /* PPI */
-		if (tms)
-			val |= PPI_TMS;
-		if (tdi)
-			val |= PPI_TDI;
-		txbuf[txpos++] = val;
-		txbuf[txpos++] = val | PPI_TCK;
-	}
-
-	if (txpos > sizeof(txbuf)) {
-		fprintf(stderr, "txbuf overflow\n");
-		if (cable_hw == CABLE_HW_USB)
-			shutdown_usb();
-		exit(EXIT_FAILURE);
+	if (m->xp2) {
+		if (m->ir == 0x45)
+			m->sed_crc = m->dr_in;
+		return;
+	}
+	switch (m->ir) {
+	case 0xc6:	/* ISC_ENABLE */
+		m->status |= MOCK_ST_ISC;
+		break;
+	case 0x0e:	/* ISC_ERASE */
+		if (!(m->status & MOCK_ST_ISC))
+			break;
+		m->status &= ~(MOCK_ST_DONE | MOCK_ST_FAIL | MOCK_ST_ID_ERR);
+		m->busy_until = m->ns + MOCK_SRAM_ERASE_NS;
+		break;
+	case 0x79:	/* LSC_REFRESH */
+		m->status &= ~MOCK_ST_ISC;
+		mock_boot(m);
+		break;
 	}
 }
 
+static void
+mock_ir_update(struct mock *m)
+{
 
-static int
-send_generic(unsigned bits, char *tdi, char *tdo, char *mask)
+	if (m->xp2) {
+		if (m->ir == 0x03)	/* Erase */
+			m->xp2_done = 0;
+		else if (m->ir == 0x2f)	/* Program DONE */
+			m->xp2_done = 1;
+		return;
+	}
+	switch (m->ir) {
+	case 0x46:	/* LSC_INIT_ADDRESS */
+		mock_bs_reset(m);
+		break;
+	case 0x26:	/* ISC_DISABLE */
+		if (!(m->status & MOCK_ST_ISC))
+			break;
+		m->status &= ~MOCK_ST_ISC;
+		mock_bs_end(m);
+		break;
+	}
+}
+
+static void
+mock_tck(struct mock *m, int tms, int tdi)
 {
-	int res, bitpos, tdomask, tdoval, maskval, val = 0, txval = 0;
-	unsigned i, rxpos, rxlen;
+	int old = m->state;
+	int done = m->xp2 ? m->xp2_done : (m->status & MOCK_ST_DONE) != 0;
 
-	if (cable_hw != CABLE_HW_PPI)
-		tdomask = JTAG_TDO;
+	m->tcks++;
+	switch (old) {
+	case DRCAPTURE:
+		m->dr_cap = mock_capture(m);
+		m->dr_in = 0;
+		m->dr_bits = 0;
+		m->bypass = 0;
+		break;
+	case DRSHIFT:
+		mock_dr_shift(m, tdi);
+		m->bypass = tdi;
+		break;
+	case IRCAPTURE:
+		m->ir_sr = 0x01 | (done ? 0x04 : 0);
+		break;
+	case IRSHIFT:
+		m->ir_sr = (m->ir_sr >> 1) | tdi << 7;
+		break;
+	}
+
+	m->state = mock_tap_next[old][tms != 0];
+	if (m->ir == 0x3a && !m->xp2 && (old == DRSHIFT) !=
+	    (m->state == DRSHIFT)) {
+		if (old == DRSHIFT)
+			mock_spi_end(m);
+		else
+			mock_spi_start(m);
+	}
+	if (m->state == DRUPDATE)
+		mock_dr_update(m);
+	if (m->state == IRUPDATE) {
+		m->ir = m->ir_sr & 0xff;
+		mock_ir_update(m);
+	}
+	if (m->state == RESET)
+		m->ir = m->xp2 ? 0x16 : 0xe0;
+
+	/* What goes out on TDO once TCK falls */
+	if (m->state == IRSHIFT)
+		m->ntdo = m->ir_sr & 1;
+	else if (m->state != DRSHIFT)
+		m->ntdo = 0;
+	else if (m->ir == 0x3a && !m->xp2)
+		m->ntdo = (m->spi_out >> (7 - m->spi_nbits)) & 1;
+	else if (m->ir == 0xff)		/* BYPASS */
+		m->ntdo = m->bypass;
 	else
-		tdomask = PPI_TDO;
+		m->ntdo = m->dr_bits < 64 ? (m->dr_cap >> m->dr_bits) & 1 : 0;
+}
 
-	i = strlen(tdi);
-	if (i != (bits + 3) / 4) {
-		fprintf(stderr, "send_generic(): bitcount and tdi "
-		    "data length do not match\n");
-		return (EXIT_FAILURE);
+static int
+setup_mock(struct jtag_ctx *ctx)
+{
+	const struct jed_devices *dev;
+	struct mock *m;
+
+	for (ctx->hmp = cable_hw_map; ctx->hmp->cable_hw != CABLE_MOCK;
+	    ctx->hmp++) {
 	}
-	if (tdo != NULL && strlen(tdo) != i) {
-		if (mask != NULL && strlen(mask) != i) {
-			fprintf(stderr, "send_generic(): tdi, tdo and mask "
-			    "must be of same length\n");
-			return (EXIT_FAILURE);
+	for (dev = jed_devices; dev->name != NULL; dev++)
+		if (strcasecmp(dev->name, mock_name) == 0)
+			break;
+	if (dev->name == NULL) {
+		fprintf(stderr, "%s: unknown device, try one of:", mock_name);
+		for (dev = jed_devices; dev->name != NULL; dev++)
+			fprintf(stderr, " %s", dev->name);
+		fprintf(stderr, "\n");
+		return (EINVAL);
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return (ENOMEM);
+	m->flash = malloc(MOCK_FLASH_SIZE);
+	if (m->flash == NULL) {
+		free(m);
+		return (ENOMEM);
+	}
+	memset(m->flash, 0xff, MOCK_FLASH_SIZE);
+	m->dev = dev;
+	m->xp2 = strncmp(dev->name, "LFXP2", 5) == 0;
+	m->state = RESET;
+	m->ir = m->xp2 ? 0x16 : 0xe0;
+	ctx->mock = m;
+
+	/* Behind an FT2232H, as on the ECP5 evaluation board */
+	if (mock_mpsse) {
+		for (ctx->hmp = cable_hw_map;
+		    ctx->hmp->cable_hw != CABLE_UNKNOWN && !ctx->hmp->mpsse;
+		    ctx->hmp++) {
 		}
-		fprintf(stderr, "send_generic(): tdi and tdo "
-		    "must be of same length\n");
-		return (EXIT_FAILURE);
+		return (mpsse_setup(ctx));
 	}
+	return (0);
+}
 
-	if (cur_s == DRPAUSE || cur_s == IRPAUSE ) {
-		/* Move from *PAUSE to *EXIT2 state */
-		set_tms_tdi(1, 0);
+static int
+shutdown_mock(struct jtag_ctx *ctx)
+{
+	struct mock *m = ctx->mock;
+
+	if (global_debug)
+		fprintf(stderr, "mock %s: %llu TCKs, %.3f s, status %08x, "
+		    "%llu bitstream bytes, %u SPI commands while busy\n",
+		    m->dev->name, (unsigned long long) m->tcks, m->ns / 1e9,
+		    m->status, (unsigned long long) m->bs_len,
+		    m->spi_busy_cmds);
+	free(m->flash);
+	free(m);
+	ctx->mock = NULL;
+	return (0);
+}
+
+static int
+commit_mock(struct jtag_ctx *ctx)
+{
+	struct mock *m = ctx->mock;
+	unsigned i;
+	int c, smp;
+
+	for (i = 0; i < ctx->txpos; i++) {
+		c = ctx->txbuf[i];
+		smp = (m->pins & ~JTAG_TDO) | (m->tdo ? JTAG_TDO : 0);
+		if (!(m->pins & JTAG_TCK) && (c & JTAG_TCK))
+			mock_tck(m, c & JTAG_TMS, c & JTAG_TDI ? 1 : 0);
+		else if ((m->pins & JTAG_TCK) && !(c & JTAG_TCK))
+			m->tdo = m->ntdo;
+		m->pins = c;
+		m->ns += MOCK_NS_PER_BYTE;
+		if (ctx->port_mode == PORT_MODE_SYNC)
+			ctx->txbuf[i] = smp;
+	}
+
+	ctx->txpos = 0;
+	return (0);
+}
+
+/* One TCK with the MPSSE engine, returning TDO as of its rising edge */
+static int
+mock_mpsse_tck(struct mock *m, int tms, int tdi)
+{
+	int tdo = m->tdo;
+
+	mock_tck(m, tms, tdi);
+	m->tdo = m->ntdo;
+	m->ns += (m->mp_div + 1) * 100ULL / 3;
+	return (tdo);
+}
+
+static int
+mock_mpsse_rx(struct mock *m, int c)
+{
+
+	if (m->mp_rxlen == sizeof(m->mp_rx)) {
+		fprintf(stderr, "mock: MPSSE read buffer overrun\n");
+		return (-1);
+	}
+	m->mp_rx[m->mp_rxlen++] = c;
+	return (0);
+}
+
+/*
+ * The MPSSE personality: run the commands mpsse_flush() sends, the way
+ * an FT2232H would, queueing TDO for mock_mpsse_read().  Bytes are
+ * shifted LSB first, while bit and TMS commands shift TDO in from the
+ * MSB end.
+ */
+static int
+mock_mpsse_write(struct jtag_ctx *ctx, const uint8_t *buf, unsigned len)
+{
+	struct mock *m = ctx->mock;
+	const uint8_t *cp = buf, *end = buf + len;
+	unsigned i, n;
+	int op = 0, c, b, tdo;
+
+	while (cp < end) {
+		op = *cp++;
+		switch (op) {
+		case MPSSE_WR_BYTES:
+		case MPSSE_RW_BYTES:
+			n = (cp[0] | cp[1] << 8) + 1;
+			cp += 2;
+			for (i = 0; i < n; i++) {
+				c = *cp++;
+				for (tdo = 0, b = 0; b < 8; b++)
+					tdo |= mock_mpsse_tck(m, m->mp_tms,
+					    (c >> b) & 1) << b;
+				m->mp_tdi = c >> 7;
+				if (op == MPSSE_RW_BYTES &&
+				    mock_mpsse_rx(m, tdo))
+					return (-1);
+			}
+			break;
+
+		case MPSSE_WR_BITS:
+		case MPSSE_RW_BITS:
+		case MPSSE_WR_TMS:
+		case MPSSE_RW_TMS:
+			n = cp[0] + 1;
+			c = cp[1];
+			cp += 2;
+			if (n > 8 || ((op == MPSSE_WR_TMS ||
+			    op == MPSSE_RW_TMS) && n > 7))
+				goto bad;
+			if (op == MPSSE_WR_TMS || op == MPSSE_RW_TMS)
+				m->mp_tdi = c >> 7;
+			for (tdo = 0, b = 0; b < (int) n; b++) {
+				if (op == MPSSE_WR_TMS || op == MPSSE_RW_TMS)
+					m->mp_tms = (c >> b) & 1;
+				else
+					m->mp_tdi = (c >> b) & 1;
+				tdo = tdo >> 1 |
+				    mock_mpsse_tck(m, m->mp_tms, m->mp_tdi) << 7;
+			}
+			if ((op == MPSSE_RW_BITS || op == MPSSE_RW_TMS) &&
+			    mock_mpsse_rx(m, tdo))
+				return (-1);
+			break;
+
+		case MPSSE_CLK_BITS:
+		case MPSSE_CLK_BYTES:
+			if (op == MPSSE_CLK_BITS)
+				n = *cp++ + 1;
+			else {
+				n = ((cp[0] | cp[1] << 8) + 1) * 8;
+				cp += 2;
+			}
+			for (i = 0; i < n; i++)
+				mock_mpsse_tck(m, m->mp_tms, m->mp_tdi);
+			break;
+
+		case MPSSE_SET_LOW:
+			m->mp_tms = (cp[0] & JTAG_TMS) != 0;
+			m->mp_tdi = (cp[0] & JTAG_TDI) != 0;
+			cp += 2;
+			break;
+
+		case MPSSE_TCK_DIVISOR:
+			m->mp_div = cp[0] | cp[1] << 8;
+			cp += 2;
+			break;
+
+		case MPSSE_LOOPBACK_OFF:
+		case MPSSE_SEND_IMMEDIATE:
+		case MPSSE_DIV5_OFF:
+		case MPSSE_3PHASE_OFF:
+		case MPSSE_RTCK_OFF:
+			break;
+
+		default:
+			goto bad;
+		}
 	}
+	if (cp == end)
+		return (len);
+bad:
+	fprintf(stderr, "mock: bad MPSSE command %02x\n", op);
+	return (-1);
+}
+
+/* Time passes on the virtual board only */
+static void
+mock_sleep(struct jtag_ctx *ctx, int ms)
+{
+
+	ctx->mock->ns += ms * 1000000ULL;
+}
+
+static int
+mock_mpsse_read(struct jtag_ctx *ctx, uint8_t *buf, unsigned len)
+{
+	struct mock *m = ctx->mock;
+
+	if (len > m->mp_rxlen)
+		len = m->mp_rxlen;
+	memcpy(buf, m->mp_rx, len);
+	m->mp_rxlen -= len;
+	memmove(m->mp_rx, &m->mp_rx[len], m->mp_rxlen);
+	return (len);
+}
 
-	/* Move from *CAPTURE or *EXIT2 to *SHIFT state */
-	set_tms_tdi(0, 0);
 
-	/* Set up receive index / length */
-	rxpos = txpos + 2;
-	rxlen = bits;
+static int
+cmp_chip_ids(char *got, char *exp)
+{
+	int got_id, exp_id;
+	struct jed_devices *got_jd, *exp_jd;
 
-	for (bitpos = 0; bits > 0; bits--) {
-		if (bitpos == 0) {
-			i--;
-			val = tdi[i];
-			if (val >= '0' && val <= '9')
-				val = val - '0';
-			else if (val >= 'A' && val <= 'F')
-				val = val + 10 - 'A';
-			else {
-				fprintf(stderr, "send_generic():"
-				    "TDI data not in hex format\n");
-				return (EXIT_FAILURE);
-			}
-		}
+	sscanf(got, "%x", &got_id);
+	sscanf(exp, "%x", &exp_id);
 
-		txval = val & 0x1;
-		if (bits > 1)
-			set_tms_tdi(0, txval);
-		else
-			set_tms_tdi(1, txval);
+	for (got_jd = jed_devices; got_jd->name != NULL; got_jd++)
+		if (got_jd->id == got_id)
+			break;
+	for (exp_jd = jed_devices; exp_jd->name != NULL; exp_jd++)
+		if (exp_jd->id == exp_id)
+			break;
 
-		val = val >> 1;
-		bitpos = (bitpos + 1) & 0x3;
-	}
+	if (exp_jd->name == NULL && got_jd->name == NULL)
+		return (EXIT_FAILURE);
 
-	/* Move from *EXIT1 to *PAUSE state */
-	set_tms_tdi(0, txval);
+	fprintf(stderr, "\nFound ");
+	if (got_jd->name)
+		fprintf(stderr, "%s", got_jd->name);
+	else
+		fprintf(stderr, "unknown (%s)", got);
+	fprintf(stderr, " device, but the bitstream is for ");
+	if (exp_jd->name)
+		fprintf(stderr, "%s", exp_jd->name);
+	else
+		fprintf(stderr, "unknown (%s)", exp);
+	fprintf(stderr, ".\n");
+	return (0);
+}
 
-	/* Send / receive data on JTAG port */
-	res = commit(0);
+/*
+ * Bitstream input.  Files are consumed strictly sequentially, so that
+ * stdin ("-"), pipes and FIFOs work the same as regular files, and
+ * programming can begin before the producer has finished writing.
+ */
+enum in_fmt {
+	IN_FMT_UNKNOWN, IN_FMT_BIT, IN_FMT_IMG, IN_FMT_JED, IN_FMT_SVF,
+	IN_FMT_WAVE
+};
 
-	/* Translate received bitstream into hex, apply mask, store in tdi */
-	if (port_mode == PORT_MODE_SYNC) {
-		if (mask != NULL)
-			mask += strlen(tdi);
-		if (tdo != NULL)
-			tdo += strlen(tdi);
-		tdi += strlen(tdi);
-		val = 0;
-		for (i = rxpos, bits = 0; bits < rxlen; i += 2) {
-			val += (((txbuf[i] & tdomask) != 0) << (bits & 0x3));
-			bits++;
-			if ((bits & 0x3) == 0 || bits == rxlen) {
-				if (mask != NULL) {
-					/* Apply mask to received data */
-					mask--;
-					maskval = *mask;
-					if (maskval >= '0' && maskval <= '9')
-						maskval = maskval - '0';
-					else if (maskval >= 'A' &&
-					    maskval <= 'F')
-						maskval = maskval + 10 - 'A';
-					val &= maskval;
-					/* Apply mask to expected TDO as well */
-					if (tdo != NULL) {
-						tdo--;
-						tdoval = *tdo;
-						if (tdoval >= '0' &&
-						    tdoval <= '9')
-							tdoval = tdoval - '0';
-						else if (tdoval >= 'A' &&
-						    tdoval <= 'F')
-							tdoval =
-							    tdoval + 10 - 'A';
-						tdoval &= maskval;
-						if (tdoval < 10)
-							*tdo = tdoval + '0';
-						else
-							*tdo =
-							    tdoval - 10 + 'A';
-					}
-				}
-				tdi--;
-				if (val < 10)
-					*tdi = val + '0';
-				else
-					*tdi = val - 10 + 'A';
-				val = 0;
-			}
-		}
-	}
+static int in_fd = -1;		/* Input file descriptor */
+static long in_size;		/* Input size, -1 if not known in advance */
+static long in_done;		/* Bytes consumed so far */
+static int in_eof;		/* No more data can be read from in_fd */
+static uint8_t in_buf[64 * 1024];
+static int in_rpos, in_wpos;	/* Valid data in in_buf */
+static struct jtag_stats *in_stats; /* Charged for reading */
 
-	return (res);
-}
+#ifdef USE_UNZIP
+/*
+ * Compressed input is inflated by a separate thread, which reads the
+ * original file and feeds the decompressed stream through a pipe, so
+ * that decompression overlaps with JTAG traffic and the uncompressed
+ * data is never fully resident.
+ */
+enum unzip_kind {
+	UNZIP_NONE, UNZIP_GZIP, UNZIP_ZSTD
+};
+
+static int infile_fill(int);
 
+static int unzip_kind;
+static int unzip_fd = -1;	/* Compressed source */
+static uint8_t unzip_pre[64 * 1024]; /* Already buffered compressed data */
+static int unzip_prelen;
+static int unzip_out = -1;	/* Write end of the pipe */
+static long unzip_size;		/* Compressed size, -1 if unknown */
+static volatile long unzip_done; /* Compressed bytes consumed */
+static volatile int unzip_err;
+static pthread_t unzip_thread;
 
 static int
-send_dr(int bits, char *tdi, char *tdo, char *mask)
+unzip_write(uint8_t *buf, int len)
 {
+	uint64_t t0 = trace_fp != NULL ? ns_uptime() : 0;
 	int res;
 
-	if (cur_s != DRPAUSE) {
-		fprintf(stderr, "Must be in DRPAUSE on entry to send_dr()!\n");
-		return (EXIT_FAILURE);
+	while (len > 0) {
+		res = write(unzip_out, buf, len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return (1);	/* Consumer has gone away, not an error */
+		buf += res;
+		len -= res;
 	}
-	res = send_generic(bits, tdi, tdo, mask);
-	cur_s = DRPAUSE;
-	return (res);
+	/* Blocked here means the consumer is the bottleneck */
+	trace_span(TRACE_TID_UNZIP, "pipe_write", t0, ns_uptime(), NULL);
+	return (0);
 }
 
-
 static int
-send_ir(int bits, char *tdi, char *tdo, char *mask)
+unzip_read(uint8_t *buf, int len)
 {
 	int res;
 
-	if (cur_s != IRPAUSE) {
-		fprintf(stderr, "Must be in IRPAUSE on entry to send_ir()!\n");
-		return (EXIT_FAILURE);
+	if (unzip_prelen > 0) {
+		res = unzip_prelen;
+		memcpy(buf, unzip_pre, res);
+		unzip_prelen = 0;
+	} else {
+		do {
+			res = read(unzip_fd, buf, len);
+		} while (res < 0 && errno == EINTR);
 	}
-	res = send_generic(bits, tdi, tdo, mask);
-	cur_s = IRPAUSE;
+	if (res > 0)
+		unzip_done += res;
 	return (res);
 }
 
-
-static int
-commit_usb(void)
+static void *
+unzip_main(void *arg)
 {
-	unsigned txchunklen, i, res;
+	uint8_t ibuf[64 * 1024], obuf[256 * 1024];
+	int len = 0, res = 0, end = 1;
 
-	for (i = 0; i < txpos; i += txchunklen) {
-		txchunklen = txpos - i;
-		if (port_mode == PORT_MODE_SYNC && txchunklen > USB_BUFLEN_SYNC)
-			txchunklen = USB_BUFLEN_SYNC;
-#ifdef WIN32
-		FT_Write(ftHandle, &txbuf[i], txchunklen, (DWORD *) &res);
-#else
-		res = ftdi_write_data(&fc, &txbuf[i], txchunklen);
-#endif
-		if (res != txchunklen) {
-			fprintf(stderr, "ftdi_write_data() failed\n");
-			return (EXIT_FAILURE);
-		}
+	(void) arg;
 
-		if (port_mode == PORT_MODE_SYNC) {
-#ifdef WIN32
-			FT_Read(ftHandle, &txbuf[i], txchunklen,
-			    (DWORD *) &res);
-#else
-			int rep = 0;
-			for (res = 0; res < txchunklen && rep < 8;
-			    rep++) {
-				res += ftdi_read_data(&fc, &txbuf[i],
-				    txchunklen - res);
-			}
-#endif
-			if (res != txchunklen) {
-#ifdef WIN32
-				fprintf(stderr, "FT_Read() failed: "
-				    "expected %d, received %d bytes\n",
-				    txchunklen, res);
-#else
-				fprintf(stderr, "ftdi_read_data() failed\n");
+	trace_thread(TRACE_TID_UNZIP, "unzip");
+	if (unzip_kind == UNZIP_GZIP) {
+#ifdef USE_ZLIB
+		z_stream zs;
+
+		memset(&zs, 0, sizeof(zs));
+		if (inflateInit2(&zs, 15 + 32) != Z_OK)
+			res = -1;
+		while (res == 0 &&
+		    (len = unzip_read(ibuf, sizeof(ibuf))) > 0) {
+			zs.next_in = ibuf;
+			zs.avail_in = len;
+			do {
+				zs.next_out = obuf;
+				zs.avail_out = sizeof(obuf);
+				res = inflate(&zs, Z_NO_FLUSH);
+				end = 0;
+				if (res == Z_STREAM_END) {
+					/* Concatenated gzip members */
+					res = inflateReset(&zs);
+					end = 1;
+				} else if (res == Z_BUF_ERROR)
+					res = Z_OK;
+				if (res != Z_OK) {
+					fprintf(stderr, "\ngzip: %s\n",
+					    zs.msg ? zs.msg : "data error");
+					res = -1;
+					break;
+				}
+				res = unzip_write(obuf,
+				    sizeof(obuf) - zs.avail_out);
+			} while (res == 0 &&
+			    (zs.avail_in > 0 || zs.avail_out == 0));
+		}
+		inflateEnd(&zs);
 #endif
-				return (EXIT_FAILURE);
-			}
+	} else {
+#ifdef USE_ZSTD
+		ZSTD_DStream *zds;
+		ZSTD_inBuffer zin;
+		ZSTD_outBuffer zout;
+		size_t zres;
+
+		zds = ZSTD_createDStream();
+		if (zds == NULL || ZSTD_isError(ZSTD_initDStream(zds)))
+			res = -1;
+		while (res == 0 &&
+		    (len = unzip_read(ibuf, sizeof(ibuf))) > 0) {
+			zin.src = ibuf;
+			zin.size = len;
+			zin.pos = 0;
+			do {
+				zout.dst = obuf;
+				zout.size = sizeof(obuf);
+				zout.pos = 0;
+				zres = ZSTD_decompressStream(zds, &zout, &zin);
+				if (ZSTD_isError(zres)) {
+					fprintf(stderr, "\nzstd: %s\n",
+					    ZSTD_getErrorName(zres));
+					res = -1;
+					break;
+				}
+				/* zres == 0 means a frame has been completed */
+				end = (zres == 0);
+				res = unzip_write(obuf, zout.pos);
+			} while (res == 0 &&
+			    (zin.pos < zin.size || zout.pos == zout.size));
 		}
+		ZSTD_freeDStream(zds);
+#endif
 	}
-	txpos = 0;
 
-	/* Schedule CBUS LED blinking */
-	i = ms_uptime();
-	if (i - last_ledblink_ms >= LED_BLINK_RATE) {
-		last_ledblink_ms += LED_BLINK_RATE;
-		need_led_blink = 1;
+	if (res == 0 && (len < 0 || !end)) {
+		fprintf(stderr, "\nunexpected end of compressed input\n");
+		res = -1;
 	}
-
-	return (0);
+	if (res < 0)
+		unzip_err = 1;
+	close(unzip_out);
+	unzip_out = -1;
+	return (NULL);
 }
 
-
-#ifdef USE_PPI
+/*
+ * If the freshly opened in_fd holds compressed data, move it aside and
+ * substitute in_fd with the read end of a pipe fed by the unzip thread.
+ */
 static int
-commit_ppi(void)
+unzip_start(const char *path)
 {
-	unsigned i, val;
+	uint8_t magic[4];
+	int fds[2];
 
-	for (i = 0; i < txpos; i++) {
-		val = txbuf[i];
-		if (port_mode == PORT_MODE_SYNC && !(i & 1))  {
-			ioctl(ppi, PPIGSTATUS, &txbuf[i]);
-		}
-		ioctl(ppi, PPISDATA, &val);
+	unzip_kind = UNZIP_NONE;
+	unzip_err = 0;
+	unzip_done = 0;
+	if (infile_fill(4) < 4)
+		return (0);
+	memcpy(magic, &in_buf[in_rpos], 4);
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		unzip_kind = UNZIP_GZIP;
+	else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+	    magic[3] == 0xfd)
+		unzip_kind = UNZIP_ZSTD;
+	else
+		return (0);
+
+#ifndef USE_ZLIB
+	if (unzip_kind == UNZIP_GZIP) {
+		fprintf(stderr, "%s: gzip input not supported\n", path);
+		return (EXIT_FAILURE);
 	}
+#endif
+#ifndef USE_ZSTD
+	if (unzip_kind == UNZIP_ZSTD) {
+		fprintf(stderr, "%s: zstd input not supported\n", path);
+		return (EXIT_FAILURE);
+	}
+#endif
 
-	txpos = 0;
+	/* Whatever has been buffered so far goes to the unzip thread */
+	unzip_prelen = in_wpos - in_rpos;
+	memcpy(unzip_pre, &in_buf[in_rpos], unzip_prelen);
+	unzip_size = in_size;
+
+	if (pipe(fds) != 0) {
+		fprintf(stderr, "%s: pipe() failed\n", path);
+		return (EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	unzip_fd = in_fd;
+	unzip_out = fds[1];
+	in_fd = fds[0];
+	in_size = -1;
+	in_eof = 0;
+	in_rpos = in_wpos = 0;
+	if (pthread_create(&unzip_thread, NULL, unzip_main, NULL) != 0) {
+		fprintf(stderr, "%s: pthread_create() failed\n", path);
+		return (EXIT_FAILURE);
+	}
 	return (0);
 }
-#endif
-
 
 static int
-commit(int force)
+unzip_stop(void)
 {
 
-	if (txpos == 0 || (!force && port_mode != PORT_MODE_SYNC &&
-	    txpos < BUFLEN_MAX))
+	if (unzip_kind == UNZIP_NONE)
 		return (0);
+	pthread_join(unzip_thread, NULL);
+	close(unzip_fd);
+	unzip_fd = -1;
+	unzip_kind = UNZIP_NONE;
+	return (unzip_err);
+}
+#endif /* USE_UNZIP */
 
-	if (!quiet && progress_perc < 100) {
-		fprintf(stderr, "\rProgramming: %d%% %c ",
-		    progress_perc, statc[blinker_phase]);
-		fflush(stderr);
-	}
+/*
+ * Take input from an already open descriptor, which infile_close() will
+ * close.  path only serves for format and compression detection.
+ */
+static int
+infile_open_fd(int fd, const char *path)
+{
+	struct stat sb;
 
-#ifdef USE_PPI
-	if (cable_hw == CABLE_HW_PPI)
-		return (commit_ppi());
-#endif
-#ifdef USE_RAW
-	if (cable_hw == CABLE_RAW)
-		return (commit_raw());
-#endif
-	if (cable_hw == CABLE_HW_USB)
-		return (commit_usb());
+	(void) path;
+	in_fd = fd;
+	if (fstat(in_fd, &sb) == 0 && S_ISREG(sb.st_mode))
+		in_size = sb.st_size;
 	else
-		return (EINVAL);
+		in_size = -1;
+	in_done = 0;
+	in_eof = 0;
+	in_rpos = in_wpos = 0;
+#ifdef USE_UNZIP
+	return (unzip_start(path));
+#else
+	return (0);
+#endif
 }
 
-
 static int
-str2tapstate(char *str)
+infile_open(const char *path)
 {
-	int i;
+	int fd;
 
-	for (i = 0; tap_statetable[i].state_str != NULL; i++) {
-		if (strcmp(str, tap_statetable[i].state_str) == 0)
-			break;
+	if (strcmp(path, "-") == 0) {
+		fd = 0;
+#ifdef WIN32
+		_setmode(0, _O_BINARY);
+#endif
+	} else
+		fd = open(path,
+#ifdef WIN32
+		    O_RDONLY | O_BINARY
+#else
+		    O_RDONLY
+#endif
+		);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s) failed\n", path);
+		return (EXIT_FAILURE);
 	}
-	return (tap_statetable[i].state_id);
+	return (infile_open_fd(fd, path));
 }
 
+static int
+infile_close(void)
+{
+	int res = 0;
 
-static void
-set_state(int tgt_s) {
-	int i, res = 0;
-
-	switch (tgt_s) {
-	case RESET:
-		for (i = 0; i < 6; i++)
-			set_tms_tdi(1, 0);
-		break;
-
-	case IDLE:
-		switch (cur_s) {
-		case RESET:
-		case DRUPDATE:
-		case IRUPDATE:
-		case IDLE:
-			set_tms_tdi(0, 0);
-			break;
-
-		case UNDEFINED:
-			set_state(RESET);
-			set_state(IDLE);
-			break;
-
-		case DRPAUSE:
-			set_state(DREXIT2);
-			set_state(DRUPDATE);
-			set_state(IDLE);
-			break;
-
-		case IRPAUSE:
-			set_state(IREXIT2);
-			set_state(IRUPDATE);
-			set_state(IDLE);
-			break;
-
-		default:
-			res = -1;
-		}
-		break;
-
-	case DRSELECT:
-		switch (cur_s) {
-		case IDLE:
-		case DRUPDATE:
-		case IRUPDATE:
-			set_tms_tdi(1, 0);
-			break;
-
-		default:
-			res = -1;
-		}
-		break;
-
-	case DRCAPTURE:
-		switch (cur_s) {
-		case DRSELECT:
-			set_tms_tdi(0, 0);
-			break;
-
-		case IDLE:
-			set_state(DRSELECT);
-			set_state(DRCAPTURE);
-			break;
-
-		case IRPAUSE:
-			set_state(IDLE);
-			set_state(DRSELECT);
-			set_state(DRCAPTURE);
-			break;
-
-		default:
-			res = -1;
-		}
-		break;
+	if (in_fd > 0)
+		close(in_fd);
+	in_fd = -1;
+#ifdef USE_UNZIP
+	res = unzip_stop();
+#endif
+	return (res);
+}
 
-	case DREXIT1:
-		switch (cur_s) {
-		case DRCAPTURE:
-			set_tms_tdi(1, 0);
-			break;
+/*
+ * Attempt to buffer at least len bytes, blocking until they arrive or the
+ * producer closes its end.  Returns the number of bytes buffered.
+ */
+static int
+infile_fill(int len)
+{
+	int res;
 
-		default:
-			res = -1;
-		}
-		break;
+	if (len > (int) sizeof(in_buf))
+		len = sizeof(in_buf);
+	if (in_rpos + len > (int) sizeof(in_buf)) {
+		memmove(in_buf, &in_buf[in_rpos], in_wpos - in_rpos);
+		in_wpos -= in_rpos;
+		in_rpos = 0;
+	}
+	while (in_wpos - in_rpos < len && !in_eof) {
+		stats_enter(in_stats, STAT_READ);
+		res = read(in_fd, &in_buf[in_wpos], sizeof(in_buf) - in_wpos);
+		stats_leave(in_stats);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			in_eof = 1;
+		else
+			in_wpos += res;
+	}
+	return (in_wpos - in_rpos);
+}
 
-	case DRPAUSE:
-		switch (cur_s) {
-		case DREXIT1:
-			set_tms_tdi(0, 0);
-			break;
+/* Look at up to len bytes of input without consuming them */
+static int
+infile_peek(uint8_t **p, int len)
+{
 
-		case IDLE:
-			set_state(DRSELECT);
-			set_state(DRCAPTURE);
-			set_state(DREXIT1);
-			set_state(DRPAUSE);
-			break;
+	len = infile_fill(len) < len ? in_wpos - in_rpos : len;
+	*p = &in_buf[in_rpos];
+	return (len);
+}
 
-		case IRPAUSE:
-			set_state(IREXIT2);
-			set_state(IRUPDATE);
-			set_state(DRSELECT);
-			set_state(DRCAPTURE);
-			set_state(DREXIT1);
-			set_state(DRPAUSE);
-			break;
+static void
+infile_consumed(int len)
+{
 
-		case DRPAUSE:
-			break;
+	in_rpos += len;
+	in_done += len;
+}
 
-		default:
-			res = -1;
-		}
-		break;
+/* Share of the input up to byte pos, 0 if the input size is unknown */
+static double
+in_frac(long pos)
+{
 
-	case DREXIT2:
-		switch (cur_s) {
-		case DRPAUSE:
-			set_tms_tdi(1, 0);
-			break;
+#ifdef USE_UNZIP
+	/* Only the compressed position relates to the size */
+	if (unzip_kind != UNZIP_NONE)
+		return (unzip_size > 0 ? (double) unzip_done / unzip_size : 0);
+#endif
+	return (in_size > 0 ? (double) pos / in_size : 0);
+}
 
-		default:
-			res = -1;
-		}
-		break;
+/*
+ * Read len bytes, blocking until all of them are available.  Returns less
+ * than len only at end of input.
+ */
+static int
+infile_read(void *buf, int len)
+{
+	int got, n;
 
-	case DRUPDATE:
-		switch (cur_s) {
-		case DREXIT2:
-			set_tms_tdi(1, 0);
+	for (got = 0; got < len; got += n) {
+		n = infile_fill(len - got);
+		if (n == 0)
 			break;
+		if (n > len - got)
+			n = len - got;
+		memcpy((char *) buf + got, &in_buf[in_rpos], n);
+		infile_consumed(n);
+	}
+	return (got);
+}
 
-		default:
-			res = -1;
-		}
-		break;
-
-	case IRSELECT:
-		switch (cur_s) {
-		case DRSELECT:
-			set_tms_tdi(1, 0);
-			break;
+/* Read whatever is available, at most len bytes, blocking only if none */
+static int
+infile_read_some(void *buf, int len)
+{
+	int n;
+
+	n = infile_fill(1);
+	if (n > len)
+		n = len;
+	memcpy(buf, &in_buf[in_rpos], n);
+	infile_consumed(n);
+	return (n);
+}
 
-		default:
-			res = -1;
-		}
-		break;
+/* fgets() equivalent for infile */
+static char *
+infile_gets(char *buf, int size)
+{
+	uint8_t *nl;
+	int n, avail;
 
-	case IRCAPTURE:
-		switch (cur_s) {
-		case IRSELECT:
-			set_tms_tdi(0, 0);
+	for (n = 0; n < size - 1;) {
+		avail = infile_fill(1);
+		if (avail == 0)
 			break;
-
-		case IDLE:
-			set_state(DRSELECT);
-			set_state(IRSELECT);
-			set_state(IRCAPTURE);
+		if (avail > size - 1 - n)
+			avail = size - 1 - n;
+		nl = memchr(&in_buf[in_rpos], '\n', avail);
+		if (nl != NULL)
+			avail = nl - &in_buf[in_rpos] + 1;
+		memcpy(&buf[n], &in_buf[in_rpos], avail);
+		infile_consumed(avail);
+		n += avail;
+		if (nl != NULL)
 			break;
+	}
+	if (n == 0)
+		return (NULL);
+	buf[n] = 0;
+	return (buf);
+}
 
-		case DRPAUSE:
-			set_state(DREXIT2);
-			set_state(DRUPDATE);
-			set_state(DRSELECT);
-			set_state(IRSELECT);
-			set_state(IRCAPTURE);
-			break;
+/*
+ * Recognize the input format by looking at its first few kilobytes.  The
+ * ".img" suffix is still honored for flash targets, since such images
+ * are written as they are, without an IDCODE check.
+ */
+static int
+infile_format(const char *path, int target)
+{
+	uint8_t *p;
+	int i, len, text = 1;
 
-		default:
-			res = -1;
-		}
-		break;
+	len = infile_peek(&p, 4096);
 
-	case IREXIT1:
-		switch (cur_s) {
-		case IRCAPTURE:
-			set_tms_tdi(1, 0);
-			break;
+#ifdef USE_RAW
+	if (len >= 4 && memcmp(p, WAVE_MAGIC, 4) == 0)
+		return (IN_FMT_WAVE);
+#endif
 
-		default:
-			res = -1;
-		}
-		break;
+	i = strlen(path) - 4;
+#ifdef USE_UNZIP
+	/* Look past the compression suffix */
+	if (unzip_kind == UNZIP_GZIP && i >= 0 &&
+	    strcasecmp(&path[i + 1], ".gz") == 0)
+		i -= 3;
+	else if (unzip_kind == UNZIP_ZSTD && i >= 0 &&
+	    strcasecmp(&path[i], ".zst") == 0)
+		i -= 4;
+#endif
+	if (target == JED_TGT_FLASH && i >= 0 &&
+	    strcasecmp(&path[i], ".img") == 0)
+		return (IN_FMT_IMG);
+
+	/* ECP5 bitstream preamble and IDCODE markers */
+	for (i = 0; i < len - 32 && i < 2000; i++)
+		if (p[i] == 0xbd && p[i + 1] == 0xb3 && p[i + 10] == 0xe2
+		    && p[i + 11] == 0 && p[i + 12] == 0 && p[i + 13] == 0)
+			return (IN_FMT_BIT);
+
+	/* JEDEC files begin with STX */
+	if (len > 0 && p[0] == 0x02)
+		return (IN_FMT_JED);
+
+	/* Bytes above 0x7f may be UTF-8 in comments, only controls are binary */
+	for (i = 0; i < len; i++)
+		if (p[i] == 0 || p[i] == 0x7f ||
+		    (p[i] < 0x20 && !isspace(p[i])))
+			text = 0;
+	if (text && len > 0) {
+		for (i = 0; i < len - 4; i++)
+			if ((i == 0 || p[i - 1] == '\n') &&
+			    (strncmp((char *) &p[i], "QF", 2) == 0 ||
+			    strncmp((char *) &p[i], "NOTE", 4) == 0))
+				return (IN_FMT_JED);
+		return (IN_FMT_SVF);
+	}
 
-	case IRPAUSE:
-		switch (cur_s) {
-		case IREXIT1:
-			set_tms_tdi(0, 0);
-			break;
+	if (target == JED_TGT_FLASH && len > 0)
+		return (IN_FMT_IMG);
+	return (IN_FMT_UNKNOWN);
+}
 
-		case IDLE:
-			set_state(DRSELECT);
-			set_state(IRSELECT);
-			set_state(IRCAPTURE);
-			set_state(IREXIT1);
-			set_state(IRPAUSE);
-			break;
 
-		case DRPAUSE:
-			set_state(DREXIT2);
-			set_state(DRUPDATE);
-			set_state(DRSELECT);
-			set_state(IRSELECT);
-			set_state(IRCAPTURE);
-			set_state(IREXIT1);
-			set_state(IRPAUSE);
-			break;
+/*
+ * SVF command stream executor.  Text is fed in arbitrary chunks, which
+ * are split into lines and pre-parsed into complete commands.  Partial
+ * lines are carried over to the next chunk.
+ */
+static void
+svf_reset(struct jtag_ctx *ctx)
+{
 
-		case IRPAUSE:
+	ctx->svf_lno = 0;
+	ctx->svf_cmd_complete = 0;
+	ctx->svf_parentheses_open = 0;
+	ctx->svf_len = 0;
+	ctx->svf_carry_len = 0;
+}
+
+static int
+exec_svf_line(struct jtag_ctx *ctx, char *linebuf, int debug)
+{
+	int tokc, res, len;
+	unsigned size;
+	char *cp, *c1, *buf;
+	char *sep = " \t\n\r";
+	char *item, *brkt, *cmd;
+	char *tokv[256];
+	char args[48];
+	uint64_t t0;
+
+	ctx->svf_lno++;
+	if (debug)
+		printf("%d: %s\n", ctx->svf_lno, linebuf);
+
+	/* Pre-parse input, join multiple lines to a single command */
+	for (item = strtok_r(linebuf, sep, &brkt); item;
+	    item = strtok_r(NULL, sep, &brkt)) {
+		/* Skip comments */
+		if (item[0] == '!')
+			break;
+		if (item[0] == '/' && item[1] == '/')
 			break;
 
-		default:
-			res = -1;
+		/* If command is complete we shouldn't end up here! */
+		if (ctx->svf_cmd_complete) {
+			fprintf(stderr, "Line %d: multiple commands "
+			    "on single line\n", ctx->svf_lno);
+			return (EXIT_FAILURE);
 		}
-		break;
-
-	case IREXIT2:
-		switch (cur_s) {
-		case IRPAUSE:
-			set_tms_tdi(1, 0);
-			break;
 
-		default:
-			res = -1;
+		/* End of command? */
+		c1 = item + strlen(item) - 1;
+		if (*c1 == ';') {
+			*c1-- = 0;
+			ctx->svf_cmd_complete = 1;
 		}
-		break;
 
-	case IRUPDATE:
-		switch (cur_s) {
-		case IREXIT2:
-			set_tms_tdi(1, 0);
-			break;
+		/* Check for parentheses */
+		if (*item == '(') {
+			item++;
+			if (ctx->svf_parentheses_open) {
+				fprintf(stderr,
+				    "Line %d: too many '('s\n", ctx->svf_lno);
+				return (EXIT_FAILURE);
+			}
+			ctx->svf_parentheses_open = 1;
+		}
+		if (!ctx->svf_parentheses_open)
+			for (char *ct = item; ct < c1; ct++)
+				if (*ct == '(') {
+					*ct = ' ';
+					ctx->svf_parentheses_open = 1;
+					break;
+				}
+		if (*c1 == ')') {
+			*c1 = 0;
+			if (!ctx->svf_parentheses_open) {
+				fprintf(stderr,
+				    "Line %d: too many ')'s\n", ctx->svf_lno);
+				return (EXIT_FAILURE);
+			}
+			ctx->svf_parentheses_open = 0;
+		}
 
-		default:
-			res = -1;
+		/* Copy to command buffer */
+		len = strlen(item);
+		if (ctx->svf_len + len + 2 > ctx->svfsize) {
+			size = ctx->svf_len + len + 64 * 1024;
+			buf = realloc(ctx->svfbuf, size);
+			if (buf == NULL) {
+				fprintf(stderr, "malloc(%u) failed\n", size);
+				return (EXIT_FAILURE);
+			}
+			ctx->svfbuf = buf;
+			ctx->svfsize = size;
 		}
-		break;
+		memcpy(&ctx->svfbuf[ctx->svf_len], item, len);
+		ctx->svf_len += len;
+		if (!ctx->svf_parentheses_open && !ctx->svf_cmd_complete)
+			ctx->svfbuf[ctx->svf_len++] = ' ';
+		ctx->svfbuf[ctx->svf_len] = 0;
+	}
 
-	default:
-		res = -1;
+	/* Proceed to next line if command is not complete yet */
+	if (!ctx->svf_cmd_complete)
+		return (0);
+
+	/* Unmatched parentheses are not permitted */
+	if (ctx->svf_parentheses_open) {
+		fprintf(stderr, "Line %d: missing ')'\n", ctx->svf_lno);
+		return (EXIT_FAILURE);
 	}
 
+	/* Normalize to all upper case letters, separate tokens */
+	tokc = 0;
+	tokv[0] = ctx->svfbuf;
+	for (cp = ctx->svfbuf; *cp != 0; cp++) {
+		if (*cp == ' ') {
+			*cp++ = 0;
+			tokc++;
+			tokv[tokc] = cp;
+		}
+		*cp = toupper(*cp);
+	}
+	if (*tokv[tokc] != 0)
+		tokc++;
+
+	/* Execute command */
+	t0 = trace_fp != NULL ? ns_uptime() : 0;
+	cmd = tokv[0];
+	if (cmd[strspn(cmd, "ABCDEFGHIJKLMNOPQRSTUVWXYZ")] != 0)
+		cmd = "?";	/* Not to be quoted in JSON */
+	res = exec_svf_tokenized(ctx, tokc, tokv);
+	if (trace_fp != NULL) {
+		if (tokc > 1 && (strcmp(cmd, "SDR") == 0 ||
+		    strcmp(cmd, "SIR") == 0))
+			snprintf(args, sizeof(args),
+			    "{\"line\": %d, \"bits\": %d}", ctx->svf_lno,
+			    atoi(tokv[1]));
+		else
+			snprintf(args, sizeof(args), "{\"line\": %d}",
+			    ctx->svf_lno);
+		trace_span(ctx->stats.tid, cmd, t0, ns_uptime(), args);
+	}
 	if (res) {
-		fprintf(stderr, "Don't know how to proceed: %s -> %s\n",
-		    STATE2STR(cur_s), STATE2STR(tgt_s));
-		if (cable_hw == CABLE_HW_USB)
-			shutdown_usb();
-		exit(EXIT_FAILURE);
+		if (res != ENODEV)
+			fprintf(stderr, "Line %d: %s\n", ctx->svf_lno,
+			    strerror(res));
+		return (res);
 	}
 
-	cur_s = tgt_s;
+	ctx->svf_len = 0;
+	ctx->svf_cmd_complete = 0;
+	return (0);
 }
 
-
 static int
-exec_svf_tokenized(int tokc, char *tokv[])
+svf_carry_add(struct jtag_ctx *ctx, const char *p, int len)
 {
-	static int last_sdr = PORT_MODE_UNKNOWN;
-	int cmd, i, res = 0;
-	int repeat = 1, delay_ms = 0;
 
-	for (i = 0; svf_cmdtable[i].cmd_str != NULL; i++) {
-		if (strcmp(tokv[0], svf_cmdtable[i].cmd_str) == 0)
-			break;
+	if (ctx->svf_carry_len + len + 1 > ctx->svf_carry_size) {
+		ctx->svf_carry_size = ctx->svf_carry_len + len + 1024;
+		ctx->svf_carry = realloc(ctx->svf_carry, ctx->svf_carry_size);
+		if (ctx->svf_carry == NULL) {
+			fprintf(stderr, "malloc(%d) failed\n",
+			    ctx->svf_carry_size);
+			return (EXIT_FAILURE);
+		}
 	}
+	memcpy(&ctx->svf_carry[ctx->svf_carry_len], p, len);
+	ctx->svf_carry_len += len;
+	ctx->svf_carry[ctx->svf_carry_len] = 0;
+	return (0);
+}
 
-	cmd = svf_cmdtable[i].cmd_id;
-	switch (cmd) {
-	case SVF_SDR:
-	case SVF_SIR:
-		if (tokc == 4) {
-			if (cmd == SVF_SDR && last_sdr == PORT_MODE_ASYNC)
-				set_port_mode(PORT_MODE_ASYNC);
-			tokv[5] = NULL;
-			tokv[7] = NULL;
-			if (cmd == SVF_SDR)
-				last_sdr = PORT_MODE_ASYNC;
-		} else if (tokc == 6 || tokc == 8) {
-			set_port_mode(PORT_MODE_SYNC);
-			if (tokc == 5)
-				tokv[7] = NULL;
-			if (cmd == SVF_SDR)
-				last_sdr = PORT_MODE_SYNC;
-		} else {
-			res = EXIT_FAILURE;
-			break;
-		}
-		if (cmd == SVF_SDR) {
-			set_state(DRPAUSE);
-			res = send_dr(atoi(tokv[1]), tokv[3], tokv[5], tokv[7]);
-		} else {
-			set_state(IRPAUSE);
-			res = send_ir(atoi(tokv[1]), tokv[3], tokv[5], tokv[7]);
-		}
-		if (res)
+/*
+ * Execute a chunk of SVF text.  The buffer is modified in place.  With
+ * final set, any unterminated last line is executed as well.
+ */
+static int
+exec_svf_text(struct jtag_ctx *ctx, char *buf, int len, int debug, int final)
+{
+	char *end = buf + len;
+	char *nl;
+	int res = 0;
+
+	stats_enter(&ctx->stats, STAT_PARSE);
+	while (res == 0 && buf < end) {
+		nl = memchr(buf, '\n', end - buf);
+		if (nl == NULL) {
+			/* Keep the partial line for the next chunk */
+			res = svf_carry_add(ctx, buf, end - buf);
 			break;
-		if (cable_hw == CABLE_RAW)
-			break; /* Ignore non-existing TDO response */
-		if ((tokc == 6 || tokc == 8) && strcmp(tokv[3], tokv[5]) != 0) {
-			if (strlen(tokv[3]) == 8 && strlen(tokv[5]) == 8 &&
-			    strcmp(tokv[7], "FFFFFFFF") == 0 &&
-			    cmp_chip_ids(tokv[3], tokv[5]) == 0)
-				return (ENODEV);
-			fprintf(stderr, "Received and expected data "
-			    "do not match!\n");
-			if (tokc == 6)
-				fprintf(stderr, "TDO: %s Expected: %s\n",
-				    tokv[3], tokv[5]);
-			if (tokc == 8)
-				fprintf(stderr, "TDO: %s Expected: %s "
-				    "mask: %s\n", tokv[3], tokv[5], tokv[7]);
-			res = EXIT_FAILURE;
 		}
-		break;
-
-	case SVF_STATE:
-		set_state(str2tapstate(tokv[1]));
-		res = commit(0);
-		break;
+		*nl = 0;
+		if (ctx->svf_input)
+			ctx->progress = in_frac(in_done - (end - nl));
+		if (ctx->svf_carry_len) {
+			res = svf_carry_add(ctx, buf, nl - buf);
+			ctx->svf_carry_len = 0;
+			if (res == 0)
+				res = exec_svf_line(ctx, ctx->svf_carry, debug);
+		} else
+			res = exec_svf_line(ctx, buf, debug);
+		buf = nl + 1;
+	}
 
-	case SVF_RUNTEST:
-		if (isnumber(tokv[1][0])) {
-			i = 1;
-			set_state(IDLE);
-		} else {
-			set_state(str2tapstate(tokv[1]));
-			i = 2;
-		}
-		for (; i < tokc; i += 2) {
-			if (strcmp(tokv[i + 1], "TCK") == 0) {
-				repeat = atoi(tokv[i]);
-				if (repeat < 1 || repeat > 100000) {
-					fprintf(stderr,
-					    "Unexpected token: %s\n",
-					    tokv[i]);
-					res = EXIT_FAILURE;
-					break;
-				}
-			} else if (strcmp(tokv[i + 1], "SEC") == 0) {
-				float f;
-				sscanf(tokv[i], "%f", &f);
-				delay_ms = (f + 0.0005) * 1000;
-				if (delay_ms < 1 || delay_ms > 120000) {
-					fprintf(stderr,
-					    "Unexpected token: %s\n",
-					    tokv[i]);
-					res = EXIT_FAILURE;
-					break;
-				}
-				/* Silently reduce insanely long waits */
-				if (delay_ms > 3000)
-					delay_ms = 3000;
-			} else {
-				fprintf(stderr, "Unexpected token: %s\n",
-				    tokv[i + 1]);
-				res = EXIT_FAILURE;
-				break;
-			}
-		}
-		i = delay_ms * (USB_BAUDS / 2000);
-#ifdef USE_PPI
-		/* libftdi is relatively slow in sync mode on FreeBSD */
-		if (port_mode == PORT_MODE_SYNC && i > USB_BUFLEN_SYNC / 2)
-			i /= 2;
-#endif
-		if (i > repeat)
-			repeat = i;
-		for (i = 0; i < repeat; i++) {
-			txbuf[txpos++] = 0;
-			txbuf[txpos++] = JTAG_TCK;
-			if (txpos >= sizeof(txbuf) / 2) {
-				commit(0);
-				if (need_led_blink)
-					set_port_mode(port_mode);
-			}
+	if (res == 0 && final) {
+		if (ctx->svf_carry_len) {
+			ctx->svf_carry_len = 0;
+			res = exec_svf_line(ctx, ctx->svf_carry, debug);
 		}
-		break;
+		/* Flush any buffered data */
+		commit(ctx, 1);
+	}
 
-	case SVF_HDR:
-	case SVF_HIR:
-	case SVF_TDR:
-	case SVF_TIR:
-		if (tokc != 2 || strcmp(tokv[1], "0") != 0)
-			res = EINVAL;
-		break;
+	stats_leave(&ctx->stats);
+	return (res);
+}
 
-	case SVF_ENDDR:
-		if (tokc != 2 ||
-		    (strcmp(tokv[1], "DRPAUSE") != 0 &&
-		    strcmp(tokv[1], "IDLE") != 0))
-			res = EINVAL;
-		break;
 
-	case SVF_ENDIR:
-		if (tokc != 2 ||
-		    (strcmp(tokv[1], "IRPAUSE") != 0 &&
-		    strcmp(tokv[1], "IDLE") != 0))
-			res = EINVAL;
-		break;
+/*
+ * SVF text generated from bitstreams is accumulated in svfo_buf and
+ * handed over in chunks, either to the SVF output file (-s) or to
+ * exec_svf_text(), so that memory use doesn't depend on bitstream size.
+ */
+#define	SVFO_BUFLEN	(256 * 1024)
+#define	SVFO_MAXLINE	(32 * 1024)	/* Longest single svf_printf() */
 
-	case SVF_FREQUENCY:
-	case SVF_TRST:
-		/* Silently ignored. */
-		break;
+#define	bitrev(a) ((a & 0x1)  << 7) | ((a & 0x2)  << 5) | ((a & 0x4)  << 3) | ((a & 0x8)  << 1) | ((a & 0x10) >> 1) | ((a & 0x20) >> 3) | ((a & 0x40) >> 5) | ((a & 0x80) >> 7)
 
-	default:
-		res = EOPNOTSUPP;
+static char svfo_hexrev[256][2];	/* Bit reversed byte to hex digits */
+
+static int
+svfo_open(struct jtag_ctx *ctx, int debug)
+{
+	int i, c;
+
+	if (ctx->svfo_buf == NULL)
+		ctx->svfo_buf = malloc(SVFO_BUFLEN);
+	if (ctx->svfo_buf == NULL) {
+		fprintf(stderr, "malloc(%d) failed\n", SVFO_BUFLEN);
+		return (EXIT_FAILURE);
 	}
+	if (svfo_hexrev[0][0] == 0)
+		for (i = 0; i < 256; i++) {
+			c = bitrev(i);
+			svfo_hexrev[i][0] = hexdigits[c >> 4];
+			svfo_hexrev[i][1] = hexdigits[c & 0xf];
+		}
+	ctx->svfo_len = 0;
+	ctx->svfo_res = 0;
+	ctx->svfo_debug = debug;
+	ctx->svfo_fd = -1;
+	svf_reset(ctx);
 
-	return (res);
+	if (svf_name == NULL)
+		return (0);
+	if (strcmp(svf_name, "-") == 0)
+		ctx->svfo_fd = 1;
+	else
+		ctx->svfo_fd = open(svf_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (ctx->svfo_fd < 0)
+		return (errno);
+	return (0);
 }
 
+static void
+svfo_flush(struct jtag_ctx *ctx, int final)
+{
+	int i, res;
 
-enum jed_states {
-	JED_INIT, JED_PACK_KNOWN, JED_SIZE_KNOWN, JED_PROG_INITIATED,
-	JED_FUSES, JED_FUSES_DONE, JED_SED_CRC, JED_HAVE_SED_CRC, JED_USER_SIG
-};
+	if (ctx->svfo_res == 0 && ctx->svfo_fd >= 0) {
+		for (i = 0; i < ctx->svfo_len; i += res) {
+			res = write(ctx->svfo_fd, &ctx->svfo_buf[i],
+			    ctx->svfo_len - i);
+			if (res < 0 && errno == EINTR)
+				res = 0;
+			else if (res <= 0) {
+				ctx->svfo_res = errno ? errno : EIO;
+				break;
+			}
+		}
+	} else if (ctx->svfo_res == 0)
+		ctx->svfo_res = exec_svf_text(ctx, ctx->svfo_buf, ctx->svfo_len,
+		    ctx->svfo_debug,
+		    final);
+	ctx->svfo_len = 0;
+}
 
-enum jed_target {
-	JED_TGT_SRAM, JED_TGT_FLASH, JED_TGT_UNKNOWN
-};
+static void
+svf_printf(struct jtag_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	ctx->svfo_len += vsnprintf(&ctx->svfo_buf[ctx->svfo_len],
+	    SVFO_BUFLEN - ctx->svfo_len,
+	    fmt, ap);
+	va_end(ap);
+	if (ctx->svfo_len > SVFO_BUFLEN - SVFO_MAXLINE)
+		svfo_flush(ctx, 0);
+}
 
-static struct jed_devices {
-	char	*name;
-	int	id;
-	int	fuses;
-	int	col_width;
-	int	row_width;
-} jed_devices[] = {
-	{
-		.name =		"LFXP2-5E",
-		.id =		0x01299043,
-		.fuses =	1236476,
-		.col_width =	638,
-		.row_width =	1938,
-	},
-	{
-		.name =		"LFXP2-8E",
-		.id =		0x0129A043,
-		.fuses =	1954736,
-		.col_width =	772,
-		.row_width=	2532,
-	},
-	{
-		.name =		"LFXP2-17E",
-		.id =		0x0129B043,
-		.fuses =	3627704,
-		.col_width =	2188,
-		.row_width =	1658,
-	},
-	{
-		.name =		"LFXP2-30E",
-		.id =		0x0129D043,
-		.fuses =	5954320,
-		.col_width =	2644,
-		.row_width =	2532,
-	},
-	{
-		.name =		"LFXP2-40E",
-		.id =		0x0129E043,
-		.fuses =	8304368,
-		.col_width =	3384,
-		.row_width =	2454,
-	},
-	{
-		.name =		"LFE5U-12F",
-		.id =		0x21111043,
-		.fuses =	5681848,
-		.col_width =	592,
-		.row_width =	7562,
-	},
-	{
-		.name =		"LFE5U-25F",
-		.id =		0x41111043,
-		.fuses =	5681848,
-		.col_width =	592,
-		.row_width =	7562,
-	},
-	{
-		.name =		"LFE5U-45F",
-		.id =		0x41112043,
-		.fuses =	10208312,
-		.col_width =	848,
-		.row_width =	9470,
-	},
-	{
-		.name =		"LFE5U-85F",
-		.id =		0x41113043,
-		.fuses =	19244856,
-		.col_width =	1136,
-		.row_width =	13294,
-	},
-	{
-		.name =		"LFE5UM-25F",
-		.id =		0x01111043,
-		.fuses =	5681848,
-		.col_width =	592,
-		.row_width =	7562,
-	},
-	{
-		.name =		"LFE5UM-45F",
-		.id =		0x01112043,
-		.fuses =	10208312,
-		.col_width =	848,
-		.row_width =	9470,
-	},
-	{
-		.name =		"LFE5UM-85F",
-		.id =		0x01113043,
-		.fuses =	19244856,
-		.col_width =	1136,
-		.row_width =	13294,
-	},
-	{NULL, 0, 0, 0, 0}
-};
+/*
+ * Append preformatted text, bypassing the formatter.
+ */
+static void
+svf_write(struct jtag_ctx *ctx, const char *str, int len)
+{
 
+	memcpy(&ctx->svfo_buf[ctx->svfo_len], str, len);
+	ctx->svfo_len += len;
+	if (ctx->svfo_len > SVFO_BUFLEN - SVFO_MAXLINE)
+		svfo_flush(ctx, 0);
+}
 
 static int
-cmp_chip_ids(char *got, char *exp)
+svfo_close(struct jtag_ctx *ctx)
 {
-	int got_id, exp_id;
-	struct jed_devices *got_jd, *exp_jd;
 
-	sscanf(got, "%x", &got_id);
-	sscanf(exp, "%x", &exp_id);
+	svfo_flush(ctx, 1);
+	if (ctx->svfo_fd > 1)
+		close(ctx->svfo_fd);
+	ctx->svfo_fd = -1;
+	return (ctx->svfo_res);
+}
 
-	for (got_jd = jed_devices; got_jd->name != NULL; got_jd++)
-		if (got_jd->id == got_id)
-			break;
-	for (exp_jd = jed_devices; exp_jd->name != NULL; exp_jd++)
-		if (exp_jd->id == exp_id)
-			break;
 
-	if (exp_jd->name == NULL && got_jd->name == NULL)
-		return (EXIT_FAILURE);
+/*
+ * Emit the SVF for one row of the fuse map, col_width fuse chars.
+ */
+static void
+jed_fuse_row(struct jtag_ctx *ctx, int target, int jed_dev, const char *fuses,
+    int row)
+{
+	char tmpbuf[2048];
+	int i, j, val;
+
+	if (target == JED_TGT_FLASH)
+		svf_printf(ctx, "SIR	8	TDI  (67);\n");
+
+	val = 0;
+	for (i = jed_devices[jed_dev].col_width, j = 0; i > 0;
+	    i--, val <<= 1) {
+		val += (fuses[i - 1] == '1');
+		if ((i & 0x3) == 1) {
+			if (val < 10)
+				tmpbuf[j++] = '0' + val;
+			else
+				tmpbuf[j++] = 'A' + val - 10;
+			val = 0;
+		}
+	}
+	tmpbuf[j++] = 0;
 
-	fprintf(stderr, "\nFound ");
-	if (got_jd->name)
-		fprintf(stderr, "%s", got_jd->name);
-	else
-		fprintf(stderr, "unknown (%s)", got);
-	fprintf(stderr, " device, but the bitstream is for ");
-	if (exp_jd->name)
-		fprintf(stderr, "%s", exp_jd->name);
+	svf_printf(ctx, "! Shift in Data Row = %d\n", row);
+	svf_printf(ctx, "SDR	%d	TDI  (%s);\n",
+	    jed_devices[jed_dev].col_width, tmpbuf);
+	if (target == JED_TGT_FLASH)
+		svf_printf(ctx, "RUNTEST	IDLE	3 TCK	1.00E-003 SEC;\n");
 	else
-		fprintf(stderr, "unknown (%s)", exp);
-	fprintf(stderr, ".\n");
-	return (0);
+		svf_printf(ctx, "RUNTEST	IDLE	3 TCK;\n");
+
+	if (target == JED_TGT_FLASH) {
+		svf_printf(ctx, "SIR	8	TDI  (52);\n");
+		svf_printf(ctx, "SDR	1	TDI  (0)\n");
+		svf_printf(ctx, "		TDO  (1);\n");
+	}
 }
 
 /*
- * Parse a Lattice XP2 JEDEC file and convert it into a SVF stream stored
- * in a contiguos chunk of memory.  If parsing is sucessfull proceed with
- * calling exec_svf_mem().
+ * Parse a Lattice XP2 JEDEC file and convert it into a SVF stream, which
+ * is either executed or written to the SVF output file as it is produced.
+ * The fuse map is converted row by row as its lines come in, so inbuf
+ * holds at most a row and a line of it.
  */
 static int
-exec_jedec_file(char *path, int target, int debug)
+exec_jedec_file(struct jtag_ctx *ctx, int target, int debug)
 {
-	char *inbuf, *outbuf, *incp, *outcp;
+	char *inbuf, *incp;
 	char tmpbuf[2048];
-	FILE *fd;
-	long flen;
+	long flen = 64 * 1024;
 	int jed_state = JED_INIT;
 	int jed_dev = -1;
 	int i, j, val, row, res;
 
-	fd = fopen(path, "r");
-	if (fd == NULL) {
-		fprintf(stderr, "open(%s) failed\n", path);
-		return (EXIT_FAILURE);
-	}
-
-	fseek(fd, 0, SEEK_END);
-	flen = ftell(fd);
-	fseek(fd, 0, SEEK_SET);
-
 	inbuf = malloc(flen);
-	outbuf = malloc(flen * 2); /* XXX rough estimate */
-	if (inbuf == NULL || outbuf == NULL) {
+	if (inbuf == NULL) {
 		fprintf(stderr, "malloc(%ld) failed\n", flen);
 		return (EXIT_FAILURE);
 	}
+	res = svfo_open(ctx, debug);
+	if (res) {
+		free(inbuf);
+		return (res);
+	}
 
 	incp = inbuf;
-	outcp = outbuf;
-	while (!feof(fd) && fgets(incp, flen, fd) != NULL) {
+	for (;;) {
+		/* Commands may span many lines, grow inbuf as needed */
+		if (flen - (incp - inbuf) < 16 * 1024) {
+			i = incp - inbuf;
+			flen *= 2;
+			inbuf = realloc(inbuf, flen);
+			if (inbuf == NULL) {
+				fprintf(stderr, "malloc(%ld) failed\n", flen);
+				res = EXIT_FAILURE;
+				goto done;
+			}
+			incp = inbuf + i;
+		}
+		if (infile_gets(incp, flen - (incp - inbuf)) == NULL)
+			break;
+		ctx->progress = in_frac(in_done);
+
 		/* Trim CR / LF chars from the tail of the line */
 		incp += strlen(incp) - 1;
 		while (incp >= inbuf && (*incp == 10 || *incp == 13))
@@ -1977,16 +6153,54 @@ exec_jedec_file(char *path, int target, int debug)
 		if (*inbuf == 'L') {
 			if (jed_state < JED_PROG_INITIATED) {
 				fprintf(stderr, "Invalid bitstream file\n");
-				return (EXIT_FAILURE);
+				res = EXIT_FAILURE;
+				goto done;
 			}
-			if (jed_state == JED_PROG_INITIATED)
+			if (jed_state == JED_PROG_INITIATED) {
 				jed_state = JED_FUSES;
-			else
+				row = 1;
+				svf_printf(ctx, "\n\n! Program Fuse Map\n\n");
+				svf_printf(ctx, "SIR	8	TDI  (21);\n");
+				svf_printf(ctx, "RUNTEST	IDLE	3 TCK"
+				    "	1.00E-002 SEC;\n");
+				if (target == JED_TGT_SRAM)
+					svf_printf(ctx,
+					    "SIR	8	TDI  (67);\n");
+			} else
 				jed_state = JED_SED_CRC;
 			incp = inbuf;
 			continue;
 		}
 
+		/* Convert the fuse rows completed by this line */
+		if (jed_state == JED_FUSES) {
+			val = incp >= inbuf && *incp == '*';
+			if (val)
+				*incp = 0;
+			else
+				incp++;
+			j = jed_devices[jed_dev].col_width;
+			for (i = 0; incp - &inbuf[i] >= j &&
+			    row <= jed_devices[jed_dev].row_width; i += j)
+				jed_fuse_row(ctx, target, jed_dev, &inbuf[i],
+				    row++);
+			memmove(inbuf, &inbuf[i], incp - &inbuf[i] + 1);
+			incp -= i;
+			if (!val)
+				continue;
+
+			/* Check that we have consumed all fuse bits */
+			if (incp != inbuf ||
+			    row <= jed_devices[jed_dev].row_width) {
+				fprintf(stderr, "Invalid bitstream file\n");
+				res = EXIT_FAILURE;
+				goto done;
+			}
+			jed_state++;
+			incp = inbuf;
+			continue;
+		}
+
 		/* Does the command terminate on this line? */
 		if (*incp != '*') {
 			incp++;
@@ -2012,98 +6226,16 @@ exec_jedec_file(char *path, int target, int debug)
 			tmpbuf[j++] = 0;
 			if (strlen(tmpbuf) != 8) {
 				fprintf(stderr, "Invalid bitstream file\n");
-				return (EXIT_FAILURE);
+				res = EXIT_FAILURE;
+				goto done;
 			}
 			jed_state = JED_HAVE_SED_CRC;
 		}
 
-		/* Is this the main fuses string? */
-		if (jed_state == JED_FUSES) {
-
-			outcp += sprintf(outcp, "\n\n! Program Fuse Map\n\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (21);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
-			    "RUNTEST	IDLE	3 TCK	1.00E-002 SEC;\n");
-			*outcp++ = 0;
-
-			if (target == JED_TGT_SRAM) {
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (67);\n");
-				*outcp++ = 0;
-			}
-
-			for (incp = inbuf, row = 1;
-			    row <= jed_devices[jed_dev].row_width; row++) {
-				if (target == JED_TGT_FLASH) {
-					outcp += sprintf(outcp,
-					    "SIR	8	TDI  (67);\n");
-					*outcp++ = 0;
-				}
-
-				val = 0;
-				for (i = jed_devices[jed_dev].col_width, j = 0;
-				    i > 0; i--, val <<= 1) {
-					val += (incp[i - 1] == '1');
-					if ((i & 0x3) == 1) {
-						if (val < 10)
-							tmpbuf[j++] = '0' +
-							    val;
-						else
-							tmpbuf[j++] = 'A' +
-							    val - 10;
-						val = 0;
-					}
-				}
-				tmpbuf[j++] = 0;
-				incp += jed_devices[jed_dev].col_width;
-
-				outcp += sprintf(outcp,
-				    "! Shift in Data Row = %d\n", row);
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SDR	%d	TDI  (%s);\n",
-				    jed_devices[jed_dev].col_width, tmpbuf);
-				*outcp++ = 0;
-				if (target == JED_TGT_FLASH) {
-					outcp += sprintf(outcp,
-					    "RUNTEST	IDLE"
-					    "	3 TCK	1.00E-003 SEC;\n");
-				} else {
-					outcp += sprintf(outcp,
-					    "RUNTEST	IDLE	3 TCK;\n");
-				}
-				*outcp++ = 0;
-
-				if (target == JED_TGT_FLASH) {
-					outcp += sprintf(outcp,
-					    "SIR	8	TDI  (52);\n");
-					*outcp++ = 0;
-
-					outcp += sprintf(outcp,
-					    "SDR	1	TDI  (0)\n");
-					*outcp++ = 0;
-					outcp += sprintf(outcp,
-					    "		TDO  (1);\n");
-					*outcp++ = 0;
-				}
-			}
-
-			/* Check that we have consumed all fuse bits */
-			if (strlen(incp) != 0) {
-				fprintf(stderr, "Invalid bitstream file\n");
-				return (EXIT_FAILURE);
-			}
-
-			jed_state++;
-		}
-		
 		/* Is this a comment line? */
 		if (*inbuf == 'N') {
 			if (jed_state == JED_INIT) {
-				outcp += sprintf(outcp, "! %s\n", inbuf);
-				*outcp++ = 0;
+				svf_printf(ctx, "! %s\n", inbuf);
 			}
 			if (strncmp(inbuf, "NOTE DEVICE NAME:", 17) == 0) {
 				incp = &inbuf[18];
@@ -2118,7 +6250,8 @@ exec_jedec_file(char *path, int target, int debug)
 				if (jed_devices[jed_dev].name == NULL) {
 					fprintf(stderr, "Bitstream for "
 					    "unsupported target: %s\n", incp);
-					return (EXIT_FAILURE);
+					res = EXIT_FAILURE;
+					goto done;
 				}
 			}
 			incp = inbuf;
@@ -2132,7 +6265,8 @@ exec_jedec_file(char *path, int target, int debug)
 				if (jed_dev < 0 || jed_state != JED_INIT) {
 					fprintf(stderr,
 					    "Invalid bitstream file\n");
-					return (EXIT_FAILURE);
+					res = EXIT_FAILURE;
+					goto done;
 				}
 				jed_state = JED_PACK_KNOWN;
 			} else if (inbuf[1] == 'F') {
@@ -2140,12 +6274,14 @@ exec_jedec_file(char *path, int target, int debug)
 				    || jed_devices[jed_dev].fuses != i) {
 					fprintf(stderr,
 					    "Invalid bitstream file\n");
-					return (EXIT_FAILURE);
+					res = EXIT_FAILURE;
+					goto done;
 				}
 				jed_state = JED_SIZE_KNOWN;
 			} else {
 				fprintf(stderr, "Invalid bitstream file\n");
-				return (EXIT_FAILURE);
+				res = EXIT_FAILURE;
+				goto done;
 			}
 		}
 
@@ -2153,157 +6289,83 @@ exec_jedec_file(char *path, int target, int debug)
 		if (*inbuf == 'F') {
 			if (jed_state != JED_SIZE_KNOWN) {
 				fprintf(stderr, "Invalid bitstream file\n");
-				return (EXIT_FAILURE);
+				res = EXIT_FAILURE;
+				goto done;
 			}
 			jed_state = JED_PROG_INITIATED;
 
-			outcp += sprintf(outcp, "\n\n! Check the IDCODE\n\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "STATE	RESET;\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "STATE	IDLE;\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (16);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
-			    "SDR	32	TDI  (FFFFFFFF)\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "		TDO  (%08X)\n",
+			svf_printf(ctx, "\n\n! Check the IDCODE\n\n");
+			svf_printf(ctx, "STATE	RESET;\n");
+			svf_printf(ctx, "STATE	IDLE;\n");
+			svf_printf(ctx, "SIR	8	TDI  (16);\n");
+			svf_printf(ctx, "SDR	32	TDI  (FFFFFFFF)\n");
+			svf_printf(ctx, "		TDO  (%08X)\n",
 			    jed_devices[jed_dev].id);
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
-			    "		MASK (FFFFFFFF);\n");
-			*outcp++ = 0;
+			svf_printf(ctx, "		MASK (FFFFFFFF);\n");
 
 			if (target == JED_TGT_SRAM) {
-				outcp += sprintf(outcp,
+				svf_printf(ctx,
 				    "\n\n! Program Bscan register\n\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (1C);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "STATE	DRPAUSE;\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "STATE	IDLE;\n");
-				*outcp++ = 0;
-
-				outcp += sprintf(outcp,
+				svf_printf(ctx, "SIR	8	TDI  (1C);\n");
+				svf_printf(ctx, "STATE	DRPAUSE;\n");
+				svf_printf(ctx, "STATE	IDLE;\n");
+
+				svf_printf(ctx,
 				    "\n\n! Enable SRAM programming mode\n\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (55);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "SIR	8	TDI  (55);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
-
-				outcp += sprintf(outcp,
-				    "\n\n! Erase the device\n\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (03);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+
+				svf_printf(ctx, "\n\n! Erase the device\n\n");
+				svf_printf(ctx, "SIR	8	TDI  (03);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
 			} else {
-				outcp += sprintf(outcp,
+				svf_printf(ctx,
 				    "\n\n! Enable XPROGRAM mode\n\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (35);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "SIR	8	TDI  (35);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
 
-				outcp += sprintf(outcp,
+				svf_printf(ctx,
 				    "\n\n! Check the Key Protection fuses\n\n");
-				*outcp++ = 0;
 
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (B2);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "SIR	8	TDI  (B2);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SDR	8	TDI  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		TDO  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		MASK (10);\n");
-				*outcp++ = 0;
-
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (B2);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "SDR	8	TDI  (00)\n");
+				svf_printf(ctx, "		TDO  (00)\n");
+				svf_printf(ctx, "		MASK (10);\n");
+
+				svf_printf(ctx, "SIR	8	TDI  (B2);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SDR	8	TDI  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		TDO  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		MASK (40);\n");
-				*outcp++ = 0;
-
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (B2);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "SDR	8	TDI  (00)\n");
+				svf_printf(ctx, "		TDO  (00)\n");
+				svf_printf(ctx, "		MASK (40);\n");
+
+				svf_printf(ctx, "SIR	8	TDI  (B2);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SDR	8	TDI  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		TDO  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		MASK (04);\n");
-				*outcp++ = 0;
-
-				outcp += sprintf(outcp,
-				    "\n\n! Erase the device\n\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (03);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "SDR	8	TDI  (00)\n");
+				svf_printf(ctx, "		TDO  (00)\n");
+				svf_printf(ctx, "		MASK (04);\n");
+
+				svf_printf(ctx, "\n\n! Erase the device\n\n");
+				svf_printf(ctx, "SIR	8	TDI  (03);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.20E+002 SEC;\n");
-				*outcp++ = 0;
-
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (52);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SDR	1	TDI  (0)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		TDO  (1);\n");
-				*outcp++ = 0;
-
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (B2);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+
+				svf_printf(ctx, "SIR	8	TDI  (52);\n");
+				svf_printf(ctx, "SDR	1	TDI  (0)\n");
+				svf_printf(ctx, "		TDO  (1);\n");
+
+				svf_printf(ctx, "SIR	8	TDI  (B2);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SDR	8	TDI  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		TDO  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		MASK (01);\n");
-				*outcp++ = 0;
+				svf_printf(ctx, "SDR	8	TDI  (00)\n");
+				svf_printf(ctx, "		TDO  (00)\n");
+				svf_printf(ctx, "		MASK (01);\n");
 			}
 		}
 
@@ -2311,597 +6373,1155 @@ exec_jedec_file(char *path, int target, int debug)
 		if (*inbuf == 'U') {
 			if (inbuf[1] != 'H' || jed_state != JED_HAVE_SED_CRC) {
 				fprintf(stderr, "Invalid bitstream file\n");
-				return (EXIT_FAILURE);
+				res = EXIT_FAILURE;
+				goto done;
 			}
 
-			outcp += sprintf(outcp, "\n\n! Program USERCODE\n\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (1A);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
-			    "SDR	32	TDI  (%s);\n", &inbuf[2]);
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
+			svf_printf(ctx, "\n\n! Program USERCODE\n\n");
+			svf_printf(ctx, "SIR	8	TDI  (1A);\n");
+			svf_printf(ctx, "SDR	32	TDI  (%s);\n",
+			    &inbuf[2]);
+			svf_printf(ctx,
 			    "RUNTEST	IDLE	3 TCK	1.00E-002 SEC;\n");
-			*outcp++ = 0;
 
 			if (target == JED_TGT_FLASH) {
-				outcp += sprintf(outcp,
+				svf_printf(ctx,
 				    "\n\n! Read the status bit;\n\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (B2);\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "SIR	8	TDI  (B2);\n");
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	1.00E-003 SEC;\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SDR	8	TDI  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		TDO  (00)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		MASK (01);\n");
-				*outcp++ = 0;
+				svf_printf(ctx, "SDR	8	TDI  (00)\n");
+				svf_printf(ctx, "		TDO  (00)\n");
+				svf_printf(ctx, "		MASK (01);\n");
 			}
 
-			outcp += sprintf(outcp,
+			svf_printf(ctx,
 			    "\n\n! Program and Verify 32 bits SED_CRC\n\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (45);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
-			    "SDR	32	TDI  (%s);\n", tmpbuf);
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
+			svf_printf(ctx, "SIR	8	TDI  (45);\n");
+			svf_printf(ctx, "SDR	32	TDI  (%s);\n", tmpbuf);
+			svf_printf(ctx,
 			    "RUNTEST	IDLE	3 TCK	1.00E-002 SEC;\n");
-			*outcp++ = 0;
 
-			outcp += sprintf(outcp, "SIR	8	TDI  (44);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
+			svf_printf(ctx, "SIR	8	TDI  (44);\n");
+			svf_printf(ctx,
 			    "RUNTEST	IDLE	3 TCK	1.00E-003 SEC;\n");
-			*outcp++ = 0;
-
-			outcp += sprintf(outcp,
-			    "SDR	32	TDI  (00000000)\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
-			    "		TDO  (%s);\n", tmpbuf);
-			*outcp++ = 0;
-
-			outcp += sprintf(outcp, "SIR	8	TDI  (B2);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
+
+			svf_printf(ctx, "SDR	32	TDI  (00000000)\n");
+			svf_printf(ctx, "		TDO  (%s);\n", tmpbuf);
+
+			svf_printf(ctx, "SIR	8	TDI  (B2);\n");
+			svf_printf(ctx,
 			    "RUNTEST	IDLE	3 TCK	1.00E-003 SEC;\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SDR	8	TDI  (00)\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "		TDO  (00)\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "		MASK (01);\n");
-			*outcp++ = 0;
-
-			outcp += sprintf(outcp,
-			    "\n\n! Program DONE bit\n\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (2F);\n");
-			*outcp++ = 0;
+			svf_printf(ctx, "SDR	8	TDI  (00)\n");
+			svf_printf(ctx, "		TDO  (00)\n");
+			svf_printf(ctx, "		MASK (01);\n");
+
+			svf_printf(ctx, "\n\n! Program DONE bit\n\n");
+			svf_printf(ctx, "SIR	8	TDI  (2F);\n");
 			if (target == JED_TGT_FLASH) {
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK	2.00E-001 SEC;\n");
 			} else {
-				outcp += sprintf(outcp, "RUNTEST	IDLE"
+				svf_printf(ctx, "RUNTEST	IDLE"
 				    "	3 TCK;\n");
 			}
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (B2);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
+			svf_printf(ctx, "SIR	8	TDI  (B2);\n");
+			svf_printf(ctx,
 			    "RUNTEST	IDLE	3 TCK	1.00E-003 SEC;\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SDR	8	TDI  (00)\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "		TDO  (02)\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "		MASK (03);\n");
-			*outcp++ = 0;
+			svf_printf(ctx, "SDR	8	TDI  (00)\n");
+			svf_printf(ctx, "		TDO  (02)\n");
+			svf_printf(ctx, "		MASK (03);\n");
 
 			if (target == JED_TGT_FLASH) {
-				outcp += sprintf(outcp,
-				    "\n\n! Verify DONE bit\n\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "SIR	8	TDI  (B2)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		TDO  (FF)\n");
-				*outcp++ = 0;
-				outcp += sprintf(outcp,
-				    "		MASK (04);\n");
-				*outcp++ = 0;
+				svf_printf(ctx, "\n\n! Verify DONE bit\n\n");
+				svf_printf(ctx, "SIR	8	TDI  (B2)\n");
+				svf_printf(ctx, "		TDO  (FF)\n");
+				svf_printf(ctx, "		MASK (04);\n");
 			}
 
-			outcp += sprintf(outcp,
-			    "\n\n! Exit the programming mode\n\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (1E);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
+			svf_printf(ctx, "\n\n! Exit the programming mode\n\n");
+			svf_printf(ctx, "SIR	8	TDI  (1E);\n");
+			svf_printf(ctx,
 			    "RUNTEST	IDLE	3 TCK	2.00E-003 SEC;\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp, "SIR	8	TDI  (FF);\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
+			svf_printf(ctx, "SIR	8	TDI  (FF);\n");
+			svf_printf(ctx,
 			    "RUNTEST	IDLE	3 TCK	1.00E-003 SEC;\n");
-			*outcp++ = 0;
-			outcp += sprintf(outcp,
-			    "STATE	RESET;\n");
-			*outcp++ = 0;
+			svf_printf(ctx, "STATE	RESET;\n");
 		}
 
 		incp = inbuf;
 	}
-	fclose(fd);
 
-	/* Count number of lines in outbuf, store in j */
-	for (i = 0, j = 0; outcp > outbuf; outcp--)
-		if (*outcp == 0)
-			j++;
+done:
+	i = svfo_close(ctx);
+	if (res == 0)
+		res = i;
+	free(inbuf);
+	return (res);
+}
+
 
-	if (svf_name) {
-		int of;
+/*
+ * Emit the SPI flash sector erase sequence for the sector at addr.
+ */
+static void
+svf_spi_erase(struct jtag_ctx *ctx, int addr)
+{
 
-		if (strncmp(svf_name, "-", 1) == 0)
-			of = 0;
-		else
-			of = open(svf_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
-		if (of < 0) {
-			res = errno;
-			goto done;
-		}
-		res = 0;
-		for (i = 0, outcp = outbuf; i < j; i++) {
-			write(of, outcp, strlen(outcp));
-			outcp += (strlen(outcp) + 1);
+	/* SPI write enable */
+	svf_printf(ctx, "SDR	8	TDI(60);\n");
+
+	/* Read status register (some chips won't clear WIP without this) */
+	svf_printf(ctx, "SDR	16	TDI(00A0)\n");
+	svf_printf(ctx, "	TDO(40FF)\n");
+	svf_printf(ctx, "	MASK(C100);\n\n");
+
+	svf_printf(ctx, "SDR	32	TDI(0000%02x1B);\n",
+	    bitrev(addr / SPI_SECTOR_SIZE));
+	svf_printf(ctx, "RUNTEST DRPAUSE 5.50E-01 SEC;\n");
+
+	/* Read status register */
+	svf_printf(ctx, "SDR	16	TDI(00A0)\n");
+	svf_printf(ctx, "	TDO(00FF)\n");
+	svf_printf(ctx, "	MASK(C100);\n\n");
+}
+
+/*
+ * Bitstream rows and flash pages are encoded into SVF text, and when
+ * executing also into pre-expanded TXBUF shift sequences, by a pool of
+ * worker threads.  Jobs sit in a ring and are committed strictly in
+ * input order by the main thread, which alone touches the cable.
+ * Without threads (or with a single CPU) each job is encoded in place.
+ */
+#define	ENC_THREADS_MAX	8
+#define	ENC_JOBS_MAX	(4 * ENC_THREADS_MAX)
+#define	ENC_HEXLEN	50	/* Row bytes per SVF text line */
+
+struct enc_job {
+	uint8_t	*in;		/* Row / page data */
+	int	n;
+	int	pos;		/* Offset of the row in the input */
+	int	skip;		/* Flash page with all bits set */
+	char	*svf;		/* SVF text for the row */
+	int	svflen;
+	uint8_t	*tck;		/* Pre-expanded TDI shift, or NULL */
+	unsigned tckbits;
+	int	done;
+};
+
+static struct enc_job enc_jobs[ENC_JOBS_MAX];
+static int enc_njobs;
+static int enc_flash;		/* Encoding SPI flash pages */
+static uint8_t enc_xlat[256][16]; /* Byte to 8 TCKs, MSB first */
+static uint8_t enc_tms;		/* TMS pin of the cable */
+static unsigned enc_submitted;	/* Jobs handed to the encoders */
+static unsigned enc_committed;	/* Jobs committed in order */
+
+#ifdef USE_THREADS
+static pthread_mutex_t enc_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t enc_cv_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t enc_cv_done = PTHREAD_COND_INITIALIZER;
+static pthread_t enc_thr[ENC_THREADS_MAX];
+static int enc_nthreads;
+static unsigned enc_picked;	/* Jobs taken by the encoders */
+static int enc_stop;
+#endif
+
+static uint8_t *
+enc_expand(uint8_t *cp, unsigned val)
+{
+
+	memcpy(cp, enc_xlat[val], 16);
+	return (cp + 16);
+}
+
+/*
+ * Encode a single row.  Must not touch anything but the job itself and
+ * tables which are read-only while the encoders are running.
+ */
+static void
+enc_row(struct enc_job *j)
+{
+	uint8_t *tp;
+	char *cp;
+	int i, addr = j->pos + spi_addr;
+
+	cp = j->svf;
+	if (enc_flash) {
+		for (i = 0; i < j->n; i++)
+			if (j->in[i] != 0xff)
+				break;
+		j->skip = (i == j->n);
+		if (j->skip)
+			return;
+		cp += sprintf(cp, "SDR	8	TDI(60);\n");
+		cp += sprintf(cp, "SDR %d TDI (", j->n * 8 + 32);
+	} else
+		cp += sprintf(cp, "SDR %d TDI (", j->n * 8);
+
+	/* Last byte first, each bit reversed, ENC_HEXLEN bytes per line */
+	for (i = j->n - 1; i >= 0; i--) {
+		*cp++ = svfo_hexrev[j->in[i]][0];
+		*cp++ = svfo_hexrev[j->in[i]][1];
+		if (i % ENC_HEXLEN == 0 && i > 0) {
+			*cp++ = '\n';
+			*cp++ = '\t';
 		}
-		if (of)
-			close(of);
+	}
+
+	if (enc_flash) {
+		cp += sprintf(cp, "%02x%02x%02x40);\n\n",
+		    bitrev(addr % 256), bitrev((addr / 256) % 256),
+		    bitrev((addr / 65536) % 256));
+		cp += sprintf(cp, "RUNTEST DRPAUSE 2.00E-03 SEC;\n");
+		cp += sprintf(cp, "SDR	16	TDI(00A0)\n");
+		cp += sprintf(cp, "	TDO(00FF)\n");
+		cp += sprintf(cp, "	MASK(C100);\n\n");
 	} else
-		res = exec_svf_mem(outbuf, j, debug);
+		cp += sprintf(cp, ");\n\n");
+	j->svflen = cp - j->svf;
 
-done:
-	free(outbuf);
-	free(inbuf);
-	return (res);
+	if (j->tck == NULL)
+		return;
+
+	/* The same data in shift order: first bit is the LSB of the text */
+	tp = j->tck;
+	if (enc_flash) {
+		tp = enc_expand(tp, 0x02);	/* SPI page program */
+		tp = enc_expand(tp, (addr >> 16) & 0xff);
+		tp = enc_expand(tp, (addr >> 8) & 0xff);
+		tp = enc_expand(tp, addr & 0xff);
+	}
+	for (i = 0; i < j->n; i++)
+		tp = enc_expand(tp, j->in[i]);
+	j->tckbits = (tp - j->tck) / 2;
+
+	/* Leave SHIFT state with the last bit */
+	tp[-2] |= enc_tms;
+	tp[-1] |= enc_tms;
 }
 
+#ifdef USE_THREADS
+static void *
+enc_main(void *arg)
+{
+	struct enc_job *j;
+	int tid = TRACE_TID_ENC + (intptr_t) arg;
+	char name[32], args[32];
+	uint64_t t0;
 
-#define	bitrev(a) ((a & 0x1)  << 7) | ((a & 0x2)  << 5) | ((a & 0x4)  << 3) | ((a & 0x8)  << 1) | ((a & 0x10) >> 1) | ((a & 0x20) >> 3) | ((a & 0x40) >> 5) | ((a & 0x80) >> 7)
+	snprintf(name, sizeof(name), "encoder %d", (int) (intptr_t) arg);
+	trace_thread(tid, name);
+
+	pthread_mutex_lock(&enc_mtx);
+	for (;;) {
+		while (enc_picked == enc_submitted && !enc_stop)
+			pthread_cond_wait(&enc_cv_work, &enc_mtx);
+		if (enc_picked == enc_submitted)
+			break;
+		j = &enc_jobs[enc_picked++ % enc_njobs];
+		pthread_mutex_unlock(&enc_mtx);
+		t0 = trace_fp != NULL ? ns_uptime() : 0;
+		enc_row(j);
+		if (trace_fp != NULL) {
+			snprintf(args, sizeof(args), "{\"pos\": %d}", j->pos);
+			trace_span(tid, "enc_row", t0, ns_uptime(), args);
+		}
+		pthread_mutex_lock(&enc_mtx);
+		j->done = 1;
+		pthread_cond_broadcast(&enc_cv_done);
+	}
+	pthread_mutex_unlock(&enc_mtx);
+	return (NULL);
+}
+#endif
+
+/*
+ * Send the oldest job to the SVF output file or execute it.  Only the
+ * main thread gets here, so rows reach the cable in input order.
+ */
+static void
+enc_commit(struct jtag_ctx *ctx, long flen)
+{
+	struct enc_job *j = &enc_jobs[enc_committed % enc_njobs];
+
+#ifdef USE_THREADS
+	if (enc_nthreads) {
+		stats_enter(&ctx->stats, STAT_ENCODE);
+		pthread_mutex_lock(&enc_mtx);
+		while (!j->done)
+			pthread_cond_wait(&enc_cv_done, &enc_mtx);
+		pthread_mutex_unlock(&enc_mtx);
+		stats_leave(&ctx->stats);
+	}
+#endif
+	enc_committed++;
+	if (flen > 0)
+		ctx->progress = (double) (j->pos + j->n) / flen;
+	else
+		ctx->progress = in_frac(in_done);
+
+	/* Erase as we go if the image size is unknown */
+	if (enc_flash && flen < 0 && j->pos % SPI_SECTOR_SIZE == 0) {
+		svf_spi_erase(ctx, j->pos + spi_addr);
+		svf_printf(ctx, "SDR	8	TDI(20);\n\n");
+	}
+	if (j->skip)
+		return;
 
-#define	buf_sprintf(p, ...) do { \
-	(p) += sprintf((p), ## __VA_ARGS__); \
-	 *(p)++ = 0; \
-} while (0)
+	if (j->tck == NULL) {
+		svf_write(ctx, j->svf, j->svflen);
+		return;
+	}
+
+	/* Execute the row now, with the pre-expanded shift sequence */
+	svfo_flush(ctx, 0);
+	if (ctx->svfo_res)
+		return;
+	ctx->sdr_tck = j->tck;
+	ctx->sdr_tck_bits = j->tckbits;
+	ctx->svfo_res = exec_svf_text(ctx, j->svf, j->svflen, ctx->svfo_debug,
+	    0);
+	ctx->sdr_tck = NULL;
+}
 
 /*
- * Parse a Lattice ECP5 bitstream file and convert it into a SVF stream,
- * stored in a contiguos chunk of memory.  If parsing is sucessfull proceed
- * with calling exec_svf_mem().
+ * Return a free job slot to be filled with input data, committing the
+ * oldest job first if the ring is full.
  */
-static int
-exec_bit_file(char *path, int jed_target, int debug)
+static struct enc_job *
+enc_get(struct jtag_ctx *ctx, long flen)
 {
-	uint8_t *inbuf;
-	char *outbuf, *op;
-	char *outcp;
-	FILE *fd;
-	long flen, got;
-	uint32_t idcode;
-	int i, j, n, addr;
-	int row_size = 64000 / 8;
-	int hexlen = 50;
-	int res;
 
-	fd = fopen(path, "rb");
-	if (fd == NULL) {
-		fprintf(stderr, "open(%s) failed\n", path);
-		return (EXIT_FAILURE);
+	if (enc_submitted - enc_committed == (unsigned) enc_njobs)
+		enc_commit(ctx, flen);
+	return (&enc_jobs[enc_submitted % enc_njobs]);
+}
+
+static void
+enc_put(struct jtag_ctx *ctx, struct enc_job *j, long flen)
+{
+
+	j->done = 0;
+	j->skip = 0;
+#ifdef USE_THREADS
+	if (enc_nthreads) {
+		pthread_mutex_lock(&enc_mtx);
+		enc_submitted++;
+		pthread_cond_signal(&enc_cv_work);
+		pthread_mutex_unlock(&enc_mtx);
+		return;
 	}
+#endif
+	stats_enter(&ctx->stats, STAT_ENCODE);
+	enc_row(j);
+	stats_leave(&ctx->stats);
+	j->done = 1;
+	enc_submitted++;
+	enc_commit(ctx, flen);
+}
 
-	fseek(fd, 0, SEEK_END);
-	flen = ftell(fd);
-	fseek(fd, 0, SEEK_SET);
+static void enc_stop_pool(void);
 
-	inbuf = malloc(flen);
-	outbuf = malloc(flen * 4); /* XXX rough estimate */
-	if (inbuf == NULL || outbuf == NULL) {
-		fprintf(stderr, "malloc(%ld) failed\n", flen);
-		return (EXIT_FAILURE);
+static int
+enc_start(struct jtag_ctx *ctx, int flash, int row_size)
+{
+	struct enc_job *j;
+	int i, b, val, expand, nthreads = 0;
+
+	enc_flash = flash;
+	enc_submitted = enc_committed = 0;
+
+	/* Only pre-expand when executing on a bitbanging cable */
+	expand = ctx->svfo_fd < 0 && !(ctx->ops->caps & CABLE_CAP_SHIFT);
+	if (expand)
+		enc_tms = JTAG_TMS;
+	for (i = 0; expand && i < 256; i++)
+		for (b = 0; b < 8; b++) {
+			val = 0;
+			if (i & (0x80 >> b))
+				val = JTAG_TDI;
+			enc_xlat[i][b * 2] = val;
+			enc_xlat[i][b * 2 + 1] = val | JTAG_TCK;
+		}
+
+#ifdef USE_THREADS
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 1)
+		nthreads = 0;
+	if (nthreads > ENC_THREADS_MAX)
+		nthreads = ENC_THREADS_MAX;
+#endif
+	enc_njobs = nthreads ? 4 * nthreads : 1;
+
+	/* The job ring gets a quarter of the --mem budget */
+	b = row_size * 3 + 256 + (expand ? (row_size + 4) * 16 : 0);
+	if (mem_budget && (size_t) enc_njobs > mem_budget / 4 / b)
+		enc_njobs = mem_budget / 4 / b;
+	if (enc_njobs < 2) {
+		enc_njobs = 1;
+		nthreads = 0;
+	} else if (nthreads > enc_njobs)
+		nthreads = enc_njobs;
+
+	for (i = 0; i < enc_njobs; i++) {
+		j = &enc_jobs[i];
+		j->in = malloc(row_size);
+		j->svf = malloc(row_size * 2 + row_size / ENC_HEXLEN * 2 + 256);
+		j->tck = NULL;
+		if (expand)
+			j->tck = malloc((row_size + 4) * 16);
+		if (j->in == NULL || j->svf == NULL ||
+		    (expand && j->tck == NULL)) {
+			fprintf(stderr, "malloc() failed\n");
+			enc_njobs = i + 1;
+			enc_stop_pool();
+			return (EXIT_FAILURE);
+		}
 	}
-	op = outbuf;
 
-	got = fread(inbuf, 1, flen, fd);
-	fclose(fd);
-	if (got != flen) {
-		fprintf(stderr, "short read: %ld instead of %ld\n",
-		    got, flen);
-		return (EXIT_FAILURE);
+#ifdef USE_THREADS
+	enc_stop = 0;
+	enc_picked = 0;
+	for (enc_nthreads = 0; enc_nthreads < nthreads; enc_nthreads++)
+		if (pthread_create(&enc_thr[enc_nthreads], NULL, enc_main,
+		    (void *) (intptr_t) enc_nthreads) != 0)
+			break;
+#endif
+	return (0);
+}
+
+static void
+enc_stop_pool(void)
+{
+	int i;
+
+#ifdef USE_THREADS
+	pthread_mutex_lock(&enc_mtx);
+	enc_stop = 1;
+	pthread_cond_broadcast(&enc_cv_work);
+	pthread_mutex_unlock(&enc_mtx);
+	for (i = 0; i < enc_nthreads; i++)
+		pthread_join(enc_thr[i], NULL);
+	enc_nthreads = 0;
+#endif
+	for (i = 0; i < enc_njobs; i++) {
+		free(enc_jobs[i].in);
+		free(enc_jobs[i].svf);
+		free(enc_jobs[i].tck);
+		memset(&enc_jobs[i], 0, sizeof(enc_jobs[i]));
 	}
+	enc_njobs = 0;
+}
+
+/*
+ * Commit all outstanding jobs and stop the encoders.
+ */
+static void
+enc_finish(struct jtag_ctx *ctx, long flen)
+{
+
+	while (enc_committed != enc_submitted)
+		enc_commit(ctx, flen);
+	enc_stop_pool();
+}
+
+/*
+ * Parse a Lattice ECP5 bitstream and convert it into a SVF stream, which
+ * is executed (or written out with -s) row by row while the bitstream is
+ * still being read.  When the input size is not known in advance, SPI
+ * flash sectors are erased just before their first page is written.
+ */
+static int
+exec_bit_file(struct jtag_ctx *ctx, int jed_target, int is_img, int debug)
+{
+	struct enc_job *job;
+	uint8_t *hdr;
+	long flen = in_size;
+	uint32_t idcode;
+	int i, j, n;
+	int row_size = 64000 / 8;
+	int res;
+
+	res = svfo_open(ctx, debug);
+	if (res)
+		return (res);
 
-	buf_sprintf(op, "STATE IDLE;\n");
-	buf_sprintf(op, "STATE RESET;\n");
-	buf_sprintf(op, "STATE IDLE;\n\n");
+	svf_printf(ctx, "STATE IDLE;\n");
+	svf_printf(ctx, "STATE RESET;\n");
+	svf_printf(ctx, "STATE IDLE;\n\n");
 
-	if (strcasecmp(&path[strlen(path) - 4], ".img") != 0) {
+	if (!is_img) {
 		/* Search for bitstream preamble and IDCODE markers */
-		for (i = 0, j = 0; i < flen - 32 && i < 2000; i++)
-			if (inbuf[i] == 0xbd && inbuf[i + 1] == 0xb3
-			    && inbuf[i + 10] == 0xe2 && inbuf[i + 11] == 0
-			    && inbuf[i + 12] == 0 && inbuf[i + 13] == 0) {
+		n = infile_peek(&hdr, 2048);
+		for (i = 0, j = -1; i < n - 32 && i < 2000; i++)
+			if (hdr[i] == 0xbd && hdr[i + 1] == 0xb3
+			    && hdr[i + 10] == 0xe2 && hdr[i + 11] == 0
+			    && hdr[i + 12] == 0 && hdr[i + 13] == 0) {
 				j = i;
 				break;
 			}
-		if (j == 0) {
+		if (j < 0) {
 			fprintf(stderr,
 			    "can't find IDCODE, invalid bitstream\n");
+			svfo_close(ctx);
 			return (EXIT_FAILURE);
 		}
-		idcode = inbuf[i + 14] << 24;
-		idcode += inbuf[i + 15] << 16;
-		idcode += inbuf[i + 16] << 8;
-		idcode += inbuf[i + 17];
+		idcode = hdr[i + 14] << 24;
+		idcode += hdr[i + 15] << 16;
+		idcode += hdr[i + 16] << 8;
+		idcode += hdr[i + 17];
 
 		/* IDCODE_PUB(0xE0): check IDCODE */
-		buf_sprintf(op, "SIR	8	TDI	(E0);\n");
-		buf_sprintf(op, "SDR	32	TDI	(00000000)\n");
-		buf_sprintf(op, "	TDO	(%08X)\n", idcode);
-		buf_sprintf(op, "	MASK	(FFFFFFFF);\n\n");
+		svf_printf(ctx, "SIR	8	TDI	(E0);\n");
+		svf_printf(ctx, "SDR	32	TDI	(00000000)\n");
+		svf_printf(ctx, "	TDO	(%08X)\n", idcode);
+		svf_printf(ctx, "	MASK	(FFFFFFFF);\n\n");
 	}
 
 	/* LSC_PRELOAD(0x1C): Program Bscan register */
-	buf_sprintf(op, "SIR	8	TDI	(1C);\n");
-	buf_sprintf(op, "SDR	510	TDI	(3FFFFFFFFFFFFFF"
+	svf_printf(ctx, "SIR	8	TDI	(1C);\n");
+	svf_printf(ctx, "SDR	510	TDI	(3FFFFFFFFFFFFFF"
 	    "FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF"
 	    "FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF);\n\n");
 
 	/* ISC ENABLE(0xC6): Enable SRAM programming mode */
-	buf_sprintf(op, "SIR	8	TDI	(C6);\n");
-	buf_sprintf(op, "SDR	8	TDI	(00);\n");
-	buf_sprintf(op, "RUNTEST IDLE    2 TCK;\n\n");
+	svf_printf(ctx, "SIR	8	TDI	(C6);\n");
+	svf_printf(ctx, "SDR	8	TDI	(00);\n");
+	svf_printf(ctx, "RUNTEST IDLE    2 TCK;\n\n");
 
 	/* ISC ERASE(0x0e): Erase the SRAM */
-	buf_sprintf(op, "SIR	8	TDI	(0e);\n");
-	buf_sprintf(op, "SDR	8	TDI	(01);\n");
-	buf_sprintf(op, "RUNTEST IDLE	32 TCK 1.00E-01 SEC;\n\n");
+	svf_printf(ctx, "SIR	8	TDI	(0e);\n");
+	svf_printf(ctx, "SDR	8	TDI	(01);\n");
+	svf_printf(ctx, "RUNTEST IDLE	32 TCK 1.00E-01 SEC;\n\n");
 
 	/* LSC_READ_STATUS(0x3c) */
-	buf_sprintf(op, "SIR	8	TDI	(3C);\n");
-	buf_sprintf(op, "SDR	32	TDI	(00000000)\n");
-	buf_sprintf(op, "	TDO	(00000000)\n");
-	buf_sprintf(op, "	MASK	(0000B000);\n\n");
+	svf_printf(ctx, "SIR	8	TDI	(3C);\n");
+	svf_printf(ctx, "SDR	32	TDI	(00000000)\n");
+	svf_printf(ctx, "	TDO	(00000000)\n");
+	svf_printf(ctx, "	MASK	(0000B000);\n\n");
 
 	if (jed_target == JED_TGT_FLASH) {
-		buf_sprintf(op, "STATE RESET;\n");
-		buf_sprintf(op, "STATE IDLE;\n");
+		svf_printf(ctx, "STATE RESET;\n");
+		svf_printf(ctx, "STATE IDLE;\n");
 
 		/* BYPASS(0xFF) */
-		buf_sprintf(op, "SIR	8	TDI(FF);\n");
-		buf_sprintf(op, "RUNTEST IDLE	32 TCK;\n");
+		svf_printf(ctx, "SIR	8	TDI(FF);\n");
+		svf_printf(ctx, "RUNTEST IDLE	32 TCK;\n");
 
 		/* LSC_PROG_SPI(0x3A) */
-		buf_sprintf(op, "SIR	8	TDI(3A);\n");
-		buf_sprintf(op, "SDR	16	TDI(68FE);\n");
-		buf_sprintf(op, "RUNTEST IDLE	32 TCK;\n\n");
+		svf_printf(ctx, "SIR	8	TDI(3A);\n");
+		svf_printf(ctx, "SDR	16	TDI(68FE);\n");
+		svf_printf(ctx, "RUNTEST IDLE	32 TCK;\n\n");
 
 		/* Erase sectors */
-		for (i = 0; i < flen; i += SPI_SECTOR_SIZE) {
-			addr = i + spi_addr;
-
-			/* SPI write enable */
-			buf_sprintf(op, "SDR	8	TDI(60);\n");
+		if (flen >= 0) {
+			for (i = 0; i < flen; i += SPI_SECTOR_SIZE)
+				svf_spi_erase(ctx, i + spi_addr);
 
-			/* Read status register (some chips won't clear WIP without this) */
-			buf_sprintf(op, "SDR	16	TDI(00A0)\n");
-			buf_sprintf(op, "	TDO(40FF)\n");
-			buf_sprintf(op, "	MASK(C100);\n\n");
-
-			buf_sprintf(op, "SDR	32	TDI(0000%02x1B);\n",
-			    bitrev(addr / SPI_SECTOR_SIZE));
-			buf_sprintf(op, "RUNTEST DRPAUSE 5.50E-01 SEC;\n");
-
-			/* Read status register */
-			buf_sprintf(op, "SDR	16	TDI(00A0)\n");
-			buf_sprintf(op, "	TDO(00FF)\n");
-			buf_sprintf(op, "	MASK(C100);\n\n");
+			/* SPI write disable */
+			svf_printf(ctx, "SDR	8	TDI(20);\n\n");
 		}
 
-		/* SPI write disable */
-		buf_sprintf(op, "SDR	8	TDI(20);\n\n");
-
 		row_size = SPI_PAGE_SIZE;
 	} else {
 		/* LSC_INIT_ADDRESS(0x46) */
-		buf_sprintf(op, "SIR	8	TDI	(46);\n");
-		buf_sprintf(op, "SDR	8	TDI	(01);\n");
-		buf_sprintf(op, "RUNTEST IDLE    2 TCK;\n\n");
+		svf_printf(ctx, "SIR	8	TDI	(46);\n");
+		svf_printf(ctx, "SDR	8	TDI	(01);\n");
+		svf_printf(ctx, "RUNTEST IDLE    2 TCK;\n\n");
 
 		/* LSC_BITSTREAM_BURST(0x7a) */
-		buf_sprintf(op, "SIR	8	TDI	(7A);\n");
-		buf_sprintf(op, "RUNTEST IDLE    2 TCK;\n\n");
-	}
-
-	for (i = 0; i < flen; i += row_size) {
-		n = flen - i;
-		if (n > row_size)
-			n = row_size;
-		if (jed_target == JED_TGT_FLASH) {
-			/* Skip write if all bits set in a block */
-			for (j = 0; j < n; j++)
-				if (inbuf[i + j] != 0xff)
-					break;
-			if (j == n)
-				continue;
+		svf_printf(ctx, "SIR	8	TDI	(7A);\n");
+		svf_printf(ctx, "RUNTEST IDLE    2 TCK;\n\n");
+	}
 
-			buf_sprintf(op, "SDR	8	TDI(60);\n");
-			buf_sprintf(op, "SDR %d TDI (", n * 8 + 32);
-		} else
-			buf_sprintf(op, "SDR %d TDI (", n * 8);
-		do {
-			n--;
-			op += sprintf(op, "%02X", bitrev(inbuf[i + n]));
-			if (n % hexlen == 0 && n > 0)
-				buf_sprintf(op, "\n\t");
-		} while (n > 0);
-		if (jed_target == JED_TGT_FLASH) {
-			addr = i + spi_addr;
-
-			buf_sprintf(op, "%02x%02x%02x40);\n\n",
-			    bitrev(addr % 256), bitrev((addr / 256) % 256),
-			    bitrev((addr / 65536) % 256));
-			buf_sprintf(op, "RUNTEST DRPAUSE 2.00E-03 SEC;\n");
-			buf_sprintf(op, "SDR	16	TDI(00A0)\n");
-			buf_sprintf(op, "	TDO(00FF)\n");
-			buf_sprintf(op, "	MASK(C100);\n\n");
-		} else
-			buf_sprintf(op, ");\n\n");
+	res = enc_start(ctx, jed_target == JED_TGT_FLASH, row_size);
+	if (res) {
+		svfo_close(ctx);
+		return (res);
 	}
-	
+	for (i = 0; ctx->svfo_res == 0; i += n) {
+		job = enc_get(ctx, flen);
+		n = infile_read(job->in, row_size);
+		if (n <= 0)
+			break;
+		job->n = n;
+		job->pos = i;
+		enc_put(ctx, job, flen);
+	}
+	enc_finish(ctx, flen);
+
 	/* BYPASS(0xFF) */
-	buf_sprintf(op, "SIR	8	TDI	(FF);\n");
-	buf_sprintf(op, "RUNTEST IDLE    100 TCK;\n\n");
+	svf_printf(ctx, "SIR	8	TDI	(FF);\n");
+	svf_printf(ctx, "RUNTEST IDLE    100 TCK;\n\n");
 
 	/* ISC DISABLE(Ox26): exit the programming mode */
-	buf_sprintf(op, "SIR	8	TDI	(26);\n");
-	buf_sprintf(op, "RUNTEST IDLE    2 TCK   2.00E-03 SEC;\n\n");
-	buf_sprintf(op, "SIR	8	TDI	(FF);\n");
-	buf_sprintf(op, "RUNTEST IDLE    2 TCK   1.00E-03 SEC;\n\n");
+	svf_printf(ctx, "SIR	8	TDI	(26);\n");
+	svf_printf(ctx, "RUNTEST IDLE    2 TCK   2.00E-03 SEC;\n\n");
+	svf_printf(ctx, "SIR	8	TDI	(FF);\n");
+	svf_printf(ctx, "RUNTEST IDLE    2 TCK   1.00E-03 SEC;\n\n");
 
 	if (jed_target == JED_TGT_FLASH) {
 		/* LSC_REFRESH(0x79) */
-		buf_sprintf(op, "SIR	8	TDI	(79);\n");
-		buf_sprintf(op, "SDR	24	TDI	(000000);\n");
-		buf_sprintf(op, "RUNTEST IDLE    2 TCK   1.00E-01 SEC;\n\n");
+		svf_printf(ctx, "SIR	8	TDI	(79);\n");
+		svf_printf(ctx, "SDR	24	TDI	(000000);\n");
+		svf_printf(ctx, "RUNTEST IDLE    2 TCK   1.00E-01 SEC;\n\n");
 	} else {
 		/* LSC_READ_STATUS(0x3c): verify status register */
-		buf_sprintf(op, "SIR	8	TDI	(3C);\n");
-		buf_sprintf(op, "SDR	32	TDI	(00000000)\n");
-		buf_sprintf(op, "	TDO	(00000100)\n");
-		buf_sprintf(op, "	MASK	(00002100);\n\n");
+		svf_printf(ctx, "SIR	8	TDI	(3C);\n");
+		svf_printf(ctx, "SDR	32	TDI	(00000000)\n");
+		svf_printf(ctx, "	TDO	(00000100)\n");
+		svf_printf(ctx, "	MASK	(00002100);\n\n");
+	}
+
+	return (svfo_close(ctx));
+}
+
+
+/*
+ * Execute a SVF file chunk by chunk, as it is being read.
+ */
+static int
+exec_svf_file(struct jtag_ctx *ctx, int debug)
+{
+	char *buf;
+	int len, res = 0;
+
+	buf = malloc(SVFO_BUFLEN);
+	if (buf == NULL) {
+		fprintf(stderr, "malloc(%d) failed\n", SVFO_BUFLEN);
+		return (EXIT_FAILURE);
 	}
-	op--;
-	i = 0;
+
+	svf_reset(ctx);
+	ctx->svf_input = 1;
 	do {
-		if (*op == '\n')
-			i++;
-	} while (op-- != outbuf);
+		len = infile_read_some(buf, SVFO_BUFLEN);
+		res = exec_svf_text(ctx, buf, len, debug, len == 0);
+	} while (res == 0 && len > 0);
+	ctx->svf_input = 0;
 
-	if (svf_name) {
-		int of;
+	free(buf);
+	return (res);
+}
+
+
+#ifdef USE_RAW
+/*
+ * Waveforms are replayed either straight from the input file, or from
+ * memory or a temporary file, in which case many contexts may share it.
+ */
+struct wave_src {
+	const uint8_t	*mem;		/* NULL when reading from a file */
+	int		fd;		/* Temporary file, -1 for infile */
+	size_t		len;
+	size_t		pos;
+};
+
+static int
+wave_read(struct wave_src *ws, void *buf, int len)
+{
+
+	if (ws->mem == NULL && ws->fd < 0)
+		return (infile_read(buf, len));
+	if ((size_t) len > ws->len - ws->pos)
+		len = ws->len - ws->pos;
+	if (ws->mem != NULL)
+		memcpy(buf, &ws->mem[ws->pos], len);
+	else if (pread(ws->fd, buf, len, ws->pos) != len)
+		return (-1);
+	ws->pos += len;
+	return (len);
+}
+
+static uint32_t
+wave_get32(struct wave_src *ws)
+{
+	uint8_t b[4];
+
+	if (wave_read(ws, b, 4) != 4)
+		return (0);
+	return (b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24));
+}
+
+/*
+ * Expand packed pin states into TXBUF, 4 TCKs per input byte, using a
+ * per-cable translation table so that no per-bit work is done here.
+ */
+static void
+wave_expand(struct jtag_ctx *ctx, uint8_t xlat[256][8], uint8_t *in,
+    unsigned clk)
+{
+	unsigned i;
+
+	txbuf_reserve(ctx, 2 * clk);
+	for (i = 0; i < clk / 4; i++, ctx->txpos += 8)
+		memcpy(&ctx->txbuf[ctx->txpos], xlat[in[i]], 8);
+	if (clk & 0x3) {
+		memcpy(&ctx->txbuf[ctx->txpos], xlat[in[i]], 2 * (clk & 0x3));
+		ctx->txpos += 2 * (clk & 0x3);
+	}
+}
+
+/*
+ * Compare TDO bits sampled in sync mode against the expected values and
+ * mask of a WAVE_CHECK record.
+ */
+static int
+wave_verify(uint8_t *rx, unsigned bits, uint8_t *map, int tdomask)
+{
+	unsigned i, bytes = (bits + 7) / 8;
+	uint32_t got = 0, exp = 0;
+	char gotstr[9], expstr[9];
+	int val, mismatch = 0;
+
+	for (i = 0; i < bits; i++) {
+		val = (rx[i * 2] & tdomask) != 0;
+		if ((val ^ (map[i / 8] >> (i & 0x7))) &
+		    (map[bytes + i / 8] >> (i & 0x7)) & 1)
+			mismatch = 1;
+		if (i < 32) {
+			got |= (uint32_t) val << i;
+			exp |= (uint32_t) ((map[i / 8] >> (i & 0x7)) & 1) << i;
+		}
+	}
+	if (!mismatch)
+		return (0);
+
+	if (bits == 32 && map[bytes] == 0xff && map[bytes + 1] == 0xff &&
+	    map[bytes + 2] == 0xff && map[bytes + 3] == 0xff) {
+		sprintf(gotstr, "%08X", got);
+		sprintf(expstr, "%08X", exp);
+		if (cmp_chip_ids(gotstr, expstr) == 0)
+			return (ENODEV);
+	}
+	fprintf(stderr, "Received and expected data do not match!\n");
+	return (EXIT_FAILURE);
+}
+
+/* Clock n TCKs with TMS = TDI = 0 */
+static int
+wave_idle(struct jtag_ctx *ctx, uint32_t n)
+{
+
+	for (; n > 0; n--) {
+		txbuf_reserve(ctx, 2);
+		ctx->txbuf[ctx->txpos++] = 0;
+		ctx->txbuf[ctx->txpos++] = JTAG_TCK;
+		if (ctx->txpos >= BUFLEN_MAX) {
+			if (commit(ctx, 0))
+				return (EXIT_FAILURE);
+			if (ctx->need_led_blink)
+				set_port_mode(ctx, ctx->port_mode);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Replay a binary waveform produced by -W.  Pin states are streamed
+ * into the transport as they are, TDO check points are verified in sync
+ * mode.
+ */
+static int
+exec_wave(struct jtag_ctx *ctx, struct wave_src *ws)
+{
+	uint8_t xlat[256][8];
+	uint8_t inbuf[16384], tagbuf, *map;
+	uint32_t clk, n, first, bits, i;
+	int tag, pins, val, bytes, tdomask = JTAG_TDO, tck = JTAG_TCK;
+	int res = 0;
+
+	if (wave_read(ws, inbuf, 4) != 4 || memcmp(inbuf, WAVE_MAGIC, 4)) {
+		fprintf(stderr, "Not a waveform file\n");
+		return (EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (n = 0; n < 4; n++) {
+			pins = (i >> (6 - 2 * n)) & 0x3;
+			val = 0;
+			if (pins & 0x2)
+				val |= JTAG_TMS;
+			if (pins & 0x1)
+				val |= JTAG_TDI;
+			xlat[i][n * 2] = val;
+			xlat[i][n * 2 + 1] = val | tck;
+		}
+	}
+
+	while (res == 0 && wave_read(ws, &tagbuf, 1) == 1) {
+		if (ws->mem == NULL && ws->fd < 0)
+			ctx->progress = in_frac(in_done);
+		else
+			ctx->progress = (double) ws->pos / ws->len;
+		tag = tagbuf;
+		clk = wave_get32(ws);
+
+		switch (tag) {
+		case WAVE_END:
+			break;
+
+		case WAVE_DATA:
+			set_port_mode(ctx, PORT_MODE_ASYNC);
+			for (; clk > 0; clk -= n) {
+				n = clk;
+				if (n > sizeof(inbuf) * 4)
+					n = sizeof(inbuf) * 4;
+				if (wave_read(ws, inbuf, (n + 3) / 4) !=
+				    (int) (n + 3) / 4) {
+					res = EXIT_FAILURE;
+					break;
+				}
+				wave_expand(ctx, xlat, inbuf, n);
+				res = commit(ctx, 0);
+				if (res)
+					break;
+				if (ctx->need_led_blink)
+					set_port_mode(ctx, ctx->port_mode);
+			}
+			break;
+
+		case WAVE_IDLE:
+			set_port_mode(ctx, PORT_MODE_ASYNC);
+			res = wave_idle(ctx, clk);
+			break;
+
+		case WAVE_SLEEP:
+			/* Timed as RUNTEST is, by this very cable */
+			set_port_mode(ctx, PORT_MODE_ASYNC);
+			if (!(ctx->ops->caps & CABLE_CAP_SLEEP)) {
+				res = wave_idle(ctx,
+				    clk * (ctx->tune.bauds / 2000));
+				break;
+			}
+			res = commit(ctx, 1);
+			if (res)
+				break;
+			stats_enter(&ctx->stats, STAT_SLEEP);
+			ctx->ops->sleep(ctx, clk);
+			stats_leave(&ctx->stats);
+			break;
+
+		case WAVE_CHECK:
+			first = wave_get32(ws);
+			bits = wave_get32(ws);
+			bytes = (clk + 3) / 4 + 2 * ((bits + 7) / 8);
+			map = malloc(bytes);
+			if (map == NULL) {
+				fprintf(stderr, "malloc(%d) failed\n", bytes);
+				res = EXIT_FAILURE;
+				break;
+			}
+			if (wave_read(ws, map, bytes) != bytes) {
+				free(map);
+				res = EXIT_FAILURE;
+				break;
+			}
+			set_port_mode(ctx, PORT_MODE_SYNC);
+			n = ctx->txpos;
+			wave_expand(ctx, xlat, map, clk);
+			res = commit(ctx, 0);
+			if (res == 0)
+				ctx->stats.tdo_checks++;
+			if (res == 0 &&
+			    !(ctx->ops->caps & CABLE_CAP_TDO_CMP)) {
+				res = wave_verify(&ctx->txbuf[n + first * 2],
+				    bits,
+				    &map[(clk + 3) / 4], tdomask);
+				if (res)
+					ctx->stats.tdo_errors++;
+			}
+			free(map);
+			break;
 
-		if (strncmp(svf_name, "-", 1) == 0)
-			of = 0;
-		else
-			of = open(svf_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
-		if (of < 0) {
-			res = errno;
-			return(res);
-		}
-		res = 0;
-		for (j = 0, outcp = outbuf; j < i; j++) {
-			write(of, outcp, strlen(outcp));
-			outcp += (strlen(outcp) + 1);
+		default:
+			fprintf(stderr, "Invalid waveform record %d\n", tag);
+			res = EXIT_FAILURE;
 		}
-		if (of)
-			close(of);
-	} else
-		res = exec_svf_mem(outbuf, i, debug);
+		if (tag == WAVE_END)
+			break;
+	}
+
+	/* Flush any buffered data */
+	if (commit(ctx, 1))
+		res = EXIT_FAILURE;
 
-	free(outbuf);
-	free(inbuf);
 	return (res);
 }
 
+static int
+exec_wave_file(struct jtag_ctx *ctx)
+{
+	struct wave_src ws = { NULL, -1, 0, 0 };
+
+	return (exec_wave(ctx, &ws));
+}
+#endif
+
 
+#ifndef WIN32
 /*
- * Load a SVF file in a contiguos chunk of memory, count number of lines,
- * and then call exec_svf_mem().
+ * Cable tuning.  --tune sweeps the bitbang rate (TCK on MPSSE cables),
+ * the sync mode chunk, the USB chunk size and the latency timer, one at a
+ * time, against the board attached.  Each setting has to read the same
+ * IDCODE and pass random vectors through the boundary scan register
+ * (SAMPLE/PRELOAD, which leaves the pins alone) TUNE_REPS times in a
+ * row.  The fastest such setting is kept, and cached for the cable.
  */
+#define	TUNE_BITS	4096	/* Test vector length */
+#define	TUNE_REPS	8	/* Test rounds per setting */
+#define	TUNE_GAIN	103	/* % of the best rate a setting has to beat */
+
+static const struct tune_param {
+	const char	*name;
+	int		mpsse;		/* 0 bitbang, 1 MPSSE, -1 both */
+	size_t		off;
+	int		val[8];
+} tune_params[] = {
+	{ "bauds",	0,	offsetof(struct cable_tune, bauds),
+	    { 500000, 1000000, 1500000, 2000000, 3000000 } },
+	{ "tck_khz",	1,	offsetof(struct cable_tune, tck_khz),
+	    { 1000, 3000, 6000, 10000, 15000, 30000 } },
+	{ "sync_chunk",	0,	offsetof(struct cable_tune, sync_chunk),
+	    { 128, 256, 384, 512, 1024 } },
+	{ "chunk",	-1,	offsetof(struct cable_tune, chunk),
+	    { 1024, 4096, 8192 } },
+	{ "latency",	-1,	offsetof(struct cable_tune, latency),
+	    { 1, 2, 4 } },
+	{ NULL, 0, 0, { 0 } }
+};
+
+static uint8_t tune_pat[2][TUNE_BITS];	/* One bit per byte */
+static char tune_hex[TUNE_BITS / 4 + 1];
+static uint32_t tune_idcode;
+static int tune_bsr;			/* BSR length found */
+
 static int
-exec_svf_file(char *path, int debug)
+tune_apply(struct jtag_ctx *ctx)
 {
-	char *linebuf, *fbuf;
-	FILE *fd;
-	long flen;
-	int lines_tot = 1;
-	int res;
-
-	fd = fopen(path, "r");
-	if (fd == NULL) {
-		fprintf(stderr, "open(%s) failed\n", path);
+	int khz;
+
+	/* Out of bitbang, else libftdi scales the rate */
+	if (set_port_mode(ctx, PORT_MODE_UART) ||
+	    ftdi_set_baudrate(&ctx->fc, ctx->tune.bauds) < 0 ||
+	    ftdi_write_data_set_chunksize(&ctx->fc, ctx->tune.chunk) < 0 ||
+	    ftdi_set_latency_timer(&ctx->fc, ctx->tune.latency) < 0 ||
+	    ftdi_usb_purge_buffers(&ctx->fc) < 0)
 		return (EXIT_FAILURE);
+	if (ctx->mp != NULL) {
+		khz = ctx->tune.tck_khz ? ctx->tune.tck_khz : tck_khz;
+		ctx->mp->div = mpsse_div(khz);
 	}
+	ctx->cur_s = UNDEFINED;
+	return (0);
+}
 
-	fseek(fd, 0, SEEK_END);
-	flen = 2 * ftell(fd);
-	fseek(fd, 0, SEEK_SET);
-
-	fbuf = malloc(flen);
-	if (fbuf == NULL) {
-		fprintf(stderr, "malloc(%ld) failed\n", flen);
+/* Shift bits through the DR selected by ir, with TDO back in tune_hex */
+static int
+tune_scan(struct jtag_ctx *ctx, const char *ir, const uint8_t *pat,
+    int bits, port_mode_t mode)
+{
+	char irbuf[3];
+	int i, len = (bits + 3) / 4;
+
+	memset(tune_hex, 0, len);
+	for (i = 0; i < bits; i++)
+		tune_hex[len - 1 - i / 4] |= pat[i] << (i & 3);
+	for (i = 0; i < len; i++)
+		tune_hex[i] = hexdigits[(int) tune_hex[i]];
+	tune_hex[len] = 0;
+	strcpy(irbuf, ir);
+
+	set_port_mode(ctx, mode);
+	if (ctx->cur_s == UNDEFINED)
+		set_state(ctx, IDLE);
+	set_state(ctx, IRPAUSE);
+	if (send_ir(ctx, 8, irbuf, NULL, NULL))
 		return (EXIT_FAILURE);
-	}
+	set_state(ctx, DRPAUSE);
+	return (send_dr(ctx, bits, tune_hex, NULL, NULL));
+}
 
-	for (linebuf = fbuf; !feof(fd); linebuf += strlen(linebuf) + 1) {
-		if (fgets(linebuf, flen, fd) == NULL)
-			break;
-		lines_tot++;
-		flen -= strlen(linebuf) + 1;
-	}
-	fclose(fd);
-	*linebuf = 0;
+/* Bit i of the TDO read back by tune_scan() */
+static int
+tune_tdo(int bits, int i)
+{
+	int c;
 
-	res = exec_svf_mem(fbuf, lines_tot, debug);
-	free(fbuf);
-	return (res);
+	c = tune_hex[(bits + 3) / 4 - 1 - i / 4];
+	c = c <= '9' ? c - '0' : c + 10 - 'A';
+	return ((c >> (i & 3)) & 1);
 }
 
+static void
+tune_random(uint8_t *pat)
+{
+	static uint32_t x;
+	int i;
+
+	if (x == 0)
+		x = ns_uptime() | 1;
+	for (i = 0; i < TUNE_BITS; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		pat[i] = x & 1;
+	}
+}
+
+static uint32_t
+tune_read_idcode(struct jtag_ctx *ctx)
+{
+	static const uint8_t zero[32];
+
+	if (tune_scan(ctx, "E0", zero, 32, PORT_MODE_SYNC))
+		return (0);
+	return (strtoul(tune_hex, NULL, 16));
+}
 
 /*
- * Parse SVF command lines stored in a contiguos chunk of memory and
- * execute appropriate JTAG actions, line by line, all in a single pass.
+ * Learn the IDCODE and the BSR length: after shifting a random vector
+ * into SAMPLE/PRELOAD, it has to come back out delayed by that many bits.
  */
 static int
-exec_svf_mem(char *fbuf, int lines_tot, int debug)
+tune_probe(struct jtag_ctx *ctx)
 {
-	int lno, tokc, cmd_complete, parentheses_open;
-	int res = 0;
-	int llen = 0;
-	char *cp, *c1;
-	char *sep = " \t\n\r";
-	char *linebuf, *item, *brkt;
-	char *tokv[256];
-
-	cp = svfbuf;
-	cmd_complete = 0;
-	parentheses_open = 0;
-	linebuf = fbuf;
-
-	for (lno = 1; lno < lines_tot; lno++, linebuf += llen) {
-		if (debug)
-			printf("%d: %s", lno, linebuf);
+	int i, n;
 
-		llen = strlen(linebuf) + 1;
-		progress_perc = lno * 1005 / (lines_tot * 10);
-
-		/* Pre-parse input, join multiple lines to a single command */
-		for (item = strtok_r(linebuf, sep, &brkt); item;
-		    item = strtok_r(NULL, sep, &brkt)) {
-			/* Skip comments */
-			if (item[0] == '!')
-				break;
-			if (item[0] == '/' && item[1] == '/')
+	tune_idcode = tune_read_idcode(ctx);
+	if ((tune_idcode & 1) == 0 || tune_idcode == 0xffffffff)
+		return (EXIT_FAILURE);
+	tune_random(tune_pat[0]);
+	if (tune_scan(ctx, "1C", tune_pat[0], TUNE_BITS, PORT_MODE_SYNC))
+		return (EXIT_FAILURE);
+	for (n = 1; n < TUNE_BITS / 2; n++) {
+		for (i = 0; i < TUNE_BITS - n; i++)
+			if (tune_tdo(TUNE_BITS, n + i) != tune_pat[0][i])
 				break;
+		if (i == TUNE_BITS - n)
+			break;
+	}
+	if (n == TUNE_BITS / 2)
+		return (EXIT_FAILURE);
+	tune_bsr = n;
+	return (0);
+}
 
-			/* If command is complete we shouldn't end up here! */
-			if (cmd_complete) {
-				fprintf(stderr, "Line %d: multiple commands "
-				    "on single line\n", lno);
-				return (EXIT_FAILURE);
-			}
-
-			/* End of command? */
-			c1 = item + strlen(item) - 1;
-			if (*c1 == ';') {
-				*c1-- = 0;
-				cmd_complete = 1;
-			}
+/*
+ * Run the test rounds with the current settings.  Each one shifts a
+ * vector in async mode, which the next IDCODE read has to survive, and
+ * one in sync mode which has to come back intact.  Returns TCKs per
+ * second, 0 if anything went wrong.
+ */
+static uint64_t
+tune_trial(struct jtag_ctx *ctx)
+{
+	uint64_t t0, tcks;
+	int i, r;
 
-			/* Check for parentheses */
-			if (*item == '(') {
-				item++;
-				if (parentheses_open) {
-					fprintf(stderr,
-					    "Line %d: too many '('s\n", lno);
-					return (EXIT_FAILURE);
-				}
-				parentheses_open = 1;
-			}
-			if (!parentheses_open)
-				for (char *ct = item; ct < c1; ct++)
-					if (*ct == '(') {
-						*ct = ' ';
-						parentheses_open = 1;
-						break;
-					}
-			if (*c1 == ')') {
-				*c1 = 0;
-				if (!parentheses_open) {
-					fprintf(stderr,
-					    "Line %d: too many ')'s\n", lno);
-					return (EXIT_FAILURE);
-				}
-				parentheses_open = 0;
-			}
+	if (tune_apply(ctx))
+		return (0);
+	t0 = ns_uptime();
+	tcks = ctx->tcks;
+	for (r = 0; r < TUNE_REPS; r++) {
+		if (tune_read_idcode(ctx) != tune_idcode)
+			return (0);
+		tune_random(tune_pat[0]);
+		tune_random(tune_pat[1]);
+		if (tune_scan(ctx, "1C", tune_pat[0], TUNE_BITS,
+		    PORT_MODE_ASYNC) ||
+		    tune_scan(ctx, "1C", tune_pat[1], TUNE_BITS,
+		    PORT_MODE_SYNC))
+			return (0);
+		for (i = tune_bsr; i < TUNE_BITS; i++)
+			if (tune_tdo(TUNE_BITS, i) !=
+			    tune_pat[1][i - tune_bsr])
+				return (0);
+	}
+	t0 = ns_uptime() - t0;
+	return ((ctx->tcks - tcks) * 1000000000 / (t0 ? t0 : 1));
+}
 
-			/* Copy to command buffer */
-			strcpy(cp, item);
-			cp += strlen(item);
-			if (!parentheses_open && !cmd_complete)
-				*cp++ = ' ';
-		}
+static int
+tune_run(struct jtag_ctx *ctx)
+{
+	const struct tune_param *tp;
+	struct cable_tune best;
+	uint64_t rate, best_rate;
+	int i, *field;
+
+	ctx->silent = 1;
+	tune_defaults(&ctx->tune);
+	if (ctx->mp != NULL && !tck_set)
+		ctx->tune.tck_khz = tck_khz;
+	if (tune_apply(ctx) || tune_probe(ctx)) {
+		fprintf(stderr, "No JTAG device responding on this cable\n");
+		return (EXIT_FAILURE);
+	}
+	best = ctx->tune;
+	best_rate = tune_trial(ctx);
+	if (best_rate == 0) {
+		fprintf(stderr, "Readback fails with the default settings\n");
+		return (EXIT_FAILURE);
+	}
+	if (!quiet)
+		printf("IDCODE %08X, %d bit boundary scan register\n"
+		    "  defaults            %10llu TCK/s\n", tune_idcode,
+		    tune_bsr, (unsigned long long) best_rate);
 
-		/* Proceed to next line if command is not complete yet */
-		if (!cmd_complete)
+	for (tp = tune_params; tp->name != NULL; tp++) {
+		if (tp->mpsse >= 0 && tp->mpsse != (ctx->mp != NULL))
 			continue;
-
-		/* Unmatched parentheses are not permitted */
-		if (parentheses_open) {
-			fprintf(stderr, "Line %d: missing ')'\n", lno);
-			return (EXIT_FAILURE);
-		}
-
-		/* Normalize to all upper case letters, separate tokens */
-		tokc = 0;
-		tokv[0] = svfbuf;
-		for (cp = svfbuf; *cp != 0; cp++) {
-			if (*cp == ' ') {
-				*cp++ = 0;
-				tokc++;
-				tokv[tokc] = cp;
+		if (tp->off == offsetof(struct cable_tune, tck_khz) && tck_set)
+			continue;
+		for (i = 0; tp->val[i] != 0; i++) {
+			ctx->tune = best;
+			field = (int *) ((char *) &ctx->tune + tp->off);
+			if (*field == tp->val[i])
+				continue;
+			*field = tp->val[i];
+			rate = tune_trial(ctx);
+			if (!quiet) {
+				printf("  %-10s %8d", tp->name, tp->val[i]);
+				if (rate)
+					printf("%10llu TCK/s\n",
+					    (unsigned long long) rate);
+				else
+					printf("      failed\n");
+			}
+			if (rate * 100 > best_rate * TUNE_GAIN) {
+				best = ctx->tune;
+				best_rate = rate;
 			}
-			*cp = toupper(*cp);
-		}
-		if (*tokv[tokc] != 0)
-			tokc++;
-
-		/* Execute command */
-		res = exec_svf_tokenized(tokc, tokv);
-		if (res) {
-			if (res != ENODEV)
-				fprintf(stderr, "Line %d: %s\n", lno,
-				    strerror(res));
-			return (res);
 		}
-
-		cp = svfbuf;
-		cmd_complete = 0;
 	}
 
-	/* Flush any buffered data */
-	commit(1);
-
-	return (res);
+	/* Once more, to be sure */
+	ctx->tune = best;
+	if (tune_trial(ctx) == 0 || tune_trial(ctx) == 0) {
+		fprintf(stderr, "Tuned settings unreliable, using defaults\n");
+		tune_defaults(&ctx->tune);
+	}
+	if (!quiet && ctx->mp != NULL)
+		printf("Using tck_khz %d, chunk %d, latency %d\n",
+		    ctx->tune.tck_khz ? ctx->tune.tck_khz : tck_khz,
+		    ctx->tune.chunk, ctx->tune.latency);
+	else if (!quiet)
+		printf("Using bauds %d, sync_chunk %d, chunk %d, latency %d\n",
+		    ctx->tune.bauds, ctx->tune.sync_chunk, ctx->tune.chunk,
+		    ctx->tune.latency);
+	return (tune_save(ctx));
 }
+#endif /* !WIN32 */
 
 
 static void
-terminal_help(void)
+terminal_help(int usb)
 {
 
 	printf("  ~>	send file\n");
-	if (cable_hw == CABLE_HW_USB)
+	if (usb)
 		printf("  ~c	set FTDI CBUS pins\n");
 	printf(
 	    "  ~b	change baudrate\n"
@@ -2919,18 +7539,23 @@ static void
 usage(void)
 {
 
-	printf("Usage: ujprog [option(s)] [bitstream_file]\n\n");
+	printf("Usage: ujprog [option(s)] [bitstream_file | -]\n\n");
 
 	printf(" Valid options:\n");
 #ifdef USE_PPI
 	printf("  -c CABLE	Select USB (default) or PPI JTAG CABLE\n");
 #endif
 	printf("  -C value	Set CBUS pin values (FTDI only)\n");
-	printf("  -p PORT	Select USB JTAG / UART PORT (default is 0)\n");
+	printf("  -p PORT	Select USB JTAG / UART PORT by index (default"
+	    " is 0),\n\t\tserial number or bus path\n");
+#if defined(USE_THREADS) && defined(USE_RAW)
+	printf("  -p P1,P2|all	Program several boards in parallel\n");
+#endif
 #ifdef WIN32
 	printf("  -L            List available FTDI COM ports\n");
 	printf("  -P COM	Select COM port (valid only with -t or -a)\n");
 #else
+	printf("  -L		List available USB JTAG cables\n");
 	printf("  -P TTY	Select TTY port (valid only with -t or -a)\n");
 #endif
 	printf("  -j TARGET	Select bitstream TARGET as SRAM (default)"
@@ -2938,6 +7563,10 @@ usage(void)
 	printf("  -f ADDR	Start writing to SPI flash at ADDR, "
 	    "optional with -j flash\n");
 	printf("  -s FILE	Convert bitstream to SVF FILE and exit\n");
+#ifdef USE_RAW
+	printf("  -W FILE	Convert bitstream to binary waveform FILE"
+	    " and exit\n");
+#endif
 	printf("  -r		Reload FPGA configuration from"
 	    " FLASH\n");
 	printf("  -t		Enter terminal emulation mode after"
@@ -2952,10 +7581,52 @@ usage(void)
 	printf("  -D DELAY	Delay transmission of each byte by"
 	    " DELAY ms\n");
 	printf("  -q 		Suppress messages\n");
+#ifdef USE_SOCKETS
+	printf("  --daemon SOCKET	Keep the cable open and serve jobs"
+	    " on SOCKET\n");
+	printf("  --connect SOCKET	Send the job to a daemon on SOCKET"
+	    " instead\n");
+	printf("  --xvc-server [ADDR:]PORT	Serve Xilinx Virtual Cable"
+	    " clients on PORT\n");
+	printf("  --remote-bitbang [HOST]:PORT|PATH	Drive a remote_bitbang"
+	    " (simulated) TAP\n");
+#endif
+#if defined(USE_THREADS) && defined(USE_RAW)
+	printf("  --watch	Program each board as it is plugged in\n");
+#endif
+	printf("  --tck FREQ	Set TCK on MPSSE cables, e.g. 500k or 15M"
+	    " (default 6M)\n");
+	printf("  --mock DEVICE	Program a virtual ULX3S with DEVICE,"
+	    " e.g. LFE5U-12F\n");
+	printf("  --mock-mpsse	Drive the virtual board through an MPSSE"
+	    " cable\n");
+	printf("  --stats[=FILE]	Write per-phase timings and counters"
+	    " as JSON to FILE or stderr\n");
+	printf("  --trace FILE	Write a Chrome / Perfetto trace of the"
+	    " programming timeline\n");
+	printf("  --mem SIZE	Keep buffers within SIZE, e.g. 8M, and"
+	    " report peak memory use\n");
+	printf("  --soak N	Program N times over, then report times"
+	    " and error rates\n");
+	printf("  --progress FILE	Write progress, rate and ETA as JSON"
+	    " lines to FILE\n");
+#ifndef WIN32
+	printf("  --usb-capture FILE	Log all USB transfers to FILE\n");
+	printf("  --usb-replay FILE	Replay a USB log instead of using"
+	    " a cable\n");
+	printf("  --usb-replay-latency	Replay with the recorded USB"
+	    " timing\n");
+	printf("  --tune		Find and save the fastest reliable settings"
+	    " for the cable\n");
+#endif
+#ifdef __linux__
+	printf("  --low-jitter[=CPU]	Drive cables with RT priority and"
+	    " locked memory, on CPU\n");
+#endif
 
 	if (terminal) {
 		printf("\n Terminal emulation mode commands:\n");
-		terminal_help();
+		terminal_help(0);
 	}
 #ifndef WIN32
 	printf("\n");
@@ -3008,119 +7679,583 @@ gets1(char *cp, int size)
 }
 
 
+/*
+ * Feed fname, or the already open fd if not -1, through the JTAG chain
+ * behind ctx, from TAP reset to TAP reset.
+ */
 static int
-prog(char *fname, int target, int debug)
+prog_stream(struct jtag_ctx *ctx, int fd, char *fname, int target,
+    int debug)
 {
-	int res, c, tstart, tend;
+	int res, fmt;
 
-	c = strlen(fname) - 4;
-	if (c < 0) {
-		usage();
-		exit(EXIT_FAILURE);
-	}
+	in_stats = &ctx->stats;
+	if (fd < 0 ? infile_open(fname) : infile_open_fd(fd, fname))
+		return (EXIT_FAILURE);
+	fmt = infile_format(fname, target);
 
-	if (cable_hw == CABLE_RAW)
+#ifdef USE_RAW
+	if (ctx->cable_hw == CABLE_RAW && raw_wave == NULL)
 		srec_header(fname);
+#endif
 
-	tstart = ms_uptime();
-	last_ledblink_ms = tstart;
+	ctx->last_ledblink_ms = ms_uptime();
+	ctx->progress = 0;
+	ctx->prog_next = ctx->prog_t = 0;
+	ctx->prog_rate = 0;
 
 	/* Move TAP into RESET state. */
-	set_port_mode(PORT_MODE_ASYNC);
-	set_state(RESET);
-
-	commit(1);
-
-	if (strcasecmp(&fname[c], ".jed") == 0)
-		res = exec_jedec_file(fname, target, debug);
-	else if (strcasecmp(&fname[c], ".bit") == 0 ||
-	    (strcasecmp(&fname[c], ".img") == 0 && target == JED_TGT_FLASH))
-		res = exec_bit_file(fname, target, debug);
-	else if (strcasecmp(&fname[c], ".svf") == 0)
-		res = exec_svf_file(fname, debug);
-	else
+	set_port_mode(ctx, PORT_MODE_ASYNC);
+	set_state(ctx, RESET);
+
+	commit(ctx, 1);
+
+	switch (fmt) {
+	case IN_FMT_JED:
+		stats_enter(&ctx->stats, STAT_CONVERT);
+		res = exec_jedec_file(ctx, target, debug);
+		stats_leave(&ctx->stats);
+		break;
+	case IN_FMT_BIT:
+	case IN_FMT_IMG:
+		stats_enter(&ctx->stats, STAT_CONVERT);
+		res = exec_bit_file(ctx, target, fmt == IN_FMT_IMG, debug);
+		stats_leave(&ctx->stats);
+		break;
+	case IN_FMT_SVF:
+		res = exec_svf_file(ctx, debug);
+		break;
+#ifdef USE_RAW
+	case IN_FMT_WAVE:
+		res = exec_wave_file(ctx);
+		break;
+#endif
+	default:
+		fprintf(stderr, "%s: unrecognized bitstream format\n", fname);
 		res = -1;
+	}
+	if (infile_close() && res == 0)
+		res = EXIT_FAILURE;
+	in_stats = NULL;
+
+	/* Leave TAP in RESET state. */
+	set_port_mode(ctx, PORT_MODE_ASYNC);
+	set_state(ctx, IDLE);
+	set_state(ctx, RESET);
+	commit(ctx, 1);
+
+	return (res);
+}
+
+/*
+ * --soak N: the same board programmed N times over, with the cable kept
+ * open, to qualify cables, hubs or host kernels.  Each run is accounted
+ * here, and summed up at the end.
+ */
+struct soak {
+	uint64_t	*ns;		/* Duration of each run */
+	int		runs;
+	int		failed;
+	uint64_t	tcks;
+	uint64_t	tdo_checks;
+	uint64_t	tdo_errors;
+	uint64_t	retries;
+};
+
+static void
+soak_add(struct soak *sk, struct jtag_ctx *ctx, int res)
+{
+	uint64_t *ns;
+
+	if (sk->runs % 1024 == 0) {
+		ns = realloc(sk->ns, (sk->runs + 1024) * sizeof(*ns));
+		if (ns == NULL)
+			return;
+		sk->ns = ns;
+	}
+	sk->ns[sk->runs++] = ctx->stats.end - ctx->stats.start;
+	if (res)
+		sk->failed++;
+	sk->tcks += ctx->tcks;
+	sk->tdo_checks += ctx->stats.tdo_checks;
+	sk->tdo_errors += ctx->stats.tdo_errors;
+	sk->retries += ctx->stats.retries;
+}
+
+static int
+soak_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* Run duration at percentile pct, by nearest rank; ns[] must be sorted */
+static double
+soak_pct(struct soak *sk, int pct)
+{
+	int i;
+
+	i = (sk->runs * pct + 99) / 100 - 1;
+	if (i < 0)
+		i = 0;
+	return (sk->ns[i] / 1e9);
+}
+
+static void
+soak_report(struct soak *sk, struct jtag_ctx *ctx)
+{
+	uint64_t sum = 0;
+	int i;
+
+	if (quiet || sk->runs == 0)
+		return;
+	qsort(sk->ns, sk->runs, sizeof(*sk->ns), soak_cmp);
+	for (i = 0; i < sk->runs; i++)
+		sum += sk->ns[i];
+
+	printf("\nSoak test");
+	if (ctx->usb_path[0] != 0)
+		printf(" of %s (%s)", ctx->usb_path,
+		    ctx->usb_serial[0] ? ctx->usb_serial : "-");
+	printf(": %d runs, %d failed (%.2f%%)\n", sk->runs, sk->failed,
+	    sk->failed * 100.0 / sk->runs);
+	printf("  Time per run:    min %.3f s, p50 %.3f s, p99 %.3f s, "
+	    "max %.3f s\n", soak_pct(sk, 0), soak_pct(sk, 50),
+	    soak_pct(sk, 99), soak_pct(sk, 100));
+	printf("  Throughput:      %.2f MTCK/s\n",
+	    sum ? sk->tcks * 1e3 / sum : 0.0);
+	printf("  TDO mismatches:  %llu of %llu checks (%.4f%%)\n",
+	    (unsigned long long) sk->tdo_errors,
+	    (unsigned long long) sk->tdo_checks,
+	    sk->tdo_checks ? sk->tdo_errors * 100.0 / sk->tdo_checks : 0.0);
+	printf("  Short reads and resends: %llu (%.2f per run)\n",
+	    (unsigned long long) sk->retries,
+	    (double) sk->retries / sk->runs);
+}
+
+static int
+prog(struct jtag_ctx *ctx, int fd, char *fname, int target, int debug)
+{
+	uint64_t tstart, tend;
+	int res;
+
+	stats_begin(ctx);
+	tstart = ns_uptime();
+	res = prog_stream(ctx, fd, fname, target, debug);
+	tend = ns_uptime();
+	stats_end(ctx);
+	progress_end(ctx, res);
+	if (res == 0) {
+		if (!quiet) {
+			fprintf(stderr, "\r%-46s", "Programming: 100%");
+			fprintf(stderr, "\nCompleted in %.2f seconds.\n",
+			    (tend - tstart) / 1e9);
+			if (mem_budget && peak_rss_kb())
+				fprintf(stderr, "Peak memory use %ld kB.\n",
+				    peak_rss_kb());
+		}
+	} else
+		fprintf(stderr, "\nFailed.\n");
+	stats_report(ctx, fname, res);
+
+	return (res);
+}
+
+static int
+soak_prog(struct jtag_ctx *ctx, char *fname, int target, int debug)
+{
+	struct soak sk;
+	int i, res;
+
+	memset(&sk, 0, sizeof(sk));
+	for (i = 0; i < soak_iters; i++) {
+		if (!quiet)
+			fprintf(stderr, "Run %d of %d\n", i + 1, soak_iters);
+		res = prog(ctx, -1, fname, target, debug);
+		soak_add(&sk, ctx, res);
+	}
+	soak_report(&sk, ctx);
+	free(sk.ns);
+	return (sk.failed ? EXIT_FAILURE : 0);
+}
+
+#if defined(USE_THREADS) && defined(USE_RAW)
+/*
+ * Programming several boards at once (-p all, -p 0,2,3).  The bitstream
+ * is converted only once, into an in-memory waveform, which is then
+ * replayed to each board from its own thread.  FT232R cables are full
+ * speed devices, so boards behind the same single-TT or full speed hub
+ * share 12 Mbit/s between them; such boards are taken one after another
+ * by a single thread, while boards on different hubs run in parallel.
+ */
+struct board {
+	struct jtag_ctx	*ctx;
+	char		hub[48];	/* Shared hub path, empty if none */
+	int		group;		/* Boards programmed by one thread */
+	int		res;
+	long		ms;		/* Programming time */
+	struct soak	soak;
+};
+
+struct board_job {
+	struct board	*boards;
+	int		nboards;
+	int		group;
+	struct wave_src	wave;
+	const char	*fname;		/* For --stats with --soak */
+	pthread_t	thread;
+	int		started;
+};
+
+static void
+board_locate(struct board *b)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list, *dev, *hub;
+
+	b->hub[0] = 0;
+	dev = libusb_get_device(b->ctx->fc.usb_dev);
+	if (dev == NULL ||
+	    libusb_get_device_list(b->ctx->fc.usb_ctx, &list) < 0)
+		return;
+
+	/* Multi-TT hubs give each port its own full speed bandwidth */
+	hub = libusb_get_parent(dev);
+	if (hub != NULL && libusb_get_parent(hub) != NULL &&
+	    libusb_get_device_descriptor(hub, &desc) == 0 &&
+	    desc.bDeviceProtocol != 2)
+		usb_path(hub, b->hub);
+	libusb_free_device_list(list, 1);
+}
+
+static void *
+board_main(void *arg)
+{
+	struct board_job *job = arg;
+	struct board *b;
+	struct wave_src ws;
+	long tstart;
+	int i, run;
+
+	for (i = 0; i < job->nboards; i++) {
+		b = &job->boards[i];
+		if (b->group != job->group)
+			continue;
+#ifdef __linux__
+		low_jitter_thread(b->ctx, job->group);
+#endif
+		for (run = 0; run == 0 || run < soak_iters; run++) {
+			ws = job->wave;
+			/* Whatever failed the previous run fails only that */
+			b->ctx->fatal = 0;
+			tstart = ms_uptime();
+			b->ctx->last_ledblink_ms = tstart;
+			stats_begin(b->ctx);
+			b->res = exec_wave(b->ctx, &ws);
+			stats_end(b->ctx);
+			progress_end(b->ctx, b->res);
+			b->ms = ms_uptime() - tstart;
+			if (b->res)
+				fprintf(stderr, "Board %s failed.\n",
+				    b->ctx->usb_path);
+			else if (!quiet)
+				fprintf(stderr, "Board %s completed in %.2f "
+				    "seconds.\n", b->ctx->usb_path,
+				    b->ms / 1000.0);
+			if (soak_iters) {
+				soak_add(&b->soak, b->ctx, b->res);
+				stats_report(b->ctx, job->fname, b->res);
+			}
+		}
+		if (soak_iters)
+			b->res = b->soak.failed ? EXIT_FAILURE : 0;
+	}
+	return (NULL);
+}
+
+static void
+wave_free(struct wave_src *ws)
+{
+
+	free((void *) ws->mem);
+	if (ws->fd >= 0)
+		close(ws->fd);
+	ws->mem = NULL;
+	ws->fd = -1;
+}
+
+/*
+ * Convert fname into a waveform for exec_wave() to replay.  It is kept
+ * in memory, or with a --mem budget in a temporary file, since it may
+ * be as large as the bitstream expanded to 4 TCKs per byte.
+ */
+static int
+wave_generate(char *fname, int target, int debug, struct wave_src *ws)
+{
+	struct jtag_ctx *ctx;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int res;
+
+	ws->mem = NULL;
+	ws->fd = -1;
+	ws->len = ws->pos = 0;
+	ctx = jtag_ctx_new(CABLE_RAW);
+	if (mem_budget) {
+		fp = tmpfile();
+		if (fp != NULL && (ws->fd = dup(fileno(fp))) < 0) {
+			fclose(fp);
+			fp = NULL;
+		}
+	} else
+		fp = open_memstream(&buf, &len);
+	if (ctx == NULL || fp == NULL) {
+		fprintf(stderr, "Can't create waveform: %s\n",
+		    strerror(errno));
+		if (ctx != NULL)
+			jtag_ctx_free(ctx);
+		if (fp != NULL)
+			fclose(fp);
+		wave_free(ws);
+		return (EXIT_FAILURE);
+	}
+	ctx->silent = 1;
+	ctx->ops = &wave_ops;
+	wave_start(ctx, fp);
+	stats_begin(ctx);
+	res = prog_stream(ctx, -1, fname, target, debug);
+	stats_end(ctx);
+	stats_report(ctx, fname, res);
+	cable_close(ctx);
+	jtag_ctx_free(ctx);
+
+	if (ws->fd >= 0)
+		ws->len = lseek(ws->fd, 0, SEEK_END);
+	else {
+		ws->mem = (const uint8_t *) buf;
+		ws->len = len;
+	}
+	return (res);
+}
+
+/*
+ * For -p all, find the bus paths of all attached cables.
+ */
+static int
+board_scan(char path[][48], int max)
+{
+	struct usb_cable uc[USB_CABLES_MAX];
+	struct ftdi_context fc;
+	struct cable_hw_map *hmp;
+	libusb_device **list;
+	int i, n, cnt = 0;
+
+	if (ftdi_init(&fc) < 0)
+		return (0);
+	n = usb_scan(fc.usb_ctx, &list, uc, USB_CABLES_MAX);
+	for (i = 0; i < n && cnt < max; i++) {
+		for (hmp = cable_hw_map; hmp->cable_hw != CABLE_UNKNOWN &&
+		    !usb_cable_is(hmp, &uc[i]); hmp++) {
+		}
+		if (hmp->cable_hw != CABLE_UNKNOWN ||
+		    (uc[i].vid == 0x0403 && uc[i].pid == 0x6001))
+			strcpy(path[cnt++], uc[i].path);
+	}
+	libusb_free_device_list(list, 1);
+	ftdi_deinit(&fc);
+	return (cnt);
+}
+
+static int
+prog_boards(char *fname, int target, int debug)
+{
+	struct board boards[BOARDS_MAX];
+	struct board_job jobs[BOARDS_MAX];
+	struct jtag_ctx *ctx;
+	char path[BOARDS_MAX][48];
+	char name[64];
+	struct wave_src wave = { NULL, -1, 0, 0 };
+	long tstart;
+	int i, j, n = 0, cnt, ok, res = EXIT_FAILURE;
+
+	cnt = board_cnt;
+	if (cnt < 0)
+		cnt = board_scan(path, BOARDS_MAX);
+
+	/* Open all cables first, so that we fail early */
+	for (i = 0; i < cnt; i++) {
+		ctx = jtag_ctx_new(CABLE_HW_USB);
+		if (ctx == NULL) {
+			fprintf(stderr, "malloc() failed\n");
+			goto done;
+		}
+		if (board_cnt < 0)
+			ctx->port_id = path[i];
+		else
+			port_select(ctx, board_sel[i]);
+		ctx->silent = 1;
+		ctx->no_exit = 1;	/* Fail this board only */
+		if (cable_open(ctx, CABLE_HW_USB)) {
+			ftdi_deinit(&ctx->fc);
+			jtag_ctx_free(ctx);
+			fprintf(stderr, "Cannot find JTAG cable %s.\n",
+			    board_cnt < 0 ? path[i] : board_sel[i]);
+			goto done;
+		}
+		boards[n].ctx = ctx;
+		board_locate(&boards[n]);
+		boards[n].group = n;
+		for (j = 0; j < n; j++)
+			if (boards[n].hub[0] &&
+			    strcmp(boards[j].hub, boards[n].hub) == 0) {
+				boards[n].group = boards[j].group;
+				break;
+			}
+		boards[n].res = -1;
+		boards[n].ms = 0;
+		memset(&boards[n].soak, 0, sizeof(boards[n].soak));
+		ctx->stats.tid = TRACE_TID_BOARD + n;
+		snprintf(name, sizeof(name), "board %s", ctx->usb_path);
+		trace_thread(ctx->stats.tid, name);
+		if (!quiet)
+			printf("Using USB cable at %s: %s\n", ctx->usb_path,
+			    ctx->hmp->cable_path);
+		n++;
+	}
+	if (n == 0) {
+		fprintf(stderr, "Cannot find JTAG cable.\n");
+		goto done;
+	}
 
-	/* Leave TAP in RESET state. */
-	set_port_mode(PORT_MODE_ASYNC);
-	set_state(IDLE);
-	set_state(RESET);
-	commit(1);
+	/* Convert the bitstream once, shared by all boards */
+	res = wave_generate(fname, target, debug, &wave);
+	if (res)
+		goto done;
 
-	tend = ms_uptime();
-	if (res == 0) {
-		if (!quiet) {
-			fprintf(stderr, "\rProgramming: 100%%  ");
-			fprintf(stderr, "\nCompleted in %.2f seconds.\n",
-			    (tend - tstart) / 1000.0);
-		}
-	} else
-		fprintf(stderr, "\nFailed.\n");
+	tstart = ms_uptime();
+	for (i = 0; i < n; i++) {
+		jobs[i].boards = boards;
+		jobs[i].nboards = n;
+		jobs[i].group = i;
+		jobs[i].wave = wave;
+		jobs[i].fname = fname;
+		jobs[i].started = 0;
+		if (boards[i].group != i)
+			continue;
+		if (pthread_create(&jobs[i].thread, NULL, board_main,
+		    &jobs[i]) == 0)
+			jobs[i].started = 1;
+		else
+			board_main(&jobs[i]);
+	}
+	for (i = 0; i < n; i++)
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+	for (i = 0; i < n && !soak_iters; i++)
+		stats_report(boards[i].ctx, fname, boards[i].res);
+
+	for (i = ok = 0; i < n; i++)
+		if (boards[i].res == 0)
+			ok++;
+	if (!quiet) {
+		printf("\n%-16s %-16s %-8s %s\n", "USB path", "Serial",
+		    "Result", "Time");
+		for (i = 0; i < n; i++)
+			printf("%-16s %-16s %-8s %.2f s\n",
+			    boards[i].ctx->usb_path, boards[i].ctx->usb_serial,
+			    boards[i].res ? "FAILED" : "OK",
+			    boards[i].ms / 1000.0);
+		printf("%d of %d boards programmed in %.2f seconds.\n",
+		    ok, n, (ms_uptime() - tstart) / 1000.0);
+		if (mem_budget)
+			printf("Peak memory use %ld kB.\n", peak_rss_kb());
+	}
+	for (i = 0; i < n; i++)
+		soak_report(&boards[i].soak, boards[i].ctx);
+	res = ok == n ? 0 : EXIT_FAILURE;
 
+done:
+	for (i = 0; i < n; i++) {
+		free(boards[i].soak.ns);
+		cable_close(boards[i].ctx);
+		jtag_ctx_free(boards[i].ctx);
+	}
+	wave_free(&wave);
 	return (res);
 }
-
+#endif /* USE_THREADS && USE_RAW */
 
 #if 0
 static void
-reload_xp2_flash(int debug)
+reload_xp2_flash(struct jtag_ctx *ctx, int debug)
 {
 	char buf[128];
 	char *c;
 
 	if (!quiet)
 		printf("Reconfiguring FPGA...\n");
-	last_ledblink_ms = ms_uptime();
-	need_led_blink = 0;
+	ctx->last_ledblink_ms = ms_uptime();
+	ctx->need_led_blink = 0;
 
 	/* Move TAP into RESET state. */
-	set_port_mode(PORT_MODE_SYNC);
-	set_state(IDLE);
-	set_state(RESET);
-	commit(1);
+	set_port_mode(ctx, PORT_MODE_SYNC);
+	set_state(ctx, IDLE);
+	set_state(ctx, RESET);
+	commit(ctx, 1);
 
 	/* Reset sequence */
 	c = buf;
 	c += sprintf(c, "RUNTEST IDLE 30 TCK;\n");
-	*c++ = 0;
 	c += sprintf(c, "SIR 8 TDI (1E);\n");
-	*c++ = 0;
 	c += sprintf(c, "SIR 8 TDI (23);\n");
-	*c++ = 0;
-	c += sprintf(c, "!\n");
-	exec_svf_mem(buf, 4, debug);
+	svf_reset(ctx);
+	exec_svf_text(ctx, buf, c - buf, debug, 1);
 
 	/* Leave TAP in RESET state. */
-	set_state(IDLE);
-	set_state(RESET);
-	commit(1);
+	set_state(ctx, IDLE);
+	set_state(ctx, RESET);
+	commit(ctx, 1);
 }
 #endif
 
 
 static int
-async_read_block(int len)
+async_read_block(struct jtag_ctx *ctx, int len)
 {
 	int res, got = 0, backoff = 0, backoff_lim = 5;
 	int i;
+	uint8_t *buf;
+
+	if (ctx->rxsize < (unsigned) len) {
+		buf = realloc(ctx->rxbuf, len);
+		if (buf == NULL) {
+			fprintf(stderr, "malloc(%d) failed\n", len);
+			return (EXIT_FAILURE);
+		}
+		ctx->rxbuf = buf;
+		ctx->rxsize = len;
+	}
 #if defined(__FreeBSD__) || defined(__linux__)
-	if (cable_hw == CABLE_HW_COM)
+	if (ctx->cable_hw == CABLE_HW_COM)
 		backoff_lim = 10;
 #endif
 	do {
-		if (cable_hw == CABLE_HW_USB) {
+		if (ctx->cable_hw == CABLE_HW_USB) {
 #ifdef WIN32
 			DWORD ev_stat, avail;
-			FT_GetStatus(ftHandle, &avail, &ev_stat, &ev_stat);
+			FT_GetStatus(ctx->ftHandle, &avail, &ev_stat, &ev_stat);
 			if (avail > len - got)
 				avail = len - got;
 			if (avail)
-				FT_Read(ftHandle, &rxbuf[got], avail,
+				FT_Read(ctx->ftHandle, &ctx->rxbuf[got], avail,
 				    (DWORD *) &res);
 			else
 				res = 0;
 #else
-			res = ftdi_read_data(&fc, &rxbuf[got], len - got);
+			res = ftdi_read_data(&ctx->fc, &ctx->rxbuf[got],
+			    len - got);
 #endif
 		} else {
 #ifdef WIN32
@@ -3128,10 +8263,10 @@ async_read_block(int len)
 			n = len - got;
 			if (n > 32)
 				n = 32;
-			ReadFile(com_port, &rxbuf[got], n,
+			ReadFile(ctx->com_port, &ctx->rxbuf[got], n,
 			    (DWORD *) &res, NULL);
 #else
-			res = read(com_port, &rxbuf[got], len - got);
+			res = read(ctx->com_port, &ctx->rxbuf[got], len - got);
 			if (res == -1)
 				res = 0;
 #endif
@@ -3141,14 +8276,17 @@ async_read_block(int len)
 			backoff = 0;
 		} else {
 			backoff++;
+			ctx->stats.retries++;
+			stats_enter(&ctx->stats, STAT_RETRY);
 			ms_sleep(backoff * 4);
+			stats_leave(&ctx->stats);
 		}
 	} while (got < len && backoff < backoff_lim);
         if(global_debug)
         {
 		fprintf(stderr, "<");
 		for(i = 0; i < got; i++)
-			fprintf(stderr, " %02x", rxbuf[i]);
+			fprintf(stderr, " %02x", ctx->rxbuf[i]);
 		fprintf(stderr, "\n");
 	}
 	return (got);
@@ -3156,32 +8294,33 @@ async_read_block(int len)
 
 
 static int
-async_send_block(int len)
+async_send_block(struct jtag_ctx *ctx, int len)
 {
 	int sent;
 	int i;
 
-	if (cable_hw == CABLE_HW_USB) {
+	if (ctx->cable_hw == CABLE_HW_USB) {
 #ifdef WIN32
-		FT_Write(ftHandle, txbuf, len, (DWORD *) &sent);
+		FT_Write(ctx->ftHandle, ctx->txbuf, len, (DWORD *) &sent);
 #else
-		sent = ftdi_write_data(&fc, txbuf, len);
+		sent = ftdi_write_data(&ctx->fc, ctx->txbuf, len);
 #endif
 	} else {
 #ifdef WIN32
-		WriteFile(com_port, txbuf, len, (DWORD *) &sent, NULL);
+		WriteFile(ctx->com_port, ctx->txbuf, len, (DWORD *) &sent,
+		    NULL);
 #else
-		fcntl(com_port, F_SETFL, 0);
-		sent = write(com_port, txbuf, len);
-		tcdrain(com_port); // flush data to hardware
-		fcntl(com_port, F_SETFL, O_NONBLOCK);
+		fcntl(ctx->com_port, F_SETFL, 0);
+		sent = write(ctx->com_port, ctx->txbuf, len);
+		tcdrain(ctx->com_port); // flush data to hardware
+		fcntl(ctx->com_port, F_SETFL, O_NONBLOCK);
 #endif
 	}
         if(global_debug)
         {
 		fprintf(stderr, ">");
 		for(i = 0; i < sent && i < 20; i++)
-			fprintf(stderr, " %02x", txbuf[i]);
+			fprintf(stderr, " %02x", ctx->txbuf[i]);
 		if(sent >= 20)
 			fprintf(stderr, "...");
 		fprintf(stderr, "\n");
@@ -3194,54 +8333,54 @@ async_send_block(int len)
 
 
 static void
-async_send_uint8(uint32_t data)
+async_send_uint8(struct jtag_ctx *ctx, uint32_t data)
 {
 
-	txbuf[0] = data;
-	async_send_block(1);
+	ctx->txbuf[0] = data;
+	async_send_block(ctx, 1);
 }
 
 
 static void
-async_send_uint32(uint32_t data)
+async_send_uint32(struct jtag_ctx *ctx, uint32_t data)
 {
 	int i;
 
 	for (i = 0; i < 4; i++) {
-		txbuf[i] = (data >> 24);
+		ctx->txbuf[i] = (data >> 24);
 		data <<= 8;
 	}
-	async_send_block(4);
+	async_send_block(ctx, 4);
 }
 
 
 static int
-async_set_baudrate(int speed)
+async_set_baudrate(struct jtag_ctx *ctx, int speed)
 {
 
-	if (cable_hw == CABLE_HW_USB) {
+	if (ctx->cable_hw == CABLE_HW_USB) {
 #ifdef WIN32
-		FT_SetBaudRate(ftHandle, speed);
+		FT_SetBaudRate(ctx->ftHandle, speed);
 #else
-		ftdi_set_baudrate(&fc, speed);
+		ftdi_set_baudrate(&ctx->fc, speed);
 #endif
 	} else {
 #ifdef WIN32
-		if (GetCommState(com_port, &tty) == 0) {
+		if (GetCommState(ctx->com_port, &ctx->tty) == 0) {
 			fprintf(stderr, "%s is not a COM port\n", com_name);
 			exit(EXIT_FAILURE);
 		}
-		tty.BaudRate = speed;
-		tty.StopBits = 0;
-		tty.Parity = 0;
-		tty.ByteSize = 8;
-		if (SetCommState(com_port, &tty) == 0) {
+		ctx->tty.BaudRate = speed;
+		ctx->tty.StopBits = 0;
+		ctx->tty.Parity = 0;
+		ctx->tty.ByteSize = 8;
+		if (SetCommState(ctx->com_port, &ctx->tty) == 0) {
 			fprintf(stderr, "Can't set baudrate to %d\n", speed);
 			exit(EXIT_FAILURE);
 		}
 #else
-		cfsetspeed(&tty, speed);
-		if (tcsetattr(com_port, TCSAFLUSH, &tty) != 0) {
+		cfsetspeed(&ctx->tty, speed);
+		if (tcsetattr(ctx->com_port, TCSAFLUSH, &ctx->tty) != 0) {
 			fprintf(stderr, "Can't set baudrate to %d\n", speed);
 			exit(EXIT_FAILURE);
 		}
@@ -3251,14 +8390,32 @@ async_set_baudrate(int speed)
 }
 
 
-static void
-txfile(void)
+/*
+ * Copy a block into place, returning the rotate-and-add checksum which
+ * the f32c loader computes over the received data.
+ */
+static uint32_t
+txfile_crc(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+	uint32_t crc = 0, i;
+
+	for (i = 0; i < len; i++) {
+		crc = (crc >> 31) | (crc << 1);
+		dst[i] = src[i];
+		crc += dst[i];
+	}
+	return (crc);
+}
+
+
+static int
+txfile(struct jtag_ctx *ctx)
 {
 	int infile, res;
 	int crc_retry;
-	int tx_retry, tx_success;
-	uint32_t rx_crc, local_crc, crc_i, tx_cnt;
-	uint32_t i, base, bootaddr;
+	int tx_retry, tx_success = 1;
+	uint32_t rx_crc, local_crc, tx_cnt;
+	uint32_t i, base = 0, bootaddr = 0;
 	uint8_t hdrbuf[40];
 	uint32_t *longp = (void *) hdrbuf;
 	uint16_t *shortp = (void *) hdrbuf;
@@ -3273,14 +8430,14 @@ txfile(void)
 		);
 		if (infile < 0) {
 			fprintf(stderr, "%s: cannot open\n", txfname);
-			return;
+			return (EXIT_FAILURE);
 		}
 		i = read(infile, hdrbuf, sizeof(hdrbuf));
 		close(infile);
 		if (i != sizeof(hdrbuf)) {
 			fprintf(stderr, "%s: short read: got %d instead of "
 			    "%d bytes\n", txfname, i, (int) sizeof(hdrbuf));
-			return;
+			return (EXIT_FAILURE);
 		}
 		if (longp[0] == 0x3c00f32c &&
 		    shortp[3] == 0x3c10 && shortp[5] == 0x2610 &&
@@ -3308,7 +8465,7 @@ txfile(void)
 		} else {
 			fprintf(stderr,
 			    "f32c header not found, invalid file type!\n");
-			return;
+			return (EXIT_FAILURE);
 		}
 		bootaddr = base;
 		if (!quiet)
@@ -3325,30 +8482,31 @@ txfile(void)
 	    );
 	if (infile < 0) {
 		fprintf(stderr, "%s: cannot open\n", txfname);
-		return;
+		return (EXIT_FAILURE);
 	}
 
-	async_set_baudrate(bauds);
-	if (cable_hw == CABLE_HW_USB) {
-		set_port_mode(PORT_MODE_UART);
+	async_set_baudrate(ctx, bauds);
+	if (ctx->cable_hw == CABLE_HW_USB) {
+		set_port_mode(ctx, PORT_MODE_UART);
 #ifdef WIN32
-		FT_SetDataCharacteristics(ftHandle, FT_BITS_8, FT_STOP_BITS_1,
+		FT_SetDataCharacteristics(ctx->ftHandle, FT_BITS_8,
+		    FT_STOP_BITS_1,
 		    FT_PARITY_NONE);
-		FT_SetFlowControl(ftHandle, FT_FLOW_NONE, 0, 0);
-		do {} while (FT_StopInTask(ftHandle) != FT_OK);
+		FT_SetFlowControl(ctx->ftHandle, FT_FLOW_NONE, 0, 0);
+		do {} while (FT_StopInTask(ctx->ftHandle) != FT_OK);
 		ms_sleep(50);
-		FT_Purge(ftHandle, FT_PURGE_RX);
-		do {} while (FT_RestartInTask(ftHandle) != FT_OK);
+		FT_Purge(ctx->ftHandle, FT_PURGE_RX);
+		do {} while (FT_RestartInTask(ctx->ftHandle) != FT_OK);
 #else
-		ftdi_set_line_property(&fc, BITS_8, STOP_BIT_1, NONE);
-		ftdi_setflowctrl(&fc, SIO_DISABLE_FLOW_CTRL);
-		ftdi_usb_purge_buffers(&fc);
+		ftdi_set_line_property(&ctx->fc, BITS_8, STOP_BIT_1, NONE);
+		ftdi_setflowctrl(&ctx->fc, SIO_DISABLE_FLOW_CTRL);
+		ftdi_usb_purge_buffers(&ctx->fc);
 		ms_sleep(50);
 #endif
 	}
 
 	/* Send a space mark to break into SIO loader prompt */
-	async_send_uint8(' ');
+	async_send_uint8(ctx, ' ');
 
 	/* Wait for f32c ROM to catch up */
 	if (tx_binary)
@@ -3357,17 +8515,17 @@ txfile(void)
 		ms_sleep(100);
 
 	/* Prune any stale data from rx buffer */
-	async_read_block(2048);
+	async_read_block(ctx, 2048);
 
 	if (tx_binary) {
 		/* Start of binary transfer marker */
-		async_send_uint8(255);
+		async_send_uint8(ctx, 255);
 
-		async_send_uint8(0x80);	/* CMD: set base */
-		async_send_uint32(xbauds);
-		async_send_uint8(0xb0);	/* CMD: set baudrate */
+		async_send_uint8(ctx, 0x80);	/* CMD: set base */
+		async_send_uint32(ctx, xbauds);
+		async_send_uint8(ctx, 0xb0);	/* CMD: set baudrate */
 		ms_sleep(50);
-		async_set_baudrate(xbauds);
+		async_set_baudrate(ctx, xbauds);
 	}
 
 	i = bauds / 300;
@@ -3379,14 +8537,19 @@ txfile(void)
 		i = 8192;
 	do {
 		if (!quiet) {
-			printf("%c ", statc[blinker_phase]);
+			printf("%c ", statc[ctx->blinker_phase]);
 			printf("\rSending %s: ", txfname);
 			fflush(stdout);
-			blinker_phase = (blinker_phase + 1) & 0x3;
+			ctx->blinker_phase = (ctx->blinker_phase + 1) & 0x3;
 		}
-		res = read(infile, &txbuf[8192], i);
+		res = read(infile, &ctx->txbuf[8192], i);
 		if (!tx_binary && txfu_ms)
 			ms_sleep(txfu_ms);
+		if (res < 0) {
+			fprintf(stderr, "%s: read error: %s\n", txfname,
+			    strerror(errno));
+			tx_success = 0;
+		}
 		if (res <= 0) {
 			tx_cnt = 0;
 		} else
@@ -3399,43 +8562,38 @@ txfile(void)
 		   tx_success = 0;
 		   for(tx_retry = 0; tx_retry < 4 && tx_success == 0; tx_retry++)
 		   {
-			async_send_uint8(0x80);	/* CMD: set base */
-			async_send_uint32(tx_cnt);
-			async_send_uint8(0x90);	/* CMD: len = base */
-
-			async_send_uint8(0x80);	/* CMD: set base */
-			async_send_uint32(base);
-
-			async_send_uint8(0xa0);	/* CMD: Write block */
-			local_crc = 0;
-			for (crc_i = 0; crc_i < tx_cnt; crc_i++) {
-				local_crc =
-				    (local_crc >> 31) | (local_crc << 1);
-				txbuf[crc_i] = txbuf[crc_i + 8192];
-				local_crc += txbuf[crc_i];
-			}
+			async_send_uint8(ctx, 0x80);	/* CMD: set base */
+			async_send_uint32(ctx, tx_cnt);
+			async_send_uint8(ctx, 0x90);	/* CMD: len = base */
+
+			async_send_uint8(ctx, 0x80);	/* CMD: set base */
+			async_send_uint32(ctx, base);
+
+			async_send_uint8(ctx, 0xa0);	/* CMD: Write block */
+			local_crc = txfile_crc(ctx->txbuf,
+			    &ctx->txbuf[8192], tx_cnt);
 			#if 0
 			if(1) // intentionally damage tx packet to test CRC
 			{
 				// srandom(time(NULL)); // randomize seed, each run will be different
 				if( (rand() % 256) > 100 ) // error probability 100/256
-					txbuf[rand() % tx_cnt] = rand() % 0xFF; // error byte at random place
+					ctx->txbuf[rand() % tx_cnt] = rand() % 0xFF; // error byte at random place
 			}
 			#endif
-			if (async_send_block(tx_cnt)) {
+			if (async_send_block(ctx, tx_cnt)) {
 				fprintf(stderr, "Block sending failed!\n");
 				tx_cnt = -1;
 				continue;
 			}
 			if(txfu_ms > 0)
 				ms_sleep(txfu_ms);
-			async_send_uint8(0x81); // read checksum
+			async_send_uint8(ctx, 0x81); // read checksum
 			res = 0;
 			for(crc_retry = 4; crc_retry > 0 && res != 4; ms_sleep(10), crc_retry--)
 			{
-				res = async_read_block(4);
+				res = async_read_block(ctx, 4);
 				if(crc_retry == 2 && res != 4)
-					async_send_uint8(0x81); // try again to read checksum
+					async_send_uint8(ctx, 0x81); // try again to read checksum
 			}
 			if(res != 4)
 			{
@@ -3443,10 +8601,10 @@ txfile(void)
 				    "got %d bytes, should be 4 (0x%08X)\n", res, local_crc);
 				continue;
 			}
-			rx_crc = rxbuf[0] << 24;
-			rx_crc += rxbuf[1] << 16;
-			rx_crc += rxbuf[2] << 8;
-			rx_crc += rxbuf[3];
+			rx_crc = ctx->rxbuf[0] << 24;
+			rx_crc += ctx->rxbuf[1] << 16;
+			rx_crc += ctx->rxbuf[2] << 8;
+			rx_crc += ctx->rxbuf[3];
 			if (rx_crc != local_crc) {
 				fprintf(stderr, "CRC error: "
 				    "got 0x%08x, should be 0x%08x\n",
@@ -3465,8 +8623,8 @@ txfile(void)
 			break;
 		    }
 		} else {
-			memcpy(txbuf, &txbuf[8192], tx_cnt);
-			if (async_send_block(tx_cnt)) {
+			memcpy(ctx->txbuf, &ctx->txbuf[8192], tx_cnt);
+			if (async_send_block(ctx, tx_cnt)) {
 				fprintf(stderr, "Block sending failed!\n");
 				tx_cnt = -1;
 				break;
@@ -3483,47 +8641,50 @@ txfile(void)
 	close(infile);
 	fflush(stdout);
 
-	if (tx_success == 0)
+	if (tx_success == 0) {
 		fprintf(stderr, "TX error at %08x\n", base);
-	else if (tx_binary) {
-		async_send_uint8(0x80);	/* CMD: set base */
-		async_send_uint32(bauds);
-		async_send_uint8(0xb0);	/* CMD: set baudrate */
+		return (EXIT_FAILURE);
+	}
+	if (tx_binary) {
+		async_send_uint8(ctx, 0x80);	/* CMD: set base */
+		async_send_uint32(ctx, bauds);
+		async_send_uint8(ctx, 0xb0);	/* CMD: set baudrate */
 		ms_sleep(50);
-		async_set_baudrate(bauds);
+		async_set_baudrate(ctx, bauds);
 
-		async_send_uint8(0x80);	/* CMD: set base */
-		async_send_uint32(bootaddr);
-		async_send_uint8(0xb1);	/* CMD: jump to base */
+		async_send_uint8(ctx, 0x80);	/* CMD: set base */
+		async_send_uint32(ctx, bootaddr);
+		async_send_uint8(ctx, 0xb1);	/* CMD: jump to base */
 	}
+	return (0);
 }
 
 
 static void
-genbrk(int ms)
+genbrk(struct jtag_ctx *ctx, int ms)
 {
 
-	if (cable_hw == CABLE_HW_USB) {
+	if (ctx->cable_hw == CABLE_HW_USB) {
 #ifdef WIN32
-		FT_SetBreakOn(ftHandle);
+		FT_SetBreakOn(ctx->ftHandle);
 		ms_sleep(ms);
-		FT_SetBreakOff(ftHandle);
+		FT_SetBreakOff(ctx->ftHandle);
 #else
-		ftdi_set_line_property2(&fc, BITS_8, STOP_BIT_1, NONE,
+		ftdi_set_line_property2(&ctx->fc, BITS_8, STOP_BIT_1, NONE,
 		    BREAK_ON);
 		ms_sleep(ms);
-		ftdi_set_line_property2(&fc, BITS_8, STOP_BIT_1, NONE,
+		ftdi_set_line_property2(&ctx->fc, BITS_8, STOP_BIT_1, NONE,
 		    BREAK_OFF);
 #endif
 	} else {
 #ifdef WIN32
-		EscapeCommFunction(com_port, SETBREAK);
+		EscapeCommFunction(ctx->com_port, SETBREAK);
 		ms_sleep(ms);
-		EscapeCommFunction(com_port, CLRBREAK);
+		EscapeCommFunction(ctx->com_port, CLRBREAK);
 #else
-		ioctl(com_port, TIOCSBRK, NULL);
+		ioctl(ctx->com_port, TIOCSBRK, NULL);
 		ms_sleep(ms);
-		ioctl(com_port, TIOCCBRK, NULL);
+		ioctl(ctx->com_port, TIOCCBRK, NULL);
 #endif
 	}
 	ms_sleep(20);
@@ -3551,33 +8712,33 @@ static int deb_riscv;
 
 
 static void
-deb_print_reg(int off)
+deb_print_reg(struct jtag_ctx *ctx, int off)
 {
 	int i;
 
 	for (i = 0; i < 4; i++)
-		printf("%02x", rxbuf[off * 4 + (3 - i)]);
+		printf("%02x", ctx->rxbuf[off * 4 + (3 - i)]);
 }
 
 
 static int
-deb_get_seqn()
+deb_get_seqn(struct jtag_ctx *ctx)
 {
 	int i;
 
-	i = async_read_block(1);
+	i = async_read_block(ctx, 1);
 	if (i == 0) {
 		printf("Error: got no sequence number, "
 		    "debugger disfunctional!\n");
 		return (1);
 	}
-	if (rxbuf[0] != ((deb_seqn + 1) & 0xff)) {
+	if (ctx->rxbuf[0] != ((deb_seqn + 1) & 0xff)) {
 		printf("Error: bad sequence number: "
-		    "got %d, should have %d\n", rxbuf[0],
+		    "got %d, should have %d\n", ctx->rxbuf[0],
 		    (deb_seqn + 1) & 0xff);
 		return (1);
 	}
-	deb_seqn = rxbuf[0];
+	deb_seqn = ctx->rxbuf[0];
 	return (0);
 }
 
@@ -3585,15 +8746,15 @@ deb_get_seqn()
 #define	BREAKPOINTS 2
 
 static int
-deb_print_breakpoints(void)
+deb_print_breakpoints(struct jtag_ctx *ctx)
 {
 	int i, enabled, trapped;
 
-	async_send_uint8(0xa1);		/* DEB_CMD_BREAKPOINT_RD */
-	async_send_uint8(0);		/* start at breakpoint #0 */
-	async_send_uint8(BREAKPOINTS - 1);/* fetch values */
-	deb_get_seqn();
-	i = async_read_block(BREAKPOINTS * 4);
+	async_send_uint8(ctx, 0xa1);		/* DEB_CMD_BREAKPOINT_RD */
+	async_send_uint8(ctx, 0);		/* start at breakpoint #0 */
+	async_send_uint8(ctx, BREAKPOINTS - 1);/* fetch values */
+	deb_get_seqn(ctx);
+	i = async_read_block(ctx, BREAKPOINTS * 4);
 	if (i != BREAKPOINTS * 4) {
 		printf("\nError: short read "
 		    "(%d instead of %d)\n", i, BREAKPOINTS * 4);
@@ -3601,12 +8762,12 @@ deb_print_breakpoints(void)
 	}
 
 	for (i = 0; i < BREAKPOINTS; i++) {
-		enabled = rxbuf[i * 4] & 1;
-		trapped = rxbuf[i * 4] & 2;
-		rxbuf[i * 4] &= ~3;
+		enabled = ctx->rxbuf[i * 4] & 1;
+		trapped = ctx->rxbuf[i * 4] & 2;
+		ctx->rxbuf[i * 4] &= ~3;
 		printf("breakpoint #%d: ", i);
 		if (enabled) {
-			deb_print_reg(i);
+			deb_print_reg(ctx, i);
 			if (trapped)
 				printf(" (trapped)");
 			printf("\n");
@@ -3619,15 +8780,15 @@ deb_print_breakpoints(void)
 
 
 static int
-deb_print_registers(void)
+deb_print_registers(struct jtag_ctx *ctx)
 {
 	int r, c, i;
 
-	async_send_uint8(0xa0);		/* DEB_CMD_REG_RD */
-	async_send_uint8(0);		/* start at reg #0 */
-	async_send_uint8(63);		/* fetch 64 values */
-	deb_get_seqn();
-	i = async_read_block(64 * 4);
+	async_send_uint8(ctx, 0xa0);		/* DEB_CMD_REG_RD */
+	async_send_uint8(ctx, 0);		/* start at reg #0 */
+	async_send_uint8(ctx, 63);		/* fetch 64 values */
+	deb_get_seqn(ctx);
+	i = async_read_block(ctx, 64 * 4);
 	if (i != 64 * 4) {
 		printf("\nError: short read "
 		    "(%d instead of %d)\n", i, 64 * 4);
@@ -3644,7 +8805,7 @@ deb_print_registers(void)
 			else
 				printf("$%d (%s): ", r + 8 * c,
 				    mips_reg_names[r + 8 * c]);
-			deb_print_reg(r + 8 * c);
+			deb_print_reg(ctx, r + 8 * c);
 			if (c != 3)
 				printf("  ");
 		}
@@ -3653,53 +8814,53 @@ deb_print_registers(void)
 	printf("\n");
 
 	printf(" HI: ");
-	deb_print_reg(32);
+	deb_print_reg(ctx, 32);
 	printf(" LO: ");
-	deb_print_reg(33);
+	deb_print_reg(ctx, 33);
 	printf(" SR: ");
-	deb_print_reg(34);
+	deb_print_reg(ctx, 34);
 	printf(" CS: ");
-	deb_print_reg(35);
+	deb_print_reg(ctx, 35);
 	printf(" EPC: ");
-	deb_print_reg(36);
+	deb_print_reg(ctx, 36);
 	printf(" EB: ");
-	deb_print_reg(37);
+	deb_print_reg(ctx, 37);
 	printf("\n");
 
 	printf("\n");
 	printf(" IF A: ");
-	deb_print_reg(40);
+	deb_print_reg(ctx, 40);
 	printf("  ID A: ");
-	deb_print_reg(42);
+	deb_print_reg(ctx, 42);
 	printf("  EX A: ");
-	deb_print_reg(44);
+	deb_print_reg(ctx, 44);
 	printf("  MA A: ");
-	deb_print_reg(46);
+	deb_print_reg(ctx, 46);
 	printf("  WB A: ");
-	deb_print_reg(48);
+	deb_print_reg(ctx, 48);
 	printf("\n");
 
 	printf(" IF I: ");
-	deb_print_reg(41);
+	deb_print_reg(ctx, 41);
 	printf("  ID I: ");
-	deb_print_reg(43);
+	deb_print_reg(ctx, 43);
 	printf("  EX I: ");
-	deb_print_reg(45);
+	deb_print_reg(ctx, 45);
 	printf("  MA I: ");
-	deb_print_reg(47);
+	deb_print_reg(ctx, 47);
 	printf("  WB I: ");
-	deb_print_reg(49);
+	deb_print_reg(ctx, 49);
 	printf("\n");
 
 	printf("\n");
 	printf(" Count: ");
-	deb_print_reg(38);
+	deb_print_reg(ctx, 38);
 	printf("     Exec: ");
-	deb_print_reg(52);
+	deb_print_reg(ctx, 52);
 	printf("     Branch: ");
-	deb_print_reg(53);
+	deb_print_reg(ctx, 53);
 	printf("     Mispred: ");
-	deb_print_reg(54);
+	deb_print_reg(ctx, 54);
 	printf("\n");
 
 	return (0);
@@ -3727,7 +8888,7 @@ debug_help(void)
 
 
 static void
-debug_cmd(void)
+debug_cmd(struct jtag_ctx *ctx)
 {
 	char cmdbuf[256];
 	int i, j, c, r;
@@ -3738,38 +8899,38 @@ debug_cmd(void)
 
 	/* Enable debugger */
 	printf("\n*** Entering debug mode ***\n");
-	async_send_uint8(0x9d);
-	async_send_uint8(0xed);
+	async_send_uint8(ctx, 0x9d);
+	async_send_uint8(ctx, 0xed);
 
 	/* Flush read buffer */
-	async_read_block(BUFLEN_MAX);
+	async_read_block(ctx, BUFLEN_MAX);
 
 	/* Fetch initial sequence number and config register */
-	async_send_uint8(0xa0);		/* DEB_CMD_REG_RD */
-	async_send_uint8(55);		/* start at reg #55 */
-	async_send_uint8(0);		/* fetch 1 value */
-	i = async_read_block(1);
+	async_send_uint8(ctx, 0xa0);		/* DEB_CMD_REG_RD */
+	async_send_uint8(ctx, 55);		/* start at reg #55 */
+	async_send_uint8(ctx, 0);		/* fetch 1 value */
+	i = async_read_block(ctx, 1);
 	if (i == 0) {
 		printf("Error: got no sequence number\n");
 		printf("Debugger disfunctional, exiting.\n");
 		return;
 	}
-	deb_seqn = rxbuf[0];
-	i = async_read_block(4);
+	deb_seqn = ctx->rxbuf[0];
+	i = async_read_block(ctx, 4);
 	if (i != 4) {
 		printf("\nError: short read (%d instead of %d)\n", i, 4);
 		printf("Debugger disfunctional, exiting.\n");
 		return;
 	}
 	printf("Detected ");
-	if (rxbuf[1] & 0x80) {
+	if (ctx->rxbuf[1] & 0x80) {
 		printf("big-endian ");
 		deb_big_endian = 1;
 	} else {
 		printf("little-endian ");
 		deb_big_endian = 0;
 	}
-	if (rxbuf[1] & 0x40) {
+	if (ctx->rxbuf[1] & 0x40) {
 		printf("f32c/riscv");
 		deb_riscv = 1;
 	} else {
@@ -3777,7 +8938,8 @@ debug_cmd(void)
 		deb_riscv = 0;
 	}
 	printf(" core, clk ticks at %f MHz.\n", 1.0 *
-	    (((rxbuf[3] & 0xf) << 8) + rxbuf[2]) / ((rxbuf[3] >> 5) + 1));
+	    (((ctx->rxbuf[3] & 0xf) << 8) + ctx->rxbuf[2]) /
+	    ((ctx->rxbuf[3] >> 5) + 1));
 
 	do {
 		printf("db> ");
@@ -3791,21 +8953,22 @@ debug_cmd(void)
 			c = atoi(&cmdbuf[i + 1]);
 			if (c < 1)
 				c = 1;
-			async_send_uint8(0xef);	/* DEB_CMD_CLK_STEP */
-			async_send_uint32(0);	/* disable clk when done */
-			async_send_uint32(c);	/* how many cycles */
-			deb_get_seqn();
+			async_send_uint8(ctx, 0xef);	/* DEB_CMD_CLK_STEP */
+			async_send_uint32(ctx,
+			    0);	/* disable clk when done */
+			async_send_uint32(ctx, c);	/* how many cycles */
+			deb_get_seqn(ctx);
 			printf("Single-stepping %d cycle(s)...\n", c);
 			/* XXX ugly hack, wait for cycles to pass... */
 			ms_sleep(c / 50000);
-			deb_print_registers();
+			deb_print_registers(ctx);
 			break;
 		case 'b': /* set / clear breakpoints */
 			i++;
 			while (cmdbuf[i] == ' ' || cmdbuf[i] == 8)
 				i++;
 			if (cmdbuf[i] == 0) {
-				deb_print_breakpoints();
+				deb_print_breakpoints(ctx);
 				break;
 			}
 			j = i;
@@ -3820,23 +8983,23 @@ debug_cmd(void)
 			c &= ~3;	/* Word align */
 			if (cmdbuf[i] != 0)
 				c |= 1;	 /* Set breakpoint enable flag */
-			async_send_uint8(0xe1); /* DEB_CMD_BREAKPOINT_WR */
-			async_send_uint32(r);	/* dst reg */
-			async_send_uint32(c);	/* value */
-			deb_get_seqn();
+			async_send_uint8(ctx, 0xe1); /* DEB_CMD_BREAKPOINT_WR */
+			async_send_uint32(ctx, r);	/* dst reg */
+			async_send_uint32(ctx, c);	/* value */
+			deb_get_seqn(ctx);
 			break;
 		case 'c': /* continue */
-			async_send_uint8(0xef); /* DEB_CMD_CLK_STEP */
-			async_send_uint32(1);	/* enable clk */
-			async_send_uint32(0);	/* don't wait */
-			deb_get_seqn();
+			async_send_uint8(ctx, 0xef); /* DEB_CMD_CLK_STEP */
+			async_send_uint32(ctx, 1);	/* enable clk */
+			async_send_uint32(ctx, 0);	/* don't wait */
+			deb_get_seqn(ctx);
 			break;
 		case 'r': /* print registers */
-			deb_print_registers();
+			deb_print_registers(ctx);
 			break;
 		case 'R': /* continuously print registers */
 			do {
-				if (deb_print_registers() != 0)
+				if (deb_print_registers(ctx) != 0)
 					break;
 #ifdef WIN32
 				if (kbhit()) {
@@ -3876,14 +9039,14 @@ debug_cmd(void)
 
 	/* Exit debugger */
 	printf("*** Exiting debug mode ***\n");
-	async_send_uint8(0x9d);
-	async_send_uint8(0xdd);
-	async_read_block(1);
+	async_send_uint8(ctx, 0x9d);
+	async_send_uint8(ctx, 0xdd);
+	async_read_block(ctx, 1);
 }
 
 
 static int
-term_emul(void)
+term_emul(struct jtag_ctx *ctx)
 {
 #ifdef WIN32
 	DWORD saved_cons_mode;
@@ -3911,18 +9074,19 @@ term_emul(void)
 	int i;
 	
 #ifdef WIN32
-	if (cable_hw == CABLE_HW_USB) {
-		FT_SetLatencyTimer(ftHandle, 20);
-		FT_SetBaudRate(ftHandle, bauds);
-		FT_SetDataCharacteristics(ftHandle, FT_BITS_8, FT_STOP_BITS_1,
+	if (ctx->cable_hw == CABLE_HW_USB) {
+		FT_SetLatencyTimer(ctx->ftHandle, 20);
+		FT_SetBaudRate(ctx->ftHandle, bauds);
+		FT_SetDataCharacteristics(ctx->ftHandle, FT_BITS_8,
+		    FT_STOP_BITS_1,
 		    FT_PARITY_NONE);
-		FT_SetFlowControl(ftHandle, FT_FLOW_NONE, 0, 0);
-		if (port_mode != PORT_MODE_UART) {
-			set_port_mode(PORT_MODE_UART);
-			do {} while (FT_StopInTask(ftHandle) != FT_OK);
+		FT_SetFlowControl(ctx->ftHandle, FT_FLOW_NONE, 0, 0);
+		if (ctx->port_mode != PORT_MODE_UART) {
+			set_port_mode(ctx, PORT_MODE_UART);
+			do {} while (FT_StopInTask(ctx->ftHandle) != FT_OK);
 			ms_sleep(50);
-			FT_Purge(ftHandle, FT_PURGE_RX);
-			do {} while (FT_RestartInTask(ftHandle) != FT_OK);
+			FT_Purge(ctx->ftHandle, FT_PURGE_RX);
+			do {} while (FT_RestartInTask(ctx->ftHandle) != FT_OK);
 		}
 	}
 
@@ -3937,15 +9101,15 @@ term_emul(void)
 	SetConsoleCursorInfo(cons_out, &cursor_info);
 	SetConsoleTextAttribute(cons_out, color0);
 #else
-	if (cable_hw == CABLE_HW_USB) {
-		if (port_mode != PORT_MODE_UART) {
-			set_port_mode(PORT_MODE_UART);
-			ftdi_usb_purge_buffers(&fc);
+	if (ctx->cable_hw == CABLE_HW_USB) {
+		if (ctx->port_mode != PORT_MODE_UART) {
+			set_port_mode(ctx, PORT_MODE_UART);
+			ftdi_usb_purge_buffers(&ctx->fc);
 		}
-		ftdi_set_latency_timer(&fc, 20);
-		ftdi_set_baudrate(&fc, bauds);
-		ftdi_set_line_property(&fc, BITS_8, STOP_BIT_1, NONE);
-		ftdi_setflowctrl(&fc, SIO_DISABLE_FLOW_CTRL);
+		ftdi_set_latency_timer(&ctx->fc, 20);
+		ftdi_set_baudrate(&ctx->fc, bauds);
+		ftdi_set_line_property(&ctx->fc, BITS_8, STOP_BIT_1, NONE);
+		ftdi_setflowctrl(&ctx->fc, SIO_DISABLE_FLOW_CTRL);
 	}
 
 	/* Disable CTRL-C, XON/XOFF etc. processing on console input. */
@@ -3962,7 +9126,7 @@ term_emul(void)
 			i = bauds / 300;
 			if (bauds < 4800)
 				i = 16;
-			res = read(infile, txbuf, i);
+			res = read(infile, ctx->txbuf, i);
 			if (res <= 0) {
 				close(infile);
 				infile = -1;
@@ -3986,10 +9150,10 @@ term_emul(void)
 #ifdef WIN32
 		while (kbhit()) {
 			c = getch();
-			txbuf[tx_cnt] = c;
+			ctx->txbuf[tx_cnt] = c;
 #else
-		while (read(0, &txbuf[tx_cnt], 1) > 0) {
-			c = txbuf[tx_cnt];
+		while (read(0, &ctx->txbuf[tx_cnt], 1) > 0) {
+			c = ctx->txbuf[tx_cnt];
 #endif
 #ifdef WIN32
 			/*
@@ -4037,7 +9201,7 @@ term_emul(void)
 				default:
 					break;
 				}
-				tx_cnt += sprintf((char *) &txbuf[tx_cnt],
+				tx_cnt += sprintf((char *) &ctx->txbuf[tx_cnt],
 				    "%s", keystr);
 				tx_esc_seqn = 0;
 				continue;
@@ -4076,7 +9240,7 @@ term_emul(void)
 				default:
 					break;
 				}
-				tx_cnt += sprintf((char *) &txbuf[tx_cnt],
+				tx_cnt += sprintf((char *) &ctx->txbuf[tx_cnt],
 				    "%s", keystr);
 				tx_esc_seqn = 0;
 				continue;
@@ -4091,20 +9255,21 @@ term_emul(void)
 				switch (c) {
 				case '?':
 					printf("~?\n");
-					terminal_help();
+					terminal_help(ctx->cable_hw ==
+					    CABLE_HW_USB);
 					continue;
 				case '#':
-					genbrk(BREAK_MS);
+					genbrk(ctx, BREAK_MS);
 					continue;
 				case '1' ... '9':
 					for (c -= '0'; c > 0; c--)
-						genbrk(PULSE_MS);
+						genbrk(ctx, PULSE_MS);
 					continue;
 				case 'c':
-					if (cable_hw != CABLE_HW_USB) {
-						txbuf[tx_cnt] = '~';
+					if (ctx->cable_hw != CABLE_HW_USB) {
+						ctx->txbuf[tx_cnt] = '~';
 						tx_cnt++;
-						txbuf[tx_cnt] = c;
+						ctx->txbuf[tx_cnt] = c;
 						key_phase = 0;
 						break;
 					}
@@ -4118,9 +9283,9 @@ term_emul(void)
 					else {
 						c |= 0xf0;
 #ifdef WIN32
-						FT_SetBitMode(ftHandle,
+						FT_SetBitMode(ctx->ftHandle,
 #else
-						ftdi_set_bitmode(&fc,
+						ftdi_set_bitmode(&ctx->fc,
 #endif
 						    c, BITMODE_CBUS);
 					}
@@ -4138,13 +9303,13 @@ term_emul(void)
 					gets1(argbuf, sizeof(argbuf));
 					c = atoi(argbuf);
 					if (c > 0 &&
-					    cable_hw == CABLE_HW_USB) {
+					    ctx->cable_hw == CABLE_HW_USB) {
 #ifdef WIN32
-						res = FT_SetBaudRate(ftHandle,
+						res = FT_SetBaudRate(ctx->ftHandle,
 						    c);
 						if (res == FT_OK) {
 #else
-						res = ftdi_set_baudrate(&fc,
+						res = ftdi_set_baudrate(&ctx->fc,
 						    c);
 						if (res == 0) {
 #endif
@@ -4173,13 +9338,13 @@ term_emul(void)
 						    argbuf);
 					continue;
 				case 'd':
-					debug_cmd();
+					debug_cmd(ctx);
 					continue;
 				default:
 					if (c != '~') {
-						txbuf[tx_cnt] = '~';
+						ctx->txbuf[tx_cnt] = '~';
 						tx_cnt++;
-						txbuf[tx_cnt] = c;
+						ctx->txbuf[tx_cnt] = c;
 					}
 					key_phase = 0;
 					break;
@@ -4198,20 +9363,22 @@ term_emul(void)
 				break;
 		}
 		if (tx_cnt) {
-			if (cable_hw == CABLE_HW_USB) {
+			if (ctx->cable_hw == CABLE_HW_USB) {
 #ifdef WIN32
-				FT_Write(ftHandle, txbuf, tx_cnt, &sent);
+				FT_Write(ctx->ftHandle, ctx->txbuf, tx_cnt,
+				    &sent);
 #else
-				sent = ftdi_write_data(&fc, txbuf, tx_cnt);
+				sent = ftdi_write_data(&ctx->fc, ctx->txbuf,
+				    tx_cnt);
 #endif
 			} else {/* cable_hw == CABLE_HW_COM */
 #ifdef WIN32
-				WriteFile(com_port, txbuf, tx_cnt,
+				WriteFile(ctx->com_port, ctx->txbuf, tx_cnt,
 				    (DWORD *) &sent, NULL);
 #else
-				fcntl(com_port, F_SETFL, 0);
-				sent = write(com_port, txbuf, tx_cnt);
-				fcntl(com_port, F_SETFL, O_NONBLOCK);
+				fcntl(ctx->com_port, F_SETFL, 0);
+				sent = write(ctx->com_port, ctx->txbuf, tx_cnt);
+				fcntl(ctx->com_port, F_SETFL, O_NONBLOCK);
 #endif
 			}
 			if (sent != tx_cnt) {
@@ -4221,27 +9388,29 @@ term_emul(void)
 		}
 
 #ifdef WIN32
-		if (cable_hw == CABLE_HW_USB) {
-			FT_GetStatus(ftHandle, &rx_cnt, &ev_stat, &ev_stat);
+		if (ctx->cable_hw == CABLE_HW_USB) {
+			FT_GetStatus(ctx->ftHandle, &rx_cnt, &ev_stat,
+			    &ev_stat);
 			if (rx_cnt > BUFLEN_MAX)
 				rx_cnt = BUFLEN_MAX;
 			if (rx_cnt)
-				FT_Read(ftHandle, txbuf, rx_cnt, &rx_cnt);
+				FT_Read(ctx->ftHandle, ctx->txbuf, rx_cnt,
+				    &rx_cnt);
 		} else {
 			rx_cnt = 32;
-			ReadFile(com_port, txbuf, rx_cnt,
+			ReadFile(ctx->com_port, ctx->txbuf, rx_cnt,
 			    (DWORD *) &rx_cnt, NULL);
 		}
 #else
 		rx_cnt = 1;
-		if (cable_hw == CABLE_HW_USB) {
-			if (rx_cnt < (int) fc.readbuffer_remaining)
-				rx_cnt = fc.readbuffer_remaining;
+		if (ctx->cable_hw == CABLE_HW_USB) {
+			if (rx_cnt < (int) ctx->fc.readbuffer_remaining)
+				rx_cnt = ctx->fc.readbuffer_remaining;
 			if (rx_cnt > BUFLEN_MAX)
 				rx_cnt = BUFLEN_MAX;
-			rx_cnt = ftdi_read_data(&fc, txbuf, rx_cnt);
+			rx_cnt = ftdi_read_data(&ctx->fc, ctx->txbuf, rx_cnt);
 		} else {
-			rx_cnt = read(com_port, txbuf, rx_cnt);
+			rx_cnt = read(ctx->com_port, ctx->txbuf, rx_cnt);
 			if (rx_cnt == -1)
 				rx_cnt = 0;
 		}
@@ -4253,7 +9422,7 @@ term_emul(void)
 			}
 #ifdef WIN32
 			for (i = 0; i < rx_cnt; i++) {
-				c = txbuf[i];
+				c = ctx->txbuf[i];
 				/*
 				 * Interpret selected VT-100 control sequences
 				 */
@@ -4334,7 +9503,8 @@ term_emul(void)
 						- screen_info.srWindow.Top,
 						screen_info.dwCursorPosition.X
 						- screen_info.srWindow.Left);
-						FT_Write(ftHandle, vt100buf,
+						FT_Write(ctx->ftHandle,
+						    vt100buf,
 						    c, &sent);
 						break;
 					case 's': /* Save cursor position */
@@ -4452,58 +9622,1121 @@ term_emul(void)
 				fwrite(&c, 1, 1, stdout);
 			}
 #else
-			fwrite(txbuf, 1, rx_cnt, stdout);
+			fwrite(ctx->txbuf, 1, rx_cnt, stdout);
+#endif
+			fflush(stdout);
+		}
+		if (tx_cnt == 0 && rx_cnt == 0) {
+			ms_sleep(sleep_t);
+			if (sleep_t < 5)
+				sleep_t++;
+		} else
+			sleep_t = 0;
+	} while (1);
+
+done:
+	printf("\n");
+
+	/* Restore special key processing on console input. */
+#ifdef WIN32
+	SetConsoleMode(cons_in, saved_cons_mode);
+	cursor_info.bVisible = 1;
+	cursor_info.dwSize = 20;
+	SetConsoleCursorInfo(cons_out, &cursor_info);
+	FT_SetLatencyTimer(ctx->ftHandle, ctx->tune.latency);
+	FT_SetBaudRate(ctx->ftHandle, ctx->tune.bauds);
+#else
+	system("stty echo isig icanon iexten ixon ixoff icrnl");
+	ftdi_set_latency_timer(&ctx->fc, ctx->tune.latency);
+	ftdi_set_baudrate(&ctx->fc, ctx->tune.bauds);
+#endif
+
+	return (res);
+}
+
+
+#ifndef WIN32
+/*
+ * Long running modes (--daemon, --watch, --xvc-server) stop on SIGINT or
+ * SIGTERM, once done with the job at hand.
+ */
+static volatile sig_atomic_t stop_requested;
+
+static void
+stop_sig(int sig)
+{
+
+	(void) sig;
+	stop_requested = 1;
+}
+
+static void
+catch_stop_signals(void)
+{
+	struct sigaction sa;
+
+	/* No SA_RESTART, so that blocking waits return with EINTR */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_sig;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
 #endif
+
+
+#ifdef USE_SOCKETS
+/*
+ * Daemon mode (--daemon SOCKET) keeps the cable open and configured and
+ * serves jobs arriving on a Unix domain socket, one at a time, so that
+ * repeated programming pays only for the data transfer.  A job is one
+ * request line, optionally followed by a payload which the client ends
+ * by shutting down its side of the connection:
+ *
+ *	sram NAME		program SRAM from the payload
+ *	flash ADDR NAME		program SPI flash at ADDR from the payload
+ *	exec PATH		send and execute a f32c binary
+ *	console BAUDS		bridge the connection to the UART
+ *	status			report the cable, TAP state and last image
+ *
+ * Messages produced while running the job are passed back to the client,
+ * followed by a NUL byte and the job's exit status.  --connect SOCKET
+ * turns the usual command line options into such jobs.
+ */
+#define	DAEMON_LINE_MAX		(PATH_MAX + 32)
+#define	CONSOLE_DETACH		0x1d	/* ^] */
+
+static struct {
+	char		image[DAEMON_LINE_MAX];	/* Last image loaded */
+	int		target;
+	int		res;
+	time_t		when;
+	unsigned	jobs;
+} dstate;
+
+static int
+daemon_getline(int s, char *buf, int size)
+{
+	int len;
+
+	/* Byte by byte, so that none of the payload is consumed */
+	for (len = 0; len < size - 1 && read(s, &buf[len], 1) == 1; len++) {
+		if (buf[len] == '\n') {
+			buf[len] = 0;
+			return (len);
+		}
+	}
+	return (-1);
+}
+
+static int
+daemon_prog(struct jtag_ctx *ctx, int s, char *name, int target, int debug)
+{
+	int fd, res;
+
+	fd = dup(s);
+	if (fd < 0) {
+		fprintf(stderr, "dup() failed\n");
+		return (EXIT_FAILURE);
+	}
+	res = prog(ctx, fd, name, target, debug);
+	strcpy(dstate.image, name);
+	dstate.target = target;
+	dstate.res = res;
+	dstate.when = time(NULL);
+	return (res);
+}
+
+static int
+daemon_exec(struct jtag_ctx *ctx, char *path)
+{
+
+	if (ctx->cable_hw != CABLE_HW_USB) {
+		fprintf(stderr, "exec requires a USB cable\n");
+		return (EXIT_FAILURE);
+	}
+	set_port_mode(ctx, PORT_MODE_UART);
+	async_set_baudrate(ctx, bauds);
+	genbrk(ctx, BREAK_MS);
+	txfname = path;
+	tx_binary = 1;
+	return (txfile(ctx));
+}
+
+static int
+daemon_console(struct jtag_ctx *ctx, int s, int speed)
+{
+	struct pollfd pfd;
+	uint8_t buf[1024];
+	int n;
+
+	if (ctx->cable_hw != CABLE_HW_USB) {
+		fprintf(stderr, "console requires a USB cable\n");
+		return (EXIT_FAILURE);
+	}
+	if (ctx->port_mode != PORT_MODE_UART) {
+		set_port_mode(ctx, PORT_MODE_UART);
+		ftdi_usb_purge_buffers(&ctx->fc);
+	}
+	ftdi_set_latency_timer(&ctx->fc, 20);
+	ftdi_set_baudrate(&ctx->fc, speed);
+	ftdi_set_line_property(&ctx->fc, BITS_8, STOP_BIT_1, NONE);
+	ftdi_setflowctrl(&ctx->fc, SIO_DISABLE_FLOW_CTRL);
+
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while (!stop_requested) {
+		if (poll(&pfd, 1, 5) > 0) {
+			n = read(s, buf, sizeof(buf));
+			if (n <= 0 || ftdi_write_data(&ctx->fc, buf, n) != n)
+				break;
+		}
+		n = ftdi_read_data(&ctx->fc, buf, sizeof(buf));
+		if (n < 0 || (n > 0 && write(s, buf, n) != n))
+			break;
+	}
+
+	ftdi_set_latency_timer(&ctx->fc, ctx->tune.latency);
+	ftdi_set_baudrate(&ctx->fc, ctx->tune.bauds);
+	return (0);
+}
+
+static int
+daemon_status(struct jtag_ctx *ctx)
+{
+
+	if (ctx->hmp != NULL)
+		printf("Cable: %s, port %d\n", ctx->hmp->cable_path,
+		    ctx->port_index);
+	printf("TAP state: %s\n", STATE2STR(ctx->cur_s));
+	if (dstate.when)
+		printf("Last image: %s (%s) %s, %s", dstate.image,
+		    dstate.target == JED_TGT_FLASH ? "flash" : "SRAM",
+		    dstate.res ? "failed" : "OK", ctime(&dstate.when));
+	else
+		printf("Last image: none\n");
+	printf("Jobs served: %u\n", dstate.jobs);
+	return (0);
+}
+
+static void
+daemon_job(struct jtag_ctx *ctx, int s, int debug)
+{
+	char line[DAEMON_LINE_MAX], arg[DAEMON_LINE_MAX];
+	const char *o_txfname = txfname;
+	int o_spi_addr = spi_addr, o_tx_binary = tx_binary;
+	int out, err, n, addr, res = EXIT_FAILURE;
+
+	if (daemon_getline(s, line, sizeof(line)) < 0)
+		return;
+
+	/* Pass our messages on to the client */
+	fflush(stdout);
+	out = dup(1);
+	err = dup(2);
+	dup2(s, 1);
+	dup2(s, 2);
+
+	if (sscanf(line, "sram %[^\n]", arg) == 1)
+		res = daemon_prog(ctx, s, arg, JED_TGT_SRAM, debug);
+	else if (sscanf(line, "flash %i %[^\n]", &addr, arg) == 2) {
+		if ((addr & (SPI_SECTOR_SIZE - 1)) != 0)
+			printf("SPI address must be a multiple of %d\n",
+			    SPI_SECTOR_SIZE);
+		else {
+			spi_addr = addr;
+			res = daemon_prog(ctx, s, arg, JED_TGT_FLASH, debug);
+		}
+	} else if (sscanf(line, "exec %[^\n]", arg) == 1)
+		res = daemon_exec(ctx, arg);
+	else if (sscanf(line, "console %d", &n) == 1)
+		res = daemon_console(ctx, s, n);
+	else if (strcmp(line, "status") == 0)
+		res = daemon_status(ctx);
+	else
+		fprintf(stderr, "Invalid request: %s\n", line);
+
+	/* A fatal error fails just this job, from a fresh TAP state */
+	if (ctx->fatal) {
+		res = EXIT_FAILURE;
+		ctx->fatal = 0;
+		ctx->cur_s = UNDEFINED;
+	}
+	/* Settings a job changes don't carry over to the next one */
+	spi_addr = o_spi_addr;
+	txfname = o_txfname;
+	tx_binary = o_tx_binary;
+
+	fflush(stdout);
+	dup2(out, 1);
+	dup2(err, 2);
+	close(out);
+	close(err);
+
+	/* Discard any payload left unread, then report */
+	while (read(s, line, sizeof(line)) > 0) {
+	}
+	n = sprintf(line, "%c%d\n", 0, res);
+	if (write(s, line, n) != n)
+		fprintf(stderr, "Lost client, job status %d\n", res);
+	dstate.jobs++;
+}
+
+static int
+daemon_run(struct jtag_ctx *ctx, const char *path, int debug)
+{
+	struct sockaddr_un sun;
+	struct stat sb;
+	mode_t mask;
+	int s, c, res;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return (EXIT_FAILURE);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) {
+		fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+		return (EXIT_FAILURE);
+	}
+
+	/* Remove a stale socket left behind by a previous daemon */
+	if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+		if (connect(s, (struct sockaddr *) &sun, sizeof(sun)) == 0) {
+			fprintf(stderr, "%s: a daemon is already serving "
+			    "there\n", path);
+			close(s);
+			return (EXIT_FAILURE);
+		}
+		close(s);
+		unlink(path);
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+	}
+
+	/* Jobs run with our privileges, so only our user may submit them */
+	mask = umask(077);
+	res = s < 0 || bind(s, (struct sockaddr *) &sun, sizeof(sun)) ||
+	    listen(s, 8);
+	umask(mask);
+	if (res) {
+		fprintf(stderr, "Can't listen on %s: %s\n", path,
+		    strerror(errno));
+		if (s >= 0)
+			close(s);
+		return (EXIT_FAILURE);
+	}
+	ctx->no_exit = 1;
+
+	catch_stop_signals();
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!quiet) {
+		printf("Serving jobs on %s\n", path);
+		fflush(stdout);
+	}
+	while (!stop_requested) {
+		c = accept(s, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "accept() failed: %s\n",
+			    strerror(errno));
+			break;
+		}
+		daemon_job(ctx, c, debug);
+		close(c);
+	}
+
+	close(s);
+	unlink(path);
+	return (0);
+}
+
+/*
+ * Run one job on the daemon listening at path: send the request and the
+ * payload read from fd, if any, while copying the daemon's messages to
+ * stdout until its status arrives.  In console mode fd is the terminal,
+ * and ^] ends the session.
+ */
+static int
+client_job(const char *path, const char *req, int fd, int console)
+{
+	struct sockaddr_un sun;
+	struct pollfd pfd[2];
+	char ibuf[16384], obuf[16384], *cp;
+	int s, n, i, off, len, wr = 1, st = 0, res = 0;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return (EXIT_FAILURE);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0 || connect(s, (struct sockaddr *) &sun, sizeof(sun))) {
+		fprintf(stderr, "Can't connect to %s: %s\n", path,
+		    strerror(errno));
+		if (s >= 0)
+			close(s);
+		return (EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The request line goes out ahead of the payload */
+	strcpy(obuf, req);
+	off = 0;
+	len = strlen(req);
+	fcntl(s, F_SETFL, O_NONBLOCK);
+
+	for (;;) {
+		if (off == len && fd < 0 && wr) {
+			shutdown(s, SHUT_WR);
+			wr = 0;
+		}
+		pfd[0].fd = s;
+		pfd[0].events = POLLIN | (off < len ? POLLOUT : 0);
+		pfd[1].fd = off < len ? -1 : fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents) {
+			n = read(fd, obuf, sizeof(obuf));
+			if (n > 0 && console &&
+			    (cp = memchr(obuf, CONSOLE_DETACH, n)) != NULL) {
+				n = cp - obuf;
+				fd = -1;
+			}
+			if (n <= 0)
+				fd = -1;
+			else {
+				off = 0;
+				len = n;
+			}
+		}
+
+		if (pfd[0].revents & POLLOUT) {
+			n = write(s, &obuf[off], len - off);
+			if (n > 0)
+				off += n;
+			else if (errno != EAGAIN) {
+				/* Daemon has stopped reading */
+				off = len;
+				fd = -1;
+			}
+		}
+
+		if (pfd[0].revents & (POLLIN | POLLHUP)) {
+			n = read(s, ibuf, sizeof(ibuf));
+			if (n < 0 && errno == EAGAIN)
+				continue;
+			if (n <= 0)
+				break;
+			for (i = 0; st == 0 && i < n && ibuf[i] != 0; i++) {
+			}
+			fwrite(ibuf, 1, i, stdout);
 			fflush(stdout);
+			if (st == 0 && i < n) {
+				st = 1;
+				i++;
+			}
+			for (; i < n; i++)
+				if (isdigit(ibuf[i]))
+					res = res * 10 + ibuf[i] - '0';
+				else if (ibuf[i] == '-')
+					st = -1;
+		}
+	}
+	close(s);
+
+	if (st == 0) {
+		fprintf(stderr, "Connection to %s lost\n", path);
+		return (EXIT_FAILURE);
+	}
+	return (st * res);
+}
+
+static int
+client_run(const char *path, char *fname, int target)
+{
+	char req[DAEMON_LINE_MAX], abspath[PATH_MAX];
+	int fd, res = 0;
+
+	if (fname != NULL) {
+		if (strcmp(fname, "-") == 0)
+			fd = 0;
+		else
+			fd = open(fname, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "open(%s) failed\n", fname);
+			return (EXIT_FAILURE);
+		}
+		if (target == JED_TGT_FLASH)
+			snprintf(req, sizeof(req), "flash %d %s\n", spi_addr,
+			    fname);
+		else
+			snprintf(req, sizeof(req), "sram %s\n", fname);
+		res = client_job(path, req, fd, 0);
+		if (fd > 0)
+			close(fd);
+	}
+
+	/* The daemon opens the binary itself */
+	if (res == 0 && txfname != NULL) {
+		if (realpath(txfname, abspath) == NULL) {
+			fprintf(stderr, "%s: cannot open\n", txfname);
+			return (EXIT_FAILURE);
+		}
+		snprintf(req, sizeof(req), "exec %s\n", abspath);
+		res = client_job(path, req, -1, 0);
+	}
+
+	if (res == 0 && terminal) {
+		printf("Terminal session on %s, ^] to detach\n", path);
+		fflush(stdout);
+		snprintf(req, sizeof(req), "console %d\n", bauds);
+		system("stty -echo -isig -icanon -iexten -ixon -ixoff -icrnl");
+		res = client_job(path, req, 0, 1);
+		system("stty echo isig icanon iexten ixon ixoff icrnl");
+		printf("\n");
+	}
+
+	if (fname == NULL && txfname == NULL && !terminal)
+		res = client_job(path, "status\n", -1, 0);
+	return (res);
+}
+
+/*
+ * Xilinx Virtual Cable server.  The client drives the TAP itself, with
+ * shift: commands carrying TMS and TDI vectors, and reads back TDO.
+ * Clients pipeline their shifts, so every shift already received is
+ * queued in TXBUF and clocked out with a single commit(), costing one
+ * USB round trip per batch instead of one per vector.
+ */
+#define	XVC_VECTOR_MAX	16384	/* Max bytes of a TMS or TDI vector */
+#define	XVC_INBUF	(4 * (10 + 2 * XVC_VECTOR_MAX))
+
+static uint32_t
+xvc_le32(const uint8_t *p)
+{
+
+	return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+}
+
+/*
+ * Queue the complete shift: commands found at in[pos..len), clock them
+ * out and send back their TDO.  Returns the offset of the first byte
+ * not consumed, or -1 on error.
+ */
+static int
+xvc_shift(struct jtag_ctx *ctx, int fd, const uint8_t *in, unsigned pos,
+    unsigned len, uint8_t *out)
+{
+	static uint32_t bits[XVC_INBUF / 10];
+	const uint8_t *tms, *tdi;
+	uint32_t i, k, nb, nshift, outlen, smp;
+
+	for (nshift = 0; len - pos >= 10 &&
+	    memcmp(&in[pos], "shift:", 6) == 0; nshift++) {
+		bits[nshift] = xvc_le32(&in[pos + 6]);
+		nb = (bits[nshift] + 7) / 8;
+		if (nb > XVC_VECTOR_MAX) {
+			fprintf(stderr, "XVC: %u bit vector too long\n",
+			    bits[nshift]);
+			return (-1);
+		}
+		if (len - pos < 10 + 2 * nb)
+			break;
+		tms = &in[pos + 10];
+		tdi = tms + nb;
+		for (i = 0; i < bits[nshift]; i++)
+			set_tms_tdi(ctx, (tms[i / 8] >> (i & 7)) & 1,
+			    (tdi[i / 8] >> (i & 7)) & 1);
+		pos += 10 + 2 * nb;
+	}
+	if (nshift == 0)
+		return (pos);
+
+	/* One more byte with TCK low, to sample TDO of the last bit */
+	if (ctx->txpos > 0) {
+		txbuf_reserve(ctx, 1);
+		ctx->txbuf[ctx->txpos] = ctx->txbuf[ctx->txpos - 1] & ~JTAG_TCK;
+		ctx->txpos++;
+		if (commit(ctx, 1))
+			return (-1);
+	}
+
+	/* TDO of TCK j is found at txbuf[2 * j + 2] */
+	for (i = 0, smp = 2, outlen = 0; i < nshift; i++) {
+		nb = (bits[i] + 7) / 8;
+		memset(&out[outlen], 0, nb);
+		for (k = 0; k < bits[i]; k++, smp += 2)
+			if (ctx->txbuf[smp] & JTAG_TDO)
+				out[outlen + k / 8] |= 1 << (k & 7);
+		outlen += nb;
+	}
+	if (sock_write(fd, out, outlen))
+		return (-1);
+	return (pos);
+}
+
+static void
+xvc_serve(struct jtag_ctx *ctx, int fd)
+{
+	static uint8_t in[XVC_INBUF], out[XVC_INBUF / 2];
+	char reply[64];
+	unsigned len = 0;
+	ssize_t n;
+	int pos;
+
+	set_port_mode(ctx, PORT_MODE_SYNC);
+	commit(ctx, 1);
+
+	while (!stop_requested) {
+		n = read(fd, &in[len], sizeof(in) - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		len += n;
+
+		for (pos = 0; pos >= 0 && (unsigned) pos < len;) {
+			n = xvc_shift(ctx, fd, in, pos, len, out);
+			if (n < 0)
+				return;
+			pos = n;
+			if (len - pos >= 8 &&
+			    memcmp(&in[pos], "getinfo:", 8) == 0) {
+				n = snprintf(reply, sizeof(reply),
+				    "xvcServer_v1.0:%u\n", XVC_VECTOR_MAX);
+				if (sock_write(fd, reply, n))
+					return;
+				pos += 8;
+			} else if (len - pos >= 11 &&
+			    memcmp(&in[pos], "settck:", 7) == 0) {
+				/*
+				 * TCK is set up with --tck when the cable is
+				 * opened, so accept whatever period is asked.
+				 */
+				if (sock_write(fd, &in[pos + 7], 4))
+					return;
+				pos += 11;
+			} else if (len - pos >= 8 &&
+			    memcmp(&in[pos], "shift:", 6) != 0 &&
+			    memcmp(&in[pos], "settck:", 7) != 0) {
+				fprintf(stderr, "XVC: unknown command\n");
+				return;
+			} else
+				break;
 		}
-		if (tx_cnt == 0 && rx_cnt == 0) {
-			ms_sleep(sleep_t);
-			if (sleep_t < 5)
-				sleep_t++;
-		} else
-			sleep_t = 0;
-	} while (1);
+		memmove(in, &in[pos], len - pos);
+		len -= pos;
+	}
+}
 
-done:
-	printf("\n");
+/*
+ * Serve XVC clients, one at a time, on TCP [ADDR:]PORT.
+ */
+static int
+xvc_run(struct jtag_ctx *ctx, const char *arg)
+{
+	struct sockaddr_in sin;
+	const char *port = arg, *cp;
+	char host[64];
+	int s, c, one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	cp = strrchr(arg, ':');
+	if (cp != NULL) {
+		port = cp + 1;
+		if (cp - arg >= (int) sizeof(host)) {
+			fprintf(stderr, "%s: invalid address\n", arg);
+			return (EXIT_FAILURE);
+		}
+		memcpy(host, arg, cp - arg);
+		host[cp - arg] = 0;
+		if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+			fprintf(stderr, "%s: invalid address\n", arg);
+			return (EXIT_FAILURE);
+		}
+	}
+	c = strtol(port, (char **) &cp, 10);
+	if (*port == 0 || *cp != 0 || c <= 0 || c > 65535) {
+		fprintf(stderr, "%s: invalid port\n", arg);
+		return (EXIT_FAILURE);
+	}
+	sin.sin_port = htons(c);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s >= 0)
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (s < 0 || bind(s, (struct sockaddr *) &sin, sizeof(sin)) ||
+	    listen(s, 1)) {
+		fprintf(stderr, "Can't listen on %s: %s\n", arg,
+		    strerror(errno));
+		return (EXIT_FAILURE);
+	}
 
-	/* Restore special key processing on console input. */
-#ifdef WIN32
-	SetConsoleMode(cons_in, saved_cons_mode);
-	cursor_info.bVisible = 1;
-	cursor_info.dwSize = 20;
-	SetConsoleCursorInfo(cons_out, &cursor_info);
-	FT_SetLatencyTimer(ftHandle, 1);
-	FT_SetBaudRate(ftHandle, USB_BAUDS);
-#else
-	system("stty echo isig icanon iexten ixon ixoff icrnl");
-	ftdi_set_latency_timer(&fc, 1);
-	ftdi_set_baudrate(&fc, USB_BAUDS);
+	catch_stop_signals();
+	signal(SIGPIPE, SIG_IGN);
+	ctx->silent = 1;
+
+	if (!quiet) {
+		printf("Serving XVC on %s\n", arg);
+		fflush(stdout);
+	}
+	while (!stop_requested) {
+		c = accept(s, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "accept() failed: %s\n",
+			    strerror(errno));
+			break;
+		}
+		setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		xvc_serve(ctx, c);
+		close(c);
+	}
+
+	close(s);
+	return (0);
+}
+#endif /* USE_SOCKETS */
+
+
+#if defined(USE_THREADS) && defined(USE_RAW)
+/*
+ * Watch mode (--watch) programs boards as they are plugged in.  The
+ * bitstream is converted to a waveform once, libusb hotplug callbacks
+ * report arriving cables, and each board is then served by its own
+ * worker thread.  Results are logged to stdout, one line per board.
+ */
+#define	WATCH_SLOTS		64
+#define	WATCH_HOLDOFF_MS	5000	/* Ignore re-enumeration after reset */
+
+static struct {
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cv;
+	int		busy;		/* Workers running */
+	struct wave_src	wave;
+	char		path[WATCH_SLOTS][48];	/* Ports seen so far */
+	int		active[WATCH_SLOTS];
+	long		done_ms[WATCH_SLOTS];
+} watch = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.cv = PTHREAD_COND_INITIALIZER,
+};
+
+static void
+watch_log(struct jtag_ctx *ctx, const char *path, const char *what,
+    long ms)
+{
+	char tbuf[32];
+	struct tm tm;
+	time_t now;
+
+	now = time(NULL);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S",
+	    localtime_r(&now, &tm));
+	printf("%s %-12s %-16s %s %.2f s\n", tbuf, path,
+	    ctx->usb_serial[0] ? ctx->usb_serial : "-", what, ms / 1000.0);
+	fflush(stdout);
+}
+
+static void *
+watch_main(void *arg)
+{
+	int slot = (intptr_t) arg;
+	struct jtag_ctx *ctx;
+	struct wave_src ws;
+	long tstart;
+	int i, res = -1;
+
+	tstart = ms_uptime();
+	ctx = jtag_ctx_new(CABLE_HW_USB);
+	if (ctx == NULL)
+		goto done;
+	ctx->port_id = watch.path[slot];
+	ctx->silent = 1;
+	ctx->no_exit = 1;	/* Keep watching the other ports */
+
+	/* Freshly attached devices may need a moment before they respond */
+	for (i = 0; i < 10; i++) {
+		res = cable_open(ctx, CABLE_HW_USB);
+		if (res == 0)
+			break;
+		ftdi_deinit(&ctx->fc);
+		ms_sleep(20);
+	}
+	if (res) {
+		watch_log(ctx, watch.path[slot], "FAILED (no cable)",
+		    ms_uptime() - tstart);
+		goto done;
+	}
+	if (ctx->hmp->cable_hw == CABLE_UNKNOWN) {
+		/* Some other FTDI device, leave it alone */
+		ftdi_usb_close(&ctx->fc);
+		ftdi_deinit(&ctx->fc);
+		goto done;
+	}
+
+#ifdef __linux__
+	low_jitter_thread(ctx, slot);
 #endif
+	ctx->last_ledblink_ms = ms_uptime();
+	ws = watch.wave;
+	stats_begin(ctx);
+	res = exec_wave(ctx, &ws);
+	stats_end(ctx);
+	progress_end(ctx, res);
+	if (res == 0 && txfname != NULL) {
+		set_port_mode(ctx, PORT_MODE_UART);
+		async_set_baudrate(ctx, bauds);
+		genbrk(ctx, BREAK_MS);
+		res = txfile(ctx);
+	}
+	cable_close(ctx);
+	watch_log(ctx, watch.path[slot], res ? "FAILED" : "OK",
+	    ms_uptime() - tstart);
 
-	return (res);
+done:
+	if (ctx != NULL)
+		jtag_ctx_free(ctx);
+	pthread_mutex_lock(&watch.mtx);
+	watch.active[slot] = 0;
+	watch.done_ms[slot] = ms_uptime();
+	watch.busy--;
+	pthread_cond_signal(&watch.cv);
+	pthread_mutex_unlock(&watch.mtx);
+	return (NULL);
+}
+
+static int
+watch_arrived(libusb_context *uctx, libusb_device *dev,
+    libusb_hotplug_event ev, void *arg)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	char path[48];
+	long now;
+	int i, slot = -1;
+
+	(void) uctx;
+	(void) ev;
+	(void) arg;
+	usb_path(dev, path);
+	now = ms_uptime();
+
+	pthread_mutex_lock(&watch.mtx);
+	for (i = 0; i < WATCH_SLOTS; i++) {
+		if (strcmp(watch.path[i], path) == 0) {
+			slot = i;
+			break;
+		}
+		if (slot < 0 && (watch.path[i][0] == 0 ||
+		    (!watch.active[i] &&
+		    now - watch.done_ms[i] > WATCH_HOLDOFF_MS)))
+			slot = i;
+	}
+	if (slot < 0 || watch.active[slot] || (strcmp(watch.path[slot],
+	    path) == 0 && now - watch.done_ms[slot] < WATCH_HOLDOFF_MS)) {
+		pthread_mutex_unlock(&watch.mtx);
+		return (0);
+	}
+	strcpy(watch.path[slot], path);
+	watch.active[slot] = 1;
+	watch.busy++;
+	pthread_mutex_unlock(&watch.mtx);
+
+	/* We mustn't talk to the device from within libusb's callback */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, watch_main,
+	    (void *) (intptr_t) slot) != 0) {
+		fprintf(stderr, "%s: pthread_create() failed\n", path);
+		pthread_mutex_lock(&watch.mtx);
+		watch.active[slot] = 0;
+		watch.busy--;
+		pthread_mutex_unlock(&watch.mtx);
+	}
+	pthread_attr_destroy(&attr);
+	return (0);
+}
+
+static int
+prog_watch(char *fname, int target, int debug)
+{
+	libusb_hotplug_callback_handle cbh[16];
+	libusb_context *uctx;
+	struct cable_hw_map *hmp, *prev;
+	struct timeval tv;
+	struct wave_src wave = { NULL, -1, 0, 0 };
+	int n = 0, res;
+
+	if (libusb_init(&uctx) < 0) {
+		fprintf(stderr, "libusb_init() failed\n");
+		return (EXIT_FAILURE);
+	}
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, "USB hotplug not supported on this platform\n");
+		libusb_exit(uctx);
+		return (EXIT_FAILURE);
+	}
+
+	res = wave_generate(fname, target, debug, &wave);
+	if (res) {
+		libusb_exit(uctx);
+		wave_free(&wave);
+		return (res);
+	}
+	watch.wave = wave;
+	if (xbauds == 0)
+		xbauds = 3000000;
+
+	/* One callback per distinct VID:PID */
+	for (hmp = cable_hw_map; hmp->cable_hw != CABLE_UNKNOWN &&
+	    n < (int) (sizeof(cbh) / sizeof(cbh[0])); hmp++) {
+		if (hmp->cable_hw != CABLE_HW_USB)
+			continue;
+		for (prev = cable_hw_map; prev != hmp; prev++)
+			if (prev->usb_vid == hmp->usb_vid &&
+			    prev->usb_pid == hmp->usb_pid)
+				break;
+		if (prev == hmp &&
+		    libusb_hotplug_register_callback(uctx,
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+		    LIBUSB_HOTPLUG_NO_FLAGS, hmp->usb_vid, hmp->usb_pid,
+		    LIBUSB_HOTPLUG_MATCH_ANY, watch_arrived, NULL,
+		    &cbh[n]) == 0)
+			n++;
+	}
+
+	catch_stop_signals();
+	if (!quiet) {
+		printf("Waiting for boards, ^C to stop\n");
+		fflush(stdout);
+	}
+	while (!stop_requested) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 200000;
+		libusb_handle_events_timeout_completed(uctx, &tv, NULL);
+	}
+
+	while (n > 0)
+		libusb_hotplug_deregister_callback(uctx, cbh[--n]);
+	pthread_mutex_lock(&watch.mtx);
+	while (watch.busy > 0)
+		pthread_cond_wait(&watch.cv, &watch.mtx);
+	pthread_mutex_unlock(&watch.mtx);
+	libusb_exit(uctx);
+	wave_free(&wave);
+	return (0);
 }
+#endif /* USE_THREADS && USE_RAW */
+
+
+/* Long options, for which we've run out of letters */
+enum {
+	OPT_DAEMON = 256,
+	OPT_CONNECT,
+	OPT_WATCH,
+	OPT_TCK,
+	OPT_XVC,
+	OPT_REMOTE,
+	OPT_MOCK,
+	OPT_MOCK_MPSSE,
+	OPT_STATS,
+	OPT_TRACE,
+	OPT_USB_CAPTURE,
+	OPT_USB_REPLAY,
+	OPT_USB_LATENCY,
+	OPT_TUNE,
+	OPT_LOW_JITTER,
+	OPT_MEM,
+	OPT_SOAK,
+	OPT_PROGRESS,
+};
 
+static const struct option long_opts[] = {
+#ifdef USE_SOCKETS
+	{ "daemon",	required_argument,	NULL,	OPT_DAEMON },
+	{ "connect",	required_argument,	NULL,	OPT_CONNECT },
+	{ "xvc-server",	required_argument,	NULL,	OPT_XVC },
+	{ "remote-bitbang", required_argument,	NULL,	OPT_REMOTE },
+#endif
+#if defined(USE_THREADS) && defined(USE_RAW)
+	{ "watch",	no_argument,		NULL,	OPT_WATCH },
+#endif
+	{ "tck",	required_argument,	NULL,	OPT_TCK },
+	{ "mock",	required_argument,	NULL,	OPT_MOCK },
+	{ "mock-mpsse",	no_argument,		NULL,	OPT_MOCK_MPSSE },
+	{ "stats",	optional_argument,	NULL,	OPT_STATS },
+	{ "trace",	required_argument,	NULL,	OPT_TRACE },
+	{ "mem",	required_argument,	NULL,	OPT_MEM },
+	{ "soak",	required_argument,	NULL,	OPT_SOAK },
+	{ "progress",	required_argument,	NULL,	OPT_PROGRESS },
+#ifndef WIN32
+	{ "usb-capture", required_argument,	NULL,	OPT_USB_CAPTURE },
+	{ "usb-replay",	required_argument,	NULL,	OPT_USB_REPLAY },
+	{ "usb-replay-latency", no_argument,	NULL,	OPT_USB_LATENCY },
+	{ "tune",	no_argument,		NULL,	OPT_TUNE },
+#endif
+#ifdef __linux__
+	{ "low-jitter",	optional_argument,	NULL,	OPT_LOW_JITTER },
+#endif
+	{ NULL,		0,			NULL,	0 }
+};
 
 int
 main(int argc, char *argv[])
 {
+	struct jtag_ctx *ctx;
 	int res = EXIT_FAILURE;
 	int jed_target = JED_TGT_SRAM;
 	int debug = 0;
 	int c;
+	char *cp;
+	double hz;
 #ifdef WIN32
 	int had_terminal = 0;
 	COMMTIMEOUTS com_to;
 #endif
 
+	ctx = jtag_ctx_new(CABLE_UNKNOWN);
+	if (ctx == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
 #if defined(USE_PPI) || defined(USE_RAW)
-#define OPTS	"qtdLj:b:p:x:p:P:a:e:f:D:rs:C:c:"
+#define OPTS	"qtdLj:b:p:x:p:P:a:e:f:D:rs:C:c:W:"
 #else
 #define OPTS	"qtdLj:b:p:x:p:P:a:e:f:D:rs:C:"
 #endif
-	while ((c = getopt(argc, argv, OPTS)) != -1) {
+	while ((c = getopt_long(argc, argv, OPTS, long_opts, NULL)) != -1) {
 		switch (c) {
+#ifdef USE_SOCKETS
+		case OPT_DAEMON:
+			daemon_name = optarg;
+			break;
+		case OPT_CONNECT:
+			connect_name = optarg;
+			break;
+		case OPT_XVC:
+			xvc_name = optarg;
+			break;
+		case OPT_REMOTE:
+			remote_name = optarg;
+			ctx->cable_hw = CABLE_REMOTE;
+			break;
+#endif
+		case OPT_MOCK:
+			mock_name = optarg;
+			ctx->cable_hw = CABLE_MOCK;
+			break;
+		case OPT_MOCK_MPSSE:
+			mock_mpsse = 1;
+			break;
+		case OPT_STATS:
+			if (optarg == NULL || strcmp(optarg, "-") == 0)
+				stats_fp = stderr;
+			else if ((stats_fp = fopen(optarg, "w")) == NULL) {
+				fprintf(stderr, "Can't create %s: %s\n",
+				    optarg, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_TRACE:
+			if (trace_open(optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case OPT_PROGRESS:
+			if ((progress_fp = fopen(optarg, "w")) == NULL) {
+				fprintf(stderr, "Can't create %s: %s\n",
+				    optarg, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SOAK:
+			soak_iters = atoi(optarg);
+			if (soak_iters < 1) {
+				fprintf(stderr, "error: "
+				    "--soak needs a number of runs\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_MEM:
+			mem_budget = strtoul(optarg, &cp, 0);
+			if (*cp == 'k' || *cp == 'K')
+				mem_budget <<= 10;
+			else if (*cp == 'm' || *cp == 'M')
+				mem_budget <<= 20;
+			else if (*cp == 'g' || *cp == 'G')
+				mem_budget <<= 30;
+			if (mem_budget < 1024 * 1024) {
+				fprintf(stderr, "error: "
+				    "--mem must be at least 1M\n");
+				exit(EXIT_FAILURE);
+			}
+			/* An eighth of the budget for pending TCKs */
+			for (txbuf_flush = TXBUF_MIN;
+			    txbuf_flush * 2 <= mem_budget / 8 &&
+			    txbuf_flush < TXBUF_MAX / 2; txbuf_flush *= 2)
+				continue;
+			break;
+#ifndef WIN32
+		case OPT_USB_CAPTURE:
+			if (usbcap_open(optarg, 0))
+				exit(EXIT_FAILURE);
+			break;
+		case OPT_USB_REPLAY:
+			if (usbcap_open(optarg, 1))
+				exit(EXIT_FAILURE);
+			ctx->cable_hw = CABLE_HW_USB;
+			break;
+		case OPT_USB_LATENCY:
+			usbrep_latency = 1;
+			break;
+		case OPT_TUNE:
+			tune_mode = 1;
+			break;
+#endif
+#ifdef __linux__
+		case OPT_LOW_JITTER:
+			low_jitter = 1;
+			if (optarg != NULL)
+				low_jitter_cpu = atoi(optarg);
+			break;
+#endif
+#if defined(USE_THREADS) && defined(USE_RAW)
+		case OPT_WATCH:
+			watch_mode = 1;
+			break;
+#endif
+		case OPT_TCK:
+			hz = strtod(optarg, &cp);
+			if (*cp == 'k' || *cp == 'K')
+				hz *= 1000;
+			else if (*cp == 'M')
+				hz *= 1000000;
+			tck_khz = hz / 1000;
+			tck_set = 1;
+			if (tck_khz < 1 || tck_khz > 30000) {
+				fprintf(stderr, "error: "
+				    "TCK must be between 1 kHz and 30 MHz\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'a':
 			txfname = optarg;
 			tx_binary = 0;
@@ -4517,11 +10750,11 @@ main(int argc, char *argv[])
 #if defined(USE_PPI) || defined(USE_RAW)
 		case 'c':
 			if (strcasecmp(optarg, "usb") == 0)
-				cable_hw = CABLE_HW_USB;
+				ctx->cable_hw = CABLE_HW_USB;
 			else if (strcasecmp(optarg, "ppi") == 0)
-				cable_hw = CABLE_HW_PPI;
+				ctx->cable_hw = CABLE_HW_PPI;
 			else if (strcasecmp(optarg, "raw") == 0)
-				cable_hw = CABLE_RAW;
+				ctx->cable_hw = CABLE_RAW;
 			else {
 				usage();
 				exit(EXIT_FAILURE);
@@ -4575,11 +10808,26 @@ main(int argc, char *argv[])
 			}
 			break;
 		case 'p':
-			port_index = atoi(optarg);
+			if (strcasecmp(optarg, "all") == 0) {
+				board_cnt = -1;
+				break;
+			}
+			if (strchr(optarg, ',') == NULL) {
+				port_select(ctx, optarg);
+				break;
+			}
+			for (cp = strtok(optarg, ","); cp != NULL;
+			    cp = strtok(NULL, ",")) {
+				if (board_cnt == BOARDS_MAX) {
+					fprintf(stderr, "Too many ports\n");
+					exit(EXIT_FAILURE);
+				}
+				board_sel[board_cnt++] = cp;
+			}
 			break;
 		case 'P':
 			com_name = optarg;
-			cable_hw = CABLE_HW_COM;
+			ctx->cable_hw = CABLE_HW_COM;
 			break;
 		case 'q':
 			quiet = 1;
@@ -4590,17 +10838,20 @@ main(int argc, char *argv[])
 		case 's':
 			svf_name = optarg;
 			break;
+#ifdef USE_RAW
+		case 'W':
+			wave_name = optarg;
+			break;
+#endif
 		case 't':
 			terminal = 1;
 #ifdef WIN32
 			had_terminal = 1;
 #endif
 			break;
-#ifdef WIN32
 		case 'L':
-			list_ports();
+			list_ports(ctx);
 			exit(0);
-#endif
 		case '?':
 			usage();
 			exit(0);
@@ -4615,28 +10866,159 @@ main(int argc, char *argv[])
 
 #ifdef WIN32
 	/* Attempt to convert -P com port to FTDI port index */
-	if (cable_hw == CABLE_HW_COM && (c = atoi(&com_name[3])) > 0
+	if (ctx->cable_hw == CABLE_HW_COM && (c = atoi(&com_name[3])) > 0
 	    && (c = com2ftindex(c, NULL)) >= 0) {
-		cable_hw = CABLE_HW_USB;
-		port_index = c;
+		ctx->cable_hw = CABLE_HW_USB;
+		ctx->port_index = c;
 		com_name = NULL;
 	}
 #endif
 
+#ifdef USE_SOCKETS
+	if (connect_name) {
+		if (svf_name || wave_name || com_name || reload ||
+		    board_cnt || cbusval >= 0 || daemon_name || xvc_name ||
+		    remote_name || mock_name ||
+		    (txfname && !tx_binary)) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		jtag_ctx_free(ctx);
+		return (client_run(connect_name, argc ? argv[0] : NULL,
+		    jed_target));
+	}
+#endif
+
+#ifndef WIN32
+	/* A log can only follow one cable at a time */
+	if ((usbcap_fp != NULL || usbrep_fp != NULL) && (board_cnt ||
+	    (usbrep_fp != NULL && (usbcap_fp != NULL ||
+	    ctx->cable_hw != CABLE_HW_USB)))) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	if (tune_mode && (terminal || reload || txfname || com_name ||
+	    board_cnt || watch_mode || argc != 0 ||
+	    (ctx->cable_hw != CABLE_UNKNOWN &&
+	    ctx->cable_hw != CABLE_HW_USB))) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	/* Keep stdout clean when SVF, waveform or SREC output goes there */
 	if (!quiet)
-		printf("%s (built %s %s)\n", verstr, __DATE__, __TIME__);
+		fprintf((wave_name != NULL && strcmp(wave_name, "-") == 0) ||
+		    (svf_name != NULL && strcmp(svf_name, "-") == 0) ||
+		    ctx->cable_hw == CABLE_RAW ? stderr : stdout,
+		    "%s (built %s %s)\n", verstr, __DATE__, __TIME__);
+
+#ifdef __linux__
+	if (low_jitter)
+		low_jitter_setup();
+#endif
+
+	if (soak_iters && (argc == 0 || strcmp(argv[0], "-") == 0 ||
+	    svf_name || wave_name || watch_mode || tune_mode)) {
+		fprintf(stderr, "error: "
+		    "--soak needs a bitstream file to program\n");
+		exit(EXIT_FAILURE);
+	}
 
 	if (svf_name) {
 		if (terminal || reload || txfname || com_name || argc == 0) {
 			usage();
 			exit(EXIT_FAILURE);
 		}
-		res = exec_bit_file(argv[0], jed_target, debug);
+		if (infile_open(argv[0]))
+			exit(EXIT_FAILURE);
+		c = infile_format(argv[0], jed_target);
+		if (c == IN_FMT_JED)
+			res = exec_jedec_file(ctx, jed_target, debug);
+		else if (c == IN_FMT_BIT || c == IN_FMT_IMG)
+			res = exec_bit_file(ctx, jed_target, c == IN_FMT_IMG,
+			    debug);
+		else {
+			fprintf(stderr, "%s: can't convert to SVF\n", argv[0]);
+			res = EXIT_FAILURE;
+		}
+		if (infile_close() && res == 0)
+			res = EXIT_FAILURE;
 		return(res);
 	}
 
+#ifdef USE_RAW
+	if (wave_name) {
+		if (terminal || reload || txfname || com_name || argc == 0) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		ctx->cable_hw = CABLE_RAW;
+		if (cable_open(ctx, CABLE_RAW)) {
+			fprintf(stderr, "Can't create %s\n", wave_name);
+			exit(EXIT_FAILURE);
+		}
+		res = prog(ctx, -1, argv[0], jed_target, debug);
+		cable_close(ctx);
+		return (res);
+	}
+#endif
+
+#if defined(USE_THREADS) && defined(USE_RAW)
+	if (watch_mode) {
+		if (terminal || reload || com_name || board_cnt ||
+		    cbusval >= 0 || argc == 0 || (txfname && !tx_binary) ||
+		    (ctx->cable_hw != CABLE_UNKNOWN &&
+		    ctx->cable_hw != CABLE_HW_USB)) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		jtag_ctx_free(ctx);
+		return (prog_watch(argv[0], jed_target, debug));
+	}
+#endif
+
+	if (board_cnt != 0) {
+		if (terminal || reload || txfname || com_name ||
+		    cbusval >= 0 || argc == 0 ||
+		    (ctx->cable_hw != CABLE_UNKNOWN &&
+		    ctx->cable_hw != CABLE_HW_USB)) {
+			usage();
+			exit(EXIT_FAILURE);
+		}
+		jtag_ctx_free(ctx);
+#if defined(USE_THREADS) && defined(USE_RAW)
+		return (prog_boards(argv[0], jed_target, debug));
+#else
+		fprintf(stderr, "error: "
+		    "multiple boards not supported on this platform\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+	if ((daemon_name || xvc_name) && (terminal || reload || txfname ||
+	    argc || com_name || ctx->cable_hw == CABLE_RAW ||
+	    (daemon_name && xvc_name))) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (remote_name && (ctx->cable_hw != CABLE_REMOTE || terminal ||
+	    reload || txfname || com_name || cbusval >= 0)) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if ((mock_name || mock_mpsse) && (ctx->cable_hw != CABLE_MOCK ||
+	    mock_name == NULL || terminal || reload || txfname || com_name ||
+	    cbusval >= 0)) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
 	if (argc == 0 && terminal == 0 && txfname == NULL && reload == 0
-	    && cbusval < 0) {
+	    && cbusval < 0 && daemon_name == NULL && xvc_name == NULL &&
+	    !tune_mode) {
 		usage();
 		exit(EXIT_FAILURE);
 	}
@@ -4647,7 +11029,7 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (com_name && cable_hw != CABLE_HW_COM) {
+	if (com_name && ctx->cable_hw != CABLE_HW_COM) {
 		fprintf(stderr, "error: "
 		    "options -P and -c are mutualy exclusive\n");
 		exit(EXIT_FAILURE);
@@ -4659,67 +11041,75 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	switch (cable_hw) {
+	switch (ctx->cable_hw) {
 	case CABLE_UNKNOWN:
 	case CABLE_HW_USB:
-		res = setup_usb();
+		res = cable_open(ctx, CABLE_HW_USB);
 		if (res == 0)
-			cable_hw = CABLE_HW_USB;
-		if (cable_hw == CABLE_HW_USB) {
+			ctx->cable_hw = CABLE_HW_USB;
+		if (ctx->cable_hw == CABLE_HW_USB) {
 			if (xbauds == 0)
 				xbauds = 3000000;
 			break;
 		}
 #ifdef USE_PPI
 	case CABLE_HW_PPI:
-		res = setup_ppi();
+		res = cable_open(ctx, CABLE_HW_PPI);
 #endif
 		break;
 #ifdef USE_RAW
 	case CABLE_RAW:
-		res = setup_raw();
+		res = cable_open(ctx, CABLE_RAW);
+		break;
+#endif
+#ifdef USE_SOCKETS
+	case CABLE_REMOTE:
+		res = cable_open(ctx, CABLE_REMOTE);
 		break;
 #endif
+	case CABLE_MOCK:
+		res = cable_open(ctx, CABLE_MOCK);
+		break;
 	case CABLE_HW_COM:
 		if (xbauds == 0)
 			xbauds = bauds;
 #ifdef WIN32
-		sprintf((char *) txbuf, "\\\\.\\%s", com_name);
-		com_port = CreateFile((char *) txbuf,
+		sprintf((char *) ctx->txbuf, "\\\\.\\%s", com_name);
+		ctx->com_port = CreateFile((char *) ctx->txbuf,
 		    GENERIC_READ | GENERIC_WRITE,
 		    0, NULL, OPEN_EXISTING, 0, NULL);
-		if (com_port == INVALID_HANDLE_VALUE) {
+		if (ctx->com_port == INVALID_HANDLE_VALUE) {
 			fprintf(stderr, "Can't open %s\n", com_name);
 			exit(EXIT_FAILURE);
 		}
-		async_set_baudrate(bauds);
-		if (GetCommTimeouts(com_port, &com_to) == 0) {
+		async_set_baudrate(ctx, bauds);
+		if (GetCommTimeouts(ctx->com_port, &com_to) == 0) {
 			fprintf(stderr, "Can't configure %s\n", com_name);
 			exit(EXIT_FAILURE);
 		}
 		com_to.ReadIntervalTimeout = 1;
 		com_to.ReadTotalTimeoutConstant = 1;
 		com_to.ReadTotalTimeoutMultiplier = 1;
-		SetCommTimeouts(com_port, &com_to);
+		SetCommTimeouts(ctx->com_port, &com_to);
 		res = 0;
 #else
-		com_port = open(com_name, O_RDWR);
-		if (com_port < 0 || tcgetattr(com_port, &tty)) {
+		ctx->com_port = open(com_name, O_RDWR);
+		if (ctx->com_port < 0 || tcgetattr(ctx->com_port, &ctx->tty)) {
 			fprintf(stderr, "Can't open %s\n", com_name);
 			exit(EXIT_FAILURE);
 		}
-		tty.c_cflag &= ~(CSIZE|PARENB);
-		tty.c_cflag |= CS8;
-		tty.c_cflag |= CLOCAL;
-		tty.c_cflag &= ~CRTSCTS;
-		tty.c_iflag &= ~(ISTRIP|ICRNL);
-		tty.c_iflag &= ~(IXON|IXOFF);
-		tty.c_oflag &= ~OPOST;
-		tty.c_lflag &= ~(ICANON|ISIG|IEXTEN|ECHO);
-		tty.c_cc[VMIN] = 1;
-		tty.c_cc[VTIME] = 0;
-		async_set_baudrate(bauds);
-		res = fcntl(com_port, F_SETFL, O_NONBLOCK);
+		ctx->tty.c_cflag &= ~(CSIZE|PARENB);
+		ctx->tty.c_cflag |= CS8;
+		ctx->tty.c_cflag |= CLOCAL;
+		ctx->tty.c_cflag &= ~CRTSCTS;
+		ctx->tty.c_iflag &= ~(ISTRIP|ICRNL);
+		ctx->tty.c_iflag &= ~(IXON|IXOFF);
+		ctx->tty.c_oflag &= ~OPOST;
+		ctx->tty.c_lflag &= ~(ICANON|ISIG|IEXTEN|ECHO);
+		ctx->tty.c_cc[VMIN] = 1;
+		ctx->tty.c_cc[VTIME] = 0;
+		async_set_baudrate(ctx, bauds);
+		res = fcntl(ctx->com_port, F_SETFL, O_NONBLOCK);
 #if defined(__FreeBSD__) || defined(__linux__)
 		/* XXX w/o this a BREAK won't be sent properly on FreeBSD ?!?*/
 		ms_sleep(300);
@@ -4738,9 +11128,9 @@ main(int argc, char *argv[])
 
 	if (cbusval >= 0) {
 #ifdef WIN32
-		res = FT_SetBitMode(ftHandle,
+		res = FT_SetBitMode(ctx->ftHandle,
 #else
-		res = ftdi_set_bitmode(&fc,
+		res = ftdi_set_bitmode(&ctx->fc,
 #endif
 		    cbusval, BITMODE_CBUS);
 		if (res != 0) {
@@ -4749,13 +11139,21 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (!quiet && cable_hw != CABLE_HW_COM) {
+	if (!quiet && ctx->cable_hw != CABLE_HW_COM) {
 #ifndef WIN32
-		if (cable_hw == CABLE_HW_USB)
-			printf("Using USB cable: %s\n", hmp->cable_path);
+		if (ctx->cable_hw == CABLE_HW_USB)
+			printf("Using USB cable: %s\n", ctx->hmp->cable_path);
+		else if (ctx->cable_hw == CABLE_MOCK)
+			printf("Using virtual ULX3S: %s\n",
+			    ctx->mock->dev->name);
+#ifdef USE_SOCKETS
+		else if (ctx->cable_hw == CABLE_REMOTE)
+			printf("Using remote_bitbang target: %s\n",
+			    remote_name);
+#endif
 #ifdef USE_PPI
-		else if (cable_hw == CABLE_RAW) {
-			printf("Generating %s\n", hmp->cable_path);
+		else if (ctx->cable_hw == CABLE_RAW) {
+			printf("Generating %s\n", ctx->hmp->cable_path);
 }
 #endif
 		else
@@ -4767,43 +11165,54 @@ main(int argc, char *argv[])
 #endif /* !WIN32 */
 	}
 
+#ifdef __linux__
+	low_jitter_thread(ctx, 0);
+#endif
+#ifndef WIN32
+	if (tune_mode)
+		res = tune_run(ctx);
+	else
+#endif
+#ifdef USE_SOCKETS
+	if (daemon_name)
+		res = daemon_run(ctx, daemon_name, debug);
+	else if (xvc_name)
+		res = xvc_run(ctx, xvc_name);
+	else
+#endif
 	do {
 		if (reload) {
-			set_port_mode(PORT_MODE_UART);
-			async_set_baudrate(bauds);
-			genbrk(BREAK_MS);
+			set_port_mode(ctx, PORT_MODE_UART);
+			async_set_baudrate(ctx, bauds);
+			genbrk(ctx, BREAK_MS);
 			reload = 0;
 		}
-		if (argc)
-			prog(argv[0], jed_target, debug);
+		if (argc && soak_iters)
+			res = soak_prog(ctx, argv[0], jed_target, debug);
+		else if (argc)
+			prog(ctx, -1, argv[0], jed_target, debug);
 		jed_target = JED_TGT_SRAM; /* for subsequent prog() calls */
 		if (txfname)
-			txfile();
-	} while (terminal && term_emul() == 0);
+			txfile(ctx);
+	} while (terminal && term_emul(ctx) == 0);
 
 #ifdef WIN32
 	if (had_terminal)
 		system("color");
 #endif
 
-	if (cable_hw == CABLE_HW_COM) {
+	if (ctx->cable_hw == CABLE_HW_COM) {
 #ifdef WIN32
-		CloseHandle(com_port);
+		CloseHandle(ctx->com_port);
 #else
-		close(com_port);
+		close(ctx->com_port);
 #endif
-	} else if (cable_hw == CABLE_HW_USB) {
-		ms_sleep(1); // small delay for f32c to start
-		shutdown_usb();
+	} else {
+		if (ctx->cable_hw == CABLE_HW_USB)
+			ms_sleep(1); // small delay for f32c to start
+		cable_close(ctx);
 	}
-#ifdef USE_RAW
-	else if (cable_hw == CABLE_RAW)
-		shutdown_raw();
-#endif
-#ifdef USE_PPI
-	else
-		shutdown_ppi();
-#endif
+	jtag_ctx_free(ctx);
 
 	return (res);
 }